@@ -0,0 +1,190 @@
+#include <err.h>
+#include <string.h>
+
+#include "corpus.h"
+
+static const char *shape_names[CORPUS_NUM_SHAPES] = {
+    [CORPUS_MIXED] = "mixed",
+    [CORPUS_DEEP] = "deep",
+    [CORPUS_LONG_IDENTS] = "long-idents",
+    [CORPUS_NUMBERS] = "numbers",
+    [CORPUS_COMMENTS] = "comments",
+};
+
+static const char *idents[] = {"x",         "acc",         "loop",
+                               "make-list", "string->sym", "vector-ref!",
+                               "a1",        "<=?",         "call-with-k"};
+#define NUM_IDENTS ((int)(sizeof(idents) / sizeof(idents[0])))
+
+static const char *words[] = {"make",   "list", "vector", "ref", "set",
+                              "string", "sym",  "with",   "call", "port",
+                              "char",   "tail", "loop",   "acc"};
+#define NUM_WORDS ((int)(sizeof(words) / sizeof(words[0])))
+
+/* A fixed linear congruential generator, the corpus is the same each run. */
+static uint32_t next_random(uint32_t *state) {
+  *state = *state * 1103515245 + 12345;
+  return (*state >> 16) & 0x7fff;
+}
+
+const char *corpus_shape_name(CorpusShape shape) {
+  return shape_names[shape];
+}
+
+bool corpus_shape_from_name(const char *name, CorpusShape *shape) {
+  for (int i = 0; i < CORPUS_NUM_SHAPES; ++i) {
+    if (strcmp(name, shape_names[i]) == 0) {
+      *shape = i;
+      return true;
+    }
+  }
+  return false;
+}
+
+static long write_mixed(FILE *output, uint32_t *state, int n) {
+  static const char *chars[] = {"#\\a", "#\\space", "#\\newline", "#\\x41"};
+  /* Drawn up front, the order arguments are evaluated in is unspecified. */
+  uint32_t r[8];
+  const char *a, *b;
+
+  for (int i = 0; i < 8; ++i)
+    r[i] = next_random(state);
+  a = idents[r[0] % NUM_IDENTS];
+  b = idents[r[1] % NUM_IDENTS];
+  return fprintf(output,
+                 ";; Definition %d, %s and %s.\n"
+                 "(define (f%d %s %s)\n"
+                 "  (let ((v (list %u %u.%u -%u)) (c %s))\n"
+                 "    (if (< %s %s)\n"
+                 "        (cons '(%s (%s %u) #t) (f%d (car v) %s))\n"
+                 "        (begin (display c) (lambda (y) (+ y %u %s))))))\n\n",
+                 n, a, b, n, a, b, r[2], r[3], r[4], r[5], chars[r[6] % 4], a,
+                 b, a, b, r[7], n, b, r[2] + r[7], a);
+}
+
+/* Calls, lets and ifs inside each other, closed all at once. */
+static long write_deep(FILE *output, uint32_t *state, int n, int depth) {
+  long written = fprintf(output, "(define (d%d x)\n", n);
+
+  for (int i = 0; i < depth; ++i) {
+    switch (next_random(state) % 3) {
+    case 0:
+      written += fprintf(output, "(+ %d ", i);
+      break;
+    case 1:
+      written += fprintf(output, "(let ((x%d x)) ", i);
+      break;
+    default:
+      written += fprintf(output, "(if (< x %d) x ", i);
+      break;
+    }
+  }
+  written += fprintf(output, "x");
+  for (int i = 0; i < depth; ++i)
+    written += fprintf(output, ")");
+  written += fprintf(output, ")\n\n");
+  return written;
+}
+
+/* A hyphenated identifier of 32 to 256 characters. */
+static long write_long_ident(FILE *output, uint32_t *state) {
+  int length = 32 + next_random(state) % 225;
+  long written = 0;
+
+  while (written < length) {
+    if (written > 0)
+      written += fprintf(output, "-");
+    written += fprintf(output, "%s", words[next_random(state) % NUM_WORDS]);
+  }
+  return written;
+}
+
+static long write_long_idents(FILE *output, uint32_t *state) {
+  long written = fprintf(output, "(define (");
+
+  for (int i = 0; i < 3; ++i) {
+    if (i > 0)
+      written += fprintf(output, " ");
+    written += write_long_ident(output, state);
+  }
+  written += fprintf(output, ")\n  (");
+  for (int i = 0; i < 3; ++i) {
+    if (i > 0)
+      written += fprintf(output, " ");
+    written += write_long_ident(output, state);
+  }
+  written += fprintf(output, "))\n\n");
+  return written;
+}
+
+static long write_numbers(FILE *output, uint32_t *state, int n) {
+  long written = fprintf(output, "(define n%d (list", n);
+
+  for (int i = 0; i < 16; ++i) {
+    uint32_t r = next_random(state);
+    switch (r % 4) {
+    case 0:
+      written += fprintf(output, " %u", r);
+      break;
+    case 1:
+      written += fprintf(output, " -%u", r % 1000);
+      break;
+    case 2:
+      written += fprintf(output, " %u.%u", r % 100, next_random(state));
+      break;
+    default:
+      written += fprintf(output, " %u", r % 10);
+      break;
+    }
+  }
+  written += fprintf(output, "))\n");
+  return written;
+}
+
+static long write_comments(FILE *output, uint32_t *state, int n) {
+  long written = 0;
+
+  for (int i = 0; i < 10; ++i) {
+    int num_words = 3 + next_random(state) % 10;
+    written += fprintf(output, ";;");
+    for (int j = 0; j < num_words; ++j)
+      written +=
+          fprintf(output, " %s", words[next_random(state) % NUM_WORDS]);
+    written += fprintf(output, "\n");
+  }
+  written += fprintf(output, "(define c%d %d)\n", n, n);
+  return written;
+}
+
+long generate_corpus(FILE *output, const CorpusOptions *options) {
+  uint32_t state = options->seed;
+  long written = 0;
+
+  for (int n = 0; written < options->size; ++n) {
+    long ret;
+
+    switch (options->shape) {
+    case CORPUS_MIXED:
+      ret = write_mixed(output, &state, n);
+      break;
+    case CORPUS_DEEP:
+      ret = write_deep(output, &state, n, options->depth);
+      break;
+    case CORPUS_LONG_IDENTS:
+      ret = write_long_idents(output, &state);
+      break;
+    case CORPUS_NUMBERS:
+      ret = write_numbers(output, &state, n);
+      break;
+    case CORPUS_COMMENTS:
+      ret = write_comments(output, &state, n);
+      break;
+    default:
+      errx(1, "unknown corpus shape %d", options->shape);
+    }
+    if (ret < 0 || ferror(output))
+      err(1, "cannot write the corpus");
+    written += ret;
+  }
+  return written;
+}
@@ -0,0 +1,44 @@
+#ifndef _CORPUS_H_
+#define _CORPUS_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Synthetic Scheme sources for timing the front end. The same options
+ * always give the same bytes, and every shape only uses syntax the parser
+ * accepts, so rsi can also run the output through --debug-only-parse.
+ */
+typedef enum CorpusShape {
+  /* Definitions mixing everything below a little. */
+  CORPUS_MIXED,
+  /* Expressions nested CorpusOptions::depth parentheses deep. */
+  CORPUS_DEEP,
+  /* Identifiers of 32 to 256 characters. */
+  CORPUS_LONG_IDENTS,
+  /* Lists of integers, decimals and negative numbers. */
+  CORPUS_NUMBERS,
+  /* Mostly comment lines with a small definition now and then. */
+  CORPUS_COMMENTS,
+  CORPUS_NUM_SHAPES,
+} CorpusShape;
+
+typedef struct CorpusOptions {
+  CorpusShape shape;
+  /* Stops after the first top-level form that reaches it, in bytes. */
+  long size;
+  uint32_t seed;
+  int depth;
+} CorpusOptions;
+
+#define CORPUS_DEFAULT_SEED 42
+#define CORPUS_DEFAULT_DEPTH 64
+
+extern const char *corpus_shape_name(CorpusShape shape);
+/* False if name is none of the shapes. */
+extern bool corpus_shape_from_name(const char *name, CorpusShape *shape);
+/* Writes the corpus to output, returns the number of bytes written. */
+extern long generate_corpus(FILE *output, const CorpusOptions *options);
+
+#endif
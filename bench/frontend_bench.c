@@ -0,0 +1,337 @@
+#include <err.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "ast.h"
+#include "parser.h"
+#include "tokenizer.h"
+#include "vector.h"
+
+#include "corpus.h"
+
+/*
+ * Times the front end in process on the corpora of corpus.h, one phase at a
+ * time: tokenizing the whole corpus, parse_program over the tokens the
+ * tokenizer kept, and free_ast_node on every top-level form. For each phase
+ * it prints as JSON the median time of --runs runs, MB/s and tokens per
+ * second, the peak RSS while it ran and what it asked of malloc.
+ */
+
+typedef enum Phase {
+  PHASE_TOKENIZE,
+  PHASE_PARSE,
+  PHASE_FREE,
+  NUM_PHASES,
+} Phase;
+
+static const char *phase_names[NUM_PHASES] = {
+    [PHASE_TOKENIZE] = "tokenize",
+    [PHASE_PARSE] = "parse_program",
+    [PHASE_FREE] = "free_ast_node",
+};
+
+typedef struct AllocStats {
+  uint64_t allocations;
+  uint64_t reallocations;
+  uint64_t frees;
+  uint64_t allocated_bytes;
+} AllocStats;
+
+typedef struct PhaseResult {
+  double *times_ms;
+  double median_ms;
+  AllocStats alloc;
+  long peak_rss_kib;
+} PhaseResult;
+
+static int num_runs = 5;
+static long corpus_size = 4 << 20;
+static uint32_t seed = CORPUS_DEFAULT_SEED;
+static int depth = CORPUS_DEFAULT_DEPTH;
+static bool shapes[CORPUS_NUM_SHAPES];
+static int flag_emit = 0;
+
+/* What the phase being measured allocated so far. */
+static AllocStats alloc_stats;
+
+#ifdef __GLIBC__
+/*
+ * Counts every allocation, the ones libc makes for strdup included, by
+ * replacing malloc and friends with wrappers of glibc's own.
+ */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t num, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+void *malloc(size_t size) {
+  ++alloc_stats.allocations;
+  alloc_stats.allocated_bytes += size;
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t num, size_t size) {
+  ++alloc_stats.allocations;
+  alloc_stats.allocated_bytes += num * size;
+  return __libc_calloc(num, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+  if (ptr)
+    ++alloc_stats.reallocations;
+  else
+    ++alloc_stats.allocations;
+  alloc_stats.allocated_bytes += size;
+  return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr) {
+  if (ptr)
+    ++alloc_stats.frees;
+  __libc_free(ptr);
+}
+#endif
+
+static void parse_command_args(int argc, char **argv) {
+  int c;
+  int option_index = 0;
+  bool any_shape = false;
+  static struct option long_options[] = {
+      {"shape", required_argument, NULL, 's'},
+      {"size-kib", required_argument, NULL, 'k'},
+      {"seed", required_argument, NULL, 'S'},
+      {"depth", required_argument, NULL, 'd'},
+      {"runs", required_argument, NULL, 'r'},
+      {"emit", no_argument, &flag_emit, 1},
+      {0, 0, 0, 0},
+  };
+
+  while (1) {
+    char *end = NULL;
+
+    c = getopt_long(argc, argv, "", long_options, &option_index);
+
+    /* Detect the end of options. */
+    if (c == -1) {
+      break;
+    }
+
+    switch (c) {
+    case 0:
+      break;
+    case 's': {
+      CorpusShape shape;
+      if (!corpus_shape_from_name(optarg, &shape))
+        errx(1, "unknown shape \"%s\"", optarg);
+      shapes[shape] = true;
+      any_shape = true;
+      break;
+    }
+    case 'k':
+      corpus_size = strtol(optarg, &end, 10) * 1024;
+      if (*end != '\0' || corpus_size <= 0)
+        errx(1, "invalid corpus size \"%s\"", optarg);
+      break;
+    case 'S':
+      seed = strtoul(optarg, &end, 10);
+      if (*end != '\0')
+        errx(1, "invalid seed \"%s\"", optarg);
+      break;
+    case 'd':
+      depth = strtol(optarg, &end, 10);
+      if (*end != '\0' || depth < 1)
+        errx(1, "invalid depth \"%s\"", optarg);
+      break;
+    case 'r':
+      num_runs = strtol(optarg, &end, 10);
+      if (*end != '\0' || num_runs < 1)
+        errx(1, "invalid number of runs \"%s\"", optarg);
+      break;
+    default:
+      exit(1);
+    }
+  }
+
+  /* Without --shape every shape runs. */
+  for (int i = 0; !any_shape && i < CORPUS_NUM_SHAPES; ++i)
+    shapes[i] = true;
+}
+
+static double now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+/*
+ * VmHWM of /proc/self/status, the peak RSS since the last reset_peak_rss,
+ * -1 where there is none.
+ */
+static long read_peak_rss(void) {
+  FILE *status = fopen("/proc/self/status", "r");
+  char line[256];
+  long peak = -1;
+
+  if (!status)
+    return -1;
+  while (fgets(line, sizeof(line), status)) {
+    if (strncmp(line, "VmHWM:", 6) == 0) {
+      peak = strtol(line + 6, NULL, 10);
+      break;
+    }
+  }
+  fclose(status);
+  return peak;
+}
+
+static void reset_peak_rss(void) {
+  FILE *clear_refs = fopen("/proc/self/clear_refs", "w");
+
+  if (!clear_refs)
+    return;
+  fputs("5", clear_refs);
+  fclose(clear_refs);
+}
+
+static double begin_phase(void) {
+  reset_peak_rss();
+  alloc_stats = (AllocStats){0};
+  return now_ms();
+}
+
+static void end_phase(PhaseResult *result, int run, double start) {
+  long peak_rss;
+
+  result->times_ms[run] = now_ms() - start;
+  result->alloc = alloc_stats;
+  peak_rss = read_peak_rss();
+  if (peak_rss > result->peak_rss_kib)
+    result->peak_rss_kib = peak_rss;
+}
+
+/* Runs each phase once over program, returns the number of tokens. */
+static int run_phases(char *program, PhaseResult *results, int run) {
+  Tokenizer tokenizer;
+  TokenIter iter;
+  Vector *parsed_program;
+  int num_tokens;
+  double start;
+
+  initialize_tokenizer(&tokenizer, "corpus", program);
+
+  start = begin_phase();
+  iter = tokenizer_iter(&tokenizer);
+  while (token_iter_peek(&iter)->kind != TOKEN_EOF)
+    token_iter_next(&iter);
+  end_phase(&results[PHASE_TOKENIZE], run, start);
+  num_tokens = vector_len(tokenizer.tokens);
+
+  start = begin_phase();
+  parsed_program = parse_program(&tokenizer);
+  end_phase(&results[PHASE_PARSE], run, start);
+  /* The parser replayed the tokens rather than tokenizing again. */
+  if (vector_len(tokenizer.tokens) != num_tokens)
+    errx(1, "parse_program read tokens past the end");
+
+  start = begin_phase();
+  for (int i = 0; i < vector_len(parsed_program); ++i)
+    free_ast_node(DatumGetPtr(vector_get(parsed_program, i)));
+  free_vector(parsed_program);
+  end_phase(&results[PHASE_FREE], run, start);
+
+  destroy_tokenizer(&tokenizer);
+  return num_tokens;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return x < y ? -1 : x > y;
+}
+
+static void bench_shape(CorpusShape shape, bool first) {
+  CorpusOptions options = {
+      .shape = shape, .size = corpus_size, .seed = seed, .depth = depth};
+  PhaseResult results[NUM_PHASES];
+  char *program = NULL;
+  size_t program_size = 0;
+  FILE *corpus = open_memstream(&program, &program_size);
+  int num_tokens = 0;
+  double mib;
+
+  if (!corpus)
+    err(1, "open_memstream");
+  generate_corpus(corpus, &options);
+  fclose(corpus);
+  mib = program_size / (1024.0 * 1024.0);
+
+  for (int i = 0; i < NUM_PHASES; ++i) {
+    results[i] = (PhaseResult){.peak_rss_kib = -1};
+    results[i].times_ms = calloc(num_runs, sizeof(double));
+    if (!results[i].times_ms)
+      errx(1, "OOM! %m");
+  }
+  for (int run = 0; run < num_runs; ++run)
+    num_tokens = run_phases(program, results, run);
+
+  printf("%s    {\"shape\": \"%s\", \"bytes\": %zu, \"tokens\": %d,\n",
+         first ? "" : ",\n", corpus_shape_name(shape), program_size,
+         num_tokens);
+  printf("     \"phases\": [\n");
+  for (int i = 0; i < NUM_PHASES; ++i) {
+    PhaseResult *result = &results[i];
+    double seconds;
+
+    qsort(result->times_ms, num_runs, sizeof(double), compare_doubles);
+    result->median_ms = result->times_ms[num_runs / 2];
+    seconds = result->median_ms / 1e3;
+    printf("       {\"name\": \"%s\", \"median_ms\": %.3f, "
+           "\"mb_per_s\": %.2f, \"tokens_per_s\": %.0f,\n",
+           phase_names[i], result->median_ms, mib / seconds,
+           num_tokens / seconds);
+    printf("        \"peak_rss_kib\": %ld, \"allocations\": %llu, "
+           "\"reallocations\": %llu, \"frees\": %llu, "
+           "\"allocated_bytes\": %llu}%s\n",
+           result->peak_rss_kib,
+           (unsigned long long)result->alloc.allocations,
+           (unsigned long long)result->alloc.reallocations,
+           (unsigned long long)result->alloc.frees,
+           (unsigned long long)result->alloc.allocated_bytes,
+           i + 1 < NUM_PHASES ? "," : "");
+    fprintf(stderr, "bench: %-12s %-14s %10.2f ms %8.2f MB/s\n",
+            corpus_shape_name(shape), phase_names[i], result->median_ms,
+            mib / seconds);
+    free(result->times_ms);
+  }
+  printf("     ]}");
+  free(program);
+}
+
+int main(int argc, char **argv) {
+  bool first = true;
+
+  parse_command_args(argc, argv);
+
+  if (flag_emit) {
+    for (int i = 0; i < CORPUS_NUM_SHAPES; ++i) {
+      CorpusOptions options = {
+          .shape = i, .size = corpus_size, .seed = seed, .depth = depth};
+      if (shapes[i])
+        generate_corpus(stdout, &options);
+    }
+    return 0;
+  }
+
+  printf("{\n  \"runs\": %d,\n  \"corpora\": [\n", num_runs);
+  for (int i = 0; i < CORPUS_NUM_SHAPES; ++i) {
+    if (!shapes[i])
+      continue;
+    bench_shape(i, first);
+    first = false;
+  }
+  printf("\n  ]\n}\n");
+  return 0;
+}
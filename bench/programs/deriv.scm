@@ -0,0 +1,37 @@
+;; Gabriel's deriv, symbolic differentiation allocating many small lists.
+(define (cadr l) (car (cdr l)))
+
+(define (map f l)
+  (if (null? l)
+      '()
+      (cons (f (car l)) (map f (cdr l)))))
+
+(define (deriv a)
+  (cond ((not (pair? a))
+         (if (eq? a 'x) 1 0))
+        ((eq? (car a) '+)
+         (cons '+ (map deriv (cdr a))))
+        ((eq? (car a) '-)
+         (cons '- (map deriv (cdr a))))
+        ((eq? (car a) '*)
+         (list '*
+               a
+               (cons '+ (map (lambda (a) (list '/ (deriv a) a)) (cdr a)))))
+        ((eq? (car a) '/)
+         (list '-
+               (list '/ (deriv (cadr a)) (car (cdr (cdr a))))
+               (list '/
+                     (cadr a)
+                     (list '*
+                           (car (cdr (cdr a)))
+                           (car (cdr (cdr a)))
+                           (deriv (car (cdr (cdr a))))))))
+        (else 'error)))
+
+(define (run n result)
+  (if (= n 0)
+      result
+      (run (- n 1) (deriv '(+ (* 3 x x) (* a x x) (* b x) 5)))))
+
+(display (run 50000 '()))
+(newline)
@@ -0,0 +1,44 @@
+;; Gabriel's destruct rebuilds a list of lists, shuffling the cells around.
+;; There is no set-car! or set-cdr!, so every pass conses fresh lists
+;; instead of mutating the old ones in place.
+(define (make-row n)
+  (let loop ((i 0) (l '()))
+    (if (= i n)
+        l
+        (loop (+ i 1) (cons i l)))))
+
+(define (make-rows n m)
+  (let loop ((i 0) (l '()))
+    (if (= i n)
+        l
+        (loop (+ i 1) (cons (make-row m) l)))))
+
+(define (drop l n)
+  (cond ((= n 0) l)
+        ((null? l) l)
+        (else (drop (cdr l) (- n 1)))))
+
+(define (take l n)
+  (cond ((= n 0) '())
+        ((null? l) l)
+        (else (cons (car l) (take (cdr l) (- n 1))))))
+
+;; Moves the first k cells of each row behind the row after it.
+(define (shuffle rows k)
+  (if (null? (cdr rows))
+      rows
+      (cons (drop (car rows) k)
+            (shuffle (cons (append (take (car rows) k) (car (cdr rows)))
+                           (cdr (cdr rows)))
+                     k))))
+
+(define (destruct n rows)
+  (if (= n 0)
+      rows
+      (destruct (- n 1) (shuffle (reverse rows) 3))))
+
+(define (total rows)
+  (if (null? rows) 0 (+ (length (car rows)) (total (cdr rows)))))
+
+(display (total (destruct 2000 (make-rows 50 20))))
+(newline)
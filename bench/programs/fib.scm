@@ -0,0 +1,8 @@
+;; Doubly recursive fib, calls and small arithmetic.
+(define (fib n)
+  (if (< n 2)
+      n
+      (+ (fib (- n 1)) (fib (- n 2)))))
+
+(display (fib 30))
+(newline)
@@ -0,0 +1,31 @@
+;; Counts the placements of n queens, list building and backtracking.
+(define (iota1 n)
+  (let loop ((i n) (l '()))
+    (if (= i 0)
+        l
+        (loop (- i 1) (cons i l)))))
+
+(define (ok? row dist placed)
+  (cond ((null? placed) #t)
+        ((= (car placed) (+ row dist)) #f)
+        ((= (car placed) (- row dist)) #f)
+        (else (ok? row (+ dist 1) (cdr placed)))))
+
+(define (try x y z)
+  (if (null? x)
+      (if (null? y) 1 0)
+      (+ (if (ok? (car x) 1 z)
+             (try (append (cdr x) y) '() (cons (car x) z))
+             0)
+         (try (cdr x) (cons (car x) y) z))))
+
+(define (queens n)
+  (try (iota1 n) '() '()))
+
+(define (repeat n)
+  (if (= n 1)
+      (queens 8)
+      (begin (queens 8) (repeat (- n 1)))))
+
+(display (repeat 60))
+(newline)
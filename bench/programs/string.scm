@@ -0,0 +1,44 @@
+;; String operations on lists of character codes, as there are no strings:
+;; copying, appending, reversing, comparing and searching for a substring.
+(define (make-string n)
+  (let loop ((i 0) (code 97) (s '()))
+    (cond ((= i n) s)
+          ((= code 122) (loop (+ i 1) 97 (cons code s)))
+          (else (loop (+ i 1) (+ code 1) (cons code s))))))
+
+(define (string-copy s)
+  (if (null? s) '() (cons (car s) (string-copy (cdr s)))))
+
+(define (string=? a b)
+  (cond ((null? a) (null? b))
+        ((null? b) #f)
+        ((= (car a) (car b)) (string=? (cdr a) (cdr b)))
+        (else #f)))
+
+(define (prefix? p s)
+  (cond ((null? p) #t)
+        ((null? s) #f)
+        ((= (car p) (car s)) (prefix? (cdr p) (cdr s)))
+        (else #f)))
+
+(define (count-matches p s n)
+  (if (null? s)
+      n
+      (count-matches p (cdr s) (if (prefix? p s) (+ n 1) n))))
+
+;; Doubles s n times, checking each copy against the original.
+(define (grow n s)
+  (if (= n 0)
+      (count-matches '(122 121 120) s 0)
+      (let ((t (append (string-copy s) (reverse s))))
+        (if (string=? t (append s (reverse s)))
+            (grow (- n 1) t)
+            'mismatch))))
+
+(define (repeat n acc)
+  (if (= n 0)
+      acc
+      (repeat (- n 1) (+ acc (grow 8 (make-string 100))))))
+
+(display (repeat 20 0))
+(newline)
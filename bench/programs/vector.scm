@@ -0,0 +1,44 @@
+;; Vector operations on lists, as there are no vectors: indexed reads and
+;; functional updates, filling, summing and an insertion sort.
+(define (make-vector n fill)
+  (let loop ((i 0) (v '()))
+    (if (= i n) v (loop (+ i 1) (cons fill v)))))
+
+(define (vector-ref v i)
+  (if (= i 0) (car v) (vector-ref (cdr v) (- i 1))))
+
+(define (vector-set v i x)
+  (if (= i 0)
+      (cons x (cdr v))
+      (cons (car v) (vector-set (cdr v) (- i 1) x))))
+
+;; Fills v with a sequence that jumps around, i * 37 wrapped at n.
+(define (scramble v n)
+  (let loop ((i 0) (x 0) (v v))
+    (if (= i n)
+        v
+        (loop (+ i 1)
+              (if (< (+ x 37) n) (+ x 37) (- (+ x 37) n))
+              (vector-set v i x)))))
+
+(define (insert x sorted)
+  (cond ((null? sorted) (list x))
+        ((< x (car sorted)) (cons x sorted))
+        (else (cons (car sorted) (insert x (cdr sorted))))))
+
+(define (sort v)
+  (let loop ((v v) (sorted '()))
+    (if (null? v) sorted (loop (cdr v) (insert (car v) sorted)))))
+
+(define (sum-by-index v n)
+  (let loop ((i 0) (sum 0))
+    (if (= i n) sum (loop (+ i 1) (+ sum (vector-ref v i))))))
+
+(define (run n acc)
+  (if (= n 0)
+      acc
+      (let ((v (scramble (make-vector 300 0) 300)))
+        (run (- n 1) (+ acc (sum-by-index (sort v) 300))))))
+
+(display (run 20 0))
+(newline)
@@ -0,0 +1,394 @@
+#include <dirent.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "corpus.h"
+
+/*
+ * Times rsi on each stage of the pipeline and prints the results as JSON:
+ *
+ *  - tokenize and parse, rsi --debug-only-tokenize and --debug-only-parse on
+ *    the mixed corpus of corpus.h generated into the work directory,
+ *  - every programs/X.scm under the base directory, run to completion.
+ *
+ * Each benchmark runs --warmup times untimed, then --runs times timed, and
+ * reports the median and the standard deviation of the wall clock time of
+ * the whole rsi process, startup included. With --baseline it compares the
+ * medians against an earlier output and fails when one got slower by more
+ * than --threshold percent and by more than twice its deviation.
+ */
+
+#define MAXPATH 1024
+#define MAXARGS 32
+#define MAXBENCHES 64
+
+static char *base_dir = NULL;
+static char *work_dir = NULL;
+static char *output_file = NULL;
+static char *baseline_file = NULL;
+static int num_runs = 5;
+static int num_warmup = 1;
+static double threshold = 10.0;
+static long corpus_size = 4 << 20;
+static char *rsi_args[MAXARGS];
+static int num_rsi_args = 0;
+
+typedef struct Bench {
+  char name[64];
+  /* The flag that stops rsi after the front end, NULL to run the program. */
+  const char *stage_flag;
+  char path[MAXPATH];
+  /* Bytes of input, for the throughput of the front end stages. */
+  long input_size;
+  double median_ms;
+  double stddev_ms;
+} Bench;
+
+static void parse_command_args(int argc, char **argv);
+static long write_corpus_file(const char *path, long size);
+static int find_programs(const char *dir_name, Bench *benches, int n);
+static void run_bench(Bench *bench);
+static void write_results(FILE *output, Bench *benches, int num_benches);
+static int compare_results(const char *filename, Bench *benches,
+                           int num_benches);
+
+int main(int argc, char **argv) {
+  Bench benches[MAXBENCHES];
+  int num_benches = 0;
+  char programs_dir[MAXPATH];
+  FILE *output = stdout;
+
+  parse_command_args(argc, argv);
+
+  benches[num_benches] = (Bench){.name = "tokenize",
+                                 .stage_flag = "--debug-only-tokenize"};
+  snprintf(benches[num_benches].path, MAXPATH, "%s/corpus.scm",
+           work_dir ? work_dir : ".");
+  benches[num_benches].input_size =
+      write_corpus_file(benches[num_benches].path, corpus_size);
+  ++num_benches;
+  benches[num_benches] = benches[0];
+  strcpy(benches[num_benches].name, "parse");
+  benches[num_benches].stage_flag = "--debug-only-parse";
+  ++num_benches;
+
+  snprintf(programs_dir, MAXPATH, "%s/programs", base_dir ? base_dir : ".");
+  num_benches += find_programs(programs_dir, &benches[num_benches],
+                               MAXBENCHES - num_benches);
+
+  for (int i = 0; i < num_benches; ++i) {
+    run_bench(&benches[i]);
+    fprintf(stderr, "bench: %-12s %10.2f ms +- %.2f\n", benches[i].name,
+            benches[i].median_ms, benches[i].stddev_ms);
+  }
+
+  if (output_file) {
+    output = fopen(output_file, "w");
+    if (!output)
+      err(1, "cannot open output file \"%s\"", output_file);
+  }
+  write_results(output, benches, num_benches);
+  if (output != stdout)
+    fclose(output);
+
+  if (baseline_file && compare_results(baseline_file, benches, num_benches))
+    errx(1, "benchmarks regressed");
+
+  return 0;
+}
+
+static void parse_command_args(int argc, char **argv) {
+  int c;
+  int option_index = 0;
+  static struct option long_options[] = {
+      {"base-dir", required_argument, NULL, 'b'},
+      {"work-dir", required_argument, NULL, 'w'},
+      {"output", required_argument, NULL, 'o'},
+      {"baseline", required_argument, NULL, 'B'},
+      {"threshold", required_argument, NULL, 't'},
+      {"runs", required_argument, NULL, 'r'},
+      {"warmup", required_argument, NULL, 'W'},
+      {"corpus-kib", required_argument, NULL, 'c'},
+      {"rsi-arg", required_argument, NULL, 'a'},
+      {0, 0, 0, 0},
+  };
+
+  while (1) {
+    char *end = NULL;
+
+    c = getopt_long(argc, argv, "", long_options, &option_index);
+
+    /* Detect the end of options. */
+    if (c == -1) {
+      break;
+    }
+
+    switch (c) {
+    case 'b':
+      base_dir = strdup(optarg);
+      break;
+    case 'w':
+      work_dir = strdup(optarg);
+      break;
+    case 'o':
+      output_file = strdup(optarg);
+      break;
+    case 'B':
+      baseline_file = strdup(optarg);
+      break;
+    case 't':
+      threshold = strtod(optarg, &end);
+      if (*end != '\0' || threshold < 0)
+        errx(1, "invalid threshold \"%s\"", optarg);
+      break;
+    case 'r':
+      num_runs = strtol(optarg, &end, 10);
+      if (*end != '\0' || num_runs < 1)
+        errx(1, "invalid number of runs \"%s\"", optarg);
+      break;
+    case 'W':
+      num_warmup = strtol(optarg, &end, 10);
+      if (*end != '\0' || num_warmup < 0)
+        errx(1, "invalid number of warm-up runs \"%s\"", optarg);
+      break;
+    case 'c':
+      corpus_size = strtol(optarg, &end, 10) * 1024;
+      if (*end != '\0' || corpus_size <= 0)
+        errx(1, "invalid corpus size \"%s\"", optarg);
+      break;
+    case 'a':
+      if (num_rsi_args == MAXARGS - 4)
+        errx(1, "too many --rsi-arg");
+      rsi_args[num_rsi_args++] = strdup(optarg);
+      break;
+    default:
+      exit(1);
+    }
+  }
+}
+
+/* The mixed corpus of corpus.h in a file, returns its size. */
+static long write_corpus_file(const char *path, long size) {
+  CorpusOptions options = {.shape = CORPUS_MIXED,
+                           .size = size,
+                           .seed = CORPUS_DEFAULT_SEED,
+                           .depth = CORPUS_DEFAULT_DEPTH};
+  FILE *corpus = fopen(path, "w");
+  long written;
+
+  if (!corpus)
+    err(1, "cannot open corpus file \"%s\"", path);
+  written = generate_corpus(corpus, &options);
+  fclose(corpus);
+  return written;
+}
+
+static int compare_names(const void *a, const void *b) {
+  return strcmp(((const Bench *)a)->name, ((const Bench *)b)->name);
+}
+
+/* Adds a Bench for each X.scm in dir_name, sorted by name. */
+static int find_programs(const char *dir_name, Bench *benches, int n) {
+  struct dirent *dir_ent;
+  DIR *dir;
+  int num_found = 0;
+
+  if (!(dir = opendir(dir_name)))
+    errx(1, "could not open directory \"%s\"", dir_name);
+
+  while ((dir_ent = readdir(dir))) {
+    int len = strlen(dir_ent->d_name);
+    Bench *bench;
+
+    if (len < 5 || strcmp(dir_ent->d_name + len - 4, ".scm") != 0)
+      continue;
+    if (len - 4 >= (int)sizeof(bench->name))
+      errx(1, "benchmark name \"%s\" is too long", dir_ent->d_name);
+    if (num_found == n)
+      errx(1, "too many benchmarks");
+
+    bench = &benches[num_found++];
+    *bench = (Bench){0};
+    memcpy(bench->name, dir_ent->d_name, len - 4);
+    if (snprintf(bench->path, MAXPATH, "%s/%s", dir_name, dir_ent->d_name) >=
+        MAXPATH)
+      errx(1, "file name too long");
+  }
+
+  closedir(dir);
+  qsort(benches, num_found, sizeof(Bench), compare_names);
+  return num_found;
+}
+
+/* Runs rsi once on bench, returns the wall clock time in milliseconds. */
+static double time_rsi(Bench *bench) {
+  char *argv[MAXARGS];
+  int argc = 0;
+  struct timespec start, end;
+  pid_t pid;
+  int status;
+
+  argv[argc++] = "rsi";
+  for (int i = 0; i < num_rsi_args; ++i)
+    argv[argc++] = rsi_args[i];
+  if (bench->stage_flag)
+    argv[argc++] = (char *)bench->stage_flag;
+  argv[argc++] = bench->path;
+  argv[argc] = NULL;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  pid = fork();
+  if (pid == -1)
+    err(1, "fork");
+  if (pid == 0) {
+    int null_fd = open("/dev/null", O_WRONLY);
+    if (null_fd == -1 || dup2(null_fd, STDOUT_FILENO) == -1)
+      _exit(127);
+    execvp(argv[0], argv);
+    _exit(127);
+  }
+  if (waitpid(pid, &status, 0) == -1)
+    err(1, "waitpid");
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    errx(1, "rsi failed on \"%s\"", bench->path);
+  return (end.tv_sec - start.tv_sec) * 1e3 +
+         (end.tv_nsec - start.tv_nsec) / 1e6;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return x < y ? -1 : x > y;
+}
+
+static void run_bench(Bench *bench) {
+  double *times = malloc(num_runs * sizeof(double));
+  double mean = 0, variance = 0;
+
+  if (!times)
+    errx(1, "OOM! %m");
+
+  for (int i = 0; i < num_warmup; ++i)
+    time_rsi(bench);
+  for (int i = 0; i < num_runs; ++i) {
+    times[i] = time_rsi(bench);
+    mean += times[i];
+  }
+  mean /= num_runs;
+  for (int i = 0; i < num_runs; ++i)
+    variance += (times[i] - mean) * (times[i] - mean);
+  if (num_runs > 1)
+    variance /= num_runs - 1;
+
+  qsort(times, num_runs, sizeof(double), compare_doubles);
+  bench->median_ms = num_runs % 2 ? times[num_runs / 2]
+                                  : (times[num_runs / 2 - 1] +
+                                     times[num_runs / 2]) /
+                                        2;
+  bench->stddev_ms = sqrt(variance);
+  free(times);
+}
+
+static void write_results(FILE *output, Bench *benches, int num_benches) {
+  fprintf(output, "{\n  \"runs\": %d,\n  \"warmup\": %d,\n", num_runs,
+          num_warmup);
+  fprintf(output, "  \"benchmarks\": [\n");
+  for (int i = 0; i < num_benches; ++i) {
+    Bench *bench = &benches[i];
+    fprintf(output,
+            "    {\"name\": \"%s\", \"median_ms\": %.3f, \"stddev_ms\": %.3f",
+            bench->name, bench->median_ms, bench->stddev_ms);
+    if (bench->stage_flag)
+      fprintf(output, ", \"input_bytes\": %ld, \"mb_per_s\": %.2f",
+              bench->input_size,
+              bench->input_size / (1024.0 * 1024.0) /
+                  (bench->median_ms / 1e3));
+    fprintf(output, "}%s\n", i + 1 < num_benches ? "," : "");
+  }
+  fprintf(output, "  ]\n}\n");
+}
+
+/*
+ * Finds the numeric field after the "name" of bench in a file written by
+ * write_results, this is not a general JSON reader.
+ */
+static bool find_field(const char *json, const char *name, const char *field,
+                       double *val) {
+  char key[128];
+  const char *p, *end;
+
+  snprintf(key, sizeof(key), "\"name\": \"%s\"", name);
+  if (!(p = strstr(json, key)))
+    return false;
+  end = strchr(p, '}');
+  snprintf(key, sizeof(key), "\"%s\": ", field);
+  if (!(p = strstr(p, key)) || (end && p > end))
+    return false;
+  *val = strtod(p + strlen(key), NULL);
+  return true;
+}
+
+static char *read_file(const char *filename) {
+  FILE *file = fopen(filename, "r");
+  char *content;
+  long size;
+
+  if (!file)
+    err(1, "cannot open baseline file \"%s\"", filename);
+  fseek(file, 0, SEEK_END);
+  size = ftell(file);
+  rewind(file);
+  content = malloc(size + 1);
+  if (!content)
+    errx(1, "OOM! %m");
+  content[fread(content, 1, size, file)] = '\0';
+  fclose(file);
+  return content;
+}
+
+/* Prints each benchmark next to its baseline, returns how many regressed. */
+static int compare_results(const char *filename, Bench *benches,
+                           int num_benches) {
+  char *baseline = read_file(filename);
+  int num_regressed = 0;
+
+  fprintf(stderr, "\n%-12s %12s %12s %8s\n", "benchmark", "baseline ms",
+          "ms", "change");
+  for (int i = 0; i < num_benches; ++i) {
+    Bench *bench = &benches[i];
+    double base_median, base_stddev = 0, change;
+    bool regressed;
+
+    if (!find_field(baseline, bench->name, "median_ms", &base_median) ||
+        base_median <= 0) {
+      fprintf(stderr, "%-12s %12s %12.2f\n", bench->name, "-",
+              bench->median_ms);
+      continue;
+    }
+    find_field(baseline, bench->name, "stddev_ms", &base_stddev);
+    change = 100.0 * (bench->median_ms - base_median) / base_median;
+    regressed = change > threshold &&
+                bench->median_ms - base_median >
+                    2 * fmax(bench->stddev_ms, base_stddev);
+    fprintf(stderr, "%-12s %12.2f %12.2f %+7.1f%%%s\n", bench->name,
+            base_median, bench->median_ms, change,
+            regressed ? "  REGRESSION" : "");
+    num_regressed += regressed;
+  }
+
+  free(baseline);
+  return num_regressed;
+}
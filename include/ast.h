@@ -2,6 +2,7 @@
 #define _AST_H_
 
 #include "common.h"
+#include "tokenizer.h"
 #include "vector.h"
 
 typedef enum AstKind {
@@ -16,6 +17,8 @@ typedef enum AstKind {
 
 typedef struct AstNode {
   AstKind kind;
+  /* Where the node starts in the source, line 0 for nodes made up by rsi. */
+  TokenLoc loc;
 } AstNode;
 
 typedef struct AstBool {
@@ -49,9 +52,6 @@ typedef struct AstQuote {
   AstNode *inner;
 } AstQuote;
 
-// extern Cons *make_cons(void *car, void *cdr);
-// extern Cons *list_reverse(Cons *list);
-
 extern AstNode *make_ast_bool(bool b);
 extern AstNode *make_ast_char(char c);
 extern AstNode *make_ast_number(double d);
@@ -59,4 +59,42 @@ extern AstNode *make_ast_ident(const char *id);
 extern AstNode *make_ast_proc_call(AstNode *callable, Vector *args);
 extern void free_ast_node(AstNode *node);
 
+/* Forms are parsed as procedure calls, element 0 is the callable. */
+static inline int form_length(AstProcCall *form) {
+  return 1 + vector_len(form->args);
+}
+
+static inline AstNode *form_ref(AstProcCall *form, int i) {
+  if (i == 0)
+    return form->callable;
+  return (AstNode *)DatumGetPtr(vector_get(form->args, i - 1));
+}
+
+static inline void form_set(AstProcCall *form, int i, AstNode *node) {
+  if (i == 0)
+    form->callable = node;
+  else
+    vector_set(form->args, i - 1, PointerGetDatum(node));
+}
+
+/* The name of an identifier node, NULL for anything else. */
+static inline const char *ast_ident_name(AstNode *node) {
+  if (!node || node->kind != AST_IDENT)
+    return NULL;
+  return ((AstIdent *)node)->ident;
+}
+
+static inline bool ast_is_ident(AstNode *node, const char *ident) {
+  return node && node->kind == AST_IDENT &&
+         strcmp(((AstIdent *)node)->ident, ident) == 0;
+}
+
+/* Whether the vector of names (char *) holds name. */
+extern bool names_contain(Vector *names, const char *name);
+/* Whether form is the special form keyword, unless one of locals shadows it. */
+extern bool ast_is_keyword(AstProcCall *form, const char *keyword,
+                           Vector *locals);
+/* Whether node refers to name anywhere, regardless of scoping. */
+extern bool ast_mentions(AstNode *node, const char *name);
+
 #endif
@@ -0,0 +1,28 @@
+#ifndef _BYTECODE_H_
+#define _BYTECODE_H_
+
+#include "common.h"
+#include "vm.h"
+
+extern const char *opcode_name(OpCode op);
+/*
+ * The opcode a type-specialized site was rewritten from, e.g. OP_CONSTANT
+ * for OP_ADD_CONSTANT. Any other opcode is its own.
+ */
+extern OpCode generic_opcode(OpCode op);
+/*
+ * The length of the instruction at ip in bytes, operands included.
+ * Specialized opcodes count as their generic one, so that scanning the code
+ * sees the same instructions before and after a rewrite.
+ */
+extern int instruction_length(const uint8_t *ip);
+extern void disassemble_instruction(FILE *output_file, ObjectsPool *constants,
+                                    const uint8_t *ip);
+extern void disassemble_instructions(FILE *output_file, ObjectsPool *constants,
+                                     Instructions *instructions);
+
+static inline bool opcode_is_jump(OpCode op) {
+  return op == OP_JUMP || op == OP_JUMP_IF_FALSE;
+}
+
+#endif
@@ -3,23 +3,152 @@
 
 #include "ast.h"
 #include "common.h"
+#include "escape.h"
+#include "heap.h"
 #include "vm.h"
 
+typedef struct Local {
+  const char *name;
+  /* Captured by a nested lambda and assigned, the slot holds a Box. */
+  bool boxed;
+} Local;
+
+/* A variable the lambda copies out of the enclosing one. */
+typedef struct FreeVar {
+  const char *name;
+  /* A slot of the enclosing frame, otherwise one of its own free variables. */
+  bool from_local;
+  uint8_t index;
+  bool boxed;
+} FreeVar;
+
+VECTOR_GENERATE_TYPE_NAME(Local, Locals, locals);
+VECTOR_GENERATE_TYPE_NAME(FreeVar, FreeVars, free_vars);
+
+/* Local variables of the lambda being compiled. */
+typedef struct Scope {
+  struct Scope *parent;
+  /* The live locals, the index is the frame slot. */
+  Locals *locals;
+  /* The number of slots the frame has to reserve. */
+  int num_locals;
+  FreeVars *free_vars;
+  /*
+   * Names (char *) that the body assigns and names that lambdas nested in it
+   * refer to. Locals found in both need a box.
+   */
+  Vector *assigned;
+  Vector *captured;
+} Scope;
+
+/* A top-level procedure whose calls can be replaced by its body. */
+typedef struct InlineCandidate {
+  const char *name;
+  /* The parameters (AstNode *) and the single body expression. */
+  Vector *params;
+  AstNode *body;
+  int size;
+  /* The constant holding the procedure, call sites check the global is it. */
+  uint16_t fn_constant;
+  /* Its body is being compiled into a call site. */
+  bool expanding;
+} InlineCandidate;
+
+/* A call site the body of callee is being compiled into. */
+typedef struct InlineExpansion {
+  struct InlineExpansion *parent;
+  InlineCandidate *callee;
+  /*
+   * What (AstNode *) each parameter is replaced by, a constant or a local
+   * that its procedure never assigns. NULL if it needs a slot of its own.
+   */
+  Vector *substituted_args;
+} InlineExpansion;
+
+/*
+ * A named let whose calls of its name are all in tail position, compiled as
+ * a loop in the current frame. Calls store the loop variables and jump back.
+ */
+typedef struct Loop {
+  struct Loop *parent;
+  Scope *scope;
+  /* The slot that binds the name, the loop variables follow it. */
+  int name_slot;
+  int num_vars;
+  /* Offset of the loop head. */
+  int head;
+} Loop;
+
+/* A top-level lambda compiled on its first call, see Compiler::lazy. */
+typedef struct LazyLambda {
+  LazyBody base;
+  struct Compiler *compiler;
+  Vector *params; /* AstNode * */
+  AstProcCall *form;
+  int body_start;
+} LazyLambda;
+
 typedef struct Compiler {
   ObjectsPool *constants;
   Instructions *instructions;
+  Heap *heap;
+  /* Innermost lambda, NULL while compiling top-level expressions. */
+  Scope *scope;
+  /*
+   * Largest body, in AST nodes, of a procedure that gets inlined. 0 turns
+   * inlining off.
+   */
+  int inline_budget;
+  /* Where to report inlining decisions, or NULL. */
+  FILE *inline_log;
+  Vector *inline_candidates;
+  InlineExpansion *expansion;
+  /* Innermost loop being compiled, see Loop. */
+  Loop *loop;
+  /*
+   * Build closures and pairs that never leave their frame in the frame's own
+   * slots, see escape.h. The analysis stays around for lazy bodies.
+   */
+  bool stack_allocate;
+  EscapeAnalysis *escapes;
+  /*
+   * Compile top-level lambdas into stubs whose body is compiled on the first
+   * call, see LazyBody. The compiler and the program have to outlive the VM
+   * then. finish_lazy, if set, is applied to each procedure compiled that
+   * way, nested ones included.
+   */
+  bool lazy;
+  void (*finish_lazy)(CompiledFunction *fn);
+  Vector *lazy_lambdas; /* LazyLambda * */
+  /*
+   * The source locations of the lambda body being compiled, NULL for
+   * top-level code, and the location of the innermost expression the code
+   * emitted now is for.
+   */
+  LineEntries *lines;
+  TokenLoc loc;
+  /* The name of the lambda about to be compiled, see compile_define. */
+  const char *lambda_name;
 } Compiler;
 
 typedef enum CompilerErr { COMPILE_SUCCESS } CompilerErr;
 
 extern void initialize_compiler(Compiler *c);
 extern void destroy_compiler(Compiler *c);
+/*
+ * Forgets the lambda, expansion and loop that an error raised in the middle
+ * of compiling left c in, see error_handler.h. The code of the innermost
+ * body is freed, what enclosing lambdas had allocated is not.
+ */
+extern void compiler_reset(Compiler *c);
 extern Compiler *make_compiler(void);
+extern CompilerErr compile_program(Compiler *c, Vector *program);
 extern CompilerErr compile_expression(Compiler *c, AstNode *ast);
 extern uint32_t compiler_add_constant(Compiler *c, Object val);
 extern void compiler_emit_instruction(Compiler *c, uint8_t instruction);
 extern ObjectsPool *compiler_give_out_constants(Compiler *c);
 extern Instructions *compiler_give_out_instructions(Compiler *c);
+extern Heap *compiler_give_out_heap(Compiler *c);
 extern void free_compiler(Compiler *c);
 
 #endif
@@ -0,0 +1,21 @@
+#ifndef _EMIT_C_H_
+#define _EMIT_C_H_
+
+#include "common.h"
+#include "vm.h"
+
+/*
+ * Translates a compiled program to a standalone C file, which builds into an
+ * executable when linked against librocket_runtime:
+ *
+ *   rsi --emit-c prog.scm > prog.c
+ *   cc -O2 -I include prog.c librocket_runtime.a -lm -o prog
+ *
+ * Every CompiledFunction becomes a C function that runs its bytecode with
+ * gotos for jumps, see CompiledFunction::compiled_code. The bytecode itself
+ * is kept, frames still point into it and global inline caches live there.
+ */
+extern void emit_c_program(FILE *output_file, ObjectsPool *constants,
+                           Instructions *instructions);
+
+#endif
@@ -0,0 +1,43 @@
+#ifndef _ERROR_HANDLER_H_
+#define _ERROR_HANDLER_H_
+
+#include <setjmp.h>
+
+#include "common.h"
+
+/*
+ * Where the errors of the library go. Code that finds an error calls
+ * raise_error with the message it used to print. Without a handler that
+ * prints it to stderr and exits, which is what rsi wants. The embedding API,
+ * see rocket.h, pushes a handler around each call into the library instead:
+ *
+ *   ErrorHandler handler;
+ *   push_error_handler(&handler);
+ *   if (setjmp(handler.env)) {
+ *     ... handler.message says what went wrong, the handler is popped ...
+ *   }
+ *   ... the work ...
+ *   pop_error_handler(&handler);
+ *
+ * The handlers are per thread, a runtime on one thread never unwinds
+ * another's.
+ */
+#define ERROR_MESSAGE_SIZE 256
+
+typedef struct ErrorHandler {
+  struct ErrorHandler *prev;
+  jmp_buf env;
+  /* The message of the error, without its trailing newline. */
+  char message[ERROR_MESSAGE_SIZE];
+} ErrorHandler;
+
+extern void push_error_handler(ErrorHandler *handler);
+extern void pop_error_handler(ErrorHandler *handler);
+/*
+ * Formats the message like printf and unwinds to the innermost handler,
+ * popping it, or prints it and exits if there is none.
+ */
+extern _Noreturn void raise_error(const char *format, ...)
+    __attribute__((format(printf, 1, 2)));
+
+#endif
@@ -0,0 +1,50 @@
+#ifndef _ESCAPE_H_
+#define _ESCAPE_H_
+
+#include "ast.h"
+#include "vector.h"
+
+/*
+ * Finds the closures and pairs that never outlive the frame creating them,
+ * which the compiler then builds in slots of that frame instead of on the
+ * heap, see OP_STACK_CLOSURE.
+ *
+ * A value escapes if it may be returned, stored in a variable, a pair or a
+ * closure, or handed to a procedure that may keep it. Top-level procedures
+ * that are defined once and never assigned are analysed for the parameters
+ * they keep, as are the built-ins the program never assigns. A value that a
+ * tail call takes along escapes too, the call reuses the frame it lives in.
+ */
+typedef struct EscapeProcedure {
+  const char *name;
+  /* (define (name params ...) body ...) */
+  AstProcCall *form;
+  /* Bit i is set if parameter i may outlive the call. */
+  uint64_t kept_params;
+} EscapeProcedure;
+
+typedef struct EscapeAnalysis {
+  Vector *procedures; /* EscapeProcedure * */
+  /* Names (char *) that a define or set! assigns, once per assignment. */
+  Vector *assigned;
+} EscapeAnalysis;
+
+extern EscapeAnalysis *analyze_escapes(Vector *program);
+extern void free_escape_analysis(EscapeAnalysis *analysis);
+/* Whether the program never assigns the global name. */
+extern bool escape_trusts_global(EscapeAnalysis *analysis, const char *name);
+/*
+ * Whether the value bound to name by the let form may outlive the let.
+ * locals (char *) are the names bound around the let, tail tells whether it
+ * is in tail position.
+ */
+extern bool escape_let_binding(EscapeAnalysis *analysis, AstProcCall *form,
+                               const char *name, Vector *locals, bool tail);
+/*
+ * Whether argument index of a call of the global callee with argc arguments
+ * may outlive the call.
+ */
+extern bool escape_call_arg(EscapeAnalysis *analysis, const char *callee,
+                            int argc, int index);
+
+#endif
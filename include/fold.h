@@ -0,0 +1,15 @@
+#ifndef _FOLD_H_
+#define _FOLD_H_
+
+#include "ast.h"
+#include "vector.h"
+
+/*
+ * Folds calls of pure built-ins whose arguments are literal numbers or
+ * booleans, and drops if and cond branches that a literal test rules out.
+ * Built-ins that are shadowed by a local, or assigned anywhere in the
+ * program, are left alone. Rewrites the parsed program in place.
+ */
+extern void fold_constants(Vector *program);
+
+#endif
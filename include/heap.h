@@ -0,0 +1,150 @@
+#ifndef _HEAP_H_
+#define _HEAP_H_
+
+#include "common.h"
+#include "object.h"
+#include "vector.h"
+
+/*
+ * Memory for runtime objects is carved out of page-granular slabs that the
+ * heap owns. Nothing goes back to malloc until the heap is freed. There is
+ * no collector yet, objects are released explicitly or with the heap.
+ */
+#define HEAP_PAGE_SIZE 4096
+
+/*
+ * Pairs are the most frequently allocated objects, so they get a region of
+ * their own. Each slab is a chunk of densely packed Pair cells that is handed
+ * out by bumping a cursor, the only per-slab overhead is the link to the next
+ * slab.
+ */
+#define HEAP_PAIR_SLAB_SIZE (16 * HEAP_PAGE_SIZE)
+
+typedef struct PairSlab {
+  struct PairSlab *next;
+  Pair cells[];
+} PairSlab;
+
+#define HEAP_PAIRS_PER_SLAB                                                    \
+  ((HEAP_PAIR_SLAB_SIZE - sizeof(PairSlab)) / sizeof(Pair))
+
+/*
+ * Everything else is served from size classes: 16-byte steps up to 128
+ * bytes, then powers of two up to 2048 bytes. Each class bump allocates out
+ * of its newest slab and recycles freed blocks through a free list. Larger
+ * requests get a dedicated malloc'ed block.
+ */
+#define HEAP_SLAB_SIZE (4 * HEAP_PAGE_SIZE)
+#define HEAP_ALIGNMENT 16
+#define HEAP_NUM_SMALL_STEPS 8
+#define HEAP_NUM_SIZE_CLASSES 12
+#define HEAP_MAX_SMALL_SIZE 2048
+
+typedef struct HeapSlab {
+  struct HeapSlab *next;
+  /* Keep the blocks after the header aligned. */
+  uint8_t padding[HEAP_ALIGNMENT - sizeof(struct HeapSlab *)];
+  uint8_t blocks[];
+} HeapSlab;
+
+typedef struct FreeBlock {
+  struct FreeBlock *next;
+} FreeBlock;
+
+typedef struct SizeClass {
+  uint32_t block_size;
+  uint8_t *cursor;
+  uint8_t *limit;
+  FreeBlock *free_list;
+  HeapSlab *slabs;
+  uint64_t num_slabs;
+  uint64_t num_allocs;
+  uint64_t num_frees;
+} SizeClass;
+
+typedef struct LargeBlock {
+  struct LargeBlock *next;
+  struct LargeBlock *prev;
+  size_t size;
+  uint8_t padding[HEAP_ALIGNMENT - sizeof(size_t)];
+  uint8_t data[];
+} LargeBlock;
+
+struct Heap {
+  /* Bump allocation window inside the newest pair slab. */
+  Pair *pair_cursor;
+  Pair *pair_limit;
+  PairSlab *pair_slabs;
+  uint64_t num_pair_slabs;
+  uint64_t num_pairs;
+
+  SizeClass size_classes[HEAP_NUM_SIZE_CLASSES];
+  LargeBlock *large_blocks;
+  uint64_t num_large_allocs;
+  uint64_t num_large_frees;
+  uint64_t large_bytes;
+
+  /* Interned symbol names (char *). */
+  Vector *symbols;
+};
+
+extern Heap *make_heap(void);
+extern void free_heap(Heap *heap);
+extern Pair *heap_alloc_pair_slow(Heap *heap);
+extern void *heap_alloc_slow(SizeClass *size_class);
+extern void *heap_alloc_large(Heap *heap, size_t size);
+extern void heap_free_large(Heap *heap, void *ptr);
+extern char *heap_strdup(Heap *heap, const char *str);
+extern const char *heap_intern_symbol(Heap *heap, const char *name);
+extern void heap_dump_stats(FILE *output_file, Heap *heap);
+
+static inline Pair *heap_alloc_pair(Heap *heap) {
+  if (heap->pair_cursor == heap->pair_limit)
+    return heap_alloc_pair_slow(heap);
+  ++heap->num_pairs;
+  return heap->pair_cursor++;
+}
+
+static inline int heap_size_class_index(size_t size) {
+  if (size <= HEAP_NUM_SMALL_STEPS * HEAP_ALIGNMENT)
+    return size <= HEAP_ALIGNMENT ? 0 : (int)((size - 1) / HEAP_ALIGNMENT);
+  /* 129..256 -> 8, 257..512 -> 9, ... */
+  return HEAP_NUM_SMALL_STEPS + (64 - __builtin_clzll(size - 1)) - 8;
+}
+
+static inline void *heap_alloc(Heap *heap, size_t size) {
+  SizeClass *size_class;
+  FreeBlock *block;
+
+  if (size > HEAP_MAX_SMALL_SIZE)
+    return heap_alloc_large(heap, size);
+
+  size_class = &heap->size_classes[heap_size_class_index(size)];
+  ++size_class->num_allocs;
+  if ((block = size_class->free_list)) {
+    size_class->free_list = block->next;
+    return block;
+  }
+  if (size_class->cursor == size_class->limit)
+    return heap_alloc_slow(size_class);
+  size_class->cursor += size_class->block_size;
+  return size_class->cursor - size_class->block_size;
+}
+
+/* The caller passes the size it allocated with, blocks carry no header. */
+static inline void heap_free(Heap *heap, void *ptr, size_t size) {
+  SizeClass *size_class;
+  FreeBlock *block = (FreeBlock *)ptr;
+
+  if (size > HEAP_MAX_SMALL_SIZE) {
+    heap_free_large(heap, ptr);
+    return;
+  }
+
+  size_class = &heap->size_classes[heap_size_class_index(size)];
+  ++size_class->num_frees;
+  block->next = size_class->free_list;
+  size_class->free_list = block;
+}
+
+#endif
@@ -0,0 +1,45 @@
+#ifndef _JIT_H_
+#define _JIT_H_
+
+#include "common.h"
+#include "vm.h"
+
+/*
+ * A baseline template JIT for the stack bytecode on x86-64. Every opcode is
+ * translated by copying a fixed machine code template and patching its
+ * operands in. Constants, locals, jumps and the arithmetic and comparison
+ * fast paths run as machine code, everything else calls jit_step on the
+ * instruction, which runs it in the interpreter.
+ *
+ * Generated code keeps VM, the frame, the frame's locals and the top of
+ * VM::stack in callee-saved registers and only writes VM::stack_pointer back
+ * around calls into C. It returns to the interpreter whenever an
+ * instruction leaves the frame, i.e. on calls of procedures and returns.
+ */
+typedef Frame *(*JitEntry)(VM *vm, Frame *frame, void *resume);
+
+typedef struct JitCode {
+  JitEntry entry;
+  uint8_t *code;
+  size_t size;
+  /* The machine address of each instruction, by bytecode offset. */
+  void **resume_points;
+} JitCode;
+
+/* Whether this build can generate machine code. */
+extern bool jit_supported(void);
+/* Translates fn, on failure it stays interpreted. */
+extern bool jit_compile_function(VM *vm, CompiledFunction *fn);
+extern void jit_free_function(CompiledFunction *fn);
+/*
+ * Runs frame's function from frame->ip in its machine code and returns the
+ * frame the interpreter continues with. VM::stack_pointer is up to date.
+ */
+extern Frame *jit_enter(VM *vm, Frame *frame);
+/*
+ * Called by generated code to run the instruction at ip in the interpreter,
+ * see vm.c.
+ */
+extern Frame *jit_step(VM *vm, Frame *frame, uint8_t *ip);
+
+#endif
@@ -0,0 +1,57 @@
+#ifndef _LINETABLE_H_
+#define _LINETABLE_H_
+
+#include "common.h"
+#include "vector.h"
+
+/*
+ * Maps bytecode offsets back to source locations, much like CPython's line
+ * table. An entry covers the code from its offset up to the next entry's,
+ * offsets increase.
+ *
+ * Entries are packed as the difference to the entry before: the offset
+ * delta, then the line and column deltas zigzag-encoded, each as an LEB128
+ * varint, which takes three bytes for most entries. Every
+ * LINE_TABLE_CHECKPOINT_INTERVAL-th entry is also kept whole in a
+ * checkpoint. A lookup binary-searches the checkpoints and decodes at most
+ * that many entries after one.
+ */
+#define LINE_TABLE_CHECKPOINT_INTERVAL 16
+
+typedef struct LineEntry {
+  uint32_t offset;
+  /* 1-based, 0 if unknown. */
+  uint32_t line;
+  /* 0-based, tabs count as 8 columns, see the tokenizer. */
+  uint32_t column;
+} LineEntry;
+
+VECTOR_GENERATE_TYPE_NAME(LineEntry, LineEntries, line_entries);
+
+typedef struct LineCheckpoint {
+  LineEntry entry;
+  /* Where the entries after it start in LineTable::data. */
+  uint32_t position;
+} LineCheckpoint;
+
+typedef struct LineTable {
+  uint8_t *data;
+  uint32_t size;
+  uint32_t num_entries;
+  LineCheckpoint *checkpoints;
+  uint32_t num_checkpoints;
+} LineTable;
+
+extern LineTable *make_line_table(LineEntries *entries);
+/* Packs entries into table, replacing what it held. */
+extern void line_table_encode(LineTable *table, LineEntries *entries);
+extern LineEntries *line_table_decode(LineTable *table);
+/*
+ * Finds the entry that covers offset, false if offset comes before the
+ * first one.
+ */
+extern bool line_table_lookup(LineTable *table, uint32_t offset,
+                              LineEntry *entry);
+extern void free_line_table(LineTable *table);
+
+#endif
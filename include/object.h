@@ -8,6 +8,15 @@ typedef enum ObjectType {
   OBJ_NIL = 0,
   OBJ_BOOL,
   OBJ_NUMBER,
+  OBJ_SYMBOL,
+  OBJ_PAIR,
+  OBJ_PROCEDURE,
+  OBJ_CLOSURE,
+  OBJ_PRIMITIVE,
+  OBJ_NATIVE,
+  OBJ_UNSPECIFIED,
+  /* Holds an assigned variable that closures share, never seen by code. */
+  OBJ_BOX,
 } ObjectType;
 
 typedef struct Object {
@@ -15,4 +24,40 @@ typedef struct Object {
   Datum value;
 } Object;
 
+/*
+ * A pair is exactly its two fields. Pairs carry no header of their own, the
+ * type lives in the Object that points at them.
+ */
+typedef struct Pair {
+  Object car;
+  Object cdr;
+} Pair;
+
+typedef struct Heap Heap;
+
+static inline Object make_object(ObjectType type, Datum value) {
+  Object obj;
+  obj.type = type;
+  obj.value = value;
+  return obj;
+}
+
+#define NIL_OBJECT (make_object(OBJ_NIL, 0))
+#define UNSPECIFIED_OBJECT (make_object(OBJ_UNSPECIFIED, 0))
+#define BoolGetObject(b) (make_object(OBJ_BOOL, BoolGetDatum((b))))
+#define FloatGetObject(f) (make_object(OBJ_NUMBER, FloatGetDatum(f)))
+
+#define ObjectGetPair(obj) ((Pair *)DatumGetPtr((obj).value))
+
+static inline bool ObjectIsFalse(Object obj) {
+  return obj.type == OBJ_BOOL && !DatumGetBool(obj.value);
+}
+
+extern Object make_pair(Heap *heap, Object car, Object cdr);
+extern int list_length(Object list);
+extern Object list_reverse(Heap *heap, Object list);
+extern Object list_append(Heap *heap, Object list, Object tail);
+extern bool object_eq(Object a, Object b);
+extern void print_object(FILE *output_file, Object obj);
+
 #endif
@@ -0,0 +1,22 @@
+#ifndef _OPTIMIZER_H_
+#define _OPTIMIZER_H_
+
+#include "common.h"
+#include "vm.h"
+
+/*
+ * Rewrites the bytecode of the top-level instructions and of the procedures
+ * in constants from index first on whose body is compiled already. Level 0
+ * leaves the code alone, level 1 runs the peephole pass. With a dump_file,
+ * each function is printed as a diff of its code before and after.
+ */
+extern void optimize_program(ObjectsPool *constants,
+                             Instructions *instructions, int first, int level,
+                             FILE *dump_file);
+/*
+ * Returns true if anything changed. lines, if not NULL, is kept in step with
+ * the code.
+ */
+extern bool peephole_optimize(Instructions *instructions, LineTable *lines);
+
+#endif
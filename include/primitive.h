@@ -0,0 +1,76 @@
+#ifndef _PRIMITIVE_H_
+#define _PRIMITIVE_H_
+
+#include "common.h"
+#include "object.h"
+#include "vm.h"
+
+typedef enum PrimitiveKind {
+  PRIM_ADD,
+  PRIM_SUB,
+  PRIM_MUL,
+  PRIM_DIV,
+  PRIM_NUM_EQ,
+  PRIM_LT,
+  PRIM_GT,
+  PRIM_LE,
+  PRIM_GE,
+  PRIM_NOT,
+  PRIM_EQ,
+  PRIM_CONS,
+  PRIM_CAR,
+  PRIM_CDR,
+  PRIM_NULL_P,
+  PRIM_PAIR_P,
+  PRIM_LIST,
+  PRIM_LENGTH,
+  PRIM_APPEND,
+  PRIM_REVERSE,
+  PRIM_DISPLAY,
+  PRIM_NEWLINE,
+  PRIM_LAST,
+} PrimitiveKind;
+
+typedef struct PrimitiveInfo {
+  const char *name;
+  /* Number of arguments, -1 for variadic primitives. */
+  int arity;
+} PrimitiveInfo;
+
+extern const PrimitiveInfo primitives[PRIM_LAST];
+
+/*
+ * The primitives from PRIM_ADD to PRIM_PAIR_P have opcodes of their own, in
+ * the same order from OP_ADD on. The compiler emits them for calls with the
+ * number of arguments below.
+ */
+#define PRIM_LAST_INLINE PRIM_PAIR_P
+
+static inline int primitive_inline_argc(PrimitiveKind kind) {
+  switch (kind) {
+  case PRIM_NOT:
+  case PRIM_CAR:
+  case PRIM_CDR:
+  case PRIM_NULL_P:
+  case PRIM_PAIR_P:
+    return 1;
+  default:
+    return 2;
+  }
+}
+
+static inline OpCode primitive_inline_op(PrimitiveKind kind) {
+  return (OpCode)(OP_ADD + (kind - PRIM_ADD));
+}
+
+static inline PrimitiveKind inline_op_primitive(OpCode op) {
+  return (PrimitiveKind)(PRIM_ADD + (op - OP_ADD));
+}
+
+extern void define_primitives(SymbolTable *globals);
+/* Returns the PrimitiveKind named name, or -1. */
+extern int lookup_primitive(const char *name);
+extern Object call_primitive(VM *vm, PrimitiveKind kind, int argc,
+                             Object *argv);
+
+#endif
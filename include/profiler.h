@@ -0,0 +1,62 @@
+#ifndef _PROFILER_H_
+#define _PROFILER_H_
+
+#include <signal.h>
+#include <time.h>
+
+#include "common.h"
+#include "vm.h"
+
+/*
+ * A sampling profiler for Scheme code, rsi --profile. On every tick of a
+ * timer on the CPU time of the thread running the VM, the SIGPROF handler
+ * copies the function and instruction pointer of the innermost frames on
+ * VM::frames into the sample buffer, and does nothing else: no malloc, no
+ * locks and no reads through the pointers it copies. The buffer grows by
+ * chunks that the handler maps itself. A frame holds NULL or a procedure
+ * that lives as long as the VM, so even one that a call is halfway through
+ * filling in is safe to copy.
+ *
+ * Once the run is over, samples are mapped to procedure names and source
+ * lines, see CompiledFunction::lines, and written as folded stacks: one line
+ * per distinct stack, outermost frame first, with the number of samples that
+ * saw it, e.g.
+ *   top-level:9;loop:4;fib:2 42
+ * which flamegraph.pl and similar tools read.
+ */
+#define PROFILER_DEFAULT_HZ 1000
+/* Deeper stacks keep their innermost frames. */
+#define PROFILER_MAX_DEPTH 256
+
+typedef struct ProfileChunk ProfileChunk;
+
+typedef struct Profiler {
+  VM *vm;
+  int hz;
+  /*
+   * Each sample is the number of frames on VM::frames followed by a
+   * CompiledFunction * and an ip for each frame kept, outermost first. They
+   * fill chunks mapped one at a time as the run goes on.
+   */
+  ProfileChunk *first_chunk;
+  ProfileChunk *last_chunk;
+  size_t num_chunks;
+  size_t num_samples;
+  /* Samples that did not fit in the chunks. */
+  size_t num_dropped;
+  timer_t timer;
+} Profiler;
+
+extern Profiler *make_profiler(VM *vm, int hz);
+/*
+ * Samples hz times a second of the calling thread's CPU time until
+ * profiler_stop. Threads running VMs of their own may each profile one.
+ */
+extern void profiler_start(Profiler *p);
+extern void profiler_stop(Profiler *p);
+/* Records the frames of the VM as they are now, the signal handler's work. */
+extern void profiler_take_sample(Profiler *p);
+extern void profiler_write_folded(Profiler *p, FILE *out);
+extern void free_profiler(Profiler *p);
+
+#endif
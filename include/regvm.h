@@ -0,0 +1,93 @@
+#ifndef _REGVM_H_
+#define _REGVM_H_
+
+#include "common.h"
+#include "primitive.h"
+#include "vm.h"
+
+/*
+ * The register bytecode. Registers are the slots of the frame on VM::stack:
+ * the locals first, then one temporary per depth of the stack bytecode's
+ * operand stack. Register operands are a byte, constants, globals and jump
+ * targets are encoded as in the stack bytecode. A is the destination.
+ */
+typedef enum RegOpCode {
+  ROP_LOADK,           /* <u8 A> <u16 constant> */
+  ROP_MOVE,            /* <u8 A> <u8 B> */
+  ROP_GET_GLOBAL,      /* <u16 name constant> <cache> <u8 A> */
+  ROP_DEFINE_GLOBAL,   /* <u16 name constant> <u8 B> */
+  ROP_SET_GLOBAL,      /* <u16 name constant> <cache> <u8 B> */
+  ROP_JUMP,            /* <u16 target> */
+  ROP_JUMP_IF_FALSE,   /* <u16 target> <u8 B> */
+  ROP_GET_FREE,        /* <u8 A> <u8 index> */
+  ROP_GET_FREE_BOX,    /* <u8 A> <u8 index> */
+  ROP_SET_FREE_BOX,    /* <u8 index> <u8 B> */
+  ROP_GET_LOCAL_BOX,   /* <u8 A> <u8 slot> */
+  ROP_SET_LOCAL_BOX,   /* <u8 slot> <u8 B> */
+  ROP_BOX_LOCAL,       /* <u8 slot> */
+  /* <u8 A> <u16 function constant> <u8 n> followed by n captures */
+  ROP_CLOSURE,
+  /* <u8 A> <u16 function constant> <u8 slot> <u8 n> followed by n captures */
+  ROP_STACK_CLOSURE,
+  ROP_STACK_CONS,      /* <u8 A> <u8 B> <u8 C> <u8 slot> */
+  /* <u8 A> <u8 argc>, calls A with A+1 ... A+argc, the result goes to A */
+  ROP_CALL,
+  ROP_TAIL_CALL,       /* <u8 A> <u8 argc> */
+  ROP_EQ_CONSTANT,     /* <u8 A> <u8 B> <u16 constant> */
+  ROP_RETURN,          /* <u8 B> */
+  /* <u8 depth>, ends the program leaving depth temporaries on the stack */
+  ROP_HALT,
+  /*
+   * Comparisons directly followed by the ROP_JUMP_IF_FALSE on their result.
+   * They jump on their own while the operands are numbers, otherwise they
+   * store the result like the plain opcode and the jump runs.
+   */
+  ROP_BRANCH_NUM_EQ, /* <u8 A> <u8 B> <u8 C> */
+  ROP_BRANCH_LT,
+  ROP_BRANCH_GT,
+  ROP_BRANCH_LE,
+  ROP_BRANCH_GE,
+  /*
+   * Inlined primitives in PrimitiveKind order, <u8 A> <u8 B> <u8 C> or
+   * <u8 A> <u8 B> for the unary ones. The operands of the call a redefined
+   * primitive falls back to go to A+1 onwards.
+   */
+  ROP_ADD,
+  ROP_SUB,
+  ROP_MUL,
+  ROP_DIV,
+  ROP_NUM_EQ,
+  ROP_LT,
+  ROP_GT,
+  ROP_LE,
+  ROP_GE,
+  ROP_NOT,
+  ROP_EQ,
+  ROP_CONS,
+  ROP_CAR,
+  ROP_CDR,
+  ROP_NULL_P,
+  ROP_PAIR_P,
+  ROP_LAST,
+} RegOpCode;
+
+static inline PrimitiveKind reg_op_primitive(RegOpCode op) {
+  if (op >= ROP_BRANCH_NUM_EQ && op <= ROP_BRANCH_GE)
+    return (PrimitiveKind)(PRIM_NUM_EQ + (op - ROP_BRANCH_NUM_EQ));
+  return (PrimitiveKind)(PRIM_ADD + (op - ROP_ADD));
+}
+
+/*
+ * Translates the top-level code and every procedure in VM::constants to
+ * register bytecode and makes vm_run execute it. With a dump_file, the
+ * translated code is printed.
+ */
+extern void registerize_program(VM *vm, FILE *dump_file);
+/* Translates fn alone, into CompiledFunction::register_instructions. */
+extern void registerize_function(CompiledFunction *fn);
+extern int reg_instruction_length(const uint8_t *ip);
+extern void disassemble_register_instructions(FILE *output_file,
+                                              ObjectsPool *constants,
+                                              Instructions *instructions);
+
+#endif
@@ -0,0 +1,134 @@
+#ifndef _ROCKET_H_
+#define _ROCKET_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * The embedding API of librocket. A Rocket is a runtime of its own: a
+ * compiler and a stack VM with their own globals, constants, heap and
+ * stacks. Runtimes share nothing, so threads may each drive one at the same
+ * time, but a single runtime is only ever used by one thread at a time.
+ *
+ *   Rocket *r = rocket_create(NULL);
+ *   RocketValue fib, result, arg = rocket_number(20);
+ *   if (rocket_eval(r, "fib.scm", source, &result) != ROCKET_OK ||
+ *       rocket_lookup(r, "fib", &fib) != ROCKET_OK ||
+ *       rocket_call(r, fib, 1, &arg, &result) != ROCKET_OK)
+ *     fprintf(stderr, "%s\n", rocket_error_message(r));
+ *   rocket_destroy(r);
+ *
+ * Values are passed by value and never copied: pairs, procedures and
+ * symbols point into the runtime's heap and stay valid until
+ * rocket_destroy. They must not be handed to another runtime.
+ *
+ * A syntax error, an unbound variable or a bad argument makes the call
+ * return ROCKET_ERROR and leaves the runtime usable. Natives report errors
+ * the same way, with rocket_raise.
+ */
+typedef struct Rocket Rocket;
+
+typedef enum RocketStatus {
+  ROCKET_OK,
+  /* See rocket_error_message. */
+  ROCKET_ERROR,
+} RocketStatus;
+
+typedef enum RocketType {
+  ROCKET_NIL,
+  ROCKET_BOOL,
+  ROCKET_NUMBER,
+  ROCKET_SYMBOL,
+  ROCKET_PAIR,
+  /* Anything Scheme code can call, natives included. */
+  ROCKET_PROCEDURE,
+  ROCKET_UNSPECIFIED,
+} RocketType;
+
+/* The fields belong to the runtime, see rocket_type and the accessors. */
+typedef struct RocketValue {
+  int tag;
+  uintptr_t bits;
+} RocketValue;
+
+/*
+ * A C function callable from Scheme. argv holds the argc arguments, only
+ * until the native returns.
+ */
+typedef RocketValue (*RocketNative)(Rocket *r, int argc,
+                                    const RocketValue *argv);
+
+typedef struct RocketOptions {
+  /* As rsi -O, 0 leaves the bytecode as compiled. */
+  int optimization_level;
+  /* As rsi --inline-budget, with optimization_level 1 or more. */
+  int inline_budget;
+  /*
+   * As rsi --jit-threshold, -1 keeps everything interpreted. Ignored where
+   * the JIT is not supported.
+   */
+  int jit_threshold;
+  /* As rsi --specialize-threshold, with optimization_level 1 or more. */
+  int specialize_threshold;
+  /* Compile top-level lambdas on their first call. */
+  bool lazy;
+} RocketOptions;
+
+/* What rsi runs with, the JIT aside. */
+extern RocketOptions rocket_default_options(void);
+/* NULL options are the default ones. Returns NULL if the VM cannot start. */
+extern Rocket *rocket_create(const RocketOptions *options);
+extern void rocket_destroy(Rocket *r);
+
+/*
+ * Compiles source, a program named name in messages, into a procedure of no
+ * arguments that runs it and returns the value of its last expression.
+ */
+extern RocketStatus rocket_compile(Rocket *r, const char *name,
+                                   const char *source, RocketValue *procedure);
+/* Compiles source and runs it, see rocket_compile. */
+extern RocketStatus rocket_eval(Rocket *r, const char *name,
+                                const char *source, RocketValue *result);
+/*
+ * Calls procedure, anything Scheme code can call, with argc arguments.
+ * Natives may call back into the runtime that called them.
+ */
+extern RocketStatus rocket_call(Rocket *r, RocketValue procedure, int argc,
+                                const RocketValue *argv, RocketValue *result);
+
+/* The value of the global name, an error if it is unbound. */
+extern RocketStatus rocket_lookup(Rocket *r, const char *name,
+                                  RocketValue *value);
+extern void rocket_define(Rocket *r, const char *name, RocketValue value);
+/* Binds name to fn, which takes arity arguments, -1 for any number. */
+extern void rocket_define_native(Rocket *r, const char *name, RocketNative fn,
+                                 int arity);
+/*
+ * Formats the message like printf and fails the call into the runtime that
+ * the native was called from. Only natives may raise.
+ */
+extern _Noreturn void rocket_raise(const char *format, ...)
+    __attribute__((format(printf, 1, 2)));
+/* What the last call that returned ROCKET_ERROR failed with. */
+extern const char *rocket_error_message(Rocket *r);
+
+extern RocketType rocket_type(RocketValue value);
+/* Whether a and b are eq?. */
+extern bool rocket_eq(RocketValue a, RocketValue b);
+extern RocketValue rocket_nil(void);
+extern RocketValue rocket_bool(bool b);
+/* False only for #f, as in Scheme conditions. */
+extern bool rocket_truthy(RocketValue value);
+extern RocketValue rocket_number(double number);
+/* value must be a number. */
+extern double rocket_number_value(RocketValue value);
+/* The symbol name, eq? to the one the program writes as 'name. */
+extern RocketValue rocket_symbol(Rocket *r, const char *name);
+/* value must be a symbol. */
+extern const char *rocket_symbol_name(RocketValue value);
+extern RocketValue rocket_cons(Rocket *r, RocketValue car, RocketValue cdr);
+/* pair must be a pair. */
+extern RocketValue rocket_car(RocketValue pair);
+extern RocketValue rocket_cdr(RocketValue pair);
+
+#endif
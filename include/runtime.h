@@ -0,0 +1,320 @@
+#ifndef _RUNTIME_H_
+#define _RUNTIME_H_
+
+#include "common.h"
+#include "error_handler.h"
+#include "heap.h"
+#include "jit.h"
+#include "primitive.h"
+#include "symbol.h"
+#include "vm.h"
+#include "vmstats.h"
+
+/*
+ * The operations behind the opcodes, shared by the interpreters in vm.c, the
+ * JIT and the C that rsi --emit-c writes, which links against them.
+ */
+
+static inline void vm_push(VM *vm, Object val) {
+  vm->stack[vm->stack_pointer++] = val;
+}
+
+static inline Object vm_pop(VM *vm) {
+  return vm->stack[--vm->stack_pointer];
+}
+
+static inline Box *vm_make_box(VM *vm, Object val) {
+  Box *box = heap_alloc(vm->heap, sizeof(Box));
+  box->value = val;
+  return box;
+}
+
+static inline Box *ObjectGetBox(Object obj) {
+  return (Box *)DatumGetPtr(obj.value);
+}
+
+static inline Native *ObjectGetNative(Object obj) {
+  return (Native *)DatumGetPtr(obj.value);
+}
+
+/* The closure of the running procedure sits just below its arguments. */
+static inline Closure *vm_current_closure(VM *vm, Frame *frame) {
+  return (Closure *)DatumGetPtr(vm->stack[frame->base_pointer - 1].value);
+}
+
+/* Unchecked, the verifier made sure that the constants exist. */
+static inline Object vm_constant(VM *vm, uint16_t constant_idx) {
+  return vm->constants->items[constant_idx];
+}
+
+static inline const char *global_name(VM *vm, uint16_t constant_idx) {
+  return DatumGetCString(vm_constant(vm, constant_idx).value);
+}
+
+/* Adds or replaces a global, bumping the version if the table grows. */
+extern void vm_store_global(VM *vm, const char *name, Object val);
+/* Looks up the global named by the instruction at ip and fills its cache. */
+extern SymbolTableElement *vm_resolve_global(VM *vm, uint8_t *ip);
+/* Stops trusting inlined primitive opcodes once their global is replaced. */
+extern void vm_note_global_store(VM *vm, const char *name, Object old,
+                                 Object val);
+extern void vm_define_global(VM *vm, const char *name, Object val);
+
+static inline SymbolTableElement *vm_global_slot(VM *vm, uint8_t *ip) {
+  uint32_t version;
+  SymbolTableElement *slot;
+
+  memcpy(&version, ip + 3, sizeof(version));
+  if (version != vm->globals_version)
+    return vm_resolve_global(vm, ip);
+  memcpy(&slot, ip + 3 + sizeof(version), sizeof(slot));
+  return slot;
+}
+
+static inline void vm_set_global(VM *vm, SymbolTableElement *slot,
+                                 Object val) {
+  if (slot->val.type == OBJ_PRIMITIVE)
+    vm_note_global_store(vm, slot->symbol_name, slot->val, val);
+  slot->val = val;
+}
+
+/*
+ * Makes a closure of fn in frame from num_free_vars <u8 from_local>
+ * <u8 index> pairs, as in OP_CLOSURE.
+ */
+extern Object vm_make_closure(VM *vm, Frame *frame, CompiledFunction *fn,
+                              uint8_t num_free_vars, const uint8_t *captures);
+/*
+ * Like vm_make_closure, but builds the closure in the frame slots from slot
+ * on, as in OP_STACK_CLOSURE.
+ */
+extern Object vm_make_stack_closure(VM *vm, Frame *frame, CompiledFunction *fn,
+                                    uint8_t slot, uint8_t num_free_vars,
+                                    const uint8_t *captures);
+
+_Static_assert(sizeof(Pair) <= 2 * sizeof(Object),
+               "a pair has to fit in two frame slots");
+_Static_assert(sizeof(Closure) <= sizeof(Object),
+               "a closure has to fit in one frame slot per free variable + 1");
+
+/* Builds a pair in the frame slots slot and slot + 1, as in OP_STACK_CONS. */
+static inline Object vm_stack_cons(VM *vm, Frame *frame, uint8_t slot,
+                                   Object car, Object cdr) {
+  Pair *pair = (Pair *)&vm->stack[frame->base_pointer + slot];
+  pair->car = car;
+  pair->cdr = cdr;
+  return make_object(OBJ_PAIR, PointerGetDatum(pair));
+}
+
+/* Notes feedback for the site at frame->ip, see CompiledFunction. */
+extern void vm_record_feedback(VM *vm, Frame *frame, uint8_t feedback);
+/*
+ * Rewrites the sites of fn whose feedback shows only numbers or compiled
+ * procedures into type-specialized opcodes, see OP_ADD_CONSTANT.
+ */
+extern void vm_specialize_function(VM *vm, CompiledFunction *fn);
+
+/*
+ * Compiles the body of the stub fn, see LazyBody. It and the procedures
+ * compiled along with it are verified and translated for the register VM if
+ * that runs.
+ */
+extern void vm_compile_lazy(VM *vm, CompiledFunction *fn);
+
+/*
+ * Counts an iteration of a loop in frame, which has just jumped back to the
+ * loop head. A procedure that is called once but loops for long is
+ * translated by the JIT here, frame then continues in the machine code.
+ */
+static inline Frame *vm_loop_back(VM *vm, Frame *frame) {
+  CompiledFunction *fn = frame->fn;
+
+  ++fn->loop_count;
+  if (vm->jit_threshold >= 0 && !fn->jit_code &&
+      fn->loop_count > (uint32_t)vm->jit_threshold)
+    jit_compile_function(vm, fn);
+  return frame;
+}
+
+/*
+ * Enters fn, the compiled procedure at callee_idx below its argc arguments.
+ * A stub gets its body on the first call. Past its first calls fn is
+ * specialized and then translated by the JIT, if either is on.
+ */
+static inline Frame *vm_call_procedure(VM *vm, Frame *frame,
+                                       CompiledFunction *fn,
+                                       uint32_t callee_idx, uint8_t argc,
+                                       bool tail) {
+  if (fn->lazy)
+    vm_compile_lazy(vm, fn);
+  if (fn->num_params != argc) {
+    raise_error("%s: expected %d arguments, got %d\n", __FUNCTION__,
+                fn->num_params, argc);
+  }
+  /*
+   * The only overflow checks, once per call. The verifier made sure that
+   * the callee stays within max_stack, the register VM's temporaries too.
+   */
+  if (vm->frame_pointer + 1 >= VM_FRAME_MAX_DEPTH ||
+      vm->stack_pointer + fn->num_locals + fn->max_stack >=
+          VM_STACK_MAX_DEPTH) {
+    raise_error("%s: stack overflow\n", __FUNCTION__);
+  }
+  if (tail) {
+    /*
+     * Slide the callee and its arguments down over the caller's, the
+     * caller's frame is then reused and the stacks stay flat.
+     */
+    memmove(&vm->stack[frame->base_pointer - 1], &vm->stack[callee_idx],
+            (argc + 1) * sizeof(Object));
+    vm->stack_pointer = frame->base_pointer + argc;
+  } else {
+    frame = &vm->frames[++vm->frame_pointer];
+    frame->base_pointer = callee_idx + 1;
+  }
+  frame->fn = fn;
+  VM_STATS_CALL(fn);
+  frame->ip = instructions_data(vm->use_registers ? fn->register_instructions
+                                                  : fn->instructions);
+  ++fn->call_count;
+  if (vm->specialize_threshold >= 0 &&
+      fn->call_count == (uint32_t)vm->specialize_threshold + 1)
+    vm_specialize_function(vm, fn);
+  if (vm->jit_threshold >= 0 && !fn->jit_code &&
+      fn->call_count > (uint32_t)vm->jit_threshold)
+    jit_compile_function(vm, fn);
+  /* Reserve the slots of the non-parameter locals. */
+  for (int i = argc; i < fn->num_locals; ++i)
+    vm_push(vm, UNSPECIFIED_OBJECT);
+  return frame;
+}
+
+/*
+ * Calls the procedure below the argc arguments on top of the stack. The
+ * caller has already moved frame->ip past the call, the frame that runs next
+ * is returned.
+ */
+static inline Frame *vm_call(VM *vm, Frame *frame, uint8_t argc, bool tail) {
+  uint32_t callee_idx = vm->stack_pointer - argc - 1;
+  Object callee = vm->stack[callee_idx];
+
+  if (callee.type == OBJ_PRIMITIVE) {
+    Object result =
+        call_primitive(vm, (PrimitiveKind)DatumGetInt64(callee.value), argc,
+                       &vm->stack[callee_idx + 1]);
+    vm->stack_pointer = callee_idx;
+    vm_push(vm, result);
+    return frame;
+  }
+
+  if (callee.type == OBJ_NATIVE) {
+    Native *native = ObjectGetNative(callee);
+    Object *argv = &vm->stack[callee_idx + 1];
+    Object result;
+    if (native->arity >= 0 && native->arity != argc) {
+      raise_error("%s: %s: expected %d arguments, got %d\n", __FUNCTION__,
+                  native->name, native->arity, argc);
+    }
+    switch (native->arity) {
+    case 0:
+      result = native->fn.fn0(vm);
+      break;
+    case 1:
+      result = native->fn.fn1(vm, argv[0]);
+      break;
+    case 2:
+      result = native->fn.fn2(vm, argv[0], argv[1]);
+      break;
+    case 3:
+      result = native->fn.fn3(vm, argv[0], argv[1], argv[2]);
+      break;
+    default:
+      result = native->fn.fnv(vm, argc, argv);
+      break;
+    }
+    vm->stack_pointer = callee_idx;
+    vm_push(vm, result);
+    return frame;
+  }
+
+  if (callee.type == OBJ_PROCEDURE || callee.type == OBJ_CLOSURE) {
+    CompiledFunction *fn =
+        callee.type == OBJ_PROCEDURE
+            ? (CompiledFunction *)DatumGetPtr(callee.value)
+            : ((Closure *)DatumGetPtr(callee.value))->fn;
+    return vm_call_procedure(vm, frame, fn, callee_idx, argc, tail);
+  }
+
+  raise_error("%s: attempt to call a non-procedure\n", __FUNCTION__);
+}
+
+/*
+ * Runs an inlined primitive opcode the long way: as a call to whatever its
+ * global holds now if that was redefined, otherwise through call_primitive,
+ * which also reports bad operands. frame->ip points to the opcode.
+ */
+extern Frame *vm_call_inlined_primitive(VM *vm, Frame *frame);
+
+/*
+ * Runs a program whose functions all have CompiledFunction::compiled_code,
+ * see emit_c.h.
+ */
+extern EvalResult vm_run_compiled(VM *vm);
+
+/*
+ * For the functions rsi --emit-c writes. These expect vm, frame, code (the
+ * function's bytecode), sp (the next free slot on VM::stack) and a resume
+ * label that reloads sp and the locals and continues at frame->ip.
+ */
+#define COMPILED_NUMBER(obj) DatumGetFloat((obj).value)
+#define COMPILED_INTACT(kind)                                                  \
+  (!(vm->redefined_primitives & ((uint64_t)1 << (kind))))
+#define COMPILED_SYNC() (vm->stack_pointer = sp - vm->stack)
+
+/*
+ * Carries on after the instruction whose successor is at offset if call
+ * stayed in the frame. Otherwise the next frame runs here if it belongs to
+ * the same function self, or in its own function via vm_run_compiled.
+ */
+#define COMPILED_CONTINUE(self, call, offset)                                  \
+  do {                                                                         \
+    Frame *next_ = (call);                                                     \
+    if (next_ == frame && frame->ip == code + (offset)) {                      \
+      sp = &vm->stack[vm->stack_pointer];                                      \
+      break;                                                                   \
+    }                                                                          \
+    frame = next_;                                                             \
+    if (frame->fn->compiled_code != (self))                                    \
+      return frame;                                                            \
+    goto resume;                                                               \
+  } while (0)
+
+#define COMPILED_CALL(self, offset, argc, tail)                                \
+  do {                                                                         \
+    COMPILED_SYNC();                                                           \
+    frame->ip = code + (offset) + 2;                                           \
+    COMPILED_CONTINUE(self, vm_call(vm, frame, (argc), (tail)),                \
+                      (offset) + 2);                                           \
+  } while (0)
+
+#define COMPILED_INLINE_SLOW_PATH(self, offset)                                \
+  do {                                                                         \
+    COMPILED_SYNC();                                                           \
+    frame->ip = code + (offset);                                               \
+    COMPILED_CONTINUE(self, vm_call_inlined_primitive(vm, frame),              \
+                      (offset) + 1);                                           \
+  } while (0)
+
+#define COMPILED_RETURN(self)                                                  \
+  do {                                                                         \
+    Object result_ = sp[-1];                                                   \
+    vm->stack_pointer = frame->base_pointer - 1;                               \
+    vm_push(vm, result_);                                                      \
+    VM_STATS_RETURN(frame->fn);                                                \
+    frame = &vm->frames[--vm->frame_pointer];                                  \
+    if (frame->fn->compiled_code != (self))                                    \
+      return frame;                                                            \
+    goto resume;                                                               \
+  } while (0)
+
+#endif
@@ -1,8 +1,8 @@
 #ifndef _SYMBOL_H_
 #define _SYMBOL_H_
 
+#include "object.h"
 #include "vector.h"
-#include "vm.h"
 
 typedef struct SymbolTableElement {
   char *symbol_name;
@@ -13,6 +13,8 @@ VECTOR_GENERATE_TYPE_NAME(SymbolTableElement, SymbolTable, symbol_table);
 
 void symbol_table_add(SymbolTable *sym_tab, const char *symbol_name,
                       const Object val);
+/* Returns the index of symbol_name, or -1. */
+int symbol_table_index(SymbolTable *sym_tab, const char *symbol_name);
 Object symbol_table_find(SymbolTable *sym_tab, const char *symbol_name,
                          bool *exists);
 
@@ -0,0 +1,36 @@
+#ifndef _VERIFIER_H_
+#define _VERIFIER_H_
+
+#include "common.h"
+#include "vm.h"
+
+/*
+ * Checks bytecode before it runs, so that the interpreters, the JIT and the
+ * C that rsi --emit-c writes can trust it: constants, local slots and free
+ * variables exist, jumps land on instructions inside the function, no path
+ * falls off its end or pops more than it pushed, and wherever paths meet
+ * they agree on the stack depth.
+ *
+ * It also finds the deepest the value stack gets above the locals, counting
+ * the callee that the slow path of an inlined primitive pushes, so that a
+ * call only has to check for room once, see vm_call_procedure.
+ */
+typedef struct VerifyError {
+  int offset;
+  const char *message;
+} VerifyError;
+
+/*
+ * Returns true and sets CompiledFunction::max_stack if the code of fn is
+ * well-formed, otherwise fills in error.
+ */
+extern bool verify_function(ObjectsPool *constants, CompiledFunction *fn,
+                            VerifyError *error);
+/*
+ * Verifies fn and the procedures in constants from index first on whose body
+ * is compiled, exits on malformed code.
+ */
+extern void verify_code(ObjectsPool *constants, CompiledFunction *fn,
+                        int first);
+
+#endif
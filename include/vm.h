@@ -4,43 +4,276 @@
 #include <stdint.h>
 
 #include "ast.h"
+#include "heap.h"
+#include "linetable.h"
 #include "object.h"
+#include "symbol.h"
 #include "vector.h"
 
-#define VM_STACK_MAX_DEPTH 256
-#define VM_FRAME_MAX_DEPTH 256
+/*
+ * The value and frame stacks are reserved up front as large virtual regions.
+ * Pages are only committed when the stacks first reach them, so deep
+ * recursion costs the same as shallow calls and the stacks never move. An
+ * inaccessible guard page sits past the end of each region.
+ */
+#define VM_STACK_MAX_DEPTH (8 * 1024 * 1024)
+#define VM_FRAME_MAX_DEPTH (1024 * 1024)
+/*
+ * Operands follow the opcode byte. Constant, global and jump operands are
+ * 16-bit little-endian, jump targets are offsets from the start of the
+ * enclosing function's instructions. Local slots and argument counts are a
+ * single byte.
+ *
+ * Global reads and writes carry an inline cache after the name: the
+ * VM::globals_version it was filled at (u32) followed by a pointer to the
+ * variable's SymbolTableElement. The compiler emits it zeroed.
+ */
+#define VM_GLOBAL_CACHE_SIZE (sizeof(uint32_t) + sizeof(void *))
 
 typedef enum OpCode {
-  OP_CONSTANT,
-  OP_PROC_CALL,
-  OP_RETURN,
+  OP_CONSTANT,      /* <u16 constant> */
+  OP_POP,           /* */
+  OP_GET_LOCAL,     /* <u8 slot> */
+  OP_SET_LOCAL,     /* <u8 slot> */
+  OP_GET_GLOBAL,    /* <u16 name constant> <cache> */
+  OP_DEFINE_GLOBAL, /* <u16 name constant> */
+  OP_SET_GLOBAL,    /* <u16 name constant> <cache> */
+  OP_JUMP,          /* <u16 target> */
+  OP_JUMP_IF_FALSE, /* <u16 target> */
+  OP_GET_FREE,      /* <u8 index> */
+  OP_GET_FREE_BOX,  /* <u8 index> */
+  OP_SET_FREE_BOX,  /* <u8 index> */
+  OP_GET_LOCAL_BOX, /* <u8 slot> */
+  OP_SET_LOCAL_BOX, /* <u8 slot> */
+  OP_BOX_LOCAL,     /* <u8 slot> */
+  /* <u16 function constant> <u8 n> followed by n <u8 from_local> <u8 index> */
+  OP_CLOSURE,
+  /*
+   * <u16 function constant> <u8 slot> <u8 n> followed by n captures. Builds
+   * the closure in the frame slots from slot on, which the compiler reserves
+   * for closures that never outlive the frame, see escape.h.
+   */
+  OP_STACK_CLOSURE,
+  /*
+   * <u8 slot>, replaces the top two by a pair of them built in the frame
+   * slots slot and slot + 1. Only emitted while cons is never assigned.
+   */
+  OP_STACK_CONS,
+  OP_PROC_CALL,     /* <u8 argc> */
+  OP_TAIL_CALL,     /* <u8 argc>, reuses the caller's frame */
+  /*
+   * Calls of natives with 0 to 3 fixed arguments. The VM rewrites call sites
+   * into these once they have called such a native. The operand is 1 if the
+   * site was a tail call.
+   */
+  OP_CALL_NATIVE0, /* <u8 tail> */
+  OP_CALL_NATIVE1, /* <u8 tail> */
+  OP_CALL_NATIVE2, /* <u8 tail> */
+  OP_CALL_NATIVE3, /* <u8 tail> */
+  OP_EQ_CONSTANT,  /* <u16 constant>, replaces the top by (eq? top constant) */
+  OP_RETURN,        /* */
+  /*
+   * Primitives that the compiler inlines, in PrimitiveKind order. Each one
+   * pops its arguments and pushes the result.
+   */
+  OP_ADD,
+  OP_SUB,
+  OP_MUL,
+  OP_DIV,
+  OP_NUM_EQ,
+  OP_LT,
+  OP_GT,
+  OP_LE,
+  OP_GE,
+  OP_NOT,
+  OP_EQ,
+  OP_CONS,
+  OP_CAR,
+  OP_CDR,
+  OP_NULL_P,
+  OP_PAIR_P,
+  /*
+   * Type-specialized forms that the VM rewrites hot sites into, see
+   * vm_specialize_function. Only the first byte of the generic code changes,
+   * the rest stays in place behind it. Their guard checks the operand types
+   * and that the primitive is intact, on failure the site goes back to the
+   * generic opcode.
+   *
+   * <u16 number constant> ADD: top + constant, and so on.
+   */
+  OP_ADD_CONSTANT,
+  OP_SUB_CONSTANT,
+  OP_MUL_CONSTANT,
+  OP_DIV_CONSTANT,
+  /* LT JUMP_IF_FALSE <u16 target>: compares two numbers and branches. */
+  OP_BRANCH_NUM_EQ,
+  OP_BRANCH_LT,
+  OP_BRANCH_GT,
+  OP_BRANCH_LE,
+  OP_BRANCH_GE,
+  /* <u16 number constant> LT JUMP_IF_FALSE <u16 target> */
+  OP_BRANCH_NUM_EQ_CONSTANT,
+  OP_BRANCH_LT_CONSTANT,
+  OP_BRANCH_GT_CONSTANT,
+  OP_BRANCH_LE_CONSTANT,
+  OP_BRANCH_GE_CONSTANT,
+  /* PROC_CALL / TAIL_CALL whose callee is a compiled procedure. */
+  OP_CALL_PROCEDURE,      /* <u8 argc> */
+  OP_TAIL_CALL_PROCEDURE, /* <u8 argc> */
   OP_LAST,
 } OpCode;
 
 VECTOR_GENERATE_TYPE_NAME(Object, ObjectsPool, objects_pool);
 VECTOR_GENERATE_TYPE_NAME(uint8_t, Instructions, instructions);
 
+typedef struct VM VM;
+typedef struct Frame Frame;
+
+/*
+ * Sites report only what their fast path does not cover: an inlined
+ * primitive that ran the long way, with an operand that was not a number or
+ * after its global was replaced, and a call of anything but a compiled
+ * procedure.
+ */
+#define FEEDBACK_SLOW_PATH 0x01
+#define FEEDBACK_NOT_PROCEDURE 0x02
+
 typedef struct CompiledFunction {
+  /*
+   * Owned, like the line table and the register instructions, and freed by
+   * free_compiled_function. destroy_vm frees every procedure in
+   * VM::constants.
+   */
   Instructions *instructions;
-  /* Local variables are stored on VM::stack. */
+  /* The name it was defined under, NULL for anonymous lambdas. */
+  const char *name;
+  /* The source locations of instructions, NULL if unknown. */
+  LineTable *lines;
+  int num_params;
+  /* Local variables are stored on VM::stack, parameters come first. */
   int num_locals;
+  /* The number of variables captured from enclosing lambdas. */
+  int num_free_vars;
+  /*
+   * The most values the code keeps on VM::stack above the locals, found by
+   * the verifier, see verifier.h.
+   */
+  int max_stack;
+  /* The same code for the register VM, see regvm.h. NULL until translated. */
+  Instructions *register_instructions;
+  int num_registers;
+  uint32_t call_count;
+  /* Backward jumps taken, the iterations of loops compiled in the frame. */
+  uint32_t loop_count;
+  /*
+   * What the generic arithmetic, comparison and call sites saw, a byte of
+   * FEEDBACK_* bits per bytecode offset. NULL until a site reports anything.
+   */
+  uint8_t *type_feedback;
+  /* The machine code the JIT made for it, see jit.h. NULL until then. */
+  struct JitCode *jit_code;
+  /* Set in programs translated by rsi --emit-c, see emit_c.h. */
+  Frame *(*compiled_code)(VM *vm, Frame *frame);
+  /*
+   * Set until a call has compiled the body and verified it, see LazyBody.
+   * instructions is NULL and num_locals 0 until the first call.
+   */
+  struct LazyBody *lazy;
+#ifdef ROCKET_VM_STATS
+  /* See vmstats.h. */
+  uint64_t stats_calls;
+  uint64_t stats_returns;
+#endif
 } CompiledFunction;
 
-typedef struct Frame {
+/*
+ * What the compiler keeps of a procedure whose body it compiles on the first
+ * call, see Compiler::lazy. compile fills in the instructions and the number
+ * of locals of fn. It adds the constants the body needs to VM::constants,
+ * the procedures of nested lambdas among them.
+ */
+typedef struct LazyBody {
+  void (*compile)(VM *vm, struct LazyBody *body, CompiledFunction *fn);
+} LazyBody;
+
+/*
+ * A procedure together with the values of its free variables, copied in when
+ * the closure is created. Variables that are also assigned are shared through
+ * a Box instead. Procedures without free variables need no closure.
+ */
+typedef struct Closure {
+  CompiledFunction *fn;
+  Object free_vars[];
+} Closure;
+
+typedef struct Box {
+  Object value;
+} Box;
+
+/*
+ * C functions callable from Scheme. Arguments are read straight off
+ * VM::stack. Natives with 0 to 3 fixed arguments take them as parameters,
+ * all others get argc and a pointer to the first argument, which follows
+ * the native itself.
+ */
+typedef union NativeFn {
+  Object (*fn0)(VM *vm);
+  Object (*fn1)(VM *vm, Object a);
+  Object (*fn2)(VM *vm, Object a, Object b);
+  Object (*fn3)(VM *vm, Object a, Object b, Object c);
+  Object (*fnv)(VM *vm, int argc, Object *argv);
+} NativeFn;
+
+#define NATIVE_MAX_FIXED_ARITY 3
+
+typedef struct Native {
+  const char *name;
+  /* Number of arguments, -1 for variadic natives. */
+  int arity;
+  NativeFn fn;
+} Native;
+
+struct Frame {
   uint8_t *ip; /* Instruction pointer */
   CompiledFunction *fn;
   uint32_t base_pointer;
-} Frame;
+};
 
-typedef struct VM {
+struct VM {
   uint32_t stack_pointer; /* Offset into the stack array. */
   uint32_t frame_pointer; /* Offset into the frames array. */
-  Frame frames[VM_FRAME_MAX_DEPTH];
-  Object stack[VM_STACK_MAX_DEPTH];
+  Frame *frames;
+  Object *stack;
   ObjectsPool *constants;
-  ObjectsPool *globals;
-  ObjectsPool *heap;
-} VM;
+  SymbolTable *globals;
+  /*
+   * Bumped whenever a new global is added, which may move the elements of
+   * VM::globals. Inline caches from an older version are refilled.
+   */
+  uint32_t globals_version;
+  /*
+   * A bit per PrimitiveKind whose global has been replaced since the VM
+   * started. Inlined primitive opcodes fall back to a regular call then.
+   */
+  uint64_t redefined_primitives;
+  /* Run CompiledFunction::register_instructions instead of instructions. */
+  bool use_registers;
+  /*
+   * Procedures are compiled to machine code on the call after they have been
+   * called this many times, or on the loop iteration after a loop in them ran
+   * this many times. -1 keeps everything interpreted.
+   */
+  int jit_threshold;
+  /*
+   * Procedures are rewritten with type-specialized opcodes on the call after
+   * they have been called this many times, -1 never.
+   */
+  int specialize_threshold;
+  Heap *heap;
+#ifdef ROCKET_VM_STATS
+  struct VMStats *stats;
+#endif
+};
 
 typedef enum EvalResult {
   EVAL_OK,
@@ -52,13 +285,26 @@ static inline uint32_t objects_pool_add_constant(ObjectsPool *objects_pool,
   return objects_pool_len(objects_pool) - 1;
 }
 
+static inline uint16_t read_uint16(const uint8_t *p) {
+  return (uint16_t)(p[0] | (p[1] << 8));
+}
+
 extern void initialize_vm(VM *vm, Instructions *instructions,
-                          ObjectsPool *constants, ObjectsPool *globals);
+                          ObjectsPool *constants, SymbolTable *globals,
+                          Heap *heap);
 extern EvalResult vm_run(VM *vm);
+extern Object vm_stack_top(VM *vm);
+/*
+ * Binds name to a native, e.g.
+ *   vm_define_native(vm, "square", (NativeFn){.fn1 = square}, 1);
+ */
+extern void vm_define_native(VM *vm, const char *name, NativeFn fn,
+                             int arity);
 extern void destroy_vm(VM *vm);
 
-extern CompiledFunction *make_compiled_function(Instructions *instrs,
+extern CompiledFunction *make_compiled_function(Heap *heap,
+                                                Instructions *instrs,
                                                 int num_locals);
-extern void free_compiled_function(CompiledFunction *compiled_fn);
+extern void free_compiled_function(Heap *heap, CompiledFunction *compiled_fn);
 
 #endif
@@ -0,0 +1,117 @@
+#ifndef _VMSTATS_H_
+#define _VMSTATS_H_
+
+#include "common.h"
+#include "vm.h"
+
+/*
+ * Execution statistics, built in with cmake -DROCKET_VM_STATS=ON and printed
+ * by rsi --vm-stats when the program exits:
+ *
+ *  - how often the stack VM dispatched each OpCode,
+ *  - a log2 histogram per VMStatsClass of the cycles between the dispatch of
+ *    an instruction and the next one, timed for one instruction in
+ *    VM_STATS_CYCLE_PERIOD on average with the time stamp counter. The gaps
+ *    between timed instructions are random, a fixed one would keep landing
+ *    on the same instructions of a loop. The times include reading the
+ *    counter, compare classes rather than absolute numbers,
+ *  - calls and returns per CompiledFunction.
+ *
+ * Machine code from the JIT and from rsi --emit-c, and the register VM,
+ * only count calls and returns, and the instructions they hand back to the
+ * interpreter. Without ROCKET_VM_STATS the hooks expand to nothing and
+ * neither VM nor CompiledFunction has a field for them.
+ */
+typedef enum VMStatsClass {
+  VM_STATS_LOAD_STORE,
+  VM_STATS_BRANCH,
+  VM_STATS_PRIMITIVE,
+  VM_STATS_ALLOCATE,
+  VM_STATS_CALL,
+  VM_STATS_RETURN,
+  VM_STATS_NUM_CLASSES,
+} VMStatsClass;
+
+#ifdef ROCKET_VM_STATS
+
+#if defined(__x86_64__)
+#include <x86intrin.h>
+#else
+#include <time.h>
+#endif
+
+#define VM_STATS_CYCLE_PERIOD 16
+/* Bucket i holds the times in [2^i, 2^(i+1)), bucket 0 also 0. */
+#define VM_STATS_NUM_BUCKETS 32
+
+typedef struct VMStats {
+  uint64_t op_counts[OP_LAST + 1];
+  uint64_t histograms[VM_STATS_NUM_CLASSES][VM_STATS_NUM_BUCKETS];
+  uint64_t total_cycles[VM_STATS_NUM_CLASSES];
+  /* Dispatches left until the next one is timed. */
+  int countdown;
+  /* Of the xorshift generator that draws the countdowns. */
+  uint32_t random_state;
+  /* The class of the instruction being timed, -1 if none is. */
+  int timed_class;
+  uint64_t timed_start;
+} VMStats;
+
+extern VMStats *make_vm_stats(void);
+extern void free_vm_stats(VMStats *stats);
+extern VMStatsClass vm_stats_class(OpCode op);
+/* Prints the counters of vm, the most frequent first. */
+extern void vm_stats_report(FILE *output_file, VM *vm);
+
+/* Cycles on x86-64, nanoseconds elsewhere. */
+static inline uint64_t vm_stats_clock(void) {
+#if defined(__x86_64__)
+  return __rdtsc();
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+/* A countdown in [1, 2 * VM_STATS_CYCLE_PERIOD), the period on average. */
+static inline int vm_stats_next_countdown(VMStats *stats) {
+  uint32_t x = stats->random_state;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  stats->random_state = x;
+  return 1 + x % (2 * VM_STATS_CYCLE_PERIOD - 1);
+}
+
+static inline void vm_stats_dispatch(VMStats *stats, OpCode op) {
+  ++stats->op_counts[op];
+  if (stats->timed_class >= 0) {
+    uint64_t elapsed = vm_stats_clock() - stats->timed_start;
+    int bucket = elapsed ? 63 - __builtin_clzll(elapsed) : 0;
+    if (bucket >= VM_STATS_NUM_BUCKETS)
+      bucket = VM_STATS_NUM_BUCKETS - 1;
+    ++stats->histograms[stats->timed_class][bucket];
+    stats->total_cycles[stats->timed_class] += elapsed;
+    stats->timed_class = -1;
+  }
+  if (--stats->countdown == 0) {
+    stats->countdown = vm_stats_next_countdown(stats);
+    stats->timed_class = vm_stats_class(op);
+    stats->timed_start = vm_stats_clock();
+  }
+}
+
+#define VM_STATS_DISPATCH(vm, op) vm_stats_dispatch((vm)->stats, (op))
+#define VM_STATS_CALL(fn) (++(fn)->stats_calls)
+#define VM_STATS_RETURN(fn) (++(fn)->stats_returns)
+
+#else
+
+#define VM_STATS_DISPATCH(vm, op) ((void)0)
+#define VM_STATS_CALL(fn) ((void)0)
+#define VM_STATS_RETURN(fn) ((void)0)
+
+#endif
+
+#endif
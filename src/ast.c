@@ -1,37 +1,15 @@
 #include "common.h"
 
 #include "ast.h"
+#include "error_handler.h"
 #include "vector.h"
 #include <stdlib.h>
 #include <string.h>
 
-#if 0
-Cons *make_cons(void *car, void *cdr) {
-  Cons *cons = (Cons *)malloc(sizeof(Cons));
-  cons->car = car;
-  cons->cdr = cdr;
-  return cons;
-}
-
-Cons *list_reverse(Cons *list) {
-  Cons *tail = NULL;
-  if (!list)
-    return NULL;
-
-  while (list) {
-    Cons *curr = list;
-    tail = make_cons(curr->car, tail);
-    list = curr->cdr;
-    free(curr);
-  }
-
-  return tail;
-}
-#endif
-
 AstNode *make_ast_bool(bool b) {
   AstBool *ast = (AstBool *)malloc(sizeof(AstBool));
   ast->base.kind = AST_BOOL;
+  ast->base.loc = (TokenLoc){0, 0};
   ast->boolean = b;
   return (AstNode *)ast;
 }
@@ -39,6 +17,7 @@ AstNode *make_ast_bool(bool b) {
 AstNode *make_ast_char(char c) {
   AstChar *ast = (AstChar *)malloc(sizeof(AstChar));
   ast->base.kind = AST_CHAR;
+  ast->base.loc = (TokenLoc){0, 0};
   ast->char_ = c;
   return (AstNode *)ast;
 }
@@ -46,6 +25,7 @@ AstNode *make_ast_char(char c) {
 AstNode *make_ast_number(double d) {
   AstNumber *ast = (AstNumber *)malloc(sizeof(AstNumber));
   ast->base.kind = AST_NUMBER;
+  ast->base.loc = (TokenLoc){0, 0};
   ast->number = d;
   return (AstNode *)ast;
 }
@@ -53,6 +33,7 @@ AstNode *make_ast_number(double d) {
 AstNode *make_ast_ident(const char *id) {
   AstIdent *ast = (AstIdent *)malloc(sizeof(AstIdent));
   ast->base.kind = AST_IDENT;
+  ast->base.loc = (TokenLoc){0, 0};
   ast->ident = strdup(id);
   return (AstNode *)ast;
 }
@@ -60,12 +41,17 @@ AstNode *make_ast_ident(const char *id) {
 AstNode *make_ast_proc_call(AstNode *callable, Vector *args) {
   AstProcCall *ast = (AstProcCall *)malloc(sizeof(AstProcCall));
   ast->base.kind = AST_PROC_CALL;
+  ast->base.loc = (TokenLoc){0, 0};
   ast->callable = callable;
   ast->args = args;
   return (AstNode *)ast;
 }
 
 void free_ast_node(AstNode *node) {
+  /* `()` is parsed as NULL. */
+  if (!node)
+    return;
+
   switch (node->kind) {
   case AST_BOOL:
   case AST_CHAR:
@@ -87,8 +73,43 @@ void free_ast_node(AstNode *node) {
     free(ast);
     break;
   }
+  case AST_QUOTE: {
+    AstQuote *ast = (AstQuote *)node;
+    free_ast_node(ast->inner);
+    free(ast);
+    break;
+  }
   default:
-    fprintf(stderr, "%s: unrecognized node type", __FUNCTION__);
-    exit(1);
+    raise_error("%s: unrecognized node type", __FUNCTION__);
+  }
+}
+
+bool names_contain(Vector *names, const char *name) {
+  for (int i = 0; i < vector_len(names); ++i) {
+    if (strcmp(DatumGetCString(vector_get(names, i)), name) == 0)
+      return true;
+  }
+  return false;
+}
+
+bool ast_is_keyword(AstProcCall *form, const char *keyword, Vector *locals) {
+  const char *name = ast_ident_name(form->callable);
+  return name && strcmp(name, keyword) == 0 && !names_contain(locals, name);
+}
+
+bool ast_mentions(AstNode *node, const char *name) {
+  AstProcCall *form;
+
+  if (!node)
+    return false;
+  if (node->kind == AST_IDENT)
+    return strcmp(((AstIdent *)node)->ident, name) == 0;
+  if (node->kind != AST_PROC_CALL)
+    return false;
+  form = (AstProcCall *)node;
+  for (int i = 0; i < form_length(form); ++i) {
+    if (ast_mentions(form_ref(form, i), name))
+      return true;
   }
+  return false;
 }
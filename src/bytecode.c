@@ -0,0 +1,201 @@
+#include "common.h"
+
+#include "bytecode.h"
+#include "object.h"
+#include "vm.h"
+
+static const char *opcode_names[OP_LAST + 1] = {
+    [OP_CONSTANT] = "CONSTANT",
+    [OP_POP] = "POP",
+    [OP_GET_LOCAL] = "GET_LOCAL",
+    [OP_SET_LOCAL] = "SET_LOCAL",
+    [OP_GET_GLOBAL] = "GET_GLOBAL",
+    [OP_DEFINE_GLOBAL] = "DEFINE_GLOBAL",
+    [OP_SET_GLOBAL] = "SET_GLOBAL",
+    [OP_JUMP] = "JUMP",
+    [OP_JUMP_IF_FALSE] = "JUMP_IF_FALSE",
+    [OP_GET_FREE] = "GET_FREE",
+    [OP_GET_FREE_BOX] = "GET_FREE_BOX",
+    [OP_SET_FREE_BOX] = "SET_FREE_BOX",
+    [OP_GET_LOCAL_BOX] = "GET_LOCAL_BOX",
+    [OP_SET_LOCAL_BOX] = "SET_LOCAL_BOX",
+    [OP_BOX_LOCAL] = "BOX_LOCAL",
+    [OP_CLOSURE] = "CLOSURE",
+    [OP_STACK_CLOSURE] = "STACK_CLOSURE",
+    [OP_STACK_CONS] = "STACK_CONS",
+    [OP_PROC_CALL] = "PROC_CALL",
+    [OP_TAIL_CALL] = "TAIL_CALL",
+    [OP_CALL_NATIVE0] = "CALL_NATIVE0",
+    [OP_CALL_NATIVE1] = "CALL_NATIVE1",
+    [OP_CALL_NATIVE2] = "CALL_NATIVE2",
+    [OP_CALL_NATIVE3] = "CALL_NATIVE3",
+    [OP_EQ_CONSTANT] = "EQ_CONSTANT",
+    [OP_RETURN] = "RETURN",
+    [OP_ADD] = "ADD",
+    [OP_SUB] = "SUB",
+    [OP_MUL] = "MUL",
+    [OP_DIV] = "DIV",
+    [OP_NUM_EQ] = "NUM_EQ",
+    [OP_LT] = "LT",
+    [OP_GT] = "GT",
+    [OP_LE] = "LE",
+    [OP_GE] = "GE",
+    [OP_NOT] = "NOT",
+    [OP_EQ] = "EQ",
+    [OP_CONS] = "CONS",
+    [OP_CAR] = "CAR",
+    [OP_CDR] = "CDR",
+    [OP_NULL_P] = "NULL_P",
+    [OP_PAIR_P] = "PAIR_P",
+    [OP_ADD_CONSTANT] = "ADD_CONSTANT",
+    [OP_SUB_CONSTANT] = "SUB_CONSTANT",
+    [OP_MUL_CONSTANT] = "MUL_CONSTANT",
+    [OP_DIV_CONSTANT] = "DIV_CONSTANT",
+    [OP_BRANCH_NUM_EQ] = "BRANCH_NUM_EQ",
+    [OP_BRANCH_LT] = "BRANCH_LT",
+    [OP_BRANCH_GT] = "BRANCH_GT",
+    [OP_BRANCH_LE] = "BRANCH_LE",
+    [OP_BRANCH_GE] = "BRANCH_GE",
+    [OP_BRANCH_NUM_EQ_CONSTANT] = "BRANCH_NUM_EQ_CONSTANT",
+    [OP_BRANCH_LT_CONSTANT] = "BRANCH_LT_CONSTANT",
+    [OP_BRANCH_GT_CONSTANT] = "BRANCH_GT_CONSTANT",
+    [OP_BRANCH_LE_CONSTANT] = "BRANCH_LE_CONSTANT",
+    [OP_BRANCH_GE_CONSTANT] = "BRANCH_GE_CONSTANT",
+    [OP_CALL_PROCEDURE] = "CALL_PROCEDURE",
+    [OP_TAIL_CALL_PROCEDURE] = "TAIL_CALL_PROCEDURE",
+    [OP_LAST] = "LAST",
+};
+
+const char *opcode_name(OpCode op) {
+  if (op < 0 || op > OP_LAST || !opcode_names[op])
+    return "UNKNOWN";
+  return opcode_names[op];
+}
+
+OpCode generic_opcode(OpCode op) {
+  switch (op) {
+  case OP_ADD_CONSTANT:
+  case OP_SUB_CONSTANT:
+  case OP_MUL_CONSTANT:
+  case OP_DIV_CONSTANT:
+  case OP_BRANCH_NUM_EQ_CONSTANT:
+  case OP_BRANCH_LT_CONSTANT:
+  case OP_BRANCH_GT_CONSTANT:
+  case OP_BRANCH_LE_CONSTANT:
+  case OP_BRANCH_GE_CONSTANT:
+    return OP_CONSTANT;
+  case OP_BRANCH_NUM_EQ:
+  case OP_BRANCH_LT:
+  case OP_BRANCH_GT:
+  case OP_BRANCH_LE:
+  case OP_BRANCH_GE:
+    return OP_NUM_EQ + (op - OP_BRANCH_NUM_EQ);
+  case OP_CALL_PROCEDURE:
+    return OP_PROC_CALL;
+  case OP_TAIL_CALL_PROCEDURE:
+    return OP_TAIL_CALL;
+  default:
+    return op;
+  }
+}
+
+int instruction_length(const uint8_t *ip) {
+  switch (generic_opcode(*ip)) {
+  case OP_CONSTANT:
+  case OP_DEFINE_GLOBAL:
+  case OP_JUMP:
+  case OP_JUMP_IF_FALSE:
+  case OP_EQ_CONSTANT:
+    return 3;
+  case OP_GET_GLOBAL:
+  case OP_SET_GLOBAL:
+    return 3 + VM_GLOBAL_CACHE_SIZE;
+  case OP_GET_LOCAL:
+  case OP_SET_LOCAL:
+  case OP_GET_FREE:
+  case OP_GET_FREE_BOX:
+  case OP_SET_FREE_BOX:
+  case OP_GET_LOCAL_BOX:
+  case OP_SET_LOCAL_BOX:
+  case OP_BOX_LOCAL:
+  case OP_PROC_CALL:
+  case OP_TAIL_CALL:
+  case OP_CALL_NATIVE0:
+  case OP_CALL_NATIVE1:
+  case OP_CALL_NATIVE2:
+  case OP_CALL_NATIVE3:
+  case OP_STACK_CONS:
+    return 2;
+  case OP_CLOSURE:
+    return 4 + 2 * ip[3];
+  case OP_STACK_CLOSURE:
+    return 5 + 2 * ip[4];
+  default:
+    return 1;
+  }
+}
+
+void disassemble_instruction(FILE *output_file, ObjectsPool *constants,
+                             const uint8_t *ip) {
+  const char *name = opcode_name(*ip);
+  int padding = 14 - (int)strlen(name);
+
+  fprintf(output_file, "%s", name);
+  if (instruction_length(ip) > 1 && padding > 0)
+    fprintf(output_file, "%*s", padding, "");
+
+  switch (*ip) {
+  case OP_CONSTANT:
+  case OP_GET_GLOBAL:
+  case OP_DEFINE_GLOBAL:
+  case OP_SET_GLOBAL:
+  case OP_EQ_CONSTANT:
+  case OP_ADD_CONSTANT:
+  case OP_SUB_CONSTANT:
+  case OP_MUL_CONSTANT:
+  case OP_DIV_CONSTANT:
+  case OP_BRANCH_NUM_EQ_CONSTANT:
+  case OP_BRANCH_LT_CONSTANT:
+  case OP_BRANCH_GT_CONSTANT:
+  case OP_BRANCH_LE_CONSTANT:
+  case OP_BRANCH_GE_CONSTANT: {
+    uint16_t constant_idx = read_uint16(ip + 1);
+    fprintf(output_file, " %d ; ", constant_idx);
+    print_object(output_file, objects_pool_get(constants, constant_idx));
+    break;
+  }
+  case OP_JUMP:
+  case OP_JUMP_IF_FALSE:
+    fprintf(output_file, " -> %d", read_uint16(ip + 1));
+    break;
+  case OP_CLOSURE:
+    fprintf(output_file, " %d ;", read_uint16(ip + 1));
+    for (int i = 0; i < ip[3]; ++i)
+      fprintf(output_file, " %s %d", ip[4 + 2 * i] ? "local" : "free",
+              ip[5 + 2 * i]);
+    break;
+  case OP_STACK_CLOSURE:
+    fprintf(output_file, " %d @%d ;", read_uint16(ip + 1), ip[3]);
+    for (int i = 0; i < ip[4]; ++i)
+      fprintf(output_file, " %s %d", ip[5 + 2 * i] ? "local" : "free",
+              ip[6 + 2 * i]);
+    break;
+  default:
+    if (instruction_length(ip) == 2)
+      fprintf(output_file, " %d", ip[1]);
+    break;
+  }
+}
+
+void disassemble_instructions(FILE *output_file, ObjectsPool *constants,
+                              Instructions *instructions) {
+  uint8_t *code = instructions_data(instructions);
+  int len = instructions_len(instructions);
+
+  for (int offset = 0; offset < len;
+       offset += instruction_length(code + offset)) {
+    fprintf(output_file, "%04d  ", offset);
+    disassemble_instruction(output_file, constants, code + offset);
+    fprintf(output_file, "\n");
+  }
+}
@@ -4,43 +4,1640 @@
 #include "ast.h"
 #include "common.h"
 #include "compiler.h"
+#include "error_handler.h"
+#include "escape.h"
+#include "heap.h"
+#include "primitive.h"
 #include "vm.h"
 
+#define COMPILER_MAX_LOCALS 256
+#define COMPILER_MAX_FREE_VARS 256
+#define COMPILER_MAX_CONSTANTS 65536
+
+VECTOR_GENERATE_TYPE_NAME_IMPL(Local, Locals, locals);
+VECTOR_GENERATE_TYPE_NAME_IMPL(FreeVar, FreeVars, free_vars);
+
+static void compile_expr(Compiler *c, AstNode *ast, bool tail);
+static void compile_body(Compiler *c, AstProcCall *form, int start,
+                         bool tail);
+
 void initialize_compiler(Compiler *c) {
   c->constants = make_objects_pool();
   c->instructions = make_instructions();
+  c->heap = make_heap();
+  c->scope = NULL;
+  c->inline_budget = 0;
+  c->inline_log = NULL;
+  c->inline_candidates = make_vector();
+  c->expansion = NULL;
+  c->loop = NULL;
+  c->stack_allocate = false;
+  c->escapes = NULL;
+  c->lazy = false;
+  c->finish_lazy = NULL;
+  c->lazy_lambdas = make_vector();
+  c->lines = NULL;
+  c->loc = (TokenLoc){0, 0};
+  c->lambda_name = NULL;
 }
 
-CompilerErr compile_expression(Compiler *c, AstNode *ast) {
+static const char *ident_of(AstNode *node, const char *what) {
+  if (!node || node->kind != AST_IDENT) {
+    raise_error("%s: %s must be an identifier\n", __FUNCTION__, what);
+  }
+  return ((AstIdent *)node)->ident;
+}
+
+static void expect_form_length(AstProcCall *form, const char *name, int min,
+                               int max) {
+  int len = form_length(form);
+  if (len < min || (max >= 0 && len > max)) {
+    raise_error("%s: bad syntax in (%s ...)\n", __FUNCTION__, name);
+  }
+}
+
+static void compiler_emit_uint16(Compiler *c, uint16_t val) {
+  compiler_emit_instruction(c, val & 0xff);
+  compiler_emit_instruction(c, (val >> 8) & 0xff);
+}
+
+static void compiler_emit_constant(Compiler *c, Object val) {
+  compiler_emit_instruction(c, OP_CONSTANT);
+  compiler_emit_uint16(c, compiler_add_constant(c, val));
+}
+
+/* Emits a jump with a placeholder target, returns the operand's offset. */
+static int compiler_emit_jump(Compiler *c, OpCode op) {
+  compiler_emit_instruction(c, op);
+  compiler_emit_uint16(c, 0xffff);
+  return instructions_len(c->instructions) - 2;
+}
+
+/* Makes the jump at operand_offset land on the next emitted instruction. */
+static void compiler_patch_jump(Compiler *c, int operand_offset) {
+  int target = instructions_len(c->instructions);
+  instructions_set(c->instructions, operand_offset, target & 0xff);
+  instructions_set(c->instructions, operand_offset + 1, (target >> 8) & 0xff);
+}
+
+/*
+ * Notes that the code emitted from now on is for the expression at loc,
+ * line 0 if it is not known.
+ */
+static void compiler_set_loc(Compiler *c, TokenLoc loc) {
+  LineEntry entry = {instructions_len(c->instructions), loc.line, loc.column};
+  int len;
+
+  c->loc = loc;
+  if (!c->lines || loc.line == 0)
+    return;
+  len = line_entries_len(c->lines);
+  /* Nothing was emitted for the location before. */
+  if (len > 0 && line_entries_get(c->lines, len - 1).offset == entry.offset)
+    line_entries_delete(c->lines, --len);
+  if (len > 0 && line_entries_get(c->lines, len - 1).line == entry.line &&
+      line_entries_get(c->lines, len - 1).column == entry.column)
+    return;
+  line_entries_append(c->lines, entry);
+}
+
+static Object compiler_symbol(Compiler *c, const char *name) {
+  return make_object(OBJ_SYMBOL,
+                     CStringGetDatum(heap_intern_symbol(c->heap, name)));
+}
+
+static uint16_t compiler_add_symbol(Compiler *c, const char *name) {
+  Object symbol = compiler_symbol(c, name);
+  for (int i = 0; i < objects_pool_len(c->constants); ++i) {
+    Object val = objects_pool_get(c->constants, i);
+    if (val.type == OBJ_SYMBOL && val.value == symbol.value)
+      return i;
+  }
+  return compiler_add_constant(c, symbol);
+}
+
+static void names_add(Vector *names, const char *name) {
+  if (!names_contain(names, name))
+    vector_append(names, CStringGetDatum(name));
+}
+
+static int scope_declare_local(Scope *scope, const char *name) {
+  int slot = locals_len(scope->locals);
+  Local local;
+  if (slot >= COMPILER_MAX_LOCALS) {
+    raise_error("%s: too many local variables\n", __FUNCTION__);
+  }
+  local.name = name;
+  local.boxed = names_contain(scope->assigned, name) &&
+                names_contain(scope->captured, name);
+  locals_append(scope->locals, local);
+  if (scope->num_locals < slot + 1)
+    scope->num_locals = slot + 1;
+  return slot;
+}
+
+/* Whether count more slots fit in the frame. */
+static bool scope_has_room(Scope *scope, int count) {
+  return locals_len(scope->locals) + count <= COMPILER_MAX_LOCALS;
+}
+
+/*
+ * Declares count slots without a name, for a closure or pairs built in the
+ * frame. Returns the first one.
+ */
+static int scope_declare_storage(Scope *scope, int count) {
+  int slot = locals_len(scope->locals);
+  for (int i = 0; i < count; ++i)
+    scope_declare_local(scope, "");
+  return slot;
+}
+
+static int scope_resolve_local(Scope *scope, const char *name) {
+  /* Search backwards so that inner bindings shadow outer ones. */
+  for (int i = locals_len(scope->locals) - 1; i >= 0; --i) {
+    if (strcmp(locals_get(scope->locals, i).name, name) == 0)
+      return i;
+  }
+  return -1;
+}
+
+/*
+ * Finds name among the enclosing lambdas and returns its index in the free
+ * variables of scope, threading it through every lambda in between.
+ */
+static int scope_resolve_free_var(Scope *scope, const char *name) {
+  Scope *parent = scope->parent;
+  FreeVar free_var;
+  int index;
+
+  if (!parent)
+    return -1;
+  for (int i = 0; i < free_vars_len(scope->free_vars); ++i) {
+    if (strcmp(free_vars_get(scope->free_vars, i).name, name) == 0)
+      return i;
+  }
+
+  if ((index = scope_resolve_local(parent, name)) >= 0) {
+    free_var.from_local = true;
+    free_var.boxed = locals_get(parent->locals, index).boxed;
+  } else if ((index = scope_resolve_free_var(parent, name)) >= 0) {
+    free_var.from_local = false;
+    free_var.boxed = free_vars_get(parent->free_vars, index).boxed;
+  } else {
+    return -1;
+  }
+
+  if (free_vars_len(scope->free_vars) >= COMPILER_MAX_FREE_VARS) {
+    raise_error("%s: too many captured variables\n", __FUNCTION__);
+  }
+  free_var.name = name;
+  free_var.index = index;
+  free_vars_append(scope->free_vars, free_var);
+  return free_vars_len(scope->free_vars) - 1;
+}
+
+static void scope_pop_locals(Scope *scope, int len) {
+  while (locals_len(scope->locals) > len)
+    locals_delete(scope->locals, locals_len(scope->locals) - 1);
+}
+
+static bool compiler_is_local(Compiler *c, const char *name) {
+  for (Scope *scope = c->scope; scope; scope = scope->parent) {
+    if (scope_resolve_local(scope, name) >= 0)
+      return true;
+  }
+  return false;
+}
+
+/* Moves the boxed locals from slot start on into fresh boxes. */
+static void compiler_box_locals(Compiler *c, int start) {
+  for (int i = start; i < locals_len(c->scope->locals); ++i) {
+    if (!locals_get(c->scope->locals, i).boxed)
+      continue;
+    compiler_emit_instruction(c, OP_BOX_LOCAL);
+    compiler_emit_instruction(c, i);
+  }
+}
+
+/*
+ * The argument substituted for name, if it is a parameter of the procedure
+ * being inlined. Its body has no binding forms, so nothing in it shadows one.
+ */
+static AstNode *compiler_inlined_arg(Compiler *c, const char *name) {
+  InlineExpansion *expansion = c->expansion;
+  if (!expansion)
+    return NULL;
+  for (int i = 0; i < vector_len(expansion->callee->params); ++i) {
+    AstNode *param = DatumGetPtr(vector_get(expansion->callee->params, i));
+    if (strcmp(((AstIdent *)param)->ident, name) == 0)
+      return DatumGetPtr(vector_get(expansion->substituted_args, i));
+  }
+  return NULL;
+}
+
+static void compile_variable_ref(Compiler *c, const char *name, bool set) {
+  AstNode *arg;
+  int index;
+
+  if (!set && (arg = compiler_inlined_arg(c, name))) {
+    /* A constant or a local of the frame, no other parameters apply. */
+    InlineExpansion *expansion = c->expansion;
+    c->expansion = NULL;
+    compile_expr(c, arg, /*tail=*/false);
+    c->expansion = expansion;
+    return;
+  }
+
+  if (c->scope && (index = scope_resolve_local(c->scope, name)) >= 0) {
+    if (locals_get(c->scope->locals, index).boxed)
+      compiler_emit_instruction(c, set ? OP_SET_LOCAL_BOX : OP_GET_LOCAL_BOX);
+    else
+      compiler_emit_instruction(c, set ? OP_SET_LOCAL : OP_GET_LOCAL);
+    compiler_emit_instruction(c, index);
+    return;
+  }
+
+  if (c->scope && (index = scope_resolve_free_var(c->scope, name)) >= 0) {
+    bool boxed = free_vars_get(c->scope->free_vars, index).boxed;
+    if (set && !boxed) {
+      raise_error("%s: captured variable \"%s\" is assigned but unboxed\n",
+                  __FUNCTION__, name);
+    }
+    if (boxed)
+      compiler_emit_instruction(c, set ? OP_SET_FREE_BOX : OP_GET_FREE_BOX);
+    else
+      compiler_emit_instruction(c, OP_GET_FREE);
+    compiler_emit_instruction(c, index);
+    return;
+  }
+
+  compiler_emit_instruction(c, set ? OP_SET_GLOBAL : OP_GET_GLOBAL);
+  compiler_emit_uint16(c, compiler_add_symbol(c, name));
+  for (size_t i = 0; i < VM_GLOBAL_CACHE_SIZE; ++i)
+    compiler_emit_instruction(c, 0);
+}
+
+static Object quote_datum(Compiler *c, AstNode *datum) {
+  if (!datum)
+    return NIL_OBJECT;
+
+  switch (datum->kind) {
+  case AST_BOOL:
+    return BoolGetObject(((AstBool *)datum)->boolean);
+  case AST_NUMBER:
+    return FloatGetObject(((AstNumber *)datum)->number);
+  case AST_IDENT:
+    return compiler_symbol(c, ((AstIdent *)datum)->ident);
+  case AST_QUOTE: {
+    Object inner = quote_datum(c, ((AstQuote *)datum)->inner);
+    return make_pair(c->heap, compiler_symbol(c, "quote"),
+                     make_pair(c->heap, inner, NIL_OBJECT));
+  }
+  case AST_PROC_CALL: {
+    AstProcCall *list = (AstProcCall *)datum;
+    Object obj = NIL_OBJECT;
+    for (int i = form_length(list) - 1; i >= 0; --i)
+      obj = make_pair(c->heap, quote_datum(c, form_ref(list, i)), obj);
+    return obj;
+  }
+  default:
+    raise_error("%s: unsupported quoted datum (%d)\n", __FUNCTION__,
+                datum->kind);
+  }
+}
+
+/* Internal definitions of a body become locals of the enclosing lambda. */
+static void declare_internal_defines(Compiler *c, AstProcCall *form,
+                                     int start) {
+  for (int i = start; i < form_length(form); ++i) {
+    AstNode *expr = form_ref(form, i);
+    AstProcCall *define;
+    AstNode *target;
+
+    if (!expr || expr->kind != AST_PROC_CALL)
+      continue;
+    define = (AstProcCall *)expr;
+    if (!ast_is_ident(define->callable, "define") || form_length(define) < 2)
+      continue;
+    target = form_ref(define, 1);
+    if (target && target->kind == AST_PROC_CALL)
+      target = ((AstProcCall *)target)->callable;
+    scope_declare_local(c->scope, ident_of(target, "defined name"));
+  }
+}
+
+/* Collects the parameter list of a lambda as a vector of AstNode *. */
+static Vector *lambda_params(AstNode *params) {
+  Vector *param_nodes = make_vector();
+  AstProcCall *param_list;
+
+  if (!params)
+    return param_nodes;
+  if (params->kind != AST_PROC_CALL) {
+    raise_error("%s: variadic lambdas are not supported\n", __FUNCTION__);
+  }
+  param_list = (AstProcCall *)params;
+  for (int i = 0; i < form_length(param_list); ++i)
+    vector_append(param_nodes, PointerGetDatum(form_ref(param_list, i)));
+  return param_nodes;
+}
+
+static bool loop_only_tail_called(AstNode *node, const char *name, int argc,
+                                  bool tail);
+
+static bool loop_body_only_tail_called(AstProcCall *form, int start,
+                                       const char *name, int argc, bool tail) {
+  for (int i = start; i < form_length(form); ++i) {
+    if (!loop_only_tail_called(form_ref(form, i), name, argc,
+                               tail && i == form_length(form) - 1))
+      return false;
+  }
+  return true;
+}
+
+/*
+ * Whether node only ever refers to name by calling it with argc arguments
+ * in tail position. Anything else, including uses in nested lambdas and
+ * loops, counts as a reference to the procedure itself.
+ */
+static bool loop_only_tail_called(AstNode *node, const char *name, int argc,
+                                  bool tail) {
+  AstProcCall *form;
+
+  if (!node || node->kind != AST_PROC_CALL)
+    return !ast_is_ident(node, name);
+  form = (AstProcCall *)node;
+
+  if (ast_is_ident(form->callable, "quote"))
+    return true;
+  if (ast_is_ident(form->callable, name))
+    return tail && vector_len(form->args) == argc &&
+           loop_body_only_tail_called(form, 1, name, argc, false);
+  if (ast_is_ident(form->callable, "if"))
+    return loop_only_tail_called(form_ref(form, 1), name, argc, false) &&
+           (form_length(form) < 3 ||
+            loop_only_tail_called(form_ref(form, 2), name, argc, tail)) &&
+           (form_length(form) < 4 ||
+            loop_only_tail_called(form_ref(form, 3), name, argc, tail));
+  if (ast_is_ident(form->callable, "begin"))
+    return loop_body_only_tail_called(form, 1, name, argc, tail);
+  if (ast_is_ident(form->callable, "cond")) {
+    for (int i = 1; i < form_length(form); ++i) {
+      AstProcCall *clause = (AstProcCall *)form_ref(form, i);
+      if (!clause || clause->base.kind != AST_PROC_CALL)
+        return !ast_mentions((AstNode *)form, name);
+      if (!ast_is_ident(clause->callable, "else") &&
+          !loop_only_tail_called(clause->callable, name, argc, false))
+        return false;
+      if (!loop_body_only_tail_called(clause, 1, name, argc, tail))
+        return false;
+    }
+    return true;
+  }
+  if (ast_is_ident(form->callable, "let") && form_length(form) >= 2 &&
+      (!form_ref(form, 1) || form_ref(form, 1)->kind == AST_PROC_CALL)) {
+    AstProcCall *bindings = (AstProcCall *)form_ref(form, 1);
+    for (int i = 0; bindings && i < form_length(bindings); ++i) {
+      AstNode *binding = form_ref(bindings, i);
+      if (!binding || binding->kind != AST_PROC_CALL ||
+          form_length((AstProcCall *)binding) != 2)
+        return !ast_mentions((AstNode *)form, name);
+      if (!loop_only_tail_called(form_ref((AstProcCall *)binding, 1), name,
+                                 argc, false))
+        return false;
+    }
+    for (int i = 0; bindings && i < form_length(bindings); ++i) {
+      /* The body refers to a new variable of that name. */
+      if (ast_is_ident(((AstProcCall *)form_ref(bindings, i))->callable, name))
+        return true;
+    }
+    return loop_body_only_tail_called(form, 2, name, argc, tail);
+  }
+  if (ast_is_ident(form->callable, "lambda") ||
+      ast_is_ident(form->callable, "define") ||
+      ast_is_ident(form->callable, "set!") ||
+      ast_is_ident(form->callable, "let") || ast_is_ident(form->callable, "do"))
+    return !ast_mentions(node, name);
+  return loop_body_only_tail_called(form, 0, name, argc, false);
+}
+
+/*
+ * Whether (let name ((var init) ...) body ...) can run as a loop in the
+ * current frame: the body only calls name, and only in tail position.
+ */
+static bool named_let_is_loop(AstProcCall *form) {
+  const char *name = ((AstIdent *)form_ref(form, 1))->ident;
+  AstNode *bindings = form_ref(form, 2);
+  int num_vars = bindings ? form_length((AstProcCall *)bindings) : 0;
+  return loop_body_only_tail_called(form, 3, name, num_vars, true);
+}
+
+static inline bool is_named_let(AstProcCall *form) {
+  return ast_is_ident(form->callable, "let") && form_length(form) >= 3 &&
+         form_ref(form, 1) && form_ref(form, 1)->kind == AST_IDENT &&
+         (!form_ref(form, 2) || form_ref(form, 2)->kind == AST_PROC_CALL);
+}
+
+/*
+ * Collects the names assigned by set! or define in a lambda body, and the
+ * names referenced from lambdas nested in it. Scoping is ignored, which can
+ * only make the compiler box more variables than necessary.
+ */
+static void scan_assigned_and_captured(Scope *scope, AstNode *node,
+                                       bool nested) {
+  AstProcCall *form;
+  AstNode *target;
+  int body_start = 1;
+
+  if (!node)
+    return;
+  if (node->kind == AST_IDENT) {
+    if (nested)
+      names_add(scope->captured, ((AstIdent *)node)->ident);
+    return;
+  }
+  if (node->kind == AST_QUOTE) {
+    scan_assigned_and_captured(scope, ((AstQuote *)node)->inner, nested);
+    return;
+  }
+  if (node->kind != AST_PROC_CALL)
+    return;
+
+  form = (AstProcCall *)node;
+  target = form_length(form) >= 2 ? form_ref(form, 1) : NULL;
+  if (is_named_let(form) && !named_let_is_loop(form)) {
+    /* The body runs in a procedure of its own. */
+    scan_assigned_and_captured(scope, form_ref(form, 2), nested);
+    for (int i = 3; i < form_length(form); ++i)
+      scan_assigned_and_captured(scope, form_ref(form, i), true);
+    return;
+  }
+  if (ast_is_ident(form->callable, "lambda")) {
+    /* Skip the parameters, the body runs in a nested lambda. */
+    for (int i = 2; i < form_length(form); ++i)
+      scan_assigned_and_captured(scope, form_ref(form, i), true);
+    return;
+  }
+  if ((ast_is_ident(form->callable, "define") ||
+       ast_is_ident(form->callable, "set!")) &&
+      target) {
+    if (target->kind == AST_PROC_CALL) {
+      /* (define (name params ...) body ...) */
+      target = ((AstProcCall *)target)->callable;
+      for (int i = 2; i < form_length(form); ++i)
+        scan_assigned_and_captured(scope, form_ref(form, i), true);
+      body_start = form_length(form);
+    }
+    if (target && target->kind == AST_IDENT)
+      names_add(scope->assigned, ((AstIdent *)target)->ident);
+  }
+
+  scan_assigned_and_captured(scope, form->callable, nested);
+  for (int i = body_start; i < form_length(form); ++i)
+    scan_assigned_and_captured(scope, form_ref(form, i), nested);
+}
+
+/*
+ * Compiles the body of a lambda into fresh instructions and lines, in the
+ * empty scope whose parent is the current one. The scope then holds its
+ * locals and free variables.
+ */
+static Instructions *compile_lambda_body(Compiler *c, Scope *scope,
+                                         Vector *params, AstProcCall *form,
+                                         int body_start, LineTable **lines) {
+  Instructions *enclosing_instructions = c->instructions;
+  LineEntries *enclosing_lines = c->lines;
+  TokenLoc enclosing_loc = c->loc;
+  Instructions *instructions;
+
+  for (int i = body_start; i < form_length(form); ++i)
+    scan_assigned_and_captured(scope, form_ref(form, i), false);
+  for (int i = 0; i < vector_len(params); ++i) {
+    AstNode *param = DatumGetPtr(vector_get(params, i));
+    scope_declare_local(scope, ident_of(param, "parameter"));
+  }
+
+  c->scope = scope;
+  c->instructions = make_instructions();
+  c->lines = make_line_entries();
+  compiler_set_loc(c, form->base.loc);
+
+  declare_internal_defines(c, form, body_start);
+  compiler_box_locals(c, 0);
+  compile_body(c, form, body_start, /*tail=*/true);
+  compiler_emit_instruction(c, OP_RETURN);
+
+  instructions = c->instructions;
+  *lines = make_line_table(c->lines);
+  free_line_entries(c->lines);
+  c->instructions = enclosing_instructions;
+  c->lines = enclosing_lines;
+  c->loc = enclosing_loc;
+  c->scope = scope->parent;
+  return instructions;
+}
+
+static void initialize_scope(Scope *scope, Scope *parent) {
+  scope->parent = parent;
+  scope->locals = make_locals();
+  scope->num_locals = 0;
+  scope->free_vars = make_free_vars();
+  scope->assigned = make_vector();
+  scope->captured = make_vector();
+}
+
+static void destroy_scope(Scope *scope) {
+  free_locals(scope->locals);
+  free_free_vars(scope->free_vars);
+  free_vector(scope->assigned);
+  free_vector(scope->captured);
+}
+
+/*
+ * Fills in the body of a stub made by make_lazy_function, see LazyBody. The
+ * VM owns the constants and the heap by now.
+ */
+static void compile_lazy_lambda(VM *vm, LazyBody *body, CompiledFunction *fn) {
+  LazyLambda *lazy = (LazyLambda *)body;
+  Compiler *c = lazy->compiler;
+  ObjectsPool *constants = c->constants;
+  Heap *heap = c->heap;
+  int num_constants = objects_pool_len(vm->constants);
+  Scope scope;
+
+  c->constants = vm->constants;
+  c->heap = vm->heap;
+  initialize_scope(&scope, /*parent=*/NULL);
+  fn->instructions = compile_lambda_body(c, &scope, lazy->params, lazy->form,
+                                         lazy->body_start, &fn->lines);
+  fn->num_locals = scope.num_locals;
+  destroy_scope(&scope);
+  if (c->finish_lazy) {
+    c->finish_lazy(fn);
+    for (int i = num_constants; i < objects_pool_len(vm->constants); ++i) {
+      Object val = objects_pool_get(vm->constants, i);
+      if (val.type == OBJ_PROCEDURE)
+        c->finish_lazy(DatumGetPtr(val.value));
+    }
+  }
+  c->constants = constants;
+  c->heap = heap;
+}
+
+static CompiledFunction *make_lazy_function(Compiler *c, const char *name,
+                                            Vector *params, AstProcCall *form,
+                                            int body_start) {
+  LazyLambda *lazy = malloc(sizeof(LazyLambda));
+  CompiledFunction *fn = make_compiled_function(c->heap, NULL, 0);
+
+  if (!lazy) {
+    raise_error("%s: OOM\n", __FUNCTION__);
+  }
+  lazy->base.compile = compile_lazy_lambda;
+  lazy->compiler = c;
+  /* The caller may free params, the nodes belong to the program. */
+  lazy->params = make_vector();
+  for (int i = 0; i < vector_len(params); ++i)
+    vector_append(lazy->params, vector_get(params, i));
+  lazy->form = form;
+  lazy->body_start = body_start;
+  vector_append(c->lazy_lambdas, PointerGetDatum(lazy));
+
+  fn->name = name;
+  fn->num_params = vector_len(params);
+  fn->lazy = &lazy->base;
+  return fn;
+}
+
+/*
+ * Returns the constant that holds the compiled procedure. With in_frame, a
+ * closure is built in slots of the enclosing frame if there is room.
+ */
+static uint16_t compile_lambda(Compiler *c, Vector *params, AstProcCall *form,
+                               int body_start, bool in_frame) {
+  Scope scope;
+  CompiledFunction *fn;
+  Object fn_obj;
+  uint16_t fn_constant;
+  int num_free_vars;
+  const char *name = c->lambda_name;
+  LineTable *lines;
+
+  /* Lambdas nested in this one are anonymous. */
+  c->lambda_name = NULL;
+  if (name)
+    name = heap_intern_symbol(c->heap, name);
+
+  if (c->lazy && !c->scope) {
+    /* Top-level lambdas capture nothing, the body can wait for a call. */
+    fn = make_lazy_function(c, name, params, form, body_start);
+    fn_obj = make_object(OBJ_PROCEDURE, PointerGetDatum(fn));
+    fn_constant = compiler_add_constant(c, fn_obj);
+    compiler_emit_instruction(c, OP_CONSTANT);
+    compiler_emit_uint16(c, fn_constant);
+    return fn_constant;
+  }
+
+  initialize_scope(&scope, c->scope);
+  fn = make_compiled_function(
+      c->heap, compile_lambda_body(c, &scope, params, form, body_start, &lines),
+      0);
+  fn->name = name;
+  fn->lines = lines;
+  fn->num_locals = scope.num_locals;
+  fn->num_params = vector_len(params);
+  fn->num_free_vars = num_free_vars = free_vars_len(scope.free_vars);
+  fn_obj = make_object(OBJ_PROCEDURE, PointerGetDatum(fn));
+
+  fn_constant = compiler_add_constant(c, fn_obj);
+  if (num_free_vars == 0) {
+    /* Nothing to capture, the procedure itself is a constant. */
+    compiler_emit_instruction(c, OP_CONSTANT);
+    compiler_emit_uint16(c, fn_constant);
+  } else {
+    in_frame = in_frame && scope_has_room(c->scope, 1 + num_free_vars);
+    compiler_emit_instruction(c, in_frame ? OP_STACK_CLOSURE : OP_CLOSURE);
+    compiler_emit_uint16(c, fn_constant);
+    /* The function pointer and the free variables fit in n + 1 slots. */
+    if (in_frame)
+      compiler_emit_instruction(
+          c, scope_declare_storage(c->scope, 1 + num_free_vars));
+    compiler_emit_instruction(c, num_free_vars);
+    for (int i = 0; i < num_free_vars; ++i) {
+      FreeVar free_var = free_vars_get(scope.free_vars, i);
+      compiler_emit_instruction(c, free_var.from_local);
+      compiler_emit_instruction(c, free_var.index);
+    }
+  }
+
+  destroy_scope(&scope);
+  return fn_constant;
+}
+
+/*
+ * Compiles form[start..] as a sequence, leaving the last value. The last
+ * expression is in tail position if the sequence is.
+ */
+static void compile_body(Compiler *c, AstProcCall *form, int start,
+                         bool tail) {
+  int len = form_length(form);
+  if (start >= len) {
+    compiler_emit_constant(c, UNSPECIFIED_OBJECT);
+    return;
+  }
+  for (int i = start; i < len; ++i) {
+    compile_expr(c, form_ref(form, i), tail && i == len - 1);
+    if (i != len - 1)
+      compiler_emit_instruction(c, OP_POP);
+  }
+}
+
+static void compile_if(Compiler *c, AstProcCall *form, bool tail) {
+  int else_jump, end_jump;
+  expect_form_length(form, "if", 3, 4);
+
+  compile_expression(c, form_ref(form, 1));
+  else_jump = compiler_emit_jump(c, OP_JUMP_IF_FALSE);
+  compile_expr(c, form_ref(form, 2), tail);
+  end_jump = compiler_emit_jump(c, OP_JUMP);
+  compiler_patch_jump(c, else_jump);
+  if (form_length(form) == 4)
+    compile_expr(c, form_ref(form, 3), tail);
+  else
+    compiler_emit_constant(c, UNSPECIFIED_OBJECT);
+  compiler_patch_jump(c, end_jump);
+}
+
+/*
+ * What can replace a parameter bound to arg in an inlined body: a constant,
+ * or a local of the current frame that nothing in the procedure assigns. The
+ * body reads it only after the later arguments ran, which may not change it.
+ * NULL if the parameter needs a slot.
+ */
+static AstNode *inline_substitute_arg(Compiler *c, AstNode *arg) {
+  AstNode *substituted;
+
+  if (!arg)
+    return NULL;
+  if (arg->kind == AST_BOOL || arg->kind == AST_NUMBER ||
+      arg->kind == AST_QUOTE)
+    return arg;
+  if (arg->kind != AST_IDENT)
+    return NULL;
+  /* A parameter of the body arg appears in, pass on what replaced it. */
+  if ((substituted = compiler_inlined_arg(c, ((AstIdent *)arg)->ident)))
+    return substituted;
+  if (c->scope &&
+      scope_resolve_local(c->scope, ((AstIdent *)arg)->ident) >= 0 &&
+      !names_contain(c->scope->assigned, ((AstIdent *)arg)->ident))
+    return arg;
+  return NULL;
+}
+
+static bool is_quote_form(AstNode *node) {
+  return node && node->kind == AST_PROC_CALL &&
+         ast_is_ident(((AstProcCall *)node)->callable, "quote");
+}
+
+/*
+ * Counts the nodes of an inlining candidate's body, or returns -1 if it
+ * mentions name or binds or assigns variables, which would need renaming
+ * once it is moved into another procedure. reason then says why.
+ */
+static int inline_body_size(AstNode *node, const char *name,
+                            const char **reason) {
+  static const char *binders[] = {"lambda", "let", "do", "define"};
+  AstProcCall *form;
+  int size = 1;
+
+  if (!node || node->kind == AST_QUOTE || is_quote_form(node))
+    return 1;
+  if (node->kind == AST_IDENT) {
+    if (strcmp(((AstIdent *)node)->ident, name) == 0) {
+      *reason = "is recursive";
+      return -1;
+    }
+    if (strcmp(((AstIdent *)node)->ident, "set!") == 0) {
+      *reason = "assigns variables";
+      return -1;
+    }
+    for (size_t i = 0; i < sizeof(binders) / sizeof(binders[0]); ++i) {
+      if (strcmp(((AstIdent *)node)->ident, binders[i]) == 0) {
+        *reason = "binds variables";
+        return -1;
+      }
+    }
+    return 1;
+  }
+  if (node->kind != AST_PROC_CALL)
+    return 1;
+
+  form = (AstProcCall *)node;
+  for (int i = 0; i < form_length(form); ++i) {
+    int sub_size = inline_body_size(form_ref(form, i), name, reason);
+    if (sub_size < 0)
+      return -1;
+    size += sub_size;
+  }
+  return size;
+}
+
+static bool is_keyword(const char *name) {
+  static const char *keywords[] = {"quote", "if",   "define", "set!",
+                                   "lambda", "begin", "let",  "do",
+                                   "cond",   "else"};
+  for (size_t i = 0; i < sizeof(keywords) / sizeof(keywords[0]); ++i) {
+    if (strcmp(name, keywords[i]) == 0)
+      return true;
+  }
+  return false;
+}
+
+/* Remembers (define (name params ...) body) if its calls can be inlined. */
+static void compiler_add_inline_candidate(Compiler *c, AstProcCall *form,
+                                          uint16_t fn_constant) {
+  AstProcCall *signature = (AstProcCall *)form_ref(form, 1);
+  const char *name = ((AstIdent *)signature->callable)->ident;
+  InlineCandidate *candidate;
+  const char *reason = NULL;
+  int size;
+
+  if (c->inline_budget <= 0 || c->scope || form_length(form) != 3)
+    return;
+  for (int i = 0; i < vector_len(signature->args); ++i) {
+    AstNode *param = DatumGetPtr(vector_get(signature->args, i));
+    if (!param || param->kind != AST_IDENT ||
+        is_keyword(((AstIdent *)param)->ident))
+      return;
+  }
+
+  size = inline_body_size(form_ref(form, 2), name, &reason);
+  if (size < 0 || size > c->inline_budget) {
+    if (c->inline_log)
+      fprintf(c->inline_log, "inline: %s %s\n", name,
+              size < 0 ? reason : "is too large");
+    return;
+  }
+
+  candidate = malloc(sizeof(InlineCandidate));
+  if (!candidate) {
+    raise_error("%s: OOM\n", __FUNCTION__);
+  }
+  candidate->name = name;
+  candidate->params = signature->args;
+  candidate->body = form_ref(form, 2);
+  candidate->size = size;
+  candidate->fn_constant = fn_constant;
+  candidate->expanding = false;
+  vector_append(c->inline_candidates, PointerGetDatum(candidate));
+}
+
+static InlineCandidate *compiler_find_inline_candidate(Compiler *c,
+                                                       const char *name) {
+  /* A later definition replaces the earlier ones. */
+  for (int i = vector_len(c->inline_candidates) - 1; i >= 0; --i) {
+    InlineCandidate *candidate =
+        DatumGetPtr(vector_get(c->inline_candidates, i));
+    if (strcmp(candidate->name, name) == 0)
+      return candidate;
+  }
+  return NULL;
+}
+
+/* Whether a global the body refers to is shadowed at the call site. */
+static bool inline_body_is_shadowed(Compiler *c, InlineCandidate *callee,
+                                    AstNode *node) {
+  if (!node || node->kind == AST_QUOTE || is_quote_form(node))
+    return false;
+  if (node->kind == AST_IDENT) {
+    const char *ident = ((AstIdent *)node)->ident;
+    for (int i = 0; i < vector_len(callee->params); ++i) {
+      AstNode *param = DatumGetPtr(vector_get(callee->params, i));
+      if (strcmp(((AstIdent *)param)->ident, ident) == 0)
+        return false;
+    }
+    return compiler_is_local(c, ident) ||
+           compiler_inlined_arg(c, ident) != NULL;
+  }
+  if (node->kind == AST_PROC_CALL) {
+    AstProcCall *form = (AstProcCall *)node;
+    for (int i = 0; i < form_length(form); ++i) {
+      if (inline_body_is_shadowed(c, callee, form_ref(form, i)))
+        return true;
+    }
+  }
+  return false;
+}
+
+/*
+ * A parameter that gets a slot hides the local of the same name in the body,
+ * so an argument naming that local needs a slot as well.
+ */
+static void inline_unsubstitute_hidden_args(InlineExpansion *expansion) {
+  Vector *params = expansion->callee->params;
+  Vector *args = expansion->substituted_args;
+  bool changed = true;
+
+  while (changed) {
+    changed = false;
+    for (int i = 0; i < vector_len(args); ++i) {
+      AstNode *arg = DatumGetPtr(vector_get(args, i));
+      if (!arg || arg->kind != AST_IDENT)
+        continue;
+      for (int j = 0; j < vector_len(params); ++j) {
+        AstNode *param = DatumGetPtr(vector_get(params, j));
+        if (vector_get(args, j) ||
+            strcmp(((AstIdent *)param)->ident, ((AstIdent *)arg)->ident) != 0)
+          continue;
+        vector_set(args, i, PointerGetDatum(NULL));
+        changed = true;
+        break;
+      }
+    }
+  }
+}
+
+/*
+ * Compiles a call of an inlining candidate as its body. Constant arguments
+ * are substituted for the parameters, the others are kept in fresh frame
+ * slots unless they are locals that already have one. The body only runs
+ * while the global still holds the procedure it was taken from, otherwise
+ * the site makes the call as usual.
+ */
+static bool compile_inline_call(Compiler *c, AstProcCall *form, bool tail) {
+  const char *name;
+  InlineCandidate *callee;
+  InlineExpansion expansion;
+  int argc = vector_len(form->args);
+  int num_substituted = 0;
+  int guard_jump, end_jump, outer_len = 0;
+
+  if (!form->callable || form->callable->kind != AST_IDENT)
+    return false;
+  name = ((AstIdent *)form->callable)->ident;
+  if (compiler_is_local(c, name) || compiler_inlined_arg(c, name) ||
+      !(callee = compiler_find_inline_candidate(c, name)) ||
+      callee->expanding || vector_len(callee->params) != argc ||
+      inline_body_is_shadowed(c, callee, callee->body))
+    return false;
+
+  expansion.parent = c->expansion;
+  expansion.callee = callee;
+  expansion.substituted_args = make_vector();
+  for (int i = 0; i < argc; ++i) {
+    AstNode *arg = DatumGetPtr(vector_get(form->args, i));
+    vector_append(expansion.substituted_args,
+                  PointerGetDatum(inline_substitute_arg(c, arg)));
+  }
+  inline_unsubstitute_hidden_args(&expansion);
+  for (int i = 0; i < argc; ++i)
+    num_substituted += vector_get(expansion.substituted_args, i) != 0;
+  /* Top-level code has no frame slots to bind the other arguments to. */
+  if (!c->scope && num_substituted != argc) {
+    free_vector(expansion.substituted_args);
+    return false;
+  }
+
+  if (c->inline_log)
+    fprintf(c->inline_log, "inline: %s (size %d, %d/%d args substituted)\n",
+            name, callee->size, num_substituted, argc);
+
+  compile_variable_ref(c, name, /*set=*/false);
+  compiler_emit_instruction(c, OP_EQ_CONSTANT);
+  compiler_emit_uint16(c, callee->fn_constant);
+  guard_jump = compiler_emit_jump(c, OP_JUMP_IF_FALSE);
+
+  if (c->scope) {
+    outer_len = locals_len(c->scope->locals);
+    for (int i = 0; i < argc; ++i) {
+      if (!vector_get(expansion.substituted_args, i))
+        compile_expression(c, DatumGetPtr(vector_get(form->args, i)));
+    }
+    for (int i = 0; i < argc; ++i) {
+      AstNode *param = DatumGetPtr(vector_get(callee->params, i));
+      if (!vector_get(expansion.substituted_args, i))
+        scope_declare_local(c->scope, ((AstIdent *)param)->ident);
+    }
+    for (int i = locals_len(c->scope->locals) - 1; i >= outer_len; --i) {
+      compiler_emit_instruction(c, OP_SET_LOCAL);
+      compiler_emit_instruction(c, i);
+      compiler_emit_instruction(c, OP_POP);
+    }
+    compiler_box_locals(c, outer_len);
+  }
+
+  c->expansion = &expansion;
+  callee->expanding = true;
+  compile_expr(c, callee->body, tail);
+  callee->expanding = false;
+  c->expansion = expansion.parent;
+  if (c->scope)
+    scope_pop_locals(c->scope, outer_len);
+  end_jump = compiler_emit_jump(c, OP_JUMP);
+
+  compiler_patch_jump(c, guard_jump);
+  compile_expression(c, form->callable);
+  for (int i = 0; i < argc; ++i)
+    compile_expression(c, DatumGetPtr(vector_get(form->args, i)));
+  compiler_emit_instruction(c, tail && c->scope ? OP_TAIL_CALL : OP_PROC_CALL);
+  compiler_emit_instruction(c, argc);
+  compiler_patch_jump(c, end_jump);
+
+  free_vector(expansion.substituted_args);
+  return true;
+}
+
+static bool is_lambda_form(AstNode *node) {
+  return node && node->kind == AST_PROC_CALL &&
+         ast_is_ident(((AstProcCall *)node)->callable, "lambda");
+}
+
+static void compile_define(Compiler *c, AstProcCall *form) {
+  AstNode *target;
+  const char *name;
+  expect_form_length(form, "define", 2, -1);
+
+  target = form_ref(form, 1);
+  if (target && target->kind == AST_PROC_CALL) {
+    /* (define (name params ...) body ...) */
+    AstProcCall *signature = (AstProcCall *)target;
+    name = ident_of(signature->callable, "defined name");
+    c->lambda_name = name;
+    compiler_add_inline_candidate(
+        c, form,
+        compile_lambda(c, signature->args, form, 2, /*in_frame=*/false));
+  } else {
+    expect_form_length(form, "define", 3, 3);
+    name = ident_of(target, "defined name");
+    if (is_lambda_form(form_ref(form, 2)))
+      c->lambda_name = name;
+    compile_expression(c, form_ref(form, 2));
+    c->lambda_name = NULL;
+  }
+
+  if (c->scope) {
+    compile_variable_ref(c, name, /*set=*/true);
+  } else {
+    compiler_emit_instruction(c, OP_DEFINE_GLOBAL);
+    compiler_emit_uint16(c, compiler_add_symbol(c, name));
+  }
+}
+
+/*
+ * Whether node allocates something that can live in the frame instead: a
+ * lambda, or a call of cons or list while the program never assigns them.
+ */
+static bool compiler_allocates(Compiler *c, AstNode *node) {
+  AstProcCall *form;
+  const char *name;
+  int argc;
+
+  if (!c->escapes || !c->scope || !node || node->kind != AST_PROC_CALL)
+    return false;
+  form = (AstProcCall *)node;
+  if (!form->callable || form->callable->kind != AST_IDENT)
+    return false;
+  name = ((AstIdent *)form->callable)->ident;
+  argc = vector_len(form->args);
+  if (compiler_is_local(c, name) || compiler_inlined_arg(c, name))
+    return false;
+  if (strcmp(name, "lambda") == 0)
+    return true;
+  return ((strcmp(name, "cons") == 0 && argc == 2) ||
+          (strcmp(name, "list") == 0 && argc > 0)) &&
+         escape_trusts_global(c->escapes, name);
+}
+
+/*
+ * Compiles an allocation that compiler_allocates accepts and the escape
+ * analysis has shown to die with the frame. The closure or the pairs are
+ * built in fresh frame slots, which the caller frees with its own locals.
+ */
+static void compile_in_frame(Compiler *c, AstProcCall *form) {
+  const char *name = ((AstIdent *)form->callable)->ident;
+  int argc = vector_len(form->args);
+  int num_pairs, storage;
+
+  if (strcmp(name, "lambda") == 0) {
+    Vector *params;
+    expect_form_length(form, "lambda", 3, -1);
+    params = lambda_params(form_ref(form, 1));
+    compile_lambda(c, params, form, 2, /*in_frame=*/true);
+    free_vector(params);
+    return;
+  }
+
+  /* (list a b) is (cons a (cons b '())). */
+  num_pairs = strcmp(name, "list") == 0 ? argc : 1;
+  if (!scope_has_room(c->scope, 2 * num_pairs)) {
+    compile_expression(c, (AstNode *)form);
+    return;
+  }
+  for (int i = 0; i < argc; ++i)
+    compile_expression(c, DatumGetPtr(vector_get(form->args, i)));
+  if (strcmp(name, "list") == 0)
+    compiler_emit_constant(c, NIL_OBJECT);
+  storage = scope_declare_storage(c->scope, 2 * num_pairs);
+  for (int i = num_pairs - 1; i >= 0; --i) {
+    compiler_emit_instruction(c, OP_STACK_CONS);
+    compiler_emit_instruction(c, storage + 2 * i);
+  }
+}
+
+/* The names of all locals in scope, innermost last. */
+static Vector *compiler_visible_locals(Compiler *c) {
+  Vector *names = make_vector();
+  Vector *scopes = make_vector();
+
+  for (Scope *scope = c->scope; scope; scope = scope->parent)
+    vector_append(scopes, PointerGetDatum(scope));
+  for (int i = vector_len(scopes) - 1; i >= 0; --i) {
+    Scope *scope = DatumGetPtr(vector_get(scopes, i));
+    for (int j = 0; j < locals_len(scope->locals); ++j)
+      vector_append(names, CStringGetDatum(locals_get(scope->locals, j).name));
+  }
+  free_vector(scopes);
+  return names;
+}
+
+static inline AstNode *let_binding_name(AstProcCall *bindings, int i) {
+  return ((AstProcCall *)form_ref(bindings, i))->callable;
+}
+
+static inline AstNode *let_binding_init(AstProcCall *bindings, int i) {
+  return form_ref((AstProcCall *)form_ref(bindings, i), 1);
+}
+
+/* Whether the value of the i-th binding of the let can live in the frame. */
+static bool let_binding_stays_in_frame(Compiler *c, AstProcCall *form, int i,
+                                       bool tail) {
+  AstProcCall *bindings = (AstProcCall *)form_ref(form, 1);
+  Vector *locals;
+  bool escapes;
+
+  if (!compiler_allocates(c, let_binding_init(bindings, i)))
+    return false;
+  locals = compiler_visible_locals(c);
+  escapes = escape_let_binding(
+      c->escapes, form, ident_of(let_binding_name(bindings, i), "let name"),
+      locals, tail);
+  free_vector(locals);
+  return !escapes;
+}
+
+static void compile_let(Compiler *c, AstProcCall *form, bool tail) {
+  AstNode *bindings_node;
+  AstProcCall *bindings = NULL;
+  int num_bindings = 0;
+  int storage_len, outer_len;
+
+  expect_form_length(form, "let", 2, -1);
+  bindings_node = form_ref(form, 1);
+  if (bindings_node) {
+    if (bindings_node->kind != AST_PROC_CALL) {
+      raise_error("%s: bad let bindings\n", __FUNCTION__);
+    }
+    bindings = (AstProcCall *)bindings_node;
+    num_bindings = form_length(bindings);
+  }
+
+  for (int i = 0; i < num_bindings; ++i) {
+    AstNode *binding = form_ref(bindings, i);
+    if (!binding || binding->kind != AST_PROC_CALL ||
+        form_length((AstProcCall *)binding) != 2) {
+      raise_error("%s: bad let binding\n", __FUNCTION__);
+    }
+  }
+
+  if (!c->scope) {
+    /* Top-level code has no frame slots, run the body as a lambda. */
+    Vector *params = make_vector();
+    for (int i = 0; i < num_bindings; ++i)
+      vector_append(params, PointerGetDatum(let_binding_name(bindings, i)));
+    compile_lambda(c, params, form, 2, /*in_frame=*/false);
+    free_vector(params);
+    for (int i = 0; i < num_bindings; ++i)
+      compile_expression(c, let_binding_init(bindings, i));
+    compiler_emit_instruction(c, OP_PROC_CALL);
+    compiler_emit_instruction(c, num_bindings);
+    return;
+  }
+
+  /* Evaluate all initializers before any of the new names is visible. */
+  storage_len = locals_len(c->scope->locals);
+  for (int i = 0; i < num_bindings; ++i) {
+    if (let_binding_stays_in_frame(c, form, i, tail))
+      compile_in_frame(c, (AstProcCall *)let_binding_init(bindings, i));
+    else
+      compile_expression(c, let_binding_init(bindings, i));
+  }
+
+  outer_len = locals_len(c->scope->locals);
+  for (int i = 0; i < num_bindings; ++i)
+    scope_declare_local(c->scope,
+                        ident_of(let_binding_name(bindings, i), "let name"));
+  for (int i = num_bindings - 1; i >= 0; --i) {
+    compiler_emit_instruction(c, OP_SET_LOCAL);
+    compiler_emit_instruction(c, outer_len + i);
+    compiler_emit_instruction(c, OP_POP);
+  }
+
+  declare_internal_defines(c, form, 2);
+  compiler_box_locals(c, outer_len);
+  compile_body(c, form, 2, tail);
+  /* What the initializers built in the frame dies with the let. */
+  scope_pop_locals(c->scope, storage_len);
+}
+
+/*
+ * Top-level code has no frame slots, so forms that need them run in a
+ * procedure of their own.
+ */
+static void compile_in_new_frame(Compiler *c, AstNode *node) {
+  Vector *params = make_vector();
+  AstProcCall wrapper;
+  bool lazy = c->lazy;
+
+  wrapper.base.kind = AST_PROC_CALL;
+  wrapper.callable = NULL;
+  wrapper.args = make_vector();
+  wrapper.base.loc = (TokenLoc){0, 0};
+  vector_append(wrapper.args, PointerGetDatum(node));
+  /* The wrapper goes away, the lambda has to be compiled now. */
+  c->lazy = false;
+  compile_lambda(c, params, &wrapper, 1, /*in_frame=*/false);
+  c->lazy = lazy;
+  compiler_emit_instruction(c, OP_PROC_CALL);
+  compiler_emit_instruction(c, 0);
+  free_vector(wrapper.args);
+  free_vector(params);
+}
+
+/*
+ * Stores the num_vars values on top of the stack into slots and jumps back
+ * to the loop head, which boxes them afresh.
+ */
+static void compile_loop_back(Compiler *c, const int *slots, int num_vars,
+                              int head) {
+  for (int i = num_vars - 1; i >= 0; --i) {
+    compiler_emit_instruction(c, OP_SET_LOCAL);
+    compiler_emit_instruction(c, slots[i]);
+    compiler_emit_instruction(c, OP_POP);
+  }
+  compiler_emit_instruction(c, OP_JUMP);
+  compiler_emit_uint16(c, head);
+}
+
+/* Compiles a call of the name of an enclosing Loop as its next iteration. */
+static bool compile_loop_call(Compiler *c, AstProcCall *form) {
+  Loop *loop;
+  const char *name;
+  int *slots;
+
+  if (!form->callable || form->callable->kind != AST_IDENT)
+    return false;
+  name = ((AstIdent *)form->callable)->ident;
+  for (loop = c->loop; loop; loop = loop->parent) {
+    if (loop->scope == c->scope &&
+        scope_resolve_local(c->scope, name) == loop->name_slot)
+      break;
+  }
+  if (!loop)
+    return false;
+
+  slots = malloc((loop->num_vars + 1) * sizeof(int));
+  if (!slots) {
+    raise_error("%s: OOM\n", __FUNCTION__);
+  }
+  for (int i = 0; i < loop->num_vars; ++i) {
+    compile_expression(c, DatumGetPtr(vector_get(form->args, i)));
+    slots[i] = loop->name_slot + 1 + i;
+  }
+  compile_loop_back(c, slots, loop->num_vars, loop->head);
+  free(slots);
+  return true;
+}
+
+/*
+ * (let name ((var init) ...) body ...) binds name to a procedure of the
+ * variables with that body and calls it with the inits. If the body only
+ * ever calls name in tail position, it runs as a loop in the current frame
+ * instead, see Loop.
+ */
+static void compile_named_let(Compiler *c, AstProcCall *form, bool tail) {
+  const char *name = ident_of(form_ref(form, 1), "let name");
+  AstProcCall *bindings = (AstProcCall *)form_ref(form, 2);
+  int num_vars = bindings ? form_length(bindings) : 0;
+  int storage_len, outer_len;
+  Loop loop;
+  Local local;
+
+  for (int i = 0; i < num_vars; ++i) {
+    AstNode *binding = form_ref(bindings, i);
+    if (!binding || binding->kind != AST_PROC_CALL ||
+        form_length((AstProcCall *)binding) != 2) {
+      raise_error("%s: bad let binding\n", __FUNCTION__);
+    }
+  }
+
+  if (!c->scope) {
+    compile_in_new_frame(c, (AstNode *)form);
+    return;
+  }
+
+  storage_len = locals_len(c->scope->locals);
+  if (!named_let_is_loop(form)) {
+    Vector *params = make_vector();
+    int slot = scope_declare_local(c->scope, name);
+
+    /* The procedure refers to itself through a box. */
+    local = locals_get(c->scope->locals, slot);
+    local.boxed = true;
+    locals_set(c->scope->locals, slot, local);
+    compiler_emit_instruction(c, OP_BOX_LOCAL);
+    compiler_emit_instruction(c, slot);
+    for (int i = 0; i < num_vars; ++i)
+      vector_append(params, PointerGetDatum(let_binding_name(bindings, i)));
+    compile_lambda(c, params, form, 3, /*in_frame=*/false);
+    free_vector(params);
+    compiler_emit_instruction(c, OP_SET_LOCAL_BOX);
+    compiler_emit_instruction(c, slot);
+
+    /* The inits do not see name. */
+    local.name = "";
+    locals_set(c->scope->locals, slot, local);
+    for (int i = 0; i < num_vars; ++i)
+      compile_expression(c, let_binding_init(bindings, i));
+    compiler_emit_instruction(c, tail ? OP_TAIL_CALL : OP_PROC_CALL);
+    compiler_emit_instruction(c, num_vars);
+    scope_pop_locals(c->scope, storage_len);
+    return;
+  }
+
+  for (int i = 0; i < num_vars; ++i)
+    compile_expression(c, let_binding_init(bindings, i));
+  outer_len = locals_len(c->scope->locals);
+  loop.name_slot = scope_declare_local(c->scope, name);
+  for (int i = 0; i < num_vars; ++i)
+    scope_declare_local(c->scope,
+                        ident_of(let_binding_name(bindings, i), "let name"));
+  for (int i = num_vars - 1; i >= 0; --i) {
+    compiler_emit_instruction(c, OP_SET_LOCAL);
+    compiler_emit_instruction(c, loop.name_slot + 1 + i);
+    compiler_emit_instruction(c, OP_POP);
+  }
+  declare_internal_defines(c, form, 3);
+
+  loop.parent = c->loop;
+  loop.scope = c->scope;
+  loop.num_vars = num_vars;
+  loop.head = instructions_len(c->instructions);
+  compiler_box_locals(c, outer_len);
+  c->loop = &loop;
+  compile_body(c, form, 3, tail);
+  c->loop = loop.parent;
+  scope_pop_locals(c->scope, storage_len);
+}
+
+/*
+ * (do ((var init step) ...) (test expr ...) body ...) always runs as a loop
+ * in the current frame. Variables without a step keep their value.
+ */
+static void compile_do(Compiler *c, AstProcCall *form, bool tail) {
+  AstProcCall *specs = NULL, *exit_clause;
+  int num_vars = 0, num_stepped = 0;
+  int storage_len, outer_len, head, body_jump, end_jump;
+  int *stepped;
+
+  expect_form_length(form, "do", 3, -1);
+  if (form_ref(form, 1)) {
+    if (form_ref(form, 1)->kind != AST_PROC_CALL) {
+      raise_error("%s: bad do variables\n", __FUNCTION__);
+    }
+    specs = (AstProcCall *)form_ref(form, 1);
+    num_vars = form_length(specs);
+  }
+  for (int i = 0; i < num_vars; ++i) {
+    AstNode *spec = form_ref(specs, i);
+    if (!spec || spec->kind != AST_PROC_CALL ||
+        form_length((AstProcCall *)spec) < 2 ||
+        form_length((AstProcCall *)spec) > 3) {
+      raise_error("%s: bad do variable\n", __FUNCTION__);
+    }
+  }
+  if (!form_ref(form, 2) || form_ref(form, 2)->kind != AST_PROC_CALL) {
+    raise_error("%s: bad do exit clause\n", __FUNCTION__);
+  }
+  exit_clause = (AstProcCall *)form_ref(form, 2);
+
+  if (!c->scope) {
+    compile_in_new_frame(c, (AstNode *)form);
+    return;
+  }
+
+  storage_len = locals_len(c->scope->locals);
+  for (int i = 0; i < num_vars; ++i)
+    compile_expression(c, let_binding_init(specs, i));
+  outer_len = locals_len(c->scope->locals);
+  for (int i = 0; i < num_vars; ++i)
+    scope_declare_local(c->scope,
+                        ident_of(let_binding_name(specs, i), "do variable"));
+  for (int i = num_vars - 1; i >= 0; --i) {
+    compiler_emit_instruction(c, OP_SET_LOCAL);
+    compiler_emit_instruction(c, outer_len + i);
+    compiler_emit_instruction(c, OP_POP);
+  }
+
+  head = instructions_len(c->instructions);
+  compiler_box_locals(c, outer_len);
+  compile_expression(c, exit_clause->callable);
+  body_jump = compiler_emit_jump(c, OP_JUMP_IF_FALSE);
+  compile_body(c, exit_clause, 1, tail);
+  end_jump = compiler_emit_jump(c, OP_JUMP);
+
+  compiler_patch_jump(c, body_jump);
+  for (int i = 3; i < form_length(form); ++i) {
+    compile_expression(c, form_ref(form, i));
+    compiler_emit_instruction(c, OP_POP);
+  }
+  /*
+   * Every variable gets a fresh box per iteration, so boxed ones are
+   * unboxed even without a step.
+   */
+  stepped = malloc((num_vars + 1) * sizeof(int));
+  if (!stepped) {
+    raise_error("%s: OOM\n", __FUNCTION__);
+  }
+  for (int i = 0; i < num_vars; ++i) {
+    AstProcCall *spec = (AstProcCall *)form_ref(specs, i);
+    if (form_length(spec) == 3)
+      compile_expression(c, form_ref(spec, 2));
+    else if (locals_get(c->scope->locals, outer_len + i).boxed)
+      compile_variable_ref(c, ((AstIdent *)spec->callable)->ident,
+                           /*set=*/false);
+    else
+      continue;
+    stepped[num_stepped++] = outer_len + i;
+  }
+  compile_loop_back(c, stepped, num_stepped, head);
+  free(stepped);
+  compiler_patch_jump(c, end_jump);
+  scope_pop_locals(c->scope, storage_len);
+}
+
+static void compile_cond(Compiler *c, AstProcCall *form, bool tail) {
+  Vector *end_jumps = make_vector();
+  bool has_else = false;
+
+  for (int i = 1; i < form_length(form); ++i) {
+    AstNode *clause_node = form_ref(form, i);
+    AstProcCall *clause;
+    int next_jump;
+
+    if (!clause_node || clause_node->kind != AST_PROC_CALL) {
+      raise_error("%s: bad cond clause\n", __FUNCTION__);
+    }
+    clause = (AstProcCall *)clause_node;
+
+    if (ast_is_ident(clause->callable, "else")) {
+      compile_body(c, clause, 1, tail);
+      has_else = true;
+      break;
+    }
+
+    compile_expression(c, clause->callable);
+    if (form_length(clause) == 1) {
+      raise_error("%s: cond clauses without a body are not supported\n",
+                  __FUNCTION__);
+    }
+    next_jump = compiler_emit_jump(c, OP_JUMP_IF_FALSE);
+    compile_body(c, clause, 1, tail);
+    vector_append(end_jumps, Int64GetDatum(compiler_emit_jump(c, OP_JUMP)));
+    compiler_patch_jump(c, next_jump);
+  }
+
+  if (!has_else)
+    compiler_emit_constant(c, UNSPECIFIED_OBJECT);
+  for (int i = 0; i < vector_len(end_jumps); ++i)
+    compiler_patch_jump(c, DatumGetInt64(vector_get(end_jumps, i)));
+  free_vector(end_jumps);
+}
+
+/*
+ * Calls of a built-in that no local shadows become its opcode. The VM guards
+ * against the global being redefined at run time.
+ */
+static bool compile_inline_primitive(Compiler *c, AstProcCall *form) {
+  const char *name;
+  int kind;
+
+  if (!form->callable || form->callable->kind != AST_IDENT)
+    return false;
+  name = ((AstIdent *)form->callable)->ident;
+  kind = lookup_primitive(name);
+  if (kind < 0 || kind > PRIM_LAST_INLINE ||
+      primitive_inline_argc(kind) != vector_len(form->args) ||
+      compiler_is_local(c, name))
+    return false;
+
+  for (int i = 0; i < vector_len(form->args); ++i)
+    compile_expression(c, DatumGetPtr(vector_get(form->args, i)));
+  compiler_emit_instruction(c, primitive_inline_op(kind));
+  return true;
+}
+
+/*
+ * Whether argument i of a call can live in the frame, which needs a callee
+ * the escape analysis knows not to keep it. A tail call would reuse the
+ * frame, the caller checks for that.
+ */
+static bool call_arg_stays_in_frame(Compiler *c, AstProcCall *form, int i) {
+  const char *name;
+
+  if (!compiler_allocates(c, DatumGetPtr(vector_get(form->args, i))) ||
+      !form->callable || form->callable->kind != AST_IDENT)
+    return false;
+  name = ((AstIdent *)form->callable)->ident;
+  return !compiler_is_local(c, name) && !compiler_inlined_arg(c, name) &&
+         !escape_call_arg(c->escapes, name, vector_len(form->args), i);
+}
+
+static void compile_proc_call(Compiler *c, AstProcCall *form, bool tail) {
+  int argc = vector_len(form->args);
+  int storage_len;
+  if (argc > UINT8_MAX) {
+    raise_error("%s: too many arguments\n", __FUNCTION__);
+  }
+  if (compile_loop_call(c, form) || compile_inline_primitive(c, form) ||
+      compile_inline_call(c, form, tail))
+    return;
+  storage_len = c->scope ? locals_len(c->scope->locals) : 0;
+  compile_expression(c, form->callable);
+  for (int i = 0; i < argc; ++i) {
+    AstNode *arg = DatumGetPtr(vector_get(form->args, i));
+    if (!tail && call_arg_stays_in_frame(c, form, i))
+      compile_in_frame(c, (AstProcCall *)arg);
+    else
+      compile_expression(c, arg);
+  }
+  /* Top-level code has no frame to reuse. */
+  compiler_emit_instruction(c, tail && c->scope ? OP_TAIL_CALL : OP_PROC_CALL);
+  compiler_emit_instruction(c, argc);
+  /* The callee kept nothing built in the frame for it. */
+  if (c->scope)
+    scope_pop_locals(c->scope, storage_len);
+}
+
+static bool compile_special_form(Compiler *c, AstProcCall *form, bool tail) {
+  const char *keyword;
+
+  if (!form->callable || form->callable->kind != AST_IDENT)
+    return false;
+  keyword = ((AstIdent *)form->callable)->ident;
+  /* Local variables shadow syntactic keywords. */
+  if (compiler_is_local(c, keyword))
+    return false;
+
+  if (strcmp(keyword, "quote") == 0) {
+    expect_form_length(form, "quote", 2, 2);
+    compiler_emit_constant(c, quote_datum(c, form_ref(form, 1)));
+  } else if (strcmp(keyword, "if") == 0) {
+    compile_if(c, form, tail);
+  } else if (strcmp(keyword, "define") == 0) {
+    compile_define(c, form);
+  } else if (strcmp(keyword, "set!") == 0) {
+    expect_form_length(form, "set!", 3, 3);
+    compile_expression(c, form_ref(form, 2));
+    compile_variable_ref(c, ident_of(form_ref(form, 1), "set! target"),
+                         /*set=*/true);
+  } else if (strcmp(keyword, "lambda") == 0) {
+    Vector *params;
+    expect_form_length(form, "lambda", 3, -1);
+    params = lambda_params(form_ref(form, 1));
+    compile_lambda(c, params, form, 2, /*in_frame=*/false);
+    free_vector(params);
+  } else if (strcmp(keyword, "begin") == 0) {
+    compile_body(c, form, 1, tail);
+  } else if (strcmp(keyword, "let") == 0) {
+    if (is_named_let(form))
+      compile_named_let(c, form, tail);
+    else
+      compile_let(c, form, tail);
+  } else if (strcmp(keyword, "do") == 0) {
+    compile_do(c, form, tail);
+  } else if (strcmp(keyword, "cond") == 0) {
+    compile_cond(c, form, tail);
+  } else {
+    return false;
+  }
+  return true;
+}
+
+static void compile_expr(Compiler *c, AstNode *ast, bool tail) {
+  TokenLoc outer_loc = c->loc;
+
+  if (!ast) {
+    raise_error("%s: empty combination ()\n", __FUNCTION__);
+  }
+
+  if (ast->loc.line)
+    compiler_set_loc(c, ast->loc);
   switch (ast->kind) {
   case AST_BOOL: {
-    Object boolean;
     AstBool *node = (AstBool *)ast;
-    boolean.type = OBJ_BOOL;
-    boolean.value = BoolGetDatum(node->boolean);
-    compiler_emit_instruction(c, OP_CONSTANT);
-    compiler_emit_instruction(c, compiler_add_constant(c, boolean));
+    compiler_emit_constant(c, BoolGetObject(node->boolean));
     break;
+  }
   case AST_NUMBER: {
-    Object number;
     AstNumber *node = (AstNumber *)ast;
-    number.type = OBJ_NUMBER;
-    number.value = FloatGetDatum(node->number);
-    compiler_emit_instruction(c, OP_CONSTANT);
-    compiler_emit_instruction(c, compiler_add_constant(c, number));
+    compiler_emit_constant(c, FloatGetObject(node->number));
+    break;
+  }
+  case AST_IDENT: {
+    AstIdent *node = (AstIdent *)ast;
+    compile_variable_ref(c, node->ident, /*set=*/false);
+    break;
+  }
+  case AST_QUOTE: {
+    AstQuote *node = (AstQuote *)ast;
+    compiler_emit_constant(c, quote_datum(c, node->inner));
+    break;
+  }
+  case AST_PROC_CALL: {
+    AstProcCall *node = (AstProcCall *)ast;
+    if (!compile_special_form(c, node, tail))
+      compile_proc_call(c, node, tail);
     break;
   }
   default: {
-    fprintf(stderr, "%s: unrecognized ast node (%d)", __FUNCTION__, ast->kind);
-    exit(1);
+    raise_error("%s: unrecognized ast node (%d)", __FUNCTION__, ast->kind);
   }
   }
+  compiler_set_loc(c, outer_loc);
+}
+
+CompilerErr compile_expression(Compiler *c, AstNode *ast) {
+  compile_expr(c, ast, /*tail=*/false);
+  return COMPILE_SUCCESS;
+}
+
+CompilerErr compile_program(Compiler *c, Vector *program) {
+  int len = vector_len(program);
+  if (c->stack_allocate)
+    c->escapes = analyze_escapes(program);
+  for (int i = 0; i < len; ++i) {
+    compile_expression(c, DatumGetPtr(vector_get(program, i)));
+    if (i != len - 1)
+      compiler_emit_instruction(c, OP_POP);
   }
   compiler_emit_instruction(c, OP_LAST);
   return COMPILE_SUCCESS;
 }
 
 uint32_t compiler_add_constant(Compiler *c, Object val) {
+  if (objects_pool_len(c->constants) >= COMPILER_MAX_CONSTANTS) {
+    raise_error("%s: too many constants\n", __FUNCTION__);
+  }
   objects_pool_add_constant(c->constants, val);
   return objects_pool_len(c->constants) - 1;
 }
@@ -61,9 +1658,47 @@ Instructions *compiler_give_out_instructions(Compiler *c) {
   return instructions;
 }
 
+Heap *compiler_give_out_heap(Compiler *c) {
+  Heap *heap = c->heap;
+  c->heap = NULL;
+  return heap;
+}
+
+void compiler_reset(Compiler *c) {
+  for (int i = 0; i < vector_len(c->inline_candidates); ++i) {
+    InlineCandidate *candidate =
+        DatumGetPtr(vector_get(c->inline_candidates, i));
+    candidate->expanding = false;
+  }
+  if (c->instructions)
+    free_instructions(c->instructions);
+  if (c->lines)
+    free_line_entries(c->lines);
+  c->instructions = NULL;
+  c->scope = NULL;
+  c->expansion = NULL;
+  c->loop = NULL;
+  c->lines = NULL;
+  c->loc = (TokenLoc){0, 0};
+  c->lambda_name = NULL;
+}
+
 void destroy_compiler(Compiler *c) {
+  for (int i = 0; i < vector_len(c->inline_candidates); ++i)
+    free(DatumGetPtr(vector_get(c->inline_candidates, i)));
+  free_vector(c->inline_candidates);
+  for (int i = 0; i < vector_len(c->lazy_lambdas); ++i) {
+    LazyLambda *lazy = DatumGetPtr(vector_get(c->lazy_lambdas, i));
+    free_vector(lazy->params);
+    free(lazy);
+  }
+  free_vector(c->lazy_lambdas);
+  if (c->escapes)
+    free_escape_analysis(c->escapes);
   if (c->constants)
     free_objects_pool(c->constants);
   if (c->instructions)
     free_instructions(c->instructions);
+  if (c->heap)
+    free_heap(c->heap);
 }
@@ -0,0 +1,517 @@
+#include "common.h"
+
+#include "bytecode.h"
+#include "emit_c.h"
+#include "error_handler.h"
+#include "primitive.h"
+#include "vm.h"
+
+#include <inttypes.h>
+#include <math.h>
+
+/* What the pre-pass finds out about each bytecode offset of a function. */
+enum {
+  /* Jumped to, gets a label. */
+  EMIT_JUMP_TARGET = 1 << 0,
+  /* Where calls and slow paths continue, also reachable through resume. */
+  EMIT_RESUME = 1 << 1,
+  /* A number constant that the binary number op after it uses directly. */
+  EMIT_FOLDED_CONSTANT = 1 << 2,
+  /* A comparison whose OP_JUMP_IF_FALSE branches on the numbers directly. */
+  EMIT_FUSED_BRANCH = 1 << 3,
+};
+
+#define EMIT_LABEL (EMIT_JUMP_TARGET | EMIT_RESUME)
+
+typedef struct Emitter {
+  FILE *out;
+  ObjectsPool *constants;
+  /* The C name of the function being emitted. */
+  const char *name;
+  uint8_t *code;
+  int len;
+  uint8_t *flags;
+  bool uses_locals;
+} Emitter;
+
+static bool is_number_op(uint8_t op) {
+  return op >= OP_ADD && op <= OP_GE;
+}
+
+static bool is_comparison_op(uint8_t op) {
+  return op >= OP_NUM_EQ && op <= OP_GE;
+}
+
+static bool is_inline_op(uint8_t op) {
+  return op >= OP_ADD && op <= OP_PAIR_P;
+}
+
+static bool is_number_constant(Emitter *e, const uint8_t *ip) {
+  return *ip == OP_CONSTANT &&
+         objects_pool_get(e->constants, read_uint16(ip + 1)).type ==
+             OBJ_NUMBER;
+}
+
+static void emit_analyze(Emitter *e) {
+  int offset, prev = -1;
+
+  e->uses_locals = false;
+  for (offset = 0; offset < e->len;
+       offset += instruction_length(&e->code[offset])) {
+    uint8_t *ip = &e->code[offset];
+    int next = offset + instruction_length(ip);
+    if (*ip == OP_GET_LOCAL || *ip == OP_SET_LOCAL ||
+        *ip == OP_GET_LOCAL_BOX || *ip == OP_SET_LOCAL_BOX ||
+        *ip == OP_BOX_LOCAL)
+      e->uses_locals = true;
+    if (opcode_is_jump(*ip))
+      e->flags[read_uint16(ip + 1)] |= EMIT_JUMP_TARGET;
+    /* Calls and slow paths resume at the next instruction. */
+    if (*ip == OP_PROC_CALL || *ip == OP_TAIL_CALL ||
+        (*ip >= OP_CALL_NATIVE0 && *ip <= OP_CALL_NATIVE3) ||
+        is_inline_op(*ip))
+      e->flags[next] |= EMIT_RESUME;
+  }
+
+  for (offset = 0; offset < e->len;
+       offset += instruction_length(&e->code[offset])) {
+    uint8_t *ip = &e->code[offset];
+    int next = offset + instruction_length(ip);
+    if (is_number_op(*ip) && prev >= 0 &&
+        is_number_constant(e, &e->code[prev]) &&
+        !(e->flags[offset] & EMIT_LABEL))
+      e->flags[prev] |= EMIT_FOLDED_CONSTANT;
+    if (is_comparison_op(*ip) && e->code[next] == OP_JUMP_IF_FALSE &&
+        !(e->flags[next] & EMIT_JUMP_TARGET)) {
+      e->flags[offset] |= EMIT_FUSED_BRANCH;
+      e->flags[next + 3] |= EMIT_JUMP_TARGET;
+    }
+    prev = offset;
+  }
+}
+
+static void emit_double(Emitter *e, double number) {
+  if (isfinite(number))
+    fprintf(e->out, "%a", number);
+  else
+    fprintf(e->out, "DatumGetFloat(UINT64_C(0x%016" PRIx64 "))",
+            (uint64_t)FloatGetDatum(number));
+}
+
+static void emit_string(FILE *out, const char *str) {
+  fputc('"', out);
+  for (; *str; ++str) {
+    if (*str == '"' || *str == '\\')
+      fprintf(out, "\\%c", *str);
+    else if (isprint((unsigned char)*str))
+      fputc(*str, out);
+    else
+      fprintf(out, "\\%03o", (unsigned char)*str);
+  }
+  fputc('"', out);
+}
+
+/* An expression that rebuilds the constant at startup. */
+static void emit_constant_object(Emitter *e, Object val) {
+  switch (val.type) {
+  case OBJ_NIL:
+    fprintf(e->out, "NIL_OBJECT");
+    break;
+  case OBJ_UNSPECIFIED:
+    fprintf(e->out, "UNSPECIFIED_OBJECT");
+    break;
+  case OBJ_BOOL:
+    fprintf(e->out, "BoolGetObject(%s)",
+            DatumGetBool(val.value) ? "true" : "false");
+    break;
+  case OBJ_NUMBER:
+    fprintf(e->out, "FloatGetObject(");
+    emit_double(e, DatumGetFloat(val.value));
+    fprintf(e->out, ")");
+    break;
+  case OBJ_SYMBOL:
+    fprintf(e->out, "make_object(OBJ_SYMBOL, "
+                    "CStringGetDatum(heap_intern_symbol(heap, ");
+    emit_string(e->out, DatumGetCString(val.value));
+    fprintf(e->out, ")))");
+    break;
+  case OBJ_PAIR:
+    fprintf(e->out, "make_pair(heap, ");
+    emit_constant_object(e, ObjectGetPair(val)->car);
+    fprintf(e->out, ", ");
+    emit_constant_object(e, ObjectGetPair(val)->cdr);
+    fprintf(e->out, ")");
+    break;
+  default:
+    raise_error("%s: unexpected constant of type %d\n", __FUNCTION__, val.type);
+  }
+}
+
+/* The value of a number constant, e.g. for an operand that was folded. */
+static void emit_number_constant(Emitter *e, const uint8_t *ip) {
+  Object val = objects_pool_get(e->constants, read_uint16(ip + 1));
+  emit_double(e, DatumGetFloat(val.value));
+}
+
+static void emit_intact(Emitter *e, uint8_t op) {
+  PrimitiveKind kind = inline_op_primitive(op);
+  fprintf(e->out, "COMPILED_INTACT(%d /* %s */)", kind, primitives[kind].name);
+}
+
+static const char *number_op_operator(uint8_t op) {
+  static const char *operators[] = {"+", "-", "*", "/", "==",
+                                    "<", ">", "<=", ">="};
+  return operators[op - OP_ADD];
+}
+
+/*
+ * A binary number op. Its fast path works on the doubles directly, with a
+ * folded constant as the right operand and fused with the jump after it.
+ */
+static void emit_number_op(Emitter *e, int offset, int prev) {
+  uint8_t *ip = &e->code[offset];
+  bool folded = prev >= 0 && (e->flags[prev] & EMIT_FOLDED_CONSTANT);
+  const char *a = folded ? "sp[-1]" : "sp[-2]";
+
+  fprintf(e->out, "  if (%s.type == OBJ_NUMBER && ", a);
+  if (!folded)
+    fprintf(e->out, "sp[-1].type == OBJ_NUMBER &&\n      ");
+  emit_intact(e, *ip);
+  fprintf(e->out, ") {\n");
+
+  if (e->flags[offset] & EMIT_FUSED_BRANCH) {
+    uint8_t *jump = ip + 1;
+    fprintf(e->out, "    sp -= %d;\n", folded ? 1 : 2);
+    fprintf(e->out, "    if (!(COMPILED_NUMBER(sp[0]) %s ",
+            number_op_operator(*ip));
+    if (folded)
+      emit_number_constant(e, &e->code[prev]);
+    else
+      fprintf(e->out, "COMPILED_NUMBER(sp[1])");
+    fprintf(e->out, "))\n      goto L%d;\n", read_uint16(jump + 1));
+    fprintf(e->out, "    goto L%d;\n", offset + 4);
+  } else {
+    fprintf(e->out, "    %s = %s(COMPILED_NUMBER(%s) %s ", a,
+            is_comparison_op(*ip) ? "BoolGetObject" : "FloatGetObject", a,
+            number_op_operator(*ip));
+    if (folded)
+      emit_number_constant(e, &e->code[prev]);
+    else
+      fprintf(e->out, "COMPILED_NUMBER(sp[-1])");
+    fprintf(e->out, ");\n");
+    if (!folded)
+      fprintf(e->out, "    --sp;\n");
+  }
+
+  fprintf(e->out, "  } else {\n");
+  if (folded) {
+    fprintf(e->out, "    *sp++ = FloatGetObject(");
+    emit_number_constant(e, &e->code[prev]);
+    fprintf(e->out, ");\n");
+  }
+  fprintf(e->out, "    COMPILED_INLINE_SLOW_PATH(%s, %d);\n  }\n", e->name,
+          offset);
+}
+
+/* The other inlined primitives, guarded by cond. */
+static void emit_inline_op(Emitter *e, int offset, const char *cond,
+                           const char *body) {
+  fprintf(e->out, "  if (%s", cond);
+  emit_intact(e, e->code[offset]);
+  fprintf(e->out, ") {\n%s  } else {\n", body);
+  fprintf(e->out, "    COMPILED_INLINE_SLOW_PATH(%s, %d);\n  }\n", e->name,
+          offset);
+}
+
+static void emit_instruction(Emitter *e, int offset, int prev) {
+  uint8_t *ip = &e->code[offset];
+  FILE *out = e->out;
+
+  switch (*ip) {
+  case OP_CONSTANT: {
+    uint16_t constant_idx = read_uint16(ip + 1);
+    Object val = objects_pool_get(e->constants, constant_idx);
+    if (e->flags[offset] & EMIT_FOLDED_CONSTANT)
+      break;
+    if (val.type == OBJ_NUMBER || val.type == OBJ_BOOL ||
+        val.type == OBJ_NIL || val.type == OBJ_UNSPECIFIED) {
+      fprintf(out, "  *sp++ = ");
+      emit_constant_object(e, val);
+      fprintf(out, ";\n");
+    } else {
+      fprintf(out, "  *sp++ = vm_constant(vm, %d);\n", constant_idx);
+    }
+    break;
+  }
+  case OP_POP:
+    fprintf(out, "  --sp;\n");
+    break;
+  case OP_GET_LOCAL:
+    fprintf(out, "  *sp++ = locals[%d];\n", ip[1]);
+    break;
+  case OP_SET_LOCAL:
+    fprintf(out, "  locals[%d] = sp[-1];\n", ip[1]);
+    break;
+  case OP_GET_LOCAL_BOX:
+    fprintf(out, "  *sp++ = ObjectGetBox(locals[%d])->value;\n", ip[1]);
+    break;
+  case OP_SET_LOCAL_BOX:
+    fprintf(out, "  ObjectGetBox(locals[%d])->value = sp[-1];\n", ip[1]);
+    break;
+  case OP_BOX_LOCAL:
+    fprintf(out,
+            "  locals[%d] = make_object(OBJ_BOX, "
+            "PointerGetDatum(vm_make_box(vm, locals[%d])));\n",
+            ip[1], ip[1]);
+    break;
+  case OP_GET_FREE:
+    fprintf(out, "  *sp++ = vm_current_closure(vm, frame)->free_vars[%d];\n",
+            ip[1]);
+    break;
+  case OP_GET_FREE_BOX:
+    fprintf(out,
+            "  *sp++ = ObjectGetBox(vm_current_closure(vm, frame)"
+            "->free_vars[%d])->value;\n",
+            ip[1]);
+    break;
+  case OP_SET_FREE_BOX:
+    fprintf(out,
+            "  ObjectGetBox(vm_current_closure(vm, frame)->free_vars[%d])"
+            "->value = sp[-1];\n",
+            ip[1]);
+    break;
+  case OP_CLOSURE:
+    fprintf(out,
+            "  *sp++ = vm_make_closure(vm, frame, "
+            "DatumGetPtr(vm_constant(vm, %d).value), %d, code + %d);\n",
+            read_uint16(ip + 1), ip[3], offset + 4);
+    break;
+  case OP_STACK_CLOSURE:
+    fprintf(out,
+            "  *sp++ = vm_make_stack_closure(vm, frame, "
+            "DatumGetPtr(vm_constant(vm, %d).value), %d, %d, code + %d);\n",
+            read_uint16(ip + 1), ip[3], ip[4], offset + 5);
+    break;
+  case OP_STACK_CONS:
+    fprintf(out,
+            "  sp[-2] = vm_stack_cons(vm, frame, %d, sp[-2], sp[-1]);\n"
+            "  --sp;\n",
+            ip[1]);
+    break;
+  case OP_GET_GLOBAL:
+    fprintf(out, "  *sp++ = vm_global_slot(vm, code + %d)->val;\n", offset);
+    break;
+  case OP_DEFINE_GLOBAL:
+    fprintf(out, "  vm_define_global(vm, global_name(vm, %d), sp[-1]);\n",
+            read_uint16(ip + 1));
+    break;
+  case OP_SET_GLOBAL:
+    fprintf(out,
+            "  vm_set_global(vm, vm_global_slot(vm, code + %d), sp[-1]);\n",
+            offset);
+    break;
+  case OP_JUMP:
+    fprintf(out, "  goto L%d;\n", read_uint16(ip + 1));
+    break;
+  case OP_JUMP_IF_FALSE:
+    fprintf(out, "  if (ObjectIsFalse(*--sp))\n    goto L%d;\n",
+            read_uint16(ip + 1));
+    break;
+  case OP_PROC_CALL:
+  case OP_TAIL_CALL:
+    fprintf(out, "  COMPILED_CALL(%s, %d, %d, %s);\n", e->name, offset, ip[1],
+            *ip == OP_TAIL_CALL ? "true" : "false");
+    break;
+  case OP_CALL_NATIVE0:
+  case OP_CALL_NATIVE1:
+  case OP_CALL_NATIVE2:
+  case OP_CALL_NATIVE3:
+    fprintf(out, "  COMPILED_CALL(%s, %d, %d, %s);\n", e->name, offset,
+            *ip - OP_CALL_NATIVE0, ip[1] ? "true" : "false");
+    break;
+  case OP_EQ_CONSTANT:
+    fprintf(out,
+            "  sp[-1] = BoolGetObject(object_eq(sp[-1], "
+            "vm_constant(vm, %d)));\n",
+            read_uint16(ip + 1));
+    break;
+  case OP_RETURN:
+    fprintf(out, "  COMPILED_RETURN(%s);\n", e->name);
+    break;
+  case OP_ADD:
+  case OP_SUB:
+  case OP_MUL:
+  case OP_DIV:
+  case OP_NUM_EQ:
+  case OP_LT:
+  case OP_GT:
+  case OP_LE:
+  case OP_GE:
+    emit_number_op(e, offset, prev);
+    break;
+  case OP_NOT:
+    emit_inline_op(e, offset, "",
+                   "    sp[-1] = BoolGetObject(ObjectIsFalse(sp[-1]));\n");
+    break;
+  case OP_EQ:
+    emit_inline_op(e, offset, "",
+                   "    sp[-2] = BoolGetObject(object_eq(sp[-2], sp[-1]));\n"
+                   "    --sp;\n");
+    break;
+  case OP_CONS:
+    emit_inline_op(e, offset, "",
+                   "    sp[-2] = make_pair(vm->heap, sp[-2], sp[-1]);\n"
+                   "    --sp;\n");
+    break;
+  case OP_CAR:
+    emit_inline_op(e, offset, "sp[-1].type == OBJ_PAIR && ",
+                   "    sp[-1] = ObjectGetPair(sp[-1])->car;\n");
+    break;
+  case OP_CDR:
+    emit_inline_op(e, offset, "sp[-1].type == OBJ_PAIR && ",
+                   "    sp[-1] = ObjectGetPair(sp[-1])->cdr;\n");
+    break;
+  case OP_NULL_P:
+    emit_inline_op(e, offset, "",
+                   "    sp[-1] = BoolGetObject(sp[-1].type == OBJ_NIL);\n");
+    break;
+  case OP_PAIR_P:
+    emit_inline_op(e, offset, "",
+                   "    sp[-1] = BoolGetObject(sp[-1].type == OBJ_PAIR);\n");
+    break;
+  case OP_LAST:
+    fprintf(out, "  COMPILED_SYNC();\n  frame->ip = code + %d;\n", offset);
+    fprintf(out, "  return NULL;\n");
+    break;
+  default:
+    raise_error("%s: unrecognized operator %d\n", __FUNCTION__, *ip);
+  }
+}
+
+static void emit_function(Emitter *e, const char *name,
+                          Instructions *instructions) {
+  int offset, prev = -1;
+
+  e->name = name;
+  e->code = instructions_data(instructions);
+  e->len = instructions_len(instructions);
+  /* One more for the label after a fused jump at the very end. */
+  e->flags = calloc(e->len + 1, sizeof(uint8_t));
+  emit_analyze(e);
+
+  fprintf(e->out, "static uint8_t %s_code[] = {", name);
+  for (offset = 0; offset < e->len; ++offset) {
+    fprintf(e->out, "%s0x%02x,", offset % 12 == 0 ? "\n    " : " ",
+            e->code[offset]);
+  }
+  fprintf(e->out, "\n};\n");
+  fprintf(e->out,
+          "static Instructions %s_instructions = {\n"
+          "    sizeof(%s_code), sizeof(%s_code), %s_code};\n\n",
+          name, name, name, name);
+
+  fprintf(e->out, "static Frame *%s(VM *vm, Frame *frame) {\n", name);
+  fprintf(e->out, "  uint8_t *code = %s_code;\n", name);
+  fprintf(e->out, "  Object *%ssp;\n\n", e->uses_locals ? "locals, *" : "");
+  fprintf(e->out, "resume:\n");
+  if (e->uses_locals)
+    fprintf(e->out, "  locals = &vm->stack[frame->base_pointer];\n");
+  fprintf(e->out, "  sp = &vm->stack[vm->stack_pointer];\n");
+  fprintf(e->out, "  switch (frame->ip - code) {\n");
+  for (offset = 1; offset < e->len; ++offset) {
+    if (e->flags[offset] & EMIT_RESUME)
+      fprintf(e->out, "  case %d:\n    goto L%d;\n", offset, offset);
+  }
+  fprintf(e->out, "  }\n\n");
+
+  for (offset = 0; offset < e->len;
+       offset += instruction_length(&e->code[offset])) {
+    if (e->flags[offset] & EMIT_LABEL)
+      fprintf(e->out, "L%d:\n", offset);
+    fprintf(e->out, "  /* %s%s */\n", opcode_name(e->code[offset]),
+            (e->flags[offset] & EMIT_FOLDED_CONSTANT)
+                ? ", folded into the next instruction"
+                : "");
+    emit_instruction(e, offset, prev);
+    prev = offset;
+  }
+  if (e->flags[e->len] & EMIT_LABEL)
+    fprintf(e->out, "L%d:;\n", e->len);
+  fprintf(e->out, "}\n\n");
+
+  free(e->flags);
+}
+
+static void emit_function_name(char *name, size_t size, int constant_idx) {
+  if (constant_idx < 0)
+    snprintf(name, size, "toplevel");
+  else
+    snprintf(name, size, "procedure_%d", constant_idx);
+}
+
+void emit_c_program(FILE *output_file, ObjectsPool *constants,
+                    Instructions *instructions) {
+  Emitter e;
+  char name[32];
+  int num_constants = objects_pool_len(constants);
+
+  e.out = output_file;
+  e.constants = constants;
+
+  fprintf(output_file, "/* Generated by rsi --emit-c. */\n");
+#ifdef ROCKET_VM_STATS
+  /* The runtime it links against has the fields for the counters. */
+  fprintf(output_file, "#define ROCKET_VM_STATS\n");
+#endif
+  fprintf(output_file, "#include \"runtime.h\"\n\n");
+
+  for (int i = -1; i < num_constants; ++i) {
+    if (i >= 0 && objects_pool_get(constants, i).type != OBJ_PROCEDURE)
+      continue;
+    emit_function_name(name, sizeof(name), i);
+    fprintf(output_file, "static Frame *%s(VM *vm, Frame *frame);\n", name);
+  }
+  fprintf(output_file, "\n");
+
+  emit_function(&e, "toplevel", instructions);
+  for (int i = 0; i < num_constants; ++i) {
+    Object val = objects_pool_get(constants, i);
+    if (val.type != OBJ_PROCEDURE)
+      continue;
+    emit_function_name(name, sizeof(name), i);
+    emit_function(&e, name,
+                  ((CompiledFunction *)DatumGetPtr(val.value))->instructions);
+  }
+
+  fprintf(output_file, "int main(void) {\n");
+  fprintf(output_file, "  ObjectsPool *constants = make_objects_pool();\n");
+  fprintf(output_file, "  Heap *heap = make_heap();\n");
+  fprintf(output_file, "  CompiledFunction *fn;\n");
+  fprintf(output_file, "  VM vm;\n\n");
+  for (int i = 0; i < num_constants; ++i) {
+    Object val = objects_pool_get(constants, i);
+    if (val.type == OBJ_PROCEDURE) {
+      CompiledFunction *fn = DatumGetPtr(val.value);
+      emit_function_name(name, sizeof(name), i);
+      fprintf(output_file,
+              "  fn = make_compiled_function(heap, &%s_instructions, %d);\n",
+              name, fn->num_locals);
+      fprintf(output_file, "  fn->num_params = %d;\n", fn->num_params);
+      fprintf(output_file, "  fn->num_free_vars = %d;\n", fn->num_free_vars);
+      fprintf(output_file, "  fn->compiled_code = %s;\n", name);
+      fprintf(output_file,
+              "  objects_pool_append(constants, "
+              "make_object(OBJ_PROCEDURE, PointerGetDatum(fn)));\n");
+    } else {
+      fprintf(output_file, "  objects_pool_append(constants, ");
+      emit_constant_object(&e, val);
+      fprintf(output_file, ");\n");
+    }
+  }
+  fprintf(output_file, "\n  initialize_vm(&vm, &toplevel_instructions, "
+                       "constants, /*globals=*/NULL, heap);\n");
+  fprintf(output_file, "  vm.frames[0].fn->compiled_code = toplevel;\n");
+  fprintf(output_file, "  vm_run_compiled(&vm);\n");
+  fprintf(output_file, "  destroy_vm(&vm);\n");
+  fprintf(output_file, "  return 0;\n}\n");
+}
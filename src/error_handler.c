@@ -0,0 +1,39 @@
+#include "common.h"
+
+#include <stdarg.h>
+
+#include "error_handler.h"
+
+/* The innermost handler of this thread, NULL if errors exit. */
+static _Thread_local ErrorHandler *current_handler = NULL;
+
+void push_error_handler(ErrorHandler *handler) {
+  handler->prev = current_handler;
+  handler->message[0] = '\0';
+  current_handler = handler;
+}
+
+void pop_error_handler(ErrorHandler *handler) {
+  assert(current_handler == handler);
+  current_handler = handler->prev;
+}
+
+void raise_error(const char *format, ...) {
+  ErrorHandler *handler = current_handler;
+  va_list args;
+  size_t len;
+
+  va_start(args, format);
+  if (!handler) {
+    vfprintf(stderr, format, args);
+    exit(1);
+  }
+  vsnprintf(handler->message, sizeof(handler->message), format, args);
+  va_end(args);
+
+  len = strlen(handler->message);
+  if (len > 0 && handler->message[len - 1] == '\n')
+    handler->message[len - 1] = '\0';
+  current_handler = handler->prev;
+  longjmp(handler->env, 1);
+}
@@ -0,0 +1,396 @@
+#include "common.h"
+
+#include "ast.h"
+#include "error_handler.h"
+#include "escape.h"
+#include "primitive.h"
+#include "vector.h"
+
+/* What a procedure may do with one of its arguments. */
+typedef enum ArgUse {
+  /* Only looks at it. */
+  ARG_INSPECTED,
+  /* May return it or part of it, but keeps nothing. */
+  ARG_RETURNED,
+  /* May keep it past the call. */
+  ARG_KEPT,
+} ArgUse;
+
+/* Follows the value of one variable through the expressions in its scope. */
+typedef struct EscapeQuery {
+  EscapeAnalysis *analysis;
+  const char *name;
+  /* Names (char *) bound around the expression, including name. */
+  Vector *locals;
+  /* The value lives in the frame running the expression. */
+  bool in_frame;
+} EscapeQuery;
+
+static bool escapes(EscapeQuery *q, AstNode *node, bool flows, bool tail);
+
+static int names_count(Vector *names, const char *name) {
+  int count = 0;
+  for (int i = 0; i < vector_len(names); ++i)
+    count += strcmp(DatumGetCString(vector_get(names, i)), name) == 0;
+  return count;
+}
+
+static void push_local(Vector *locals, AstNode *name) {
+  if (ast_ident_name(name))
+    vector_append(locals, CStringGetDatum(ast_ident_name(name)));
+}
+
+static void pop_locals(Vector *locals, int len) {
+  while (vector_len(locals) > len)
+    vector_delete(locals, vector_len(locals) - 1);
+}
+
+static void collect_assigned(EscapeAnalysis *analysis, AstNode *node) {
+  AstProcCall *form;
+  AstNode *target;
+
+  if (!node || node->kind != AST_PROC_CALL)
+    return;
+  form = (AstProcCall *)node;
+  if (form_length(form) >= 2 && (ast_ident_name(form->callable) != NULL) &&
+      (strcmp(ast_ident_name(form->callable), "define") == 0 ||
+       strcmp(ast_ident_name(form->callable), "set!") == 0)) {
+    target = form_ref(form, 1);
+    if (target && target->kind == AST_PROC_CALL)
+      target = ((AstProcCall *)target)->callable;
+    if (ast_ident_name(target))
+      vector_append(analysis->assigned,
+                    CStringGetDatum(ast_ident_name(target)));
+  }
+  for (int i = 0; i < form_length(form); ++i)
+    collect_assigned(analysis, form_ref(form, i));
+}
+
+static EscapeProcedure *find_procedure(EscapeAnalysis *analysis,
+                                       const char *name) {
+  for (int i = 0; i < vector_len(analysis->procedures); ++i) {
+    EscapeProcedure *procedure =
+        DatumGetPtr(vector_get(analysis->procedures, i));
+    if (strcmp(procedure->name, name) == 0)
+      return procedure;
+  }
+  return NULL;
+}
+
+static inline AstProcCall *procedure_signature(EscapeProcedure *procedure) {
+  return (AstProcCall *)form_ref(procedure->form, 1);
+}
+
+static ArgUse global_arg_use(EscapeAnalysis *analysis, const char *callee,
+                             int argc, int index) {
+  EscapeProcedure *procedure = find_procedure(analysis, callee);
+  int kind;
+
+  if (procedure) {
+    if (vector_len(procedure_signature(procedure)->args) != argc)
+      return ARG_KEPT;
+    return (procedure->kept_params >> index) & 1 ? ARG_KEPT : ARG_INSPECTED;
+  }
+  if (!escape_trusts_global(analysis, callee) ||
+      (kind = lookup_primitive(callee)) < 0)
+    return ARG_KEPT;
+  switch (kind) {
+  case PRIM_CONS:
+  case PRIM_LIST:
+    return ARG_KEPT;
+  case PRIM_CDR:
+    return ARG_RETURNED;
+  case PRIM_APPEND:
+    /* The other lists are copied. */
+    return index == argc - 1 ? ARG_RETURNED : ARG_INSPECTED;
+  default:
+    return ARG_INSPECTED;
+  }
+}
+
+/* Follows form[start..] as a body, whose internal defines are locals. */
+static bool escapes_body(EscapeQuery *q, AstProcCall *form, int start,
+                         bool flows, bool tail) {
+  int outer_len = vector_len(q->locals);
+  bool escaped = false;
+
+  for (int i = start; i < form_length(form); ++i) {
+    AstNode *expr = form_ref(form, i);
+    AstProcCall *define;
+    AstNode *target;
+    if (!expr || expr->kind != AST_PROC_CALL)
+      continue;
+    define = (AstProcCall *)expr;
+    if (!ast_is_keyword(define, "define", q->locals) ||
+        form_length(define) < 2)
+      continue;
+    target = form_ref(define, 1);
+    if (target && target->kind == AST_PROC_CALL)
+      target = ((AstProcCall *)target)->callable;
+    /* Redefining the name itself is left to the conservative answer. */
+    if (ast_ident_name(target) && strcmp(ast_ident_name(target), q->name) == 0)
+      escaped = true;
+    push_local(q->locals, target);
+  }
+  for (int i = start; i < form_length(form) && !escaped; ++i) {
+    bool last = i == form_length(form) - 1;
+    escaped = escapes(q, form_ref(form, i), last && flows, last && tail);
+  }
+  pop_locals(q->locals, outer_len);
+  return escaped;
+}
+
+static bool escapes_let(EscapeQuery *q, AstProcCall *form, bool flows,
+                        bool tail) {
+  AstNode *bindings_node = form_ref(form, 1);
+  AstProcCall *bindings;
+  int outer_len = vector_len(q->locals);
+  bool escaped;
+
+  /* Named let is not understood, anything mentioning name escapes. */
+  if (!bindings_node || bindings_node->kind != AST_PROC_CALL)
+    return bindings_node && ast_mentions((AstNode *)form, q->name);
+  bindings = (AstProcCall *)bindings_node;
+  for (int i = 0; i < form_length(bindings); ++i) {
+    AstNode *binding = form_ref(bindings, i);
+    if (!binding || binding->kind != AST_PROC_CALL)
+      return ast_mentions((AstNode *)form, q->name);
+    /* The new variable is not followed, so its value is assumed kept. */
+    if (form_length((AstProcCall *)binding) == 2 &&
+        escapes(q, form_ref((AstProcCall *)binding, 1), true, false))
+      return true;
+  }
+  for (int i = 0; i < form_length(bindings); ++i) {
+    AstNode *name = ((AstProcCall *)form_ref(bindings, i))->callable;
+    if (ast_ident_name(name) && strcmp(ast_ident_name(name), q->name) == 0)
+      return false;
+  }
+  for (int i = 0; i < form_length(bindings); ++i)
+    push_local(q->locals, ((AstProcCall *)form_ref(bindings, i))->callable);
+  escaped = escapes_body(q, form, 2, flows, tail);
+  pop_locals(q->locals, outer_len);
+  return escaped;
+}
+
+static bool escapes_cond(EscapeQuery *q, AstProcCall *form, bool flows,
+                         bool tail) {
+  for (int i = 1; i < form_length(form); ++i) {
+    AstNode *clause_node = form_ref(form, i);
+    AstProcCall *clause;
+    if (!clause_node || clause_node->kind != AST_PROC_CALL)
+      return ast_mentions((AstNode *)form, q->name);
+    clause = (AstProcCall *)clause_node;
+    if (!(ast_ident_name(clause->callable) &&
+          strcmp(ast_ident_name(clause->callable), "else") == 0) &&
+        escapes(q, clause->callable, false, false))
+      return true;
+    if (escapes_body(q, clause, 1, flows, tail))
+      return true;
+  }
+  return false;
+}
+
+/* Whether the compiler turns the call into an opcode, see compiler.c. */
+static bool is_inlined_primitive(EscapeQuery *q, AstProcCall *form) {
+  const char *callee = ast_ident_name(form->callable);
+  int kind;
+
+  if (!callee || names_contain(q->locals, callee) ||
+      (kind = lookup_primitive(callee)) < 0 || kind > PRIM_LAST_INLINE)
+    return false;
+  return primitive_inline_argc(kind) == form_length(form) - 1;
+}
+
+static bool escapes_call(EscapeQuery *q, AstProcCall *form, bool flows,
+                         bool tail) {
+  const char *callee = ast_ident_name(form->callable);
+  int argc = form_length(form) - 1;
+
+  /* A tail call reuses the frame, and the value with it. */
+  if (tail && q->in_frame && !is_inlined_primitive(q, form) &&
+      ast_mentions((AstNode *)form, q->name))
+    return true;
+  /* Calling the value keeps nothing. */
+  if (escapes(q, form->callable, false, false))
+    return true;
+  for (int i = 0; i < argc; ++i) {
+    ArgUse use = ARG_KEPT;
+    if (callee && !names_contain(q->locals, callee) && i < 64)
+      use = global_arg_use(q->analysis, callee, argc, i);
+    if (escapes(q, form_ref(form, i + 1),
+                use == ARG_KEPT || (use == ARG_RETURNED && flows), false))
+      return true;
+  }
+  return false;
+}
+
+/*
+ * Whether the value of q->name may outlive the frame through node. flows
+ * tells whether the value of node is used, rather than dropped or only
+ * looked at, tail whether node is in tail position.
+ */
+static bool escapes(EscapeQuery *q, AstNode *node, bool flows, bool tail) {
+  AstProcCall *form;
+
+  if (!node)
+    return false;
+  if (node->kind == AST_IDENT)
+    return flows && strcmp(((AstIdent *)node)->ident, q->name) == 0;
+  if (node->kind != AST_PROC_CALL)
+    return false;
+  form = (AstProcCall *)node;
+
+  if (ast_is_keyword(form, "quote", q->locals))
+    return false;
+  if (ast_is_keyword(form, "if", q->locals)) {
+    return escapes(q, form_ref(form, 1), false, false) ||
+           (form_length(form) > 2 &&
+            escapes(q, form_ref(form, 2), flows, tail)) ||
+           (form_length(form) > 3 &&
+            escapes(q, form_ref(form, 3), flows, tail));
+  }
+  if (ast_is_keyword(form, "begin", q->locals))
+    return escapes_body(q, form, 1, flows, tail);
+  if (ast_is_keyword(form, "cond", q->locals))
+    return escapes_cond(q, form, flows, tail);
+  if (ast_is_keyword(form, "let", q->locals) && form_length(form) >= 2)
+    return escapes_let(q, form, flows, tail);
+  /* Closures keep what they refer to, loops are not followed. */
+  if (ast_is_keyword(form, "lambda", q->locals) ||
+      ast_is_keyword(form, "do", q->locals))
+    return ast_mentions(node, q->name);
+  if (ast_is_keyword(form, "define", q->locals) ||
+      ast_is_keyword(form, "set!", q->locals)) {
+    AstNode *target = form_length(form) >= 2 ? form_ref(form, 1) : NULL;
+    if (target && target->kind == AST_PROC_CALL)
+      return ast_mentions(node, q->name);
+    return form_length(form) >= 3 && escapes(q, form_ref(form, 2), true, false);
+  }
+  return escapes_call(q, form, flows, tail);
+}
+
+static bool procedure_keeps_param(EscapeAnalysis *analysis,
+                                  EscapeProcedure *procedure, int index) {
+  AstProcCall *signature = procedure_signature(procedure);
+  EscapeQuery q;
+  bool kept;
+
+  q.analysis = analysis;
+  q.name = ast_ident_name(DatumGetPtr(vector_get(signature->args, index)));
+  q.locals = make_vector();
+  q.in_frame = false;
+  for (int i = 0; i < vector_len(signature->args); ++i)
+    push_local(q.locals, DatumGetPtr(vector_get(signature->args, i)));
+  kept = escapes_body(&q, procedure->form, 2, true, false);
+  free_vector(q.locals);
+  return kept;
+}
+
+/* Remembers (define (name params ...) body ...) if calls of it are known. */
+static void add_procedure(EscapeAnalysis *analysis, AstNode *node) {
+  AstProcCall *form, *signature;
+  EscapeProcedure *procedure;
+  const char *name;
+
+  if (!node || node->kind != AST_PROC_CALL)
+    return;
+  form = (AstProcCall *)node;
+  if (!ast_ident_name(form->callable) ||
+      strcmp(ast_ident_name(form->callable), "define") != 0 ||
+      form_length(form) < 3 || !form_ref(form, 1) ||
+      form_ref(form, 1)->kind != AST_PROC_CALL)
+    return;
+  signature = (AstProcCall *)form_ref(form, 1);
+  name = ast_ident_name(signature->callable);
+  /* Built-ins can be called before the definition replaces them. */
+  if (!name || names_count(analysis->assigned, name) != 1 ||
+      lookup_primitive(name) >= 0 || vector_len(signature->args) > 64)
+    return;
+  for (int i = 0; i < vector_len(signature->args); ++i) {
+    if (!ast_ident_name(DatumGetPtr(vector_get(signature->args, i))))
+      return;
+  }
+
+  procedure = malloc(sizeof(EscapeProcedure));
+  if (!procedure) {
+    raise_error("%s: OOM\n", __FUNCTION__);
+  }
+  procedure->name = name;
+  procedure->form = form;
+  procedure->kept_params = 0;
+  vector_append(analysis->procedures, PointerGetDatum(procedure));
+}
+
+EscapeAnalysis *analyze_escapes(Vector *program) {
+  EscapeAnalysis *analysis = malloc(sizeof(EscapeAnalysis));
+  bool changed = true;
+
+  if (!analysis) {
+    raise_error("%s: OOM\n", __FUNCTION__);
+  }
+  analysis->procedures = make_vector();
+  analysis->assigned = make_vector();
+  for (int i = 0; i < vector_len(program); ++i)
+    collect_assigned(analysis, DatumGetPtr(vector_get(program, i)));
+  for (int i = 0; i < vector_len(program); ++i)
+    add_procedure(analysis, DatumGetPtr(vector_get(program, i)));
+
+  /*
+   * Start out assuming no parameter is kept and give that up where the
+   * bodies show otherwise, until nothing changes. Recursive procedures
+   * passing their parameters on keep nothing unless some base case does.
+   */
+  while (changed) {
+    changed = false;
+    for (int i = 0; i < vector_len(analysis->procedures); ++i) {
+      EscapeProcedure *procedure =
+          DatumGetPtr(vector_get(analysis->procedures, i));
+      int num_params = vector_len(procedure_signature(procedure)->args);
+      for (int j = 0; j < num_params; ++j) {
+        if ((procedure->kept_params >> j) & 1 ||
+            !procedure_keeps_param(analysis, procedure, j))
+          continue;
+        procedure->kept_params |= (uint64_t)1 << j;
+        changed = true;
+      }
+    }
+  }
+  return analysis;
+}
+
+void free_escape_analysis(EscapeAnalysis *analysis) {
+  for (int i = 0; i < vector_len(analysis->procedures); ++i)
+    free(DatumGetPtr(vector_get(analysis->procedures, i)));
+  free_vector(analysis->procedures);
+  free_vector(analysis->assigned);
+  free(analysis);
+}
+
+bool escape_trusts_global(EscapeAnalysis *analysis, const char *name) {
+  return !names_contain(analysis->assigned, name);
+}
+
+bool escape_let_binding(EscapeAnalysis *analysis, AstProcCall *form,
+                        const char *name, Vector *locals, bool tail) {
+  AstProcCall *bindings = (AstProcCall *)form_ref(form, 1);
+  int outer_len = vector_len(locals);
+  EscapeQuery q;
+  bool escaped;
+
+  q.analysis = analysis;
+  q.name = name;
+  q.locals = locals;
+  q.in_frame = true;
+  for (int i = 0; i < form_length(bindings); ++i)
+    push_local(locals, ((AstProcCall *)form_ref(bindings, i))->callable);
+  /* The value of the let itself may go anywhere. */
+  escaped = escapes_body(&q, form, 2, true, tail);
+  pop_locals(locals, outer_len);
+  return escaped;
+}
+
+bool escape_call_arg(EscapeAnalysis *analysis, const char *callee, int argc,
+                     int index) {
+  return index >= 64 ||
+         global_arg_use(analysis, callee, argc, index) != ARG_INSPECTED;
+}
@@ -0,0 +1,346 @@
+#include "common.h"
+
+#include "ast.h"
+#include "fold.h"
+#include "primitive.h"
+#include "vector.h"
+
+typedef struct Folder {
+  /* Names (char *) bound by the enclosing lambdas and lets. */
+  Vector *locals;
+  /* Names (char *) that a define or set! assigns somewhere. */
+  Vector *assigned;
+} Folder;
+
+static AstNode *fold_expr(Folder *f, AstNode *node);
+
+static void collect_assigned(Folder *f, AstNode *node) {
+  AstProcCall *form;
+  AstNode *target;
+
+  if (!node || node->kind != AST_PROC_CALL)
+    return;
+  form = (AstProcCall *)node;
+  if (form_length(form) >= 2 && (ast_ident_name(form->callable) != NULL) &&
+      (strcmp(ast_ident_name(form->callable), "define") == 0 ||
+       strcmp(ast_ident_name(form->callable), "set!") == 0)) {
+    target = form_ref(form, 1);
+    if (target && target->kind == AST_PROC_CALL)
+      target = ((AstProcCall *)target)->callable;
+    if (ast_ident_name(target))
+      vector_append(f->assigned, CStringGetDatum(ast_ident_name(target)));
+  }
+  for (int i = 0; i < form_length(form); ++i)
+    collect_assigned(f, form_ref(form, i));
+}
+
+static void push_local(Folder *f, AstNode *name) {
+  if (ast_ident_name(name))
+    vector_append(f->locals, CStringGetDatum(ast_ident_name(name)));
+}
+
+static void pop_locals(Folder *f, int len) {
+  while (vector_len(f->locals) > len)
+    vector_delete(f->locals, vector_len(f->locals) - 1);
+}
+
+static void push_params(Folder *f, AstNode *params) {
+  if (params && params->kind == AST_PROC_CALL) {
+    AstProcCall *param_list = (AstProcCall *)params;
+    for (int i = 0; i < form_length(param_list); ++i)
+      push_local(f, form_ref(param_list, i));
+  } else {
+    push_local(f, params);
+  }
+}
+
+/* Folds form[start..] as a body, whose internal defines are locals. */
+static void fold_body(Folder *f, AstProcCall *form, int start) {
+  for (int i = start; i < form_length(form); ++i) {
+    AstNode *expr = form_ref(form, i);
+    AstProcCall *define;
+    AstNode *target;
+    if (!expr || expr->kind != AST_PROC_CALL)
+      continue;
+    define = (AstProcCall *)expr;
+    if (!ast_is_keyword(define, "define", f->locals) ||
+        form_length(define) < 2)
+      continue;
+    target = form_ref(define, 1);
+    if (target && target->kind == AST_PROC_CALL)
+      target = ((AstProcCall *)target)->callable;
+    push_local(f, target);
+  }
+  for (int i = start; i < form_length(form); ++i)
+    form_set(form, i, fold_expr(f, form_ref(form, i)));
+}
+
+/* Folds element i of each (name init ...) binding. */
+static void fold_bindings(Folder *f, AstProcCall *bindings, int i) {
+  for (int j = 0; j < form_length(bindings); ++j) {
+    AstNode *binding = form_ref(bindings, j);
+    if (binding && binding->kind == AST_PROC_CALL &&
+        i < form_length((AstProcCall *)binding))
+      form_set((AstProcCall *)binding, i,
+               fold_expr(f, form_ref((AstProcCall *)binding, i)));
+  }
+}
+
+static void push_bindings(Folder *f, AstProcCall *bindings) {
+  for (int i = 0; i < form_length(bindings); ++i) {
+    AstNode *binding = form_ref(bindings, i);
+    if (binding && binding->kind == AST_PROC_CALL)
+      push_local(f, ((AstProcCall *)binding)->callable);
+  }
+}
+
+static bool is_literal(AstNode *node) {
+  return node && (node->kind == AST_BOOL || node->kind == AST_NUMBER ||
+                  node->kind == AST_CHAR || node->kind == AST_QUOTE);
+}
+
+static bool literal_is_false(AstNode *node) {
+  return node->kind == AST_BOOL && !((AstBool *)node)->boolean;
+}
+
+/* Evaluates a built-in on literal arguments, NULL if it cannot. */
+static AstNode *fold_primitive(PrimitiveKind kind, AstProcCall *form) {
+  int argc = vector_len(form->args);
+  double args[argc > 0 ? argc : 1];
+  double acc;
+
+  if (kind == PRIM_NOT) {
+    if (argc != 1 || !is_literal(form_ref(form, 1)))
+      return NULL;
+    return make_ast_bool(literal_is_false(form_ref(form, 1)));
+  }
+
+  for (int i = 0; i < argc; ++i) {
+    AstNode *arg = form_ref(form, i + 1);
+    if (!arg || arg->kind != AST_NUMBER)
+      return NULL;
+    args[i] = ((AstNumber *)arg)->number;
+  }
+
+  switch (kind) {
+  case PRIM_ADD:
+  case PRIM_MUL:
+    acc = kind == PRIM_ADD ? 0 : 1;
+    for (int i = 0; i < argc; ++i)
+      acc = kind == PRIM_ADD ? acc + args[i] : acc * args[i];
+    return make_ast_number(acc);
+  case PRIM_SUB:
+  case PRIM_DIV:
+    if (argc == 0)
+      return NULL;
+    if (argc == 1)
+      return make_ast_number(kind == PRIM_SUB ? -args[0] : 1 / args[0]);
+    acc = args[0];
+    for (int i = 1; i < argc; ++i)
+      acc = kind == PRIM_SUB ? acc - args[i] : acc / args[i];
+    return make_ast_number(acc);
+  case PRIM_NUM_EQ:
+  case PRIM_LT:
+  case PRIM_GT:
+  case PRIM_LE:
+  case PRIM_GE:
+    if (argc != 2)
+      return NULL;
+    switch (kind) {
+    case PRIM_NUM_EQ:
+      return make_ast_bool(args[0] == args[1]);
+    case PRIM_LT:
+      return make_ast_bool(args[0] < args[1]);
+    case PRIM_GT:
+      return make_ast_bool(args[0] > args[1]);
+    case PRIM_LE:
+      return make_ast_bool(args[0] <= args[1]);
+    default:
+      return make_ast_bool(args[0] >= args[1]);
+    }
+  default:
+    return NULL;
+  }
+}
+
+static AstNode *fold_call(Folder *f, AstProcCall *form) {
+  const char *name = ast_ident_name(form->callable);
+  AstNode *folded;
+  int kind;
+
+  for (int i = 0; i < form_length(form); ++i)
+    form_set(form, i, fold_expr(f, form_ref(form, i)));
+
+  if (!name || names_contain(f->locals, name) ||
+      names_contain(f->assigned, name) || (kind = lookup_primitive(name)) < 0)
+    return (AstNode *)form;
+  if (!(folded = fold_primitive(kind, form)))
+    return (AstNode *)form;
+  folded->loc = form->base.loc;
+  free_ast_node((AstNode *)form);
+  return folded;
+}
+
+/* Replaces the form by one of its elements, freeing the rest. */
+static AstNode *take_form_ref(AstProcCall *form, int i) {
+  AstNode *node = form_ref(form, i);
+  form_set(form, i, NULL);
+  free_ast_node((AstNode *)form);
+  return node;
+}
+
+static AstNode *fold_if(Folder *f, AstProcCall *form) {
+  AstNode *test;
+
+  for (int i = 1; i < form_length(form); ++i)
+    form_set(form, i, fold_expr(f, form_ref(form, i)));
+  if (form_length(form) < 3 || form_length(form) > 4)
+    return (AstNode *)form;
+
+  test = form_ref(form, 1);
+  if (!is_literal(test))
+    return (AstNode *)form;
+  if (!literal_is_false(test))
+    return take_form_ref(form, 2);
+  if (form_length(form) == 4)
+    return take_form_ref(form, 3);
+  return (AstNode *)form;
+}
+
+static AstNode *fold_cond(Folder *f, AstProcCall *form) {
+  int i = 1;
+
+  while (i < form_length(form)) {
+    AstNode *clause_node = form_ref(form, i);
+    AstProcCall *clause;
+    AstNode *test;
+
+    if (!clause_node || clause_node->kind != AST_PROC_CALL)
+      return (AstNode *)form;
+    clause = (AstProcCall *)clause_node;
+    if (ast_ident_name(clause->callable) &&
+        strcmp(ast_ident_name(clause->callable), "else") == 0) {
+      fold_body(f, clause, 1);
+      break;
+    }
+
+    clause->callable = fold_expr(f, clause->callable);
+    for (int j = 1; j < form_length(clause); ++j)
+      form_set(clause, j, fold_expr(f, form_ref(clause, j)));
+    test = clause->callable;
+    if (is_literal(test) && literal_is_false(test)) {
+      /* The clause can never be taken. */
+      free_ast_node(clause_node);
+      vector_delete(form->args, i - 1);
+      continue;
+    }
+    if (is_literal(test) && form_length(clause) > 1) {
+      /* Always taken, it becomes the else clause. */
+      clause->callable = make_ast_ident("else");
+      clause->callable->loc = test->loc;
+      free_ast_node(test);
+      while (form_length(form) > i + 1) {
+        free_ast_node(form_ref(form, i + 1));
+        vector_delete(form->args, i);
+      }
+      break;
+    }
+    ++i;
+  }
+  return (AstNode *)form;
+}
+
+static AstNode *fold_expr(Folder *f, AstNode *node) {
+  AstProcCall *form;
+  int outer_len = vector_len(f->locals);
+
+  if (!node || node->kind != AST_PROC_CALL)
+    return node;
+  form = (AstProcCall *)node;
+
+  if (ast_is_keyword(form, "quote", f->locals))
+    return node;
+
+  if (ast_is_keyword(form, "lambda", f->locals) && form_length(form) >= 2) {
+    push_params(f, form_ref(form, 1));
+    fold_body(f, form, 2);
+    pop_locals(f, outer_len);
+    return node;
+  }
+
+  if (ast_is_keyword(form, "define", f->locals) && form_length(form) >= 2) {
+    AstNode *target = form_ref(form, 1);
+    if (target && target->kind == AST_PROC_CALL) {
+      /* (define (name params ...) body ...) */
+      push_params(f, target);
+      fold_body(f, form, 2);
+      pop_locals(f, outer_len);
+    } else {
+      for (int i = 2; i < form_length(form); ++i)
+        form_set(form, i, fold_expr(f, form_ref(form, i)));
+    }
+    return node;
+  }
+
+  if (ast_is_keyword(form, "let", f->locals) && form_length(form) >= 2) {
+    /* (let name ((var init) ...) body ...) binds name in the body too. */
+    int bindings_at = ast_ident_name(form_ref(form, 1)) ? 2 : 1;
+    AstNode *bindings_node =
+        bindings_at < form_length(form) ? form_ref(form, bindings_at) : NULL;
+    AstProcCall *bindings;
+    if (!bindings_node || bindings_node->kind != AST_PROC_CALL)
+      return node;
+    bindings = (AstProcCall *)bindings_node;
+    fold_bindings(f, bindings, 1);
+    if (bindings_at == 2)
+      push_local(f, form_ref(form, 1));
+    push_bindings(f, bindings);
+    fold_body(f, form, bindings_at + 1);
+    pop_locals(f, outer_len);
+    return node;
+  }
+
+  if (ast_is_keyword(form, "do", f->locals) && form_length(form) >= 3) {
+    /* (do ((var init step) ...) (test expr ...) body ...) */
+    AstNode *specs_node = form_ref(form, 1);
+    if (specs_node && specs_node->kind != AST_PROC_CALL)
+      return node;
+    if (specs_node) {
+      fold_bindings(f, (AstProcCall *)specs_node, 1);
+      push_bindings(f, (AstProcCall *)specs_node);
+      fold_bindings(f, (AstProcCall *)specs_node, 2);
+    }
+    for (int i = 2; i < form_length(form); ++i)
+      form_set(form, i, fold_expr(f, form_ref(form, i)));
+    pop_locals(f, outer_len);
+    return node;
+  }
+
+  if (ast_is_keyword(form, "if", f->locals))
+    return fold_if(f, form);
+  if (ast_is_keyword(form, "cond", f->locals))
+    return fold_cond(f, form);
+  if (ast_is_keyword(form, "set!", f->locals) ||
+      ast_is_keyword(form, "begin", f->locals)) {
+    for (int i = 1; i < form_length(form); ++i)
+      form_set(form, i, fold_expr(f, form_ref(form, i)));
+    return node;
+  }
+  return fold_call(f, form);
+}
+
+void fold_constants(Vector *program) {
+  Folder f;
+  f.locals = make_vector();
+  f.assigned = make_vector();
+
+  for (int i = 0; i < vector_len(program); ++i)
+    collect_assigned(&f, DatumGetPtr(vector_get(program, i)));
+  for (int i = 0; i < vector_len(program); ++i) {
+    AstNode *expr = DatumGetPtr(vector_get(program, i));
+    vector_set(program, i, PointerGetDatum(fold_expr(&f, expr)));
+  }
+
+  free_vector(f.locals);
+  free_vector(f.assigned);
+}
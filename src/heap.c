@@ -0,0 +1,182 @@
+#include "common.h"
+
+#include "error_handler.h"
+#include "heap.h"
+#include "object.h"
+#include "vector.h"
+
+static void *heap_alloc_pages(size_t size) {
+  void *pages = aligned_alloc(HEAP_PAGE_SIZE, size);
+  if (!pages) {
+    raise_error("%s: OOM!\n", __FUNCTION__);
+  }
+  return pages;
+}
+
+Heap *make_heap(void) {
+  Heap *heap = (Heap *)malloc(sizeof(Heap));
+  heap->pair_cursor = NULL;
+  heap->pair_limit = NULL;
+  heap->pair_slabs = NULL;
+  heap->num_pair_slabs = 0;
+  heap->num_pairs = 0;
+
+  for (int i = 0; i < HEAP_NUM_SIZE_CLASSES; ++i) {
+    SizeClass *size_class = &heap->size_classes[i];
+    if (i < HEAP_NUM_SMALL_STEPS)
+      size_class->block_size = (i + 1) * HEAP_ALIGNMENT;
+    else
+      size_class->block_size = 256 << (i - HEAP_NUM_SMALL_STEPS);
+    size_class->cursor = NULL;
+    size_class->limit = NULL;
+    size_class->free_list = NULL;
+    size_class->slabs = NULL;
+    size_class->num_slabs = 0;
+    size_class->num_allocs = 0;
+    size_class->num_frees = 0;
+  }
+  heap->large_blocks = NULL;
+  heap->num_large_allocs = 0;
+  heap->num_large_frees = 0;
+  heap->large_bytes = 0;
+
+  heap->symbols = make_vector();
+  return heap;
+}
+
+void free_heap(Heap *heap) {
+  PairSlab *pair_slab = heap->pair_slabs;
+  LargeBlock *large_block = heap->large_blocks;
+
+  while (pair_slab) {
+    PairSlab *next = pair_slab->next;
+    free(pair_slab);
+    pair_slab = next;
+  }
+
+  for (int i = 0; i < HEAP_NUM_SIZE_CLASSES; ++i) {
+    HeapSlab *slab = heap->size_classes[i].slabs;
+    while (slab) {
+      HeapSlab *next = slab->next;
+      free(slab);
+      slab = next;
+    }
+  }
+
+  while (large_block) {
+    LargeBlock *next = large_block->next;
+    free(large_block);
+    large_block = next;
+  }
+
+  /* Symbol names live in the size classes. */
+  free_vector(heap->symbols);
+  free(heap);
+}
+
+Pair *heap_alloc_pair_slow(Heap *heap) {
+  PairSlab *slab = (PairSlab *)heap_alloc_pages(HEAP_PAIR_SLAB_SIZE);
+  slab->next = heap->pair_slabs;
+  heap->pair_slabs = slab;
+  heap->num_pair_slabs += 1;
+  heap->pair_cursor = &slab->cells[0];
+  heap->pair_limit = &slab->cells[HEAP_PAIRS_PER_SLAB];
+  ++heap->num_pairs;
+  return heap->pair_cursor++;
+}
+
+void *heap_alloc_slow(SizeClass *size_class) {
+  HeapSlab *slab = (HeapSlab *)heap_alloc_pages(HEAP_SLAB_SIZE);
+  size_t num_blocks =
+      (HEAP_SLAB_SIZE - sizeof(HeapSlab)) / size_class->block_size;
+
+  slab->next = size_class->slabs;
+  size_class->slabs = slab;
+  size_class->num_slabs += 1;
+  size_class->cursor = slab->blocks + size_class->block_size;
+  size_class->limit = slab->blocks + num_blocks * size_class->block_size;
+  return slab->blocks;
+}
+
+void *heap_alloc_large(Heap *heap, size_t size) {
+  LargeBlock *block = (LargeBlock *)malloc(sizeof(LargeBlock) + size);
+  if (!block) {
+    raise_error("%s: OOM!\n", __FUNCTION__);
+  }
+  block->size = size;
+  block->prev = NULL;
+  block->next = heap->large_blocks;
+  if (heap->large_blocks)
+    heap->large_blocks->prev = block;
+  heap->large_blocks = block;
+  heap->num_large_allocs += 1;
+  heap->large_bytes += size;
+  return block->data;
+}
+
+void heap_free_large(Heap *heap, void *ptr) {
+  LargeBlock *block = (LargeBlock *)((uint8_t *)ptr - sizeof(LargeBlock));
+  if (block->prev)
+    block->prev->next = block->next;
+  else
+    heap->large_blocks = block->next;
+  if (block->next)
+    block->next->prev = block->prev;
+  heap->num_large_frees += 1;
+  heap->large_bytes -= block->size;
+  free(block);
+}
+
+char *heap_strdup(Heap *heap, const char *str) {
+  size_t len = strlen(str);
+  char *copy = (char *)heap_alloc(heap, len + 1);
+  memcpy(copy, str, len + 1);
+  return copy;
+}
+
+const char *heap_intern_symbol(Heap *heap, const char *name) {
+  int len = vector_len(heap->symbols);
+  char *symbol;
+  for (int i = 0; i < len; ++i) {
+    symbol = DatumGetCString(vector_get(heap->symbols, i));
+    if (strcmp(symbol, name) == 0)
+      return symbol;
+  }
+  symbol = heap_strdup(heap, name);
+  vector_append(heap->symbols, CStringGetDatum(symbol));
+  return symbol;
+}
+
+void heap_dump_stats(FILE *output_file, Heap *heap) {
+  uint64_t total_slab_bytes = heap->num_pair_slabs * HEAP_PAIR_SLAB_SIZE;
+
+  fprintf(output_file, "%-8s %8s %8s %12s %12s %12s\n", "class", "size",
+          "slabs", "allocs", "frees", "live");
+  fprintf(output_file, "%-8s %8zu %8llu %12llu %12d %12llu\n", "pair",
+          sizeof(Pair), (unsigned long long)heap->num_pair_slabs,
+          (unsigned long long)heap->num_pairs, 0,
+          (unsigned long long)heap->num_pairs);
+
+  for (int i = 0; i < HEAP_NUM_SIZE_CLASSES; ++i) {
+    SizeClass *size_class = &heap->size_classes[i];
+    if (size_class->num_allocs == 0)
+      continue;
+    total_slab_bytes += size_class->num_slabs * HEAP_SLAB_SIZE;
+    fprintf(output_file, "%-8d %8u %8llu %12llu %12llu %12llu\n", i,
+            size_class->block_size,
+            (unsigned long long)size_class->num_slabs,
+            (unsigned long long)size_class->num_allocs,
+            (unsigned long long)size_class->num_frees,
+            (unsigned long long)(size_class->num_allocs -
+                                 size_class->num_frees));
+  }
+
+  fprintf(output_file, "%-8s %8s %8s %12llu %12llu %12llu\n", "large", "-",
+          "-", (unsigned long long)heap->num_large_allocs,
+          (unsigned long long)heap->num_large_frees,
+          (unsigned long long)(heap->num_large_allocs -
+                               heap->num_large_frees));
+  fprintf(output_file, "slab bytes: %llu, large bytes: %llu\n",
+          (unsigned long long)total_slab_bytes,
+          (unsigned long long)heap->large_bytes);
+}
@@ -0,0 +1,81 @@
+#include <assert.h>
+
+#include "common.h"
+#include "heap.h"
+#include "object.h"
+
+int main() {
+  Heap *heap = make_heap();
+  Object list = NIL_OBJECT;
+  Object reversed, appended;
+  Pair *first, *second;
+
+  /* Pairs are two objects wide and packed back to back. */
+  assert(sizeof(Pair) == 2 * sizeof(Object));
+  first = heap_alloc_pair(heap);
+  second = heap_alloc_pair(heap);
+  assert(second == first + 1);
+
+  for (int i = 0; i < 10000; ++i)
+    list = make_pair(heap, FloatGetObject(i), list);
+  assert(list_length(list) == 10000);
+  assert(heap->num_pairs == 10002);
+  assert(heap->num_pair_slabs ==
+         (10002 + HEAP_PAIRS_PER_SLAB - 1) / HEAP_PAIRS_PER_SLAB);
+
+  reversed = list_reverse(heap, list);
+  assert(DatumGetFloat(ObjectGetPair(reversed)->car.value) == 0);
+  assert(DatumGetFloat(ObjectGetPair(list)->car.value) == 9999);
+
+  appended = list_append(heap, reversed, list);
+  assert(list_length(appended) == 20000);
+  /* The last argument is shared, not copied. */
+  for (int i = 0; i < 10000; ++i)
+    appended = ObjectGetPair(appended)->cdr;
+  assert(appended.value == list.value);
+  assert(list_append(heap, NIL_OBJECT, list).value == list.value);
+
+  assert(heap_intern_symbol(heap, "foo") == heap_intern_symbol(heap, "foo"));
+
+  /* Small requests are rounded up to their size class. */
+  assert(heap_size_class_index(1) == 0);
+  assert(heap_size_class_index(16) == 0);
+  assert(heap_size_class_index(17) == 1);
+  assert(heap_size_class_index(128) == 7);
+  assert(heap_size_class_index(129) == 8);
+  assert(heap_size_class_index(256) == 8);
+  assert(heap_size_class_index(257) == 9);
+  assert(heap_size_class_index(HEAP_MAX_SMALL_SIZE) ==
+         HEAP_NUM_SIZE_CLASSES - 1);
+  for (int i = 0; i < HEAP_NUM_SIZE_CLASSES; ++i) {
+    uint32_t block_size = heap->size_classes[i].block_size;
+    assert(heap_size_class_index(block_size) == i);
+    assert(block_size % HEAP_ALIGNMENT == 0);
+  }
+
+  {
+    void *a = heap_alloc(heap, 40);
+    void *b = heap_alloc(heap, 48);
+    void *large;
+    /* Both land in the 48-byte class, side by side. */
+    assert((uint8_t *)b - (uint8_t *)a == 48);
+    assert((uintptr_t)a % HEAP_ALIGNMENT == 0);
+    /* Freed blocks are reused first. */
+    heap_free(heap, a, 40);
+    assert(heap_alloc(heap, 33) == a);
+
+    large = heap_alloc(heap, HEAP_MAX_SMALL_SIZE + 1);
+    assert((uintptr_t)large % HEAP_ALIGNMENT == 0);
+    assert(heap->large_bytes == HEAP_MAX_SMALL_SIZE + 1);
+    heap_free(heap, large, HEAP_MAX_SMALL_SIZE + 1);
+    assert(heap->large_blocks == NULL);
+  }
+
+  /* A slab is filled before another one is requested. */
+  for (int i = 0; i < 10000; ++i)
+    heap_alloc(heap, 64);
+  assert(heap->size_classes[3].num_slabs ==
+         (10000 + (HEAP_SLAB_SIZE - sizeof(HeapSlab)) / 64 - 1) /
+             ((HEAP_SLAB_SIZE - sizeof(HeapSlab)) / 64));
+  free_heap(heap);
+}
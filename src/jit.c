@@ -0,0 +1,435 @@
+#include "common.h"
+
+#include "bytecode.h"
+#include "error_handler.h"
+#include "jit.h"
+#include "primitive.h"
+#include "vm.h"
+
+#include <stddef.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#if defined(__x86_64__)
+
+/*
+ * Register assignment of the generated code:
+ *   rbx  &VM::stack[VM::stack_pointer], the next free stack slot
+ *   r12  &VM::stack[frame->base_pointer], the locals
+ *   r13  the VM
+ *   r14  the frame
+ * All four are callee-saved, so they survive the calls into C.
+ */
+
+typedef struct JitFixup {
+  int position; /* Of the rel32 to patch. */
+  int target;   /* A bytecode offset, or -1 for the exit. */
+} JitFixup;
+
+typedef struct JitAssembler {
+  Instructions *code;
+  JitFixup *fixups;
+  int num_fixups;
+  int max_fixups;
+} JitAssembler;
+
+#define EMIT(as, ...)                                                          \
+  jit_emit_bytes((as), (const uint8_t[]){__VA_ARGS__},                         \
+                 sizeof((const uint8_t[]){__VA_ARGS__}))
+
+static void jit_emit_bytes(JitAssembler *as, const uint8_t *bytes, int n) {
+  for (int i = 0; i < n; ++i)
+    instructions_append(as->code, bytes[i]);
+}
+
+static void jit_emit32(JitAssembler *as, uint32_t value) {
+  for (int i = 0; i < 4; ++i)
+    instructions_append(as->code, (uint8_t)(value >> (8 * i)));
+}
+
+static void jit_emit64(JitAssembler *as, uint64_t value) {
+  for (int i = 0; i < 8; ++i)
+    instructions_append(as->code, (uint8_t)(value >> (8 * i)));
+}
+
+static inline int jit_position(JitAssembler *as) {
+  return instructions_len(as->code);
+}
+
+/* Emits a zero rel32 and returns its position for jit_patch_here. */
+static int jit_emit_rel32(JitAssembler *as) {
+  int position = jit_position(as);
+  jit_emit32(as, 0);
+  return position;
+}
+
+/* Points the rel32 at position to the current position. */
+static void jit_patch_here(JitAssembler *as, int position) {
+  uint8_t *code = instructions_data(as->code);
+  int32_t rel = jit_position(as) - (position + 4);
+  memcpy(&code[position], &rel, sizeof(rel));
+}
+
+/* Emits a rel32 resolved once the whole function has been translated. */
+static void jit_emit_fixup(JitAssembler *as, int target) {
+  if (as->num_fixups == as->max_fixups) {
+    JitFixup *fixups =
+        realloc(as->fixups, 2 * as->max_fixups * sizeof(JitFixup));
+    if (!fixups) {
+      raise_error("%s: OOM\n", __FUNCTION__);
+    }
+    as->fixups = fixups;
+    as->max_fixups *= 2;
+  }
+  as->fixups[as->num_fixups].position = jit_emit_rel32(as);
+  as->fixups[as->num_fixups].target = target;
+  ++as->num_fixups;
+}
+
+/* jne to the exit, which returns rax to the interpreter. */
+static void jit_emit_jne_exit(JitAssembler *as) {
+  EMIT(as, 0x0f, 0x85);
+  jit_emit_fixup(as, -1);
+}
+
+/* mov rax, [r13 + offset] */
+static void jit_emit_load_vm_field(JitAssembler *as, size_t offset) {
+  EMIT(as, 0x49, 0x8b, 0x85);
+  jit_emit32(as, (uint32_t)offset);
+}
+
+/* rbx = &vm->stack[vm->stack_pointer] */
+static void jit_emit_load_stack_pointer(JitAssembler *as) {
+  jit_emit_load_vm_field(as, offsetof(VM, stack));
+  EMIT(as, 0x41, 0x8b, 0x8d); /* mov ecx, [r13 + stack_pointer] */
+  jit_emit32(as, offsetof(VM, stack_pointer));
+  EMIT(as, 0x48, 0xc1, 0xe1, 0x04); /* shl rcx, 4 */
+  EMIT(as, 0x48, 0x8d, 0x1c, 0x08); /* lea rbx, [rax + rcx] */
+}
+
+/* vm->stack_pointer = rbx - vm->stack */
+static void jit_emit_store_stack_pointer(JitAssembler *as) {
+  jit_emit_load_vm_field(as, offsetof(VM, stack));
+  EMIT(as, 0x48, 0x89, 0xd9);       /* mov rcx, rbx */
+  EMIT(as, 0x48, 0x29, 0xc1);       /* sub rcx, rax */
+  EMIT(as, 0x48, 0xc1, 0xe9, 0x04); /* shr rcx, 4 */
+  EMIT(as, 0x41, 0x89, 0x8d);       /* mov [r13 + stack_pointer], ecx */
+  jit_emit32(as, offsetof(VM, stack_pointer));
+}
+
+static void jit_emit_prologue(JitAssembler *as) {
+  /* Five pushes keep rsp 16-byte aligned for the calls into C. */
+  EMIT(as, 0x53);             /* push rbx */
+  EMIT(as, 0x41, 0x54);       /* push r12 */
+  EMIT(as, 0x41, 0x55);       /* push r13 */
+  EMIT(as, 0x41, 0x56);       /* push r14 */
+  EMIT(as, 0x41, 0x57);       /* push r15 */
+  EMIT(as, 0x49, 0x89, 0xfd); /* mov r13, rdi */
+  EMIT(as, 0x49, 0x89, 0xf6); /* mov r14, rsi */
+  jit_emit_load_vm_field(as, offsetof(VM, stack));
+  EMIT(as, 0x41, 0x8b, 0x8e); /* mov ecx, [r14 + base_pointer] */
+  jit_emit32(as, offsetof(Frame, base_pointer));
+  EMIT(as, 0x48, 0xc1, 0xe1, 0x04); /* shl rcx, 4 */
+  EMIT(as, 0x4c, 0x8d, 0x24, 0x08); /* lea r12, [rax + rcx] */
+  jit_emit_load_stack_pointer(as);
+  EMIT(as, 0xff, 0xe2); /* jmp rdx */
+}
+
+static void jit_emit_epilogue(JitAssembler *as) {
+  EMIT(as, 0x41, 0x5f); /* pop r15 */
+  EMIT(as, 0x41, 0x5e); /* pop r14 */
+  EMIT(as, 0x41, 0x5d); /* pop r13 */
+  EMIT(as, 0x41, 0x5c); /* pop r12 */
+  EMIT(as, 0x5b);       /* pop rbx */
+  EMIT(as, 0xc3);       /* ret */
+}
+
+/*
+ * Runs the instruction at ip through jit_step. Generated code carries on
+ * with the next instruction if the frame is still the same and its ip moved
+ * just past this one, otherwise it leaves with the frame to continue.
+ */
+static void jit_emit_step(JitAssembler *as, uint8_t *ip) {
+  jit_emit_store_stack_pointer(as);
+  EMIT(as, 0x4c, 0x89, 0xef); /* mov rdi, r13 */
+  EMIT(as, 0x4c, 0x89, 0xf6); /* mov rsi, r14 */
+  EMIT(as, 0x48, 0xba);       /* mov rdx, ip */
+  jit_emit64(as, (uint64_t)(uintptr_t)ip);
+  EMIT(as, 0x48, 0xb8); /* mov rax, jit_step */
+  jit_emit64(as, (uint64_t)(uintptr_t)jit_step);
+  EMIT(as, 0xff, 0xd0);       /* call rax */
+  EMIT(as, 0x4c, 0x39, 0xf0); /* cmp rax, r14 */
+  jit_emit_jne_exit(as);
+  EMIT(as, 0x48, 0xb9); /* mov rcx, ip + length */
+  jit_emit64(as, (uint64_t)(uintptr_t)(ip + instruction_length(ip)));
+  EMIT(as, 0x49, 0x39, 0x8e); /* cmp [r14 + ip], rcx */
+  jit_emit32(as, offsetof(Frame, ip));
+  jit_emit_jne_exit(as);
+  jit_emit_load_stack_pointer(as);
+}
+
+static void jit_emit_constant(JitAssembler *as, Object constant) {
+  EMIT(as, 0xc7, 0x03); /* mov dword [rbx], type */
+  jit_emit32(as, (uint32_t)constant.type);
+  EMIT(as, 0x48, 0xb8); /* mov rax, value */
+  jit_emit64(as, (uint64_t)constant.value);
+  EMIT(as, 0x48, 0x89, 0x43, 0x08); /* mov [rbx + 8], rax */
+  EMIT(as, 0x48, 0x83, 0xc3, 0x10); /* add rbx, 16 */
+}
+
+static void jit_emit_get_local(JitAssembler *as, uint8_t slot) {
+  EMIT(as, 0xf3, 0x41, 0x0f, 0x6f, 0x84, 0x24); /* movdqu xmm0, [r12 + d] */
+  jit_emit32(as, slot * sizeof(Object));
+  EMIT(as, 0xf3, 0x0f, 0x7f, 0x03);             /* movdqu [rbx], xmm0 */
+  EMIT(as, 0x48, 0x83, 0xc3, 0x10);             /* add rbx, 16 */
+}
+
+static void jit_emit_set_local(JitAssembler *as, uint8_t slot) {
+  EMIT(as, 0xf3, 0x0f, 0x6f, 0x43, 0xf0);       /* movdqu xmm0, [rbx - 16] */
+  EMIT(as, 0xf3, 0x41, 0x0f, 0x7f, 0x84, 0x24); /* movdqu [r12 + d], xmm0 */
+  jit_emit32(as, slot * sizeof(Object));
+}
+
+static void jit_emit_jump_if_false(JitAssembler *as, int target) {
+  EMIT(as, 0x48, 0x83, 0xeb, 0x10); /* sub rbx, 16 */
+  EMIT(as, 0x83, 0x3b, OBJ_BOOL);   /* cmp dword [rbx], OBJ_BOOL */
+  EMIT(as, 0x75, 0x0b);             /* jne past the je */
+  EMIT(as, 0x48, 0x83, 0x7b, 0x08, 0x00); /* cmp qword [rbx + 8], 0 */
+  EMIT(as, 0x0f, 0x84);                   /* je target */
+  jit_emit_fixup(as, target);
+}
+
+/*
+ * Arithmetic and comparisons on two numbers run inline as long as the
+ * primitive has not been redefined, anything else takes jit_step.
+ */
+static void jit_emit_number_op(JitAssembler *as, uint8_t *ip) {
+  OpCode op = generic_opcode(*ip);
+  int slow[3], done;
+
+  EMIT(as, 0x83, 0x7b, 0xe0, OBJ_NUMBER); /* cmp dword [rbx - 32], number */
+  EMIT(as, 0x0f, 0x85);
+  slow[0] = jit_emit_rel32(as);
+  EMIT(as, 0x83, 0x7b, 0xf0, OBJ_NUMBER); /* cmp dword [rbx - 16], number */
+  EMIT(as, 0x0f, 0x85);
+  slow[1] = jit_emit_rel32(as);
+  jit_emit_load_vm_field(as, offsetof(VM, redefined_primitives));
+  EMIT(as, 0x48, 0x0f, 0xba, 0xe0, inline_op_primitive(op)); /* bt rax, k */
+  EMIT(as, 0x0f, 0x82);                                      /* jc slow */
+  slow[2] = jit_emit_rel32(as);
+
+  switch (op) {
+  case OP_ADD:
+  case OP_SUB:
+  case OP_MUL:
+  case OP_DIV: {
+    static const uint8_t sse_op[] = {0x58, 0x5c, 0x59, 0x5e};
+    EMIT(as, 0xf2, 0x0f, 0x10, 0x43, 0xe8); /* movsd xmm0, [rbx - 24] */
+    EMIT(as, 0xf2, 0x0f, sse_op[op - OP_ADD], 0x43, 0xf8); /* op [rbx - 8] */
+    EMIT(as, 0xf2, 0x0f, 0x11, 0x43, 0xe8); /* movsd [rbx - 24], xmm0 */
+    break;
+  }
+  default: {
+    /*
+     * ucomisd reports unordered operands as "below" and "equal", < and <=
+     * compare the other way round so that NaN compares false like in C.
+     */
+    bool swap = op == OP_LT || op == OP_LE;
+    EMIT(as, 0xf2, 0x0f, 0x10, 0x43, swap ? 0xf8 : 0xe8); /* movsd xmm0 */
+    EMIT(as, 0x66, 0x0f, 0x2e, 0x43, swap ? 0xe8 : 0xf8); /* ucomisd xmm0 */
+    switch (op) {
+    case OP_NUM_EQ:
+      EMIT(as, 0x0f, 0x94, 0xc0); /* sete al */
+      EMIT(as, 0x0f, 0x9b, 0xc1); /* setnp cl */
+      EMIT(as, 0x20, 0xc8);       /* and al, cl */
+      break;
+    case OP_LT:
+    case OP_GT:
+      EMIT(as, 0x0f, 0x97, 0xc0); /* seta al */
+      break;
+    default:
+      EMIT(as, 0x0f, 0x93, 0xc0); /* setae al */
+      break;
+    }
+    EMIT(as, 0x0f, 0xb6, 0xc0);       /* movzx eax, al */
+    EMIT(as, 0x48, 0x89, 0x43, 0xe8); /* mov [rbx - 24], rax */
+    EMIT(as, 0xc7, 0x43, 0xe0);       /* mov dword [rbx - 32], OBJ_BOOL */
+    jit_emit32(as, OBJ_BOOL);
+    break;
+  }
+  }
+  EMIT(as, 0x48, 0x83, 0xeb, 0x10); /* sub rbx, 16 */
+  EMIT(as, 0xe9);                   /* jmp done */
+  done = jit_emit_rel32(as);
+
+  for (int i = 0; i < 3; ++i)
+    jit_patch_here(as, slow[i]);
+  jit_emit_step(as, ip);
+  jit_patch_here(as, done);
+}
+
+static void jit_translate(VM *vm, JitAssembler *as, CompiledFunction *fn,
+                          int *offsets) {
+  uint8_t *code = instructions_data(fn->instructions);
+  int len = instructions_len(fn->instructions);
+
+  jit_emit_prologue(as);
+  for (int offset = 0; offset < len;
+       offset += instruction_length(&code[offset])) {
+    uint8_t *ip = &code[offset];
+    offsets[offset] = jit_position(as);
+    /* Specialized sites get the generic template, it has guards of its own. */
+    switch (generic_opcode(*ip)) {
+    case OP_CONSTANT:
+      jit_emit_constant(as, objects_pool_get(vm->constants,
+                                             read_uint16(ip + 1)));
+      break;
+    case OP_POP:
+      EMIT(as, 0x48, 0x83, 0xeb, 0x10); /* sub rbx, 16 */
+      break;
+    case OP_GET_LOCAL:
+      jit_emit_get_local(as, ip[1]);
+      break;
+    case OP_SET_LOCAL:
+      jit_emit_set_local(as, ip[1]);
+      break;
+    case OP_JUMP:
+      EMIT(as, 0xe9);
+      jit_emit_fixup(as, read_uint16(ip + 1));
+      break;
+    case OP_JUMP_IF_FALSE:
+      jit_emit_jump_if_false(as, read_uint16(ip + 1));
+      break;
+    case OP_ADD:
+    case OP_SUB:
+    case OP_MUL:
+    case OP_DIV:
+    case OP_NUM_EQ:
+    case OP_LT:
+    case OP_GT:
+    case OP_LE:
+    case OP_GE:
+      jit_emit_number_op(as, ip);
+      break;
+    default:
+      jit_emit_step(as, ip);
+      break;
+    }
+  }
+
+  /* The exit, jumped to with the frame to continue in rax. */
+  for (int i = 0; i < as->num_fixups; ++i) {
+    if (as->fixups[i].target < 0)
+      jit_patch_here(as, as->fixups[i].position);
+  }
+  jit_emit_epilogue(as);
+
+  for (int i = 0; i < as->num_fixups; ++i) {
+    int position = as->fixups[i].position;
+    int32_t rel;
+    if (as->fixups[i].target < 0)
+      continue;
+    rel = offsets[as->fixups[i].target] - (position + 4);
+    memcpy(&instructions_data(as->code)[position], &rel, sizeof(rel));
+  }
+}
+
+bool jit_supported(void) {
+  return true;
+}
+
+bool jit_compile_function(VM *vm, CompiledFunction *fn) {
+  uint8_t *bytecode = instructions_data(fn->instructions);
+  int len = instructions_len(fn->instructions);
+  size_t page_size = sysconf(_SC_PAGESIZE);
+  JitAssembler as;
+  JitCode *jit;
+  void **resume_points;
+  int *offsets;
+  size_t size;
+  uint8_t *code;
+
+  as.code = make_instructions();
+  as.num_fixups = 0;
+  as.max_fixups = 16;
+  as.fixups = malloc(as.max_fixups * sizeof(JitFixup));
+  offsets = malloc(len * sizeof(int));
+  if (!as.fixups || !offsets) {
+    raise_error("%s: OOM\n", __FUNCTION__);
+  }
+  jit_translate(vm, &as, fn, offsets);
+
+  size = (instructions_len(as.code) + page_size - 1) / page_size * page_size;
+  code = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+              -1, 0);
+  if (code == MAP_FAILED) {
+    free(offsets);
+    free(as.fixups);
+    free_instructions(as.code);
+    return false;
+  }
+  memcpy(code, instructions_data(as.code), instructions_len(as.code));
+  free(as.fixups);
+  free_instructions(as.code);
+  if (mprotect(code, size, PROT_READ | PROT_EXEC) != 0) {
+    munmap(code, size);
+    free(offsets);
+    raise_error("%s: cannot make the generated code executable %m\n",
+                __FUNCTION__);
+  }
+
+  jit = malloc(sizeof(JitCode));
+  resume_points = malloc(len * sizeof(void *));
+  if (!jit || !resume_points) {
+    munmap(code, size);
+    free(offsets);
+    free(jit);
+    free(resume_points);
+    raise_error("%s: OOM\n", __FUNCTION__);
+  }
+  jit->code = code;
+  jit->size = size;
+  jit->entry = (JitEntry)code;
+  jit->resume_points = resume_points;
+  for (int offset = 0; offset < len;
+       offset += instruction_length(&bytecode[offset]))
+    jit->resume_points[offset] = code + offsets[offset];
+  fn->jit_code = jit;
+
+  free(offsets);
+  return true;
+}
+
+void jit_free_function(CompiledFunction *fn) {
+  if (!fn->jit_code)
+    return;
+  munmap(fn->jit_code->code, fn->jit_code->size);
+  free(fn->jit_code->resume_points);
+  free(fn->jit_code);
+  fn->jit_code = NULL;
+}
+
+Frame *jit_enter(VM *vm, Frame *frame) {
+  JitCode *jit = frame->fn->jit_code;
+  int offset = frame->ip - instructions_data(frame->fn->instructions);
+  return jit->entry(vm, frame, jit->resume_points[offset]);
+}
+
+#else
+
+bool jit_supported(void) {
+  return false;
+}
+
+bool jit_compile_function(VM *vm, CompiledFunction *fn) {
+  return false;
+}
+
+void jit_free_function(CompiledFunction *fn) {
+}
+
+Frame *jit_enter(VM *vm, Frame *frame) {
+  raise_error("%s: no JIT for this architecture\n", __FUNCTION__);
+}
+
+#endif
@@ -0,0 +1,150 @@
+#include "common.h"
+
+#include "error_handler.h"
+#include "linetable.h"
+
+VECTOR_GENERATE_TYPE_NAME_IMPL(LineEntry, LineEntries, line_entries);
+
+/* The most bytes a uint32_t takes as a varint. */
+#define VARINT_MAX_LENGTH 5
+
+static uint8_t *write_varint(uint8_t *p, uint32_t val) {
+  while (val >= 0x80) {
+    *p++ = (val & 0x7f) | 0x80;
+    val >>= 7;
+  }
+  *p++ = val;
+  return p;
+}
+
+static const uint8_t *read_varint(const uint8_t *p, uint32_t *val) {
+  int shift = 0;
+
+  *val = 0;
+  do {
+    *val |= (uint32_t)(*p & 0x7f) << shift;
+    shift += 7;
+  } while (*p++ & 0x80);
+  return p;
+}
+
+/* Small deltas of either sign become small unsigned numbers. */
+static inline uint32_t zigzag_encode(uint32_t delta) {
+  return (delta << 1) ^ -(delta >> 31);
+}
+
+static inline uint32_t zigzag_decode(uint32_t val) {
+  return (val >> 1) ^ -(val & 1);
+}
+
+static const uint8_t *read_entry(const uint8_t *p, LineEntry *entry) {
+  uint32_t delta;
+
+  p = read_varint(p, &delta);
+  entry->offset += delta;
+  p = read_varint(p, &delta);
+  entry->line += zigzag_decode(delta);
+  p = read_varint(p, &delta);
+  entry->column += zigzag_decode(delta);
+  return p;
+}
+
+static void *checked_malloc(size_t size, const char *caller) {
+  void *p = malloc(size > 0 ? size : 1);
+  if (!p) {
+    raise_error("%s: OOM\n", caller);
+  }
+  return p;
+}
+
+LineTable *make_line_table(LineEntries *entries) {
+  LineTable *table = checked_malloc(sizeof(LineTable), __FUNCTION__);
+
+  table->data = NULL;
+  table->checkpoints = NULL;
+  line_table_encode(table, entries);
+  return table;
+}
+
+void line_table_encode(LineTable *table, LineEntries *entries) {
+  uint32_t num_entries = line_entries_len(entries);
+  uint8_t *data =
+      checked_malloc(num_entries * 3 * VARINT_MAX_LENGTH, __FUNCTION__);
+  uint8_t *p = data;
+  LineEntry prev = {0, 0, 0};
+
+  free(table->data);
+  free(table->checkpoints);
+  table->num_entries = num_entries;
+  table->num_checkpoints = (num_entries + LINE_TABLE_CHECKPOINT_INTERVAL - 1) /
+                           LINE_TABLE_CHECKPOINT_INTERVAL;
+  table->checkpoints = checked_malloc(
+      table->num_checkpoints * sizeof(LineCheckpoint), __FUNCTION__);
+
+  for (uint32_t i = 0; i < num_entries; ++i) {
+    LineEntry entry = line_entries_get(entries, i);
+    assert(i == 0 || entry.offset > prev.offset);
+    p = write_varint(p, entry.offset - prev.offset);
+    p = write_varint(p, zigzag_encode(entry.line - prev.line));
+    p = write_varint(p, zigzag_encode(entry.column - prev.column));
+    if (i % LINE_TABLE_CHECKPOINT_INTERVAL == 0) {
+      LineCheckpoint *checkpoint =
+          &table->checkpoints[i / LINE_TABLE_CHECKPOINT_INTERVAL];
+      checkpoint->entry = entry;
+      checkpoint->position = p - data;
+    }
+    prev = entry;
+  }
+
+  table->size = p - data;
+  table->data = realloc(data, table->size > 0 ? table->size : 1);
+}
+
+LineEntries *line_table_decode(LineTable *table) {
+  LineEntries *entries = make_line_entries();
+  const uint8_t *p = table->data;
+  LineEntry entry = {0, 0, 0};
+
+  for (uint32_t i = 0; i < table->num_entries; ++i) {
+    p = read_entry(p, &entry);
+    line_entries_append(entries, entry);
+  }
+  return entries;
+}
+
+bool line_table_lookup(LineTable *table, uint32_t offset, LineEntry *entry) {
+  uint32_t lo = 0, hi = table->num_checkpoints, first, end;
+  const uint8_t *p;
+
+  /* The last checkpoint at or before offset. */
+  while (lo < hi) {
+    uint32_t mid = lo + (hi - lo) / 2;
+    if (table->checkpoints[mid].entry.offset <= offset)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  if (lo == 0)
+    return false;
+
+  *entry = table->checkpoints[lo - 1].entry;
+  p = table->data + table->checkpoints[lo - 1].position;
+  first = (lo - 1) * LINE_TABLE_CHECKPOINT_INTERVAL;
+  end = first + LINE_TABLE_CHECKPOINT_INTERVAL;
+  if (end > table->num_entries)
+    end = table->num_entries;
+  for (uint32_t i = first + 1; i < end; ++i) {
+    LineEntry next = *entry;
+    p = read_entry(p, &next);
+    if (next.offset > offset)
+      break;
+    *entry = next;
+  }
+  return true;
+}
+
+void free_line_table(LineTable *table) {
+  free(table->data);
+  free(table->checkpoints);
+  free(table);
+}
@@ -0,0 +1,80 @@
+#include <assert.h>
+
+#include "common.h"
+#include "linetable.h"
+
+/* The entry covering offset found the slow way, NULL if there is none. */
+static const LineEntry *find_entry(LineEntries *entries, uint32_t offset) {
+  const LineEntry *found = NULL;
+  for (int i = 0; i < line_entries_len(entries); ++i) {
+    if (entries->items[i].offset > offset)
+      break;
+    found = &entries->items[i];
+  }
+  return found;
+}
+
+int main() {
+  {
+    LineEntries *entries = make_line_entries();
+    LineTable *table = make_line_table(entries);
+    LineEntry entry;
+    assert(table->num_entries == 0 && table->size == 0);
+    assert(!line_table_lookup(table, 0, &entry));
+    free_line_table(table);
+    free_line_entries(entries);
+  }
+  {
+    /*
+     * Lines and columns that go back as well as forth, offset gaps past a
+     * single varint byte and enough entries for several checkpoints.
+     */
+    LineEntries *entries = make_line_entries();
+    LineEntries *decoded;
+    LineTable *table;
+    uint32_t offset = 3, line = 10, column = 4;
+
+    for (int i = 0; i < 100; ++i) {
+      line_entries_append(entries, (LineEntry){offset, line, column});
+      offset += 1 + (i % 7 == 0 ? 300 : i % 5);
+      line = i % 3 == 0 ? line - 2 : line + 1 + i % 4;
+      column = (column * 7 + i) % 90;
+    }
+    table = make_line_table(entries);
+    assert(table->num_entries == 100);
+    assert(table->num_checkpoints ==
+           (100 + LINE_TABLE_CHECKPOINT_INTERVAL - 1) /
+               LINE_TABLE_CHECKPOINT_INTERVAL);
+    /* Small deltas take a byte each. */
+    assert(table->size < 4 * 100);
+
+    decoded = line_table_decode(table);
+    assert(line_entries_len(decoded) == 100);
+    for (int i = 0; i < 100; ++i) {
+      LineEntry a = line_entries_get(entries, i);
+      LineEntry b = line_entries_get(decoded, i);
+      assert(a.offset == b.offset && a.line == b.line && a.column == b.column);
+    }
+
+    for (uint32_t at = 0; at < offset + 10; ++at) {
+      const LineEntry *expected = find_entry(entries, at);
+      LineEntry entry;
+      bool found = line_table_lookup(table, at, &entry);
+      assert(found == (expected != NULL));
+      if (found)
+        assert(entry.offset == expected->offset &&
+               entry.line == expected->line &&
+               entry.column == expected->column);
+    }
+
+    /* Encoding again replaces the contents. */
+    while (line_entries_len(entries) > 1)
+      line_entries_delete(entries, line_entries_len(entries) - 1);
+    line_table_encode(table, entries);
+    assert(table->num_entries == 1 && table->num_checkpoints == 1);
+
+    free_line_entries(decoded);
+    free_line_table(table);
+    free_line_entries(entries);
+  }
+}
@@ -2,10 +2,17 @@
 
 #include "ast.h"
 #include "compiler.h"
+#include "emit_c.h"
+#include "fold.h"
+#include "jit.h"
+#include "optimizer.h"
 #include "parser.h"
+#include "profiler.h"
+#include "regvm.h"
 #include "tokenizer.h"
 #include "vector.h"
 #include "vm.h"
+#include "vmstats.h"
 
 #include <assert.h>
 #include <getopt.h>
@@ -15,10 +22,24 @@
 #include <string.h>
 
 static int flag_debug_only_tokenize = 0;
+static int flag_debug_only_parse = 0;
 static int flag_debug_dump_tokens = 0;
 static char *debug_tokens_output_file = NULL;
 static int flag_debug_dump_ast = 0;
 static char *debug_ast_output_file = NULL;
+static int flag_alloc_stats = 0;
+static int flag_debug_dump_bytecode = 0;
+static int optimization_level = 1;
+static int flag_debug_inline = 0;
+static int inline_budget = 16;
+static int flag_register_vm = 0;
+static int flag_jit = 0;
+static int jit_threshold = 100;
+static int specialize_threshold = 100;
+static int flag_emit_c = 0;
+static int flag_eager_compile = 0;
+static char *profile_output_file = NULL;
+static int flag_vm_stats = 0;
 
 static char *read_file(const char *filename) {
   char *script = malloc(BLKSZ);
@@ -61,11 +82,24 @@ static void rocket_parse_command_args(int argc, char **argv) {
       {"debug-dump-tokens", optional_argument, &flag_debug_dump_tokens, 1},
       {"debug-dump-ast", no_argument, &flag_debug_dump_ast, 1},
       {"debug-only-tokenize", no_argument, &flag_debug_only_tokenize, 1},
+      {"debug-only-parse", no_argument, &flag_debug_only_parse, 1},
+      {"alloc-stats", no_argument, &flag_alloc_stats, 1},
+      {"debug-dump-bytecode", no_argument, &flag_debug_dump_bytecode, 1},
+      {"debug-inline", no_argument, &flag_debug_inline, 1},
+      {"inline-budget", required_argument, NULL, 'I'},
+      {"vm", required_argument, NULL, 'V'},
+      {"jit", no_argument, &flag_jit, 1},
+      {"jit-threshold", required_argument, NULL, 'J'},
+      {"specialize-threshold", required_argument, NULL, 'S'},
+      {"emit-c", no_argument, &flag_emit_c, 1},
+      {"compile", required_argument, NULL, 'C'},
+      {"profile", required_argument, NULL, 'P'},
+      {"vm-stats", no_argument, &flag_vm_stats, 1},
       {0, 0, 0, 0},
   };
 
   while (1) {
-    c = getopt_long(argc, argv, "", long_options, &option_index);
+    c = getopt_long(argc, argv, "O:", long_options, &option_index);
 
     /* Detect the end of options. */
     if (c == -1) {
@@ -80,12 +114,92 @@ static void rocket_parse_command_args(int argc, char **argv) {
     case 1: {
       if (optarg)
         debug_ast_output_file = strdup(optarg);
+      break;
+    }
+    }
+    case 'O': {
+      char *end;
+      optimization_level = strtol(optarg, &end, 10);
+      if (*end != '\0' || optimization_level < 0) {
+        fprintf(stderr, "invalid optimization level \"%s\"\n", optarg);
+        exit(1);
+      }
+      break;
+    }
+    case 'I': {
+      char *end;
+      inline_budget = strtol(optarg, &end, 10);
+      if (*end != '\0' || inline_budget < 0) {
+        fprintf(stderr, "invalid inline budget \"%s\"\n", optarg);
+        exit(1);
+      }
+      break;
+    }
+    case 'V': {
+      if (strcmp(optarg, "stack") == 0) {
+        flag_register_vm = 0;
+      } else if (strcmp(optarg, "register") == 0) {
+        flag_register_vm = 1;
+      } else {
+        fprintf(stderr, "unknown vm \"%s\", expected stack or register\n",
+                optarg);
+        exit(1);
+      }
+      break;
+    }
+    case 'C': {
+      if (strcmp(optarg, "lazy") == 0) {
+        flag_eager_compile = 0;
+      } else if (strcmp(optarg, "eager") == 0) {
+        flag_eager_compile = 1;
+      } else {
+        fprintf(stderr, "unknown compile mode \"%s\", expected lazy or eager\n",
+                optarg);
+        exit(1);
+      }
+      break;
+    }
+    case 'P': {
+      profile_output_file = strdup(optarg);
+      break;
+    }
+    case 'J': {
+      char *end;
+      jit_threshold = strtol(optarg, &end, 10);
+      if (*end != '\0' || jit_threshold < 0) {
+        fprintf(stderr, "invalid jit threshold \"%s\"\n", optarg);
+        exit(1);
+      }
+      break;
     }
+    case 'S': {
+      char *end;
+      specialize_threshold = strtol(optarg, &end, 10);
+      if (*end != '\0' || specialize_threshold < -1) {
+        fprintf(stderr, "invalid specialize threshold \"%s\"\n", optarg);
+        exit(1);
+      }
+      break;
     }
     default:
       exit(1);
     }
   }
+
+  if (flag_jit && flag_register_vm) {
+    fprintf(stderr, "--jit only works with the stack vm\n");
+    exit(1);
+  }
+  if (flag_jit && !jit_supported()) {
+    fprintf(stderr, "--jit is not supported on this architecture\n");
+    exit(1);
+  }
+#ifndef ROCKET_VM_STATS
+  if (flag_vm_stats) {
+    fprintf(stderr, "--vm-stats needs a build with -DROCKET_VM_STATS=ON\n");
+    exit(1);
+  }
+#endif
 }
 
 static void debug_dump_tokens(const char *output_file_name,
@@ -116,7 +230,22 @@ static void debug_dump_tokens(const char *output_file_name,
     fclose(output_file);
 }
 
+/* Tokenizes the whole program, for timing the tokenizer on its own. */
+static void tokenize_all(Tokenizer *tokenizer) {
+  TokenIter iter = tokenizer_iter(tokenizer);
+  Token *tok;
+
+  for (tok = token_iter_peek(&iter); tok->kind != TOKEN_EOF;
+       tok = token_iter_next(&iter))
+    ;
+}
+
 static void debug_dump_ast_node(FILE *output_file, AstNode *node, int indent) {
+  if (!node) {
+    fprintf(output_file ? output_file : stdout, "%*s%s\n", indent, "", "NIL");
+    return;
+  }
+
   switch (node->kind) {
   case AST_BOOL: {
     AstBool *boolean = (AstBool *)node;
@@ -156,6 +285,13 @@ static void debug_dump_ast_node(FILE *output_file, AstNode *node, int indent) {
     fprintf(output_file ? output_file : stdout, "%*s)\n", indent, "");
     break;
   }
+  case AST_QUOTE: {
+    AstQuote *quote = (AstQuote *)node;
+    fprintf(output_file ? output_file : stdout, "%*s%s:\n", indent, "",
+            "QUOTE");
+    debug_dump_ast_node(output_file, quote->inner, indent + 2);
+    break;
+  }
   default:
     fprintf(stderr, "%*s%s: unknown ast kind (%d)\n", indent, "", __FUNCTION__,
             node->kind);
@@ -186,6 +322,93 @@ static void debug_dump_ast(const char *output_file_name,
     fclose(output_file);
 }
 
+static void free_program(Vector *parsed_program) {
+  for (int i = 0; i < vector_len(parsed_program); ++i)
+    free_ast_node(DatumGetPtr(vector_get(parsed_program, i)));
+  free_vector(parsed_program);
+}
+
+static void optimize_lazy_body(CompiledFunction *fn) {
+  peephole_optimize(fn->instructions, fn->lines);
+}
+
+static void run_program(Vector *parsed_program) {
+  Compiler compiler;
+  VM vm;
+  Profiler *profiler = NULL;
+  FILE *profile_file = NULL;
+
+  if (optimization_level >= 1)
+    fold_constants(parsed_program);
+
+  initialize_compiler(&compiler);
+  if (optimization_level >= 1) {
+    compiler.inline_budget = inline_budget;
+    compiler.stack_allocate = true;
+  }
+  if (flag_debug_inline)
+    compiler.inline_log = stderr;
+  /*
+   * Procedures are compiled on their first call, unless all of the code is
+   * to be printed or translated.
+   */
+  compiler.lazy = !flag_eager_compile && !flag_emit_c &&
+                  !flag_debug_dump_bytecode && !flag_debug_inline;
+  if (optimization_level >= 1)
+    compiler.finish_lazy = optimize_lazy_body;
+  compile_program(&compiler, parsed_program);
+  optimize_program(compiler.constants, compiler.instructions, /*first=*/0,
+                   optimization_level,
+                   flag_debug_dump_bytecode ? stdout : NULL);
+
+  if (flag_emit_c) {
+    emit_c_program(stdout, compiler.constants, compiler.instructions);
+    destroy_compiler(&compiler);
+    return;
+  }
+
+  initialize_vm(&vm, compiler_give_out_instructions(&compiler),
+                compiler_give_out_constants(&compiler), /*globals=*/NULL,
+                compiler_give_out_heap(&compiler));
+
+  if (flag_register_vm)
+    registerize_program(&vm, flag_debug_dump_bytecode ? stdout : NULL);
+  else if (optimization_level >= 1)
+    vm.specialize_threshold = specialize_threshold;
+  if (flag_jit)
+    vm.jit_threshold = jit_threshold;
+
+  if (profile_output_file) {
+    profile_file = fopen(profile_output_file, "w");
+    if (!profile_file) {
+      fprintf(stderr, "cannot open profile output file: \"%s\" %m\n",
+              profile_output_file);
+      exit(1);
+    }
+    profiler = make_profiler(&vm, PROFILER_DEFAULT_HZ);
+    profiler_start(profiler);
+  }
+
+  vm_run(&vm);
+
+  if (profiler) {
+    profiler_stop(profiler);
+    profiler_write_folded(profiler, profile_file);
+    free_profiler(profiler);
+    fclose(profile_file);
+  }
+
+  if (flag_alloc_stats)
+    heap_dump_stats(stderr, vm.heap);
+#ifdef ROCKET_VM_STATS
+  if (flag_vm_stats)
+    vm_stats_report(stderr, &vm);
+#endif
+
+  destroy_vm(&vm);
+  destroy_compiler(&compiler);
+}
+
 static int eval_script(const char *script_name) {
   char *script;
   Tokenizer tokenizer;
@@ -197,14 +420,21 @@ static int eval_script(const char *script_name) {
   if (flag_debug_dump_tokens)
     debug_dump_tokens(debug_tokens_output_file, &tokenizer);
 
-  if (flag_debug_only_tokenize)
+  if (flag_debug_only_tokenize) {
+    if (!flag_debug_dump_tokens)
+      tokenize_all(&tokenizer);
     goto out;
+  }
 
   parsed_program = parse_program(&tokenizer);
 
   if (flag_debug_dump_ast)
     debug_dump_ast(debug_ast_output_file, parsed_program);
 
+  if (!flag_debug_only_parse)
+    run_program(parsed_program);
+  free_program(parsed_program);
+
 out:
   destroy_tokenizer(&tokenizer);
   free(script);
@@ -0,0 +1,117 @@
+#include "common.h"
+
+#include "error_handler.h"
+#include "heap.h"
+#include "object.h"
+
+Object make_pair(Heap *heap, Object car, Object cdr) {
+  Pair *pair = heap_alloc_pair(heap);
+  pair->car = car;
+  pair->cdr = cdr;
+  return make_object(OBJ_PAIR, PointerGetDatum(pair));
+}
+
+int list_length(Object list) {
+  int len = 0;
+  while (list.type == OBJ_PAIR) {
+    ++len;
+    list = ObjectGetPair(list)->cdr;
+  }
+  return len;
+}
+
+Object list_reverse(Heap *heap, Object list) {
+  Object tail = NIL_OBJECT;
+  while (list.type == OBJ_PAIR) {
+    Pair *curr = ObjectGetPair(list);
+    tail = make_pair(heap, curr->car, tail);
+    list = curr->cdr;
+  }
+  return tail;
+}
+
+Object list_append(Heap *heap, Object list, Object tail) {
+  Object head = NIL_OBJECT;
+  Pair *last = NULL;
+
+  /* Copy the spine of the first list, the tail is shared. */
+  while (list.type == OBJ_PAIR) {
+    Object cell = make_pair(heap, ObjectGetPair(list)->car, NIL_OBJECT);
+    if (last)
+      last->cdr = cell;
+    else
+      head = cell;
+    last = ObjectGetPair(cell);
+    list = ObjectGetPair(list)->cdr;
+  }
+
+  if (!last)
+    return tail;
+  last->cdr = tail;
+  return head;
+}
+
+bool object_eq(Object a, Object b) {
+  if (a.type != b.type)
+    return false;
+  switch (a.type) {
+  case OBJ_NIL:
+  case OBJ_UNSPECIFIED:
+    return true;
+  case OBJ_NUMBER:
+    return DatumGetFloat(a.value) == DatumGetFloat(b.value);
+  default:
+    return a.value == b.value;
+  }
+}
+
+static void print_number(FILE *output_file, double number) {
+  if (number == (double)(int64_t)number && number > -1e15 && number < 1e15)
+    fprintf(output_file, "%lld", (long long)number);
+  else
+    fprintf(output_file, "%.15g", number);
+}
+
+void print_object(FILE *output_file, Object obj) {
+  switch (obj.type) {
+  case OBJ_NIL:
+    fprintf(output_file, "()");
+    break;
+  case OBJ_BOOL:
+    fprintf(output_file, "%s", DatumGetBool(obj.value) ? "#t" : "#f");
+    break;
+  case OBJ_NUMBER:
+    print_number(output_file, DatumGetFloat(obj.value));
+    break;
+  case OBJ_SYMBOL:
+    fprintf(output_file, "%s", DatumGetCString(obj.value));
+    break;
+  case OBJ_PAIR: {
+    fprintf(output_file, "(");
+    print_object(output_file, ObjectGetPair(obj)->car);
+    obj = ObjectGetPair(obj)->cdr;
+    while (obj.type == OBJ_PAIR) {
+      fprintf(output_file, " ");
+      print_object(output_file, ObjectGetPair(obj)->car);
+      obj = ObjectGetPair(obj)->cdr;
+    }
+    if (obj.type != OBJ_NIL) {
+      fprintf(output_file, " . ");
+      print_object(output_file, obj);
+    }
+    fprintf(output_file, ")");
+    break;
+  }
+  case OBJ_PROCEDURE:
+  case OBJ_CLOSURE:
+  case OBJ_PRIMITIVE:
+  case OBJ_NATIVE:
+    fprintf(output_file, "#<procedure>");
+    break;
+  case OBJ_UNSPECIFIED:
+    fprintf(output_file, "#<unspecified>");
+    break;
+  default:
+    raise_error("%s: unrecognized object type (%d)\n", __FUNCTION__, obj.type);
+  }
+}
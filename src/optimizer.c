@@ -0,0 +1,432 @@
+#include "common.h"
+
+#include "bytecode.h"
+#include "optimizer.h"
+#include "vm.h"
+
+/*
+ * The peephole pass decodes a function into an array of instructions, lets
+ * the rules below rewrite it until none applies, and encodes it again. Jump
+ * targets are kept as instruction indices in between, so rules may drop or
+ * shrink instructions freely. A jump to a dropped instruction lands on the
+ * next one that survives.
+ */
+typedef struct PeepholeInsn {
+  /* The original encoding, operands are copied from here. */
+  const uint8_t *code;
+  uint8_t op;
+  int length;
+  /* Index of the jump target, -1 for other instructions. */
+  int target;
+  bool removed;
+  bool is_target;
+} PeepholeInsn;
+
+typedef struct Peephole {
+  PeepholeInsn *insns;
+  int num_insns;
+} Peephole;
+
+typedef bool (*PeepholeRule)(Peephole *p, int i);
+
+static int next_live(Peephole *p, int i) {
+  do {
+    ++i;
+  } while (i < p->num_insns && p->insns[i].removed);
+  return i;
+}
+
+/* The instruction that a jump to i actually reaches. */
+static int resolve_target(Peephole *p, int i) {
+  if (i < p->num_insns && p->insns[i].removed)
+    return next_live(p, i);
+  return i;
+}
+
+static inline bool live_op_is(Peephole *p, int i, OpCode op) {
+  return i < p->num_insns && p->insns[i].op == op;
+}
+
+static void mark_targets(Peephole *p) {
+  for (int i = 0; i < p->num_insns; ++i)
+    p->insns[i].is_target = false;
+  for (int i = 0; i < p->num_insns; ++i) {
+    int target;
+    if (p->insns[i].removed || p->insns[i].target < 0)
+      continue;
+    target = resolve_target(p, p->insns[i].target);
+    if (target < p->num_insns)
+      p->insns[target].is_target = true;
+  }
+}
+
+static void remove_insn(Peephole *p, int i) {
+  p->insns[i].removed = true;
+}
+
+/* Turns the instruction into one without operands. */
+static void replace_insn(Peephole *p, int i, OpCode op) {
+  p->insns[i].op = op;
+  p->insns[i].length = 1;
+  p->insns[i].target = -1;
+}
+
+/* A push without side effects whose value is popped right away. */
+static bool peephole_push_pop(Peephole *p, int i) {
+  int next = next_live(p, i);
+  OpCode op = p->insns[i].op;
+
+  if (op != OP_CONSTANT && op != OP_GET_LOCAL && op != OP_GET_FREE)
+    return false;
+  if (!live_op_is(p, next, OP_POP) || p->insns[next].is_target)
+    return false;
+  remove_insn(p, i);
+  remove_insn(p, next);
+  return true;
+}
+
+/* SET_LOCAL n; POP; GET_LOCAL n leaves the stored value on the stack. */
+static bool peephole_store_reload(Peephole *p, int i) {
+  int pop = next_live(p, i);
+  int load = next_live(p, pop);
+
+  if (p->insns[i].op != OP_SET_LOCAL || !live_op_is(p, pop, OP_POP) ||
+      !live_op_is(p, load, OP_GET_LOCAL) || p->insns[pop].is_target ||
+      p->insns[load].is_target ||
+      p->insns[i].code[1] != p->insns[load].code[1])
+    return false;
+  remove_insn(p, pop);
+  remove_insn(p, load);
+  return true;
+}
+
+/* GET_LOCAL n; SET_LOCAL n stores back the value it just loaded. */
+static bool peephole_load_store(Peephole *p, int i) {
+  int store = next_live(p, i);
+
+  if (p->insns[i].op != OP_GET_LOCAL || !live_op_is(p, store, OP_SET_LOCAL) ||
+      p->insns[store].is_target ||
+      p->insns[i].code[1] != p->insns[store].code[1])
+    return false;
+  remove_insn(p, store);
+  return true;
+}
+
+/* A jump to an unconditional jump goes straight to the final target. */
+static bool peephole_thread_jump(Peephole *p, int i) {
+  int target, final_target;
+
+  if (p->insns[i].target < 0)
+    return false;
+  target = resolve_target(p, p->insns[i].target);
+  if (!live_op_is(p, target, OP_JUMP))
+    return false;
+  final_target = resolve_target(p, p->insns[target].target);
+  if (final_target == target ||
+      final_target == resolve_target(p, p->insns[i].target))
+    return false;
+  p->insns[i].target = final_target;
+  return true;
+}
+
+/* A jump to the next instruction does nothing but pop its condition. */
+static bool peephole_jump_to_next(Peephole *p, int i) {
+  if (p->insns[i].target < 0 ||
+      resolve_target(p, p->insns[i].target) != next_live(p, i))
+    return false;
+  if (p->insns[i].op == OP_JUMP_IF_FALSE)
+    replace_insn(p, i, OP_POP);
+  else
+    remove_insn(p, i);
+  return true;
+}
+
+/* A jump to a return may as well return. */
+static bool peephole_jump_to_return(Peephole *p, int i) {
+  if (p->insns[i].op != OP_JUMP ||
+      !live_op_is(p, resolve_target(p, p->insns[i].target), OP_RETURN))
+    return false;
+  replace_insn(p, i, OP_RETURN);
+  return true;
+}
+
+/* Nothing reaches code between a jump or return and the next jump target. */
+static bool peephole_dead_code(Peephole *p, int i) {
+  bool changed = false;
+  int next;
+
+  if (p->insns[i].op != OP_JUMP && p->insns[i].op != OP_RETURN)
+    return false;
+  for (next = next_live(p, i); next < p->num_insns; next = next_live(p, next)) {
+    if (p->insns[next].is_target || p->insns[next].op == OP_LAST)
+      break;
+    remove_insn(p, next);
+    changed = true;
+  }
+  return changed;
+}
+
+static const struct {
+  const char *name;
+  PeepholeRule rule;
+} peephole_rules[] = {
+    {"push-pop", peephole_push_pop},
+    {"store-reload", peephole_store_reload},
+    {"load-store", peephole_load_store},
+    {"thread-jump", peephole_thread_jump},
+    {"jump-to-next", peephole_jump_to_next},
+    {"jump-to-return", peephole_jump_to_return},
+    {"dead-code", peephole_dead_code},
+};
+
+#define NUM_PEEPHOLE_RULES (sizeof(peephole_rules) / sizeof(peephole_rules[0]))
+
+static bool peephole_decode(Peephole *p, Instructions *instructions) {
+  uint8_t *code = instructions_data(instructions);
+  int len = instructions_len(instructions);
+  int *insn_at = malloc(len * sizeof(int));
+  bool ok = true;
+  int offset;
+
+  for (offset = 0; offset < len; ++offset)
+    insn_at[offset] = -1;
+  p->num_insns = 0;
+  for (offset = 0; offset < len; offset += instruction_length(code + offset))
+    insn_at[offset] = p->num_insns++;
+  p->insns = malloc(p->num_insns * sizeof(PeepholeInsn));
+
+  offset = 0;
+  for (int i = 0; i < p->num_insns; ++i) {
+    PeepholeInsn *insn = &p->insns[i];
+    insn->code = code + offset;
+    insn->op = code[offset];
+    insn->length = instruction_length(code + offset);
+    insn->target = -1;
+    insn->removed = false;
+    insn->is_target = false;
+    if (opcode_is_jump(insn->op)) {
+      int target_offset = read_uint16(code + offset + 1);
+      /* Leave code with jumps into the middle of instructions alone. */
+      if (target_offset >= len || insn_at[target_offset] < 0)
+        ok = false;
+      else
+        insn->target = insn_at[target_offset];
+    }
+    offset += insn->length;
+  }
+  free(insn_at);
+  return ok;
+}
+
+/*
+ * Moves each entry of lines to where the instruction it starts at ends up.
+ * Entries that come to share an offset keep the last, and an entry that
+ * repeats the location before it goes.
+ */
+static void peephole_remap_lines(Peephole *p, const uint8_t *code,
+                                 const int *new_offsets, LineTable *lines) {
+  LineEntries *entries = line_table_decode(lines);
+  int i = 0, len = 0;
+
+  for (int e = 0; e < line_entries_len(entries); ++e) {
+    LineEntry entry = line_entries_get(entries, e);
+    LineEntry prev;
+    while (i < p->num_insns && p->insns[i].code - code < entry.offset)
+      ++i;
+    entry.offset = new_offsets[i];
+    if (len > 0 && line_entries_get(entries, len - 1).offset == entry.offset)
+      --len;
+    prev = len > 0 ? line_entries_get(entries, len - 1) : (LineEntry){0};
+    if (len > 0 && prev.line == entry.line && prev.column == entry.column)
+      continue;
+    line_entries_set(entries, len++, entry);
+  }
+  while (line_entries_len(entries) > len)
+    line_entries_delete(entries, line_entries_len(entries) - 1);
+  line_table_encode(lines, entries);
+  free_line_entries(entries);
+}
+
+/*
+ * Writes the surviving instructions back in place. Instructions only ever
+ * shrink or move towards the start, so nothing is overwritten before it has
+ * been copied.
+ */
+static void peephole_encode(Peephole *p, Instructions *instructions,
+                            LineTable *lines) {
+  uint8_t *code = instructions_data(instructions);
+  int *new_offsets = malloc((p->num_insns + 1) * sizeof(int));
+  int offset = 0;
+
+  for (int i = 0; i < p->num_insns; ++i) {
+    new_offsets[i] = offset;
+    if (!p->insns[i].removed)
+      offset += p->insns[i].length;
+  }
+  new_offsets[p->num_insns] = offset;
+  if (lines)
+    peephole_remap_lines(p, code, new_offsets, lines);
+
+  for (int i = 0; i < p->num_insns; ++i) {
+    PeepholeInsn *insn = &p->insns[i];
+    uint8_t *dest = code + new_offsets[i];
+    if (insn->removed)
+      continue;
+    memmove(dest + 1, insn->code + 1, insn->length - 1);
+    dest[0] = insn->op;
+    if (insn->target >= 0) {
+      int target = new_offsets[resolve_target(p, insn->target)];
+      dest[1] = target & 0xff;
+      dest[2] = (target >> 8) & 0xff;
+    }
+  }
+
+  while (instructions_len(instructions) > offset)
+    instructions_delete(instructions, instructions_len(instructions) - 1);
+  free(new_offsets);
+}
+
+bool peephole_optimize(Instructions *instructions, LineTable *lines) {
+  Peephole p;
+  bool changed, any_changed = false;
+
+  if (!peephole_decode(&p, instructions)) {
+    free(p.insns);
+    return false;
+  }
+
+  do {
+    changed = false;
+    mark_targets(&p);
+    for (int i = 0; i < p.num_insns; ++i) {
+      for (size_t r = 0; r < NUM_PEEPHOLE_RULES; ++r) {
+        if (p.insns[i].removed)
+          break;
+        if (peephole_rules[r].rule(&p, i)) {
+          changed = any_changed = true;
+          mark_targets(&p);
+        }
+      }
+    }
+  } while (changed);
+
+  if (any_changed)
+    peephole_encode(&p, instructions, lines);
+  free(p.insns);
+  return any_changed;
+}
+
+/* Renders every instruction of a function as a line of text. */
+static char **disassemble_lines(ObjectsPool *constants,
+                                Instructions *instructions, int **offsets,
+                                int *num_lines) {
+  uint8_t *code = instructions_data(instructions);
+  int len = instructions_len(instructions);
+  char **lines = malloc((len + 1) * sizeof(char *));
+  int n = 0;
+
+  *offsets = malloc((len + 1) * sizeof(int));
+  for (int offset = 0; offset < len;
+       offset += instruction_length(code + offset)) {
+    size_t size;
+    FILE *line_file = open_memstream(&lines[n], &size);
+    disassemble_instruction(line_file, constants, code + offset);
+    fclose(line_file);
+    (*offsets)[n++] = offset;
+  }
+  *num_lines = n;
+  return lines;
+}
+
+/* Prints a line diff of two versions of a function's code. */
+static void dump_bytecode_diff(FILE *dump_file, ObjectsPool *constants,
+                               Instructions *before, Instructions *after) {
+  int *old_offsets, *new_offsets;
+  int num_old, num_new;
+  char **old_lines =
+      disassemble_lines(constants, before, &old_offsets, &num_old);
+  char **new_lines =
+      disassemble_lines(constants, after, &new_offsets, &num_new);
+  /* lcs[i][j] is the longest common subsequence of old[i..] and new[j..]. */
+  int *lcs = calloc((num_old + 1) * (num_new + 1), sizeof(int));
+  int i = 0, j = 0;
+
+#define LCS(i, j) lcs[(i) * (num_new + 1) + (j)]
+  for (int a = num_old - 1; a >= 0; --a) {
+    for (int b = num_new - 1; b >= 0; --b) {
+      if (strcmp(old_lines[a], new_lines[b]) == 0)
+        LCS(a, b) = LCS(a + 1, b + 1) + 1;
+      else
+        LCS(a, b) =
+            LCS(a + 1, b) > LCS(a, b + 1) ? LCS(a + 1, b) : LCS(a, b + 1);
+    }
+  }
+
+  while (i < num_old || j < num_new) {
+    if (i < num_old && j < num_new && strcmp(old_lines[i], new_lines[j]) == 0) {
+      fprintf(dump_file, "  %04d  %s\n", new_offsets[j], new_lines[j]);
+      ++i;
+      ++j;
+    } else if (i < num_old &&
+               (j == num_new || LCS(i + 1, j) >= LCS(i, j + 1))) {
+      fprintf(dump_file, "- %04d  %s\n", old_offsets[i], old_lines[i]);
+      ++i;
+    } else {
+      fprintf(dump_file, "+ %04d  %s\n", new_offsets[j], new_lines[j]);
+      ++j;
+    }
+  }
+#undef LCS
+
+  for (int k = 0; k < num_old; ++k)
+    free(old_lines[k]);
+  for (int k = 0; k < num_new; ++k)
+    free(new_lines[k]);
+  free(old_lines);
+  free(new_lines);
+  free(old_offsets);
+  free(new_offsets);
+  free(lcs);
+}
+
+static Instructions *copy_instructions(Instructions *instructions) {
+  Instructions *copy = make_instructions();
+  for (int i = 0; i < instructions_len(instructions); ++i)
+    instructions_append(copy, instructions_get(instructions, i));
+  return copy;
+}
+
+static void optimize_function(ObjectsPool *constants,
+                              Instructions *instructions, LineTable *lines,
+                              int level, FILE *dump_file, const char *name) {
+  Instructions *before = dump_file ? copy_instructions(instructions) : NULL;
+
+  if (level >= 1)
+    peephole_optimize(instructions, lines);
+
+  if (dump_file) {
+    fprintf(dump_file, "== %s ==\n", name);
+    dump_bytecode_diff(dump_file, constants, before, instructions);
+    free_instructions(before);
+  }
+}
+
+void optimize_program(ObjectsPool *constants, Instructions *instructions,
+                      int first, int level, FILE *dump_file) {
+  optimize_function(constants, instructions, NULL, level, dump_file,
+                    "top-level");
+
+  for (int i = first; i < objects_pool_len(constants); ++i) {
+    Object val = objects_pool_get(constants, i);
+    CompiledFunction *fn;
+    char name[32];
+    if (val.type != OBJ_PROCEDURE)
+      continue;
+    fn = DatumGetPtr(val.value);
+    if (fn->lazy)
+      continue;
+    snprintf(name, sizeof(name), "procedure %d", i);
+    optimize_function(constants, fn->instructions, fn->lines, level,
+                      dump_file, name);
+  }
+}
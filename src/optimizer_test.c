@@ -0,0 +1,108 @@
+#include <assert.h>
+
+#include "common.h"
+#include "optimizer.h"
+#include "vm.h"
+
+static Instructions *make_code(const uint8_t *bytes, int len) {
+  Instructions *code = make_instructions();
+  for (int i = 0; i < len; ++i)
+    instructions_append(code, bytes[i]);
+  return code;
+}
+
+static bool code_equals(Instructions *code, const uint8_t *bytes, int len) {
+  if (instructions_len(code) != len)
+    return false;
+  return memcmp(instructions_data(code), bytes, len) == 0;
+}
+
+#define ASSERT_PEEPHOLE(before, after)                                         \
+  do {                                                                         \
+    Instructions *code = make_code(before, sizeof(before));                    \
+    peephole_optimize(code, NULL);                                             \
+    assert(code_equals(code, after, sizeof(after)));                           \
+    free_instructions(code);                                                   \
+  } while (0)
+
+int main() {
+  {
+    /* A constant that is popped right away disappears. */
+    const uint8_t before[] = {OP_CONSTANT, 0, 0, OP_POP,
+                              OP_CONSTANT, 1, 0, OP_LAST};
+    const uint8_t after[] = {OP_CONSTANT, 1, 0, OP_LAST};
+    ASSERT_PEEPHOLE(before, after);
+  }
+  {
+    const uint8_t before[] = {OP_SET_LOCAL, 1, OP_POP, OP_GET_LOCAL, 1,
+                              OP_RETURN};
+    const uint8_t after[] = {OP_SET_LOCAL, 1, OP_RETURN};
+    ASSERT_PEEPHOLE(before, after);
+  }
+  {
+    const uint8_t before[] = {OP_JUMP, 3, 0, OP_CONSTANT, 0, 0, OP_LAST};
+    const uint8_t after[] = {OP_CONSTANT, 0, 0, OP_LAST};
+    ASSERT_PEEPHOLE(before, after);
+  }
+  {
+    /*
+     * (if x 0 1) in tail position: the jump over the else branch becomes a
+     * return and the jump into the else branch moves with it.
+     */
+    const uint8_t before[] = {
+        OP_GET_LOCAL, 0,                /* 0 */
+        OP_JUMP_IF_FALSE, 11, 0,        /* 2 */
+        OP_CONSTANT, 0, 0,              /* 5 */
+        OP_JUMP, 14, 0,                 /* 8 */
+        OP_CONSTANT, 1, 0,              /* 11 */
+        OP_RETURN,                      /* 14 */
+    };
+    const uint8_t after[] = {
+        OP_GET_LOCAL, 0,         OP_JUMP_IF_FALSE, 9, 0, OP_CONSTANT, 0, 0,
+        OP_RETURN,    OP_CONSTANT, 1, 0, OP_RETURN,
+    };
+    ASSERT_PEEPHOLE(before, after);
+  }
+  {
+    /*
+     * The conditional jump is threaded through the jump at 10, which leaves
+     * that one dead and the jump at 7 pointing at the next instruction.
+     */
+    const uint8_t before[] = {
+        OP_GET_LOCAL, 0,                /* 0 */
+        OP_JUMP_IF_FALSE, 10, 0,        /* 2 */
+        OP_PROC_CALL, 0,                /* 5 */
+        OP_JUMP, 13, 0,                 /* 7 */
+        OP_JUMP, 15, 0,                 /* 10 */
+        OP_PROC_CALL, 0,                /* 13 */
+        OP_LAST,                        /* 15 */
+    };
+    const uint8_t after[] = {
+        OP_GET_LOCAL, 0,           OP_JUMP_IF_FALSE, 9, 0, OP_PROC_CALL, 0,
+        OP_PROC_CALL, 0,           OP_LAST,
+    };
+    ASSERT_PEEPHOLE(before, after);
+  }
+  {
+    /* Line table entries move with the instructions they start at. */
+    const uint8_t before[] = {OP_CONSTANT, 0, 0, OP_POP, OP_CONSTANT, 1, 0,
+                              OP_RETURN};
+    const LineEntry entries[] = {{0, 1, 0}, {4, 2, 2}, {7, 3, 0}};
+    Instructions *code = make_code(before, sizeof(before));
+    LineEntries *packed = make_line_entries();
+    LineTable *lines;
+    LineEntry entry;
+    for (size_t i = 0; i < sizeof(entries) / sizeof(entries[0]); ++i)
+      line_entries_append(packed, entries[i]);
+    lines = make_line_table(packed);
+    assert(peephole_optimize(code, lines));
+    assert(instructions_len(code) == 4);
+    assert(lines->num_entries == 2);
+    assert(line_table_lookup(lines, 0, &entry) && entry.line == 2 &&
+           entry.column == 2);
+    assert(line_table_lookup(lines, 3, &entry) && entry.line == 3);
+    free_line_entries(packed);
+    free_line_table(lines);
+    free_instructions(code);
+  }
+}
@@ -1,6 +1,7 @@
 #include "common.h"
 
 #include "ast.h"
+#include "error_handler.h"
 #include "parser.h"
 #include "tokenizer.h"
 #include "vector.h"
@@ -14,6 +15,7 @@ static AstNode *parse_number(Token *tok);
 static AstNode *parse_ident(Token *tok);
 static AstNode *parse_quote(TokenIter *iter);
 static AstNode *parse_expression(TokenIter *iter);
+static AstNode *parse_expression_at(TokenIter *iter);
 
 #define CURR_TOKEN(iter) (token_iter_peek(iter))
 #define NEXT_TOKEN(iter) (token_iter_next(iter))
@@ -33,6 +35,16 @@ Vector *parse_program(Tokenizer *tokenizer) {
 }
 
 static AstNode *parse_expression(TokenIter *iter) {
+  TokenLoc loc = CURR_TOKEN(iter)->loc;
+  AstNode *node = parse_expression_at(iter);
+
+  /* `()` is parsed as NULL. */
+  if (node)
+    node->loc = loc;
+  return node;
+}
+
+static AstNode *parse_expression_at(TokenIter *iter) {
   switch (CURR_TOKEN(iter)->kind) {
   case TOKEN_BOOL: {
     AstNode *bool_ast = parse_boolean(CURR_TOKEN(iter));
@@ -81,8 +93,7 @@ static AstNode *parse_expression(TokenIter *iter) {
       AstNode *inner_ast = NULL;
       if (CURR_TOKEN(iter)->kind == TOKEN_EOF) {
         /* Need more tokens. */
-        fprintf(stderr, "%s: Expected more tokens.", __FUNCTION__);
-        exit(1);
+        raise_error("%s: Expected more tokens.", __FUNCTION__);
       }
 
       inner_ast = parse_expression(iter);
@@ -104,13 +115,11 @@ static AstNode *parse_expression(TokenIter *iter) {
   }
   case TOKEN_EOF: {
     /* Need more tokens. */
-    fprintf(stderr, "%s: Expected more tokens.\n", __FUNCTION__);
-    exit(1);
+    raise_error("%s: Expected more tokens.\n", __FUNCTION__);
   }
   default: {
-    fprintf(stderr, "%s: Unexpected token kind (%d)\n", __FUNCTION__,
-            CURR_TOKEN(iter)->kind);
-    exit(1);
+    raise_error("%s: Unexpected token kind (%d)\n", __FUNCTION__,
+                CURR_TOKEN(iter)->kind);
   }
   }
   return NULL;
@@ -156,8 +165,7 @@ static AstNode *parse_char(Token *tok) {
         c = 9;
       } else {
         /* Otherwise, Raise error. */
-        fprintf(stderr, "%s: Error\n", __FUNCTION__);
-        exit(1);
+        raise_error("%s: Error\n", __FUNCTION__);
       }
     }
   }
@@ -0,0 +1,148 @@
+#include "common.h"
+
+#include "error_handler.h"
+#include "heap.h"
+#include "object.h"
+#include "primitive.h"
+#include "symbol.h"
+#include "vm.h"
+
+const PrimitiveInfo primitives[PRIM_LAST] = {
+    [PRIM_ADD] = {"+", -1},          [PRIM_SUB] = {"-", -1},
+    [PRIM_MUL] = {"*", -1},          [PRIM_DIV] = {"/", -1},
+    [PRIM_NUM_EQ] = {"=", 2},        [PRIM_LT] = {"<", 2},
+    [PRIM_GT] = {">", 2},            [PRIM_LE] = {"<=", 2},
+    [PRIM_GE] = {">=", 2},           [PRIM_NOT] = {"not", 1},
+    [PRIM_EQ] = {"eq?", 2},          [PRIM_CONS] = {"cons", 2},
+    [PRIM_CAR] = {"car", 1},         [PRIM_CDR] = {"cdr", 1},
+    [PRIM_NULL_P] = {"null?", 1},    [PRIM_PAIR_P] = {"pair?", 1},
+    [PRIM_LIST] = {"list", -1},      [PRIM_LENGTH] = {"length", 1},
+    [PRIM_APPEND] = {"append", -1},  [PRIM_REVERSE] = {"reverse", 1},
+    [PRIM_DISPLAY] = {"display", 1}, [PRIM_NEWLINE] = {"newline", 0},
+};
+
+_Static_assert(OP_PAIR_P - OP_ADD == PRIM_LAST_INLINE - PRIM_ADD,
+               "inlined primitive opcodes must follow PrimitiveKind");
+_Static_assert(PRIM_LAST <= 64, "VM::redefined_primitives is 64 bits");
+
+void define_primitives(SymbolTable *globals) {
+  for (int i = 0; i < PRIM_LAST; ++i)
+    symbol_table_add(globals, primitives[i].name,
+                     make_object(OBJ_PRIMITIVE, Int64GetDatum(i)));
+}
+
+int lookup_primitive(const char *name) {
+  for (int i = 0; i < PRIM_LAST; ++i) {
+    if (strcmp(primitives[i].name, name) == 0)
+      return i;
+  }
+  return -1;
+}
+
+static double number_arg(PrimitiveKind kind, Object arg) {
+  if (arg.type != OBJ_NUMBER) {
+    raise_error("%s: %s: expected a number\n", __FUNCTION__,
+                primitives[kind].name);
+  }
+  return DatumGetFloat(arg.value);
+}
+
+static Pair *pair_arg(PrimitiveKind kind, Object arg) {
+  if (arg.type != OBJ_PAIR) {
+    raise_error("%s: %s: expected a pair\n", __FUNCTION__,
+                primitives[kind].name);
+  }
+  return ObjectGetPair(arg);
+}
+
+Object call_primitive(VM *vm, PrimitiveKind kind, int argc, Object *argv) {
+  if (primitives[kind].arity >= 0 && primitives[kind].arity != argc) {
+    raise_error("%s: %s: expected %d arguments, got %d\n", __FUNCTION__,
+                primitives[kind].name, primitives[kind].arity, argc);
+  }
+
+  switch (kind) {
+  case PRIM_ADD:
+  case PRIM_MUL: {
+    double acc = kind == PRIM_ADD ? 0 : 1;
+    for (int i = 0; i < argc; ++i) {
+      if (kind == PRIM_ADD)
+        acc += number_arg(kind, argv[i]);
+      else
+        acc *= number_arg(kind, argv[i]);
+    }
+    return FloatGetObject(acc);
+  }
+  case PRIM_SUB:
+  case PRIM_DIV: {
+    double acc;
+    if (argc == 0) {
+      raise_error("%s: %s: expected at least 1 argument\n", __FUNCTION__,
+                  primitives[kind].name);
+    }
+    acc = number_arg(kind, argv[0]);
+    if (argc == 1)
+      return FloatGetObject(kind == PRIM_SUB ? -acc : 1 / acc);
+    for (int i = 1; i < argc; ++i) {
+      if (kind == PRIM_SUB)
+        acc -= number_arg(kind, argv[i]);
+      else
+        acc /= number_arg(kind, argv[i]);
+    }
+    return FloatGetObject(acc);
+  }
+  case PRIM_NUM_EQ:
+    return BoolGetObject(number_arg(kind, argv[0]) ==
+                         number_arg(kind, argv[1]));
+  case PRIM_LT:
+    return BoolGetObject(number_arg(kind, argv[0]) <
+                         number_arg(kind, argv[1]));
+  case PRIM_GT:
+    return BoolGetObject(number_arg(kind, argv[0]) >
+                         number_arg(kind, argv[1]));
+  case PRIM_LE:
+    return BoolGetObject(number_arg(kind, argv[0]) <=
+                         number_arg(kind, argv[1]));
+  case PRIM_GE:
+    return BoolGetObject(number_arg(kind, argv[0]) >=
+                         number_arg(kind, argv[1]));
+  case PRIM_NOT:
+    return BoolGetObject(ObjectIsFalse(argv[0]));
+  case PRIM_EQ:
+    return BoolGetObject(object_eq(argv[0], argv[1]));
+  case PRIM_CONS:
+    return make_pair(vm->heap, argv[0], argv[1]);
+  case PRIM_CAR:
+    return pair_arg(kind, argv[0])->car;
+  case PRIM_CDR:
+    return pair_arg(kind, argv[0])->cdr;
+  case PRIM_NULL_P:
+    return BoolGetObject(argv[0].type == OBJ_NIL);
+  case PRIM_PAIR_P:
+    return BoolGetObject(argv[0].type == OBJ_PAIR);
+  case PRIM_LIST: {
+    Object list = NIL_OBJECT;
+    for (int i = argc - 1; i >= 0; --i)
+      list = make_pair(vm->heap, argv[i], list);
+    return list;
+  }
+  case PRIM_LENGTH:
+    return FloatGetObject(list_length(argv[0]));
+  case PRIM_APPEND: {
+    Object list = argc > 0 ? argv[argc - 1] : NIL_OBJECT;
+    for (int i = argc - 2; i >= 0; --i)
+      list = list_append(vm->heap, argv[i], list);
+    return list;
+  }
+  case PRIM_REVERSE:
+    return list_reverse(vm->heap, argv[0]);
+  case PRIM_DISPLAY:
+    print_object(stdout, argv[0]);
+    return UNSPECIFIED_OBJECT;
+  case PRIM_NEWLINE:
+    fprintf(stdout, "\n");
+    return UNSPECIFIED_OBJECT;
+  default:
+    raise_error("%s: unrecognized primitive (%d)\n", __FUNCTION__, kind);
+  }
+}
@@ -0,0 +1,314 @@
+#define _GNU_SOURCE
+#include "common.h"
+
+#include <pthread.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "error_handler.h"
+#include "profiler.h"
+#include "vm.h"
+
+/* Older C libraries only name the field in the kernel's headers. */
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+/*
+ * Samples go into chunks of this many words, mapped as the previous one
+ * fills up. Room for the deepest sample, 1 + 2 * PROFILER_MAX_DEPTH words.
+ */
+#define PROFILER_CHUNK_WORDS (64 * 1024)
+/* Over an hour of samples 32 frames deep at the default rate. */
+#define PROFILER_MAX_CHUNKS 4096
+
+/* A sample never spans two chunks. */
+struct ProfileChunk {
+  struct ProfileChunk *next;
+  size_t num_words;
+  uintptr_t words[PROFILER_CHUNK_WORDS];
+};
+
+/* A frame of the stacks seen, its children are the frames it called. */
+typedef struct ProfileNode {
+  /* NULL for the frames cut off a stack deeper than PROFILER_MAX_DEPTH. */
+  CompiledFunction *fn;
+  int line;
+  /* Samples whose innermost frame this is. */
+  size_t count;
+  struct ProfileNode *child;
+  struct ProfileNode *sibling;
+} ProfileNode;
+
+/*
+ * The profiler of the calling thread. Each profiler's timer counts the CPU
+ * time of the thread that started it and sends SIGPROF to that thread alone.
+ */
+static _Thread_local Profiler *active_profiler = NULL;
+
+Profiler *make_profiler(VM *vm, int hz) {
+  Profiler *p = malloc(sizeof(Profiler));
+
+  if (!p) {
+    raise_error("%s: OOM\n", __FUNCTION__);
+  }
+  p->vm = vm;
+  p->hz = hz;
+  p->first_chunk = NULL;
+  p->last_chunk = NULL;
+  p->num_chunks = 0;
+  p->num_samples = 0;
+  p->num_dropped = 0;
+  return p;
+}
+
+/*
+ * The chunk with room for size more words, NULL if the profiler has used up
+ * its chunks or the next one cannot be mapped. Called from the SIGPROF
+ * handler: mmap is a plain system call, unlike malloc.
+ */
+static ProfileChunk *profile_chunk_for(Profiler *p, size_t size) {
+  ProfileChunk *chunk = p->last_chunk;
+
+  if (chunk && chunk->num_words + size <= PROFILER_CHUNK_WORDS)
+    return chunk;
+  if (p->num_chunks == PROFILER_MAX_CHUNKS)
+    return NULL;
+  chunk = mmap(NULL, sizeof(ProfileChunk), PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (chunk == MAP_FAILED)
+    return NULL;
+  chunk->next = NULL;
+  chunk->num_words = 0;
+  if (p->last_chunk)
+    p->last_chunk->next = chunk;
+  else
+    p->first_chunk = chunk;
+  p->last_chunk = chunk;
+  ++p->num_chunks;
+  return chunk;
+}
+
+void profiler_take_sample(Profiler *p) {
+  /* The VM may be anywhere in a call or return, read each field once. */
+  uint32_t num_frames = *(volatile uint32_t *)&p->vm->frame_pointer + 1;
+  uint32_t depth = num_frames < PROFILER_MAX_DEPTH ? num_frames
+                                                   : PROFILER_MAX_DEPTH;
+  volatile Frame *frames = p->vm->frames;
+  ProfileChunk *chunk = profile_chunk_for(p, 1 + 2 * depth);
+  uintptr_t *out;
+
+  if (!chunk) {
+    ++p->num_dropped;
+    return;
+  }
+  out = chunk->words + chunk->num_words;
+  *out++ = num_frames;
+  for (uint32_t i = num_frames - depth; i < num_frames; ++i) {
+    *out++ = (uintptr_t)frames[i].fn;
+    *out++ = (uintptr_t)frames[i].ip;
+  }
+  chunk->num_words += 1 + 2 * depth;
+  ++p->num_samples;
+}
+
+static void profiler_handle_signal(int sig) {
+  (void)sig;
+  if (active_profiler)
+    profiler_take_sample(active_profiler);
+}
+
+/*
+ * Installs the SIGPROF handler for good. Other threads may still have
+ * profilers running, so stopping one cannot put the old action back; the
+ * handler ignores ticks on threads that have no active profiler.
+ */
+static pthread_once_t handler_once = PTHREAD_ONCE_INIT;
+static bool handler_failed = false;
+
+static void install_handler_once(void) {
+  struct sigaction action;
+
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = profiler_handle_signal;
+  sigemptyset(&action.sa_mask);
+  action.sa_flags = SA_RESTART;
+  if (sigaction(SIGPROF, &action, NULL) != 0)
+    handler_failed = true;
+}
+
+static void profiler_install_handler(void) {
+  pthread_once(&handler_once, install_handler_once);
+  if (handler_failed) {
+    raise_error("%s: cannot handle SIGPROF\n", __FUNCTION__);
+  }
+}
+
+void profiler_start(Profiler *p) {
+  struct sigevent event;
+  struct itimerspec timer;
+
+  profiler_install_handler();
+  active_profiler = p;
+
+  memset(&event, 0, sizeof(event));
+  event.sigev_notify = SIGEV_THREAD_ID;
+  event.sigev_signo = SIGPROF;
+  event.sigev_notify_thread_id = gettid();
+  if (timer_create(CLOCK_THREAD_CPUTIME_ID, &event, &p->timer) != 0) {
+    active_profiler = NULL;
+    raise_error("%s: cannot create the profiling timer %m\n", __FUNCTION__);
+  }
+
+  timer.it_interval.tv_sec = 0;
+  timer.it_interval.tv_nsec = 1000000000L / p->hz;
+  timer.it_value = timer.it_interval;
+  if (timer_settime(p->timer, 0, &timer, NULL) != 0) {
+    timer_delete(p->timer);
+    active_profiler = NULL;
+    raise_error("%s: cannot start the profiling timer %m\n", __FUNCTION__);
+  }
+}
+
+void profiler_stop(Profiler *p) {
+  timer_delete(p->timer);
+  active_profiler = NULL;
+}
+
+/*
+ * The line of the code at ip in fn, 0 if unknown. Only the stack VM's ip
+ * points into CompiledFunction::instructions. A caller's ip has moved past
+ * its call already.
+ */
+static int sample_line(CompiledFunction *fn, uintptr_t ip, bool caller) {
+  uintptr_t code;
+  int offset;
+  LineEntry entry;
+
+  if (!fn->instructions || !fn->lines)
+    return 0;
+  code = (uintptr_t)instructions_data(fn->instructions);
+  if (ip < code || ip >= code + instructions_len(fn->instructions))
+    return 0;
+  offset = ip - code;
+  if (caller && offset > 0)
+    --offset;
+  return line_table_lookup(fn->lines, offset, &entry) ? entry.line : 0;
+}
+
+static ProfileNode *profile_child(ProfileNode *parent, CompiledFunction *fn,
+                                  int line) {
+  ProfileNode **link = &parent->child;
+  ProfileNode *node;
+
+  /* Children stay in the order they were first seen. */
+  for (; *link; link = &(*link)->sibling) {
+    if ((*link)->fn == fn && (*link)->line == line)
+      return *link;
+  }
+  node = malloc(sizeof(ProfileNode));
+  if (!node) {
+    raise_error("%s: OOM\n", __FUNCTION__);
+  }
+  node->fn = fn;
+  node->line = line;
+  node->count = 0;
+  node->child = NULL;
+  node->sibling = NULL;
+  *link = node;
+  return node;
+}
+
+/* Folds the samples into a tree of the stacks they saw. */
+static void profile_build_tree(Profiler *p, ProfileNode *root) {
+  for (ProfileChunk *chunk = p->first_chunk; chunk; chunk = chunk->next) {
+    const uintptr_t *words = chunk->words;
+    size_t word = 0;
+
+    while (word < chunk->num_words) {
+      uint32_t num_frames = words[word++];
+      uint32_t depth = num_frames < PROFILER_MAX_DEPTH ? num_frames
+                                                       : PROFILER_MAX_DEPTH;
+      ProfileNode *node = root;
+
+      if (depth < num_frames)
+        node = profile_child(node, NULL, 0);
+      for (uint32_t i = 0; i < depth; ++i, word += 2) {
+        CompiledFunction *fn = (CompiledFunction *)words[word];
+        /* A frame that a call has claimed but not filled in yet. */
+        if (!fn)
+          continue;
+        node = profile_child(
+            node, fn, sample_line(fn, words[word + 1], i + 1 < depth));
+      }
+      ++node->count;
+    }
+  }
+}
+
+static void write_frame(FILE *out, ProfileNode *node, bool outermost) {
+  const char *name;
+
+  if (!node->fn)
+    name = "[truncated]";
+  else if (node->fn->name)
+    name = node->fn->name;
+  else if (outermost)
+    name = "top-level";
+  else
+    name = "lambda";
+  if (node->line)
+    fprintf(out, "%s:%d", name, node->line);
+  else
+    fprintf(out, "%s", name);
+}
+
+static void write_stacks(FILE *out, ProfileNode *node, ProfileNode **path,
+                         int depth) {
+  path[depth++] = node;
+  if (node->count > 0) {
+    for (int i = 0; i < depth; ++i) {
+      if (i > 0)
+        fputc(';', out);
+      write_frame(out, path[i], i == 0);
+    }
+    fprintf(out, " %zu\n", node->count);
+  }
+  for (ProfileNode *child = node->child; child; child = child->sibling)
+    write_stacks(out, child, path, depth);
+}
+
+static void free_profile_tree(ProfileNode *node) {
+  while (node) {
+    ProfileNode *sibling = node->sibling;
+    free_profile_tree(node->child);
+    free(node);
+    node = sibling;
+  }
+}
+
+void profiler_write_folded(Profiler *p, FILE *out) {
+  ProfileNode root = {NULL, 0, 0, NULL, NULL};
+  /* The truncation marker comes on top of the deepest stack kept. */
+  ProfileNode *path[PROFILER_MAX_DEPTH + 1];
+
+  profile_build_tree(p, &root);
+  for (ProfileNode *node = root.child; node; node = node->sibling)
+    write_stacks(out, node, path, 0);
+  free_profile_tree(root.child);
+  if (p->num_dropped > 0)
+    fprintf(stderr, "%s: %zu of %zu samples did not fit\n", __FUNCTION__,
+            p->num_dropped, p->num_samples + p->num_dropped);
+}
+
+void free_profiler(Profiler *p) {
+  ProfileChunk *chunk = p->first_chunk;
+
+  while (chunk) {
+    ProfileChunk *next = chunk->next;
+    munmap(chunk, sizeof(ProfileChunk));
+    chunk = next;
+  }
+  free(p);
+}
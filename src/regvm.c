@@ -0,0 +1,545 @@
+#include "common.h"
+
+#include "bytecode.h"
+#include "error_handler.h"
+#include "primitive.h"
+#include "regvm.h"
+#include "vm.h"
+
+#define REGVM_MAX_REGISTERS 256
+
+static const char *reg_opcode_names[ROP_LAST] = {
+    [ROP_LOADK] = "LOADK",
+    [ROP_MOVE] = "MOVE",
+    [ROP_GET_GLOBAL] = "GET_GLOBAL",
+    [ROP_DEFINE_GLOBAL] = "DEFINE_GLOBAL",
+    [ROP_SET_GLOBAL] = "SET_GLOBAL",
+    [ROP_JUMP] = "JUMP",
+    [ROP_JUMP_IF_FALSE] = "JUMP_IF_FALSE",
+    [ROP_GET_FREE] = "GET_FREE",
+    [ROP_GET_FREE_BOX] = "GET_FREE_BOX",
+    [ROP_SET_FREE_BOX] = "SET_FREE_BOX",
+    [ROP_GET_LOCAL_BOX] = "GET_LOCAL_BOX",
+    [ROP_SET_LOCAL_BOX] = "SET_LOCAL_BOX",
+    [ROP_BOX_LOCAL] = "BOX_LOCAL",
+    [ROP_CLOSURE] = "CLOSURE",
+    [ROP_STACK_CLOSURE] = "STACK_CLOSURE",
+    [ROP_STACK_CONS] = "STACK_CONS",
+    [ROP_CALL] = "CALL",
+    [ROP_TAIL_CALL] = "TAIL_CALL",
+    [ROP_EQ_CONSTANT] = "EQ_CONSTANT",
+    [ROP_RETURN] = "RETURN",
+    [ROP_HALT] = "HALT",
+    [ROP_BRANCH_NUM_EQ] = "BRANCH_NUM_EQ",
+    [ROP_BRANCH_LT] = "BRANCH_LT",
+    [ROP_BRANCH_GT] = "BRANCH_GT",
+    [ROP_BRANCH_LE] = "BRANCH_LE",
+    [ROP_BRANCH_GE] = "BRANCH_GE",
+    [ROP_ADD] = "ADD",
+    [ROP_SUB] = "SUB",
+    [ROP_MUL] = "MUL",
+    [ROP_DIV] = "DIV",
+    [ROP_NUM_EQ] = "NUM_EQ",
+    [ROP_LT] = "LT",
+    [ROP_GT] = "GT",
+    [ROP_LE] = "LE",
+    [ROP_GE] = "GE",
+    [ROP_NOT] = "NOT",
+    [ROP_EQ] = "EQ",
+    [ROP_CONS] = "CONS",
+    [ROP_CAR] = "CAR",
+    [ROP_CDR] = "CDR",
+    [ROP_NULL_P] = "NULL_P",
+    [ROP_PAIR_P] = "PAIR_P",
+};
+
+_Static_assert(ROP_PAIR_P - ROP_ADD == PRIM_LAST_INLINE - PRIM_ADD,
+               "register opcodes of inlined primitives are out of sync");
+
+static inline bool reg_op_is_inline_primitive(uint8_t op) {
+  return op >= ROP_ADD && op <= ROP_PAIR_P;
+}
+
+int reg_instruction_length(const uint8_t *ip) {
+  if (reg_op_is_inline_primitive(*ip))
+    return 2 + primitive_inline_argc(reg_op_primitive(*ip));
+
+  switch (*ip) {
+  case ROP_BOX_LOCAL:
+  case ROP_RETURN:
+  case ROP_HALT:
+    return 2;
+  case ROP_MOVE:
+  case ROP_JUMP:
+  case ROP_GET_FREE:
+  case ROP_GET_FREE_BOX:
+  case ROP_SET_FREE_BOX:
+  case ROP_GET_LOCAL_BOX:
+  case ROP_SET_LOCAL_BOX:
+  case ROP_CALL:
+  case ROP_TAIL_CALL:
+    return 3;
+  case ROP_LOADK:
+  case ROP_DEFINE_GLOBAL:
+  case ROP_JUMP_IF_FALSE:
+  case ROP_BRANCH_NUM_EQ:
+  case ROP_BRANCH_LT:
+  case ROP_BRANCH_GT:
+  case ROP_BRANCH_LE:
+  case ROP_BRANCH_GE:
+    return 4;
+  case ROP_EQ_CONSTANT:
+  case ROP_STACK_CONS:
+    return 5;
+  case ROP_GET_GLOBAL:
+  case ROP_SET_GLOBAL:
+    return 4 + VM_GLOBAL_CACHE_SIZE;
+  case ROP_CLOSURE:
+    return 5 + 2 * ip[4];
+  case ROP_STACK_CLOSURE:
+    return 6 + 2 * ip[5];
+  default:
+    raise_error("%s: unknown register opcode %d\n", __FUNCTION__, *ip);
+  }
+}
+
+static void disassemble_register_instruction(FILE *output_file,
+                                             ObjectsPool *constants,
+                                             const uint8_t *ip) {
+  const char *name = *ip < ROP_LAST ? reg_opcode_names[*ip] : "UNKNOWN";
+  uint16_t constant_idx;
+
+  fprintf(output_file, "%-14s ", name);
+  switch (*ip) {
+  case ROP_LOADK:
+    constant_idx = read_uint16(ip + 2);
+    fprintf(output_file, "r%d, %d ; ", ip[1], constant_idx);
+    print_object(output_file, objects_pool_get(constants, constant_idx));
+    break;
+  case ROP_GET_GLOBAL:
+  case ROP_SET_GLOBAL:
+  case ROP_DEFINE_GLOBAL:
+    constant_idx = read_uint16(ip + 1);
+    fprintf(output_file, "r%d, %d ; ",
+            ip[*ip == ROP_DEFINE_GLOBAL ? 3 : 3 + VM_GLOBAL_CACHE_SIZE],
+            constant_idx);
+    print_object(output_file, objects_pool_get(constants, constant_idx));
+    break;
+  case ROP_JUMP:
+    fprintf(output_file, "-> %d", read_uint16(ip + 1));
+    break;
+  case ROP_JUMP_IF_FALSE:
+    fprintf(output_file, "r%d -> %d", ip[3], read_uint16(ip + 1));
+    break;
+  case ROP_GET_FREE:
+  case ROP_GET_FREE_BOX:
+  case ROP_GET_LOCAL_BOX:
+  case ROP_CALL:
+  case ROP_TAIL_CALL:
+    fprintf(output_file, "r%d, %d", ip[1], ip[2]);
+    break;
+  case ROP_SET_FREE_BOX:
+  case ROP_SET_LOCAL_BOX:
+    fprintf(output_file, "%d, r%d", ip[1], ip[2]);
+    break;
+  case ROP_BOX_LOCAL:
+  case ROP_HALT:
+    fprintf(output_file, "%d", ip[1]);
+    break;
+  case ROP_RETURN:
+    fprintf(output_file, "r%d", ip[1]);
+    break;
+  case ROP_MOVE:
+    fprintf(output_file, "r%d, r%d", ip[1], ip[2]);
+    break;
+  case ROP_EQ_CONSTANT:
+    constant_idx = read_uint16(ip + 3);
+    fprintf(output_file, "r%d, r%d, %d ; ", ip[1], ip[2], constant_idx);
+    print_object(output_file, objects_pool_get(constants, constant_idx));
+    break;
+  case ROP_CLOSURE:
+    fprintf(output_file, "r%d, %d ;", ip[1], read_uint16(ip + 2));
+    for (int i = 0; i < ip[4]; ++i)
+      fprintf(output_file, " %s %d", ip[5 + 2 * i] ? "local" : "free",
+              ip[6 + 2 * i]);
+    break;
+  case ROP_STACK_CLOSURE:
+    fprintf(output_file, "r%d, %d @%d ;", ip[1], read_uint16(ip + 2), ip[4]);
+    for (int i = 0; i < ip[5]; ++i)
+      fprintf(output_file, " %s %d", ip[6 + 2 * i] ? "local" : "free",
+              ip[7 + 2 * i]);
+    break;
+  case ROP_STACK_CONS:
+    fprintf(output_file, "r%d, r%d, r%d @%d", ip[1], ip[2], ip[3], ip[4]);
+    break;
+  default:
+    fprintf(output_file, "r%d", ip[1]);
+    for (int i = 2; i < reg_instruction_length(ip); ++i)
+      fprintf(output_file, ", r%d", ip[i]);
+    break;
+  }
+}
+
+void disassemble_register_instructions(FILE *output_file,
+                                       ObjectsPool *constants,
+                                       Instructions *instructions) {
+  uint8_t *code = instructions_data(instructions);
+  int len = instructions_len(instructions);
+
+  for (int offset = 0; offset < len;
+       offset += reg_instruction_length(code + offset)) {
+    fprintf(output_file, "%04d  ", offset);
+    disassemble_register_instruction(output_file, constants, code + offset);
+    fprintf(output_file, "\n");
+  }
+}
+
+/*
+ * The translation walks the stack bytecode once, keeping track of which
+ * register holds each operand stack entry. An entry at depth d normally
+ * lives in temporary register num_locals + d, except that GET_LOCAL only
+ * records the local's own register. Such aliases are copied into their
+ * temporary before the local is written, and before any jump or jump target,
+ * where all entries have to be in their temporaries.
+ */
+typedef struct Registerizer {
+  const uint8_t *code;
+  int len;
+  int num_locals;
+  Instructions *out;
+  /* The register of each operand stack entry. */
+  uint8_t regs[REGVM_MAX_REGISTERS];
+  int depth;
+  int max_depth;
+  /* Indexed by stack bytecode offset. */
+  bool *is_target;
+  int *target_depth;
+  int *new_offset;
+  /* Pairs of (operand offset in out, stack bytecode target). */
+  Vector *jump_fixups;
+} Registerizer;
+
+static inline uint8_t temp_reg(Registerizer *r, int depth) {
+  return r->num_locals + depth;
+}
+
+static inline void emit(Registerizer *r, uint8_t byte) {
+  instructions_append(r->out, byte);
+}
+
+static inline void emit_uint16(Registerizer *r, uint16_t val) {
+  emit(r, val & 0xff);
+  emit(r, (val >> 8) & 0xff);
+}
+
+static void emit_jump_target(Registerizer *r, uint16_t target) {
+  vector_append(r->jump_fixups, Int64GetDatum(instructions_len(r->out)));
+  vector_append(r->jump_fixups, Int64GetDatum(target));
+  emit_uint16(r, 0);
+}
+
+/* Pushes an entry held in reg, returns the register of the new entry. */
+static uint8_t push_entry(Registerizer *r, uint8_t reg) {
+  if (r->num_locals + r->depth + 1 >= REGVM_MAX_REGISTERS) {
+    raise_error("%s: too many registers\n", __FUNCTION__);
+  }
+  r->regs[r->depth++] = reg;
+  if (r->depth > r->max_depth)
+    r->max_depth = r->depth;
+  return reg;
+}
+
+static uint8_t pop_entry(Registerizer *r) {
+  if (r->depth == 0) {
+    raise_error("%s: operand stack underflow\n", __FUNCTION__);
+  }
+  return r->regs[--r->depth];
+}
+
+static inline uint8_t top_entry(Registerizer *r) {
+  return r->regs[r->depth - 1];
+}
+
+/* Copies the aliased entries at depths [from, to) into their temporaries. */
+static void materialize(Registerizer *r, int from, int to) {
+  for (int i = from; i < to; ++i) {
+    if (r->regs[i] == temp_reg(r, i))
+      continue;
+    emit(r, ROP_MOVE);
+    emit(r, temp_reg(r, i));
+    emit(r, r->regs[i]);
+    r->regs[i] = temp_reg(r, i);
+  }
+}
+
+static void materialize_local(Registerizer *r, uint8_t slot) {
+  for (int i = 0; i < r->depth; ++i) {
+    if (r->regs[i] != slot)
+      continue;
+    emit(r, ROP_MOVE);
+    emit(r, temp_reg(r, i));
+    emit(r, slot);
+    r->regs[i] = temp_reg(r, i);
+  }
+}
+
+static void record_target_depth(Registerizer *r, int target) {
+  if (target > r->len) {
+    raise_error("%s: jump out of the function\n", __FUNCTION__);
+  }
+  r->target_depth[target] = r->depth;
+}
+
+static void registerize_inline_primitive(Registerizer *r, int offset) {
+  PrimitiveKind kind = inline_op_primitive(r->code[offset]);
+  int argc = primitive_inline_argc(kind);
+  int next = offset + 1;
+  uint8_t args[2];
+  bool branch = kind >= PRIM_NUM_EQ && kind <= PRIM_GE && next < r->len &&
+                r->code[next] == OP_JUMP_IF_FALSE && !r->is_target[next];
+
+  if (branch) {
+    /* The jump that follows must come right after, with nothing to move. */
+    materialize(r, 0, r->depth - argc);
+  }
+  for (int i = argc - 1; i >= 0; --i)
+    args[i] = pop_entry(r);
+
+  emit(r, branch ? ROP_BRANCH_NUM_EQ + (kind - PRIM_NUM_EQ)
+                 : ROP_ADD + (kind - PRIM_ADD));
+  emit(r, push_entry(r, temp_reg(r, r->depth)));
+  for (int i = 0; i < argc; ++i)
+    emit(r, args[i]);
+}
+
+/* Translates one instruction, returns false after one control never leaves
+   in sequence. */
+static bool registerize_instruction(Registerizer *r, int offset) {
+  const uint8_t *ip = r->code + offset;
+  uint8_t reg;
+
+  if (*ip >= OP_ADD && *ip <= OP_PAIR_P) {
+    registerize_inline_primitive(r, offset);
+    return true;
+  }
+
+  switch (*ip) {
+  case OP_CONSTANT:
+    emit(r, ROP_LOADK);
+    emit(r, push_entry(r, temp_reg(r, r->depth)));
+    emit_uint16(r, read_uint16(ip + 1));
+    return true;
+  case OP_POP:
+    pop_entry(r);
+    return true;
+  case OP_GET_LOCAL:
+    push_entry(r, ip[1]);
+    return true;
+  case OP_SET_LOCAL:
+    materialize_local(r, ip[1]);
+    if (top_entry(r) != ip[1]) {
+      emit(r, ROP_MOVE);
+      emit(r, ip[1]);
+      emit(r, top_entry(r));
+    }
+    return true;
+  case OP_GET_LOCAL_BOX:
+  case OP_GET_FREE:
+  case OP_GET_FREE_BOX:
+    emit(r, *ip == OP_GET_LOCAL_BOX ? ROP_GET_LOCAL_BOX
+            : *ip == OP_GET_FREE    ? ROP_GET_FREE
+                                    : ROP_GET_FREE_BOX);
+    emit(r, push_entry(r, temp_reg(r, r->depth)));
+    emit(r, ip[1]);
+    return true;
+  case OP_SET_LOCAL_BOX:
+  case OP_SET_FREE_BOX:
+    emit(r, *ip == OP_SET_LOCAL_BOX ? ROP_SET_LOCAL_BOX : ROP_SET_FREE_BOX);
+    emit(r, ip[1]);
+    emit(r, top_entry(r));
+    return true;
+  case OP_BOX_LOCAL:
+    materialize_local(r, ip[1]);
+    emit(r, ROP_BOX_LOCAL);
+    emit(r, ip[1]);
+    return true;
+  case OP_CLOSURE:
+  case OP_STACK_CLOSURE:
+    emit(r, *ip == OP_CLOSURE ? ROP_CLOSURE : ROP_STACK_CLOSURE);
+    emit(r, push_entry(r, temp_reg(r, r->depth)));
+    for (int i = 1; i < instruction_length(ip); ++i)
+      emit(r, ip[i]);
+    return true;
+  case OP_STACK_CONS: {
+    uint8_t cdr = pop_entry(r);
+    uint8_t car = pop_entry(r);
+    emit(r, ROP_STACK_CONS);
+    emit(r, push_entry(r, temp_reg(r, r->depth)));
+    emit(r, car);
+    emit(r, cdr);
+    emit(r, ip[1]);
+    return true;
+  }
+  case OP_GET_GLOBAL:
+  case OP_SET_GLOBAL:
+    emit(r, *ip == OP_GET_GLOBAL ? ROP_GET_GLOBAL : ROP_SET_GLOBAL);
+    emit_uint16(r, read_uint16(ip + 1));
+    for (size_t i = 0; i < VM_GLOBAL_CACHE_SIZE; ++i)
+      emit(r, 0);
+    emit(r, *ip == OP_GET_GLOBAL ? push_entry(r, temp_reg(r, r->depth))
+                                 : top_entry(r));
+    return true;
+  case OP_DEFINE_GLOBAL:
+    emit(r, ROP_DEFINE_GLOBAL);
+    emit_uint16(r, read_uint16(ip + 1));
+    emit(r, top_entry(r));
+    return true;
+  case OP_JUMP:
+    materialize(r, 0, r->depth);
+    emit(r, ROP_JUMP);
+    emit_jump_target(r, read_uint16(ip + 1));
+    record_target_depth(r, read_uint16(ip + 1));
+    return false;
+  case OP_JUMP_IF_FALSE:
+    reg = pop_entry(r);
+    materialize(r, 0, r->depth);
+    emit(r, ROP_JUMP_IF_FALSE);
+    emit_jump_target(r, read_uint16(ip + 1));
+    emit(r, reg);
+    record_target_depth(r, read_uint16(ip + 1));
+    return true;
+  case OP_PROC_CALL:
+  case OP_TAIL_CALL:
+    /* The callee and its arguments go to consecutive temporaries. */
+    if (r->depth < ip[1] + 1) {
+      raise_error("%s: operand stack underflow\n", __FUNCTION__);
+    }
+    materialize(r, r->depth - ip[1] - 1, r->depth);
+    r->depth -= ip[1] + 1;
+    emit(r, *ip == OP_PROC_CALL ? ROP_CALL : ROP_TAIL_CALL);
+    emit(r, push_entry(r, temp_reg(r, r->depth)));
+    emit(r, ip[1]);
+    /* A tail call of a primitive returns here, the RETURN follows. */
+    return true;
+  case OP_EQ_CONSTANT:
+    reg = pop_entry(r);
+    emit(r, ROP_EQ_CONSTANT);
+    emit(r, push_entry(r, temp_reg(r, r->depth)));
+    emit(r, reg);
+    emit_uint16(r, read_uint16(ip + 1));
+    return true;
+  case OP_RETURN:
+    emit(r, ROP_RETURN);
+    emit(r, top_entry(r));
+    return false;
+  case OP_LAST:
+    materialize(r, 0, r->depth);
+    emit(r, ROP_HALT);
+    emit(r, r->depth);
+    return false;
+  default:
+    raise_error("%s: cannot translate %s\n", __FUNCTION__, opcode_name(*ip));
+  }
+}
+
+void registerize_function(CompiledFunction *fn) {
+  Registerizer r;
+  bool reachable = true;
+
+  r.code = instructions_data(fn->instructions);
+  r.len = instructions_len(fn->instructions);
+  r.num_locals = fn->num_locals;
+  r.out = make_instructions();
+  r.depth = 0;
+  r.max_depth = 0;
+  r.is_target = calloc(r.len + 1, sizeof(bool));
+  r.target_depth = malloc((r.len + 1) * sizeof(int));
+  r.new_offset = malloc((r.len + 1) * sizeof(int));
+  r.jump_fixups = make_vector();
+  if (!r.is_target || !r.target_depth || !r.new_offset) {
+    raise_error("%s: OOM\n", __FUNCTION__);
+  }
+
+  for (int offset = 0; offset < r.len;
+       offset += instruction_length(r.code + offset)) {
+    if (opcode_is_jump(r.code[offset]))
+      r.is_target[read_uint16(r.code + offset + 1)] = true;
+  }
+  for (int i = 0; i <= r.len; ++i) {
+    r.target_depth[i] = -1;
+    r.new_offset[i] = -1;
+  }
+
+  for (int offset = 0; offset < r.len;
+       offset += instruction_length(r.code + offset)) {
+    if (r.is_target[offset]) {
+      if (reachable)
+        materialize(&r, 0, r.depth);
+      else if (r.target_depth[offset] >= 0)
+        r.depth = r.target_depth[offset];
+      else
+        continue;
+      for (int i = 0; i < r.depth; ++i)
+        r.regs[i] = temp_reg(&r, i);
+      reachable = true;
+    }
+    /* Code after a jump that nothing jumps to is dead. */
+    if (!reachable)
+      continue;
+    r.new_offset[offset] = instructions_len(r.out);
+    reachable = registerize_instruction(&r, offset);
+  }
+  r.new_offset[r.len] = instructions_len(r.out);
+
+  for (int i = 0; i < vector_len(r.jump_fixups); i += 2) {
+    int operand = DatumGetInt64(vector_get(r.jump_fixups, i));
+    int target = DatumGetInt64(vector_get(r.jump_fixups, i + 1));
+    uint8_t *code = instructions_data(r.out);
+    if (r.new_offset[target] < 0) {
+      raise_error("%s: jump to untranslated code\n", __FUNCTION__);
+    }
+    code[operand] = r.new_offset[target] & 0xff;
+    code[operand + 1] = (r.new_offset[target] >> 8) & 0xff;
+  }
+
+  fn->register_instructions = r.out;
+  fn->num_registers = r.num_locals + r.max_depth;
+
+  free(r.is_target);
+  free(r.target_depth);
+  free(r.new_offset);
+  free_vector(r.jump_fixups);
+}
+
+void registerize_program(VM *vm, FILE *dump_file) {
+  CompiledFunction *top_level = vm->frames[0].fn;
+
+  registerize_function(top_level);
+  if (dump_file) {
+    fprintf(dump_file, "== top-level (%d registers) ==\n",
+            top_level->num_registers);
+    disassemble_register_instructions(dump_file, vm->constants,
+                                      top_level->register_instructions);
+  }
+
+  for (int i = 0; i < objects_pool_len(vm->constants); ++i) {
+    Object val = objects_pool_get(vm->constants, i);
+    CompiledFunction *fn;
+    if (val.type != OBJ_PROCEDURE)
+      continue;
+    fn = DatumGetPtr(val.value);
+    /* Stubs are translated once their body is compiled. */
+    if (fn->lazy)
+      continue;
+    registerize_function(fn);
+    if (dump_file) {
+      fprintf(dump_file, "== procedure %d (%d registers) ==\n", i,
+              fn->num_registers);
+      disassemble_register_instructions(dump_file, vm->constants,
+                                        fn->register_instructions);
+    }
+  }
+
+  vm->use_registers = true;
+  vm->frames[0].ip = instructions_data(top_level->register_instructions);
+}
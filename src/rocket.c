@@ -0,0 +1,390 @@
+#include "common.h"
+
+#include <setjmp.h>
+#include <stdarg.h>
+
+#include "ast.h"
+#include "compiler.h"
+#include "error_handler.h"
+#include "heap.h"
+#include "jit.h"
+#include "optimizer.h"
+#include "parser.h"
+#include "rocket.h"
+#include "runtime.h"
+#include "symbol.h"
+#include "tokenizer.h"
+#include "verifier.h"
+#include "vm.h"
+
+struct Rocket {
+  /*
+   * The compiler works on the VM's constants and heap, and stays around for
+   * the bodies that lazy compilation leaves for the first call.
+   */
+  Compiler compiler;
+  VM vm;
+  RocketOptions options;
+  /*
+   * Every program compiled (Vector * of AstNode *). Lazy bodies and inlined
+   * procedures are compiled from their nodes later on.
+   */
+  Vector *programs;
+  char error_message[ERROR_MESSAGE_SIZE];
+};
+
+/*
+ * A native defined through rocket_define_native. The VM calls every one of
+ * them as a variadic native, host_native_call finds the rest from base.
+ */
+typedef struct HostNative {
+  Native base;
+  Rocket *rocket;
+  RocketNative fn;
+  int arity;
+} HostNative;
+
+static Object object_of(RocketValue value) {
+  return make_object((ObjectType)value.tag, (Datum)value.bits);
+}
+
+static RocketValue value_of(Object obj) {
+  return (RocketValue){.tag = obj.type, .bits = obj.value};
+}
+
+RocketOptions rocket_default_options(void) {
+  return (RocketOptions){
+      .optimization_level = 1,
+      .inline_budget = 16,
+      .jit_threshold = -1,
+      .specialize_threshold = 100,
+      .lazy = true,
+  };
+}
+
+static void optimize_lazy_body(CompiledFunction *fn) {
+  peephole_optimize(fn->instructions, fn->lines);
+}
+
+/* Keeps the message of the error handler caught, the handler is popped. */
+static RocketStatus rocket_fail(Rocket *r, ErrorHandler *handler) {
+  memcpy(r->error_message, handler->message, sizeof(r->error_message));
+  return ROCKET_ERROR;
+}
+
+Rocket *rocket_create(const RocketOptions *options) {
+  Rocket *r = malloc(sizeof(Rocket));
+  Compiler *c;
+  Instructions *instructions;
+  ErrorHandler handler;
+
+  if (!r)
+    return NULL;
+  r->options = options ? *options : rocket_default_options();
+  r->programs = make_vector();
+  r->error_message[0] = '\0';
+
+  push_error_handler(&handler);
+  if (setjmp(handler.env)) {
+    free_vector(r->programs);
+    free(r);
+    return NULL;
+  }
+
+  c = &r->compiler;
+  initialize_compiler(c);
+  c->lazy = r->options.lazy;
+  if (r->options.optimization_level >= 1) {
+    c->inline_budget = r->options.inline_budget;
+    c->finish_lazy = optimize_lazy_body;
+  }
+  /*
+   * Escape analysis needs the whole program, and later programs may keep
+   * what an earlier one built in its frame. Everything goes on the heap.
+   */
+  c->stack_allocate = false;
+
+  /*
+   * Frame 0 never runs code of its own, rocket_call stops each run when the
+   * procedure returns to a frame of this code.
+   */
+  instructions = compiler_give_out_instructions(c);
+  instructions_append(instructions, OP_LAST);
+  initialize_vm(&r->vm, instructions, c->constants, /*globals=*/NULL,
+                c->heap);
+  if (r->options.optimization_level >= 1)
+    r->vm.specialize_threshold = r->options.specialize_threshold;
+  if (jit_supported())
+    r->vm.jit_threshold = r->options.jit_threshold;
+
+  pop_error_handler(&handler);
+  return r;
+}
+
+void rocket_destroy(Rocket *r) {
+  /* The VM frees the constants and the heap. */
+  compiler_give_out_constants(&r->compiler);
+  compiler_give_out_heap(&r->compiler);
+  destroy_compiler(&r->compiler);
+  destroy_vm(&r->vm);
+  for (int i = 0; i < vector_len(r->programs); ++i) {
+    Vector *program = DatumGetPtr(vector_get(r->programs, i));
+    for (int j = 0; j < vector_len(program); ++j)
+      free_ast_node(DatumGetPtr(vector_get(program, j)));
+    free_vector(program);
+  }
+  free_vector(r->programs);
+  free(r);
+}
+
+/* Compiles program into the body of a procedure of no arguments. */
+static CompiledFunction *compile_procedure(Rocket *r, Vector *program) {
+  Compiler *c = &r->compiler;
+  int first = objects_pool_len(c->constants);
+  int len = vector_len(program);
+  CompiledFunction *fn;
+
+  c->instructions = make_instructions();
+  for (int i = 0; i < len; ++i) {
+    compile_expression(c, DatumGetPtr(vector_get(program, i)));
+    if (i != len - 1)
+      compiler_emit_instruction(c, OP_POP);
+  }
+  if (len == 0) {
+    uint16_t constant = compiler_add_constant(c, UNSPECIFIED_OBJECT);
+    compiler_emit_instruction(c, OP_CONSTANT);
+    compiler_emit_instruction(c, constant & 0xff);
+    compiler_emit_instruction(c, constant >> 8);
+  }
+  compiler_emit_instruction(c, OP_RETURN);
+  optimize_program(c->constants, c->instructions, first,
+                   r->options.optimization_level, /*dump_file=*/NULL);
+
+  fn = make_compiled_function(c->heap, compiler_give_out_instructions(c), 0);
+  compiler_add_constant(c, make_object(OBJ_PROCEDURE, PointerGetDatum(fn)));
+  verify_code(c->constants, fn, first);
+  return fn;
+}
+
+RocketStatus rocket_compile(Rocket *r, const char *name, const char *source,
+                            RocketValue *procedure) {
+  char *program = strdup(source);
+  Tokenizer tokenizer;
+  Vector *parsed_program;
+  CompiledFunction *fn;
+  ErrorHandler handler;
+
+  if (!program) {
+    snprintf(r->error_message, sizeof(r->error_message), "%s: OOM",
+             __FUNCTION__);
+    return ROCKET_ERROR;
+  }
+  initialize_tokenizer(&tokenizer, name, program);
+
+  push_error_handler(&handler);
+  if (setjmp(handler.env)) {
+    /* What the compiler was in the middle of is dropped. */
+    compiler_reset(&r->compiler);
+    destroy_tokenizer(&tokenizer);
+    free(program);
+    return rocket_fail(r, &handler);
+  }
+
+  parsed_program = parse_program(&tokenizer);
+  /* Kept even if it fails to compile, lambdas may refer to it by now. */
+  vector_append(r->programs, PointerGetDatum(parsed_program));
+  fn = compile_procedure(r, parsed_program);
+  pop_error_handler(&handler);
+
+  destroy_tokenizer(&tokenizer);
+  free(program);
+  *procedure = value_of(make_object(OBJ_PROCEDURE, PointerGetDatum(fn)));
+  return ROCKET_OK;
+}
+
+RocketStatus rocket_eval(Rocket *r, const char *name, const char *source,
+                         RocketValue *result) {
+  RocketValue procedure;
+
+  if (rocket_compile(r, name, source, &procedure) != ROCKET_OK)
+    return ROCKET_ERROR;
+  return rocket_call(r, procedure, 0, NULL, result);
+}
+
+RocketStatus rocket_call(Rocket *r, RocketValue procedure, int argc,
+                         const RocketValue *argv, RocketValue *result) {
+  VM *vm = &r->vm;
+  uint32_t stack_pointer = vm->stack_pointer;
+  uint32_t frame_pointer = vm->frame_pointer;
+  ErrorHandler handler;
+  Frame *frame;
+
+  push_error_handler(&handler);
+  if (setjmp(handler.env)) {
+    /* Unwind whatever the procedure had on the stacks. */
+    vm->stack_pointer = stack_pointer;
+    vm->frame_pointer = frame_pointer;
+    compiler_reset(&r->compiler);
+    return rocket_fail(r, &handler);
+  }
+
+  if (argc < 0 || argc > UINT8_MAX) {
+    raise_error("%s: bad number of arguments %d\n", __FUNCTION__, argc);
+  }
+  if (vm->frame_pointer + 1 >= VM_FRAME_MAX_DEPTH ||
+      vm->stack_pointer + argc + 1 >= VM_STACK_MAX_DEPTH) {
+    raise_error("%s: stack overflow\n", __FUNCTION__);
+  }
+
+  /*
+   * A frame of frame 0's code, which is only OP_LAST: the run ends once the
+   * procedure returns to it. Calls from natives nest the same way.
+   */
+  frame = &vm->frames[++vm->frame_pointer];
+  frame->fn = vm->frames[0].fn;
+  frame->ip = instructions_data(frame->fn->instructions);
+  frame->base_pointer = vm->stack_pointer;
+  vm_push(vm, object_of(procedure));
+  for (int i = 0; i < argc; ++i)
+    vm_push(vm, object_of(argv[i]));
+  /* Primitives and natives are done when vm_call returns. */
+  if (vm_call(vm, frame, argc, /*tail=*/false) != frame)
+    vm_run(vm);
+  *result = value_of(vm_pop(vm));
+
+  vm->stack_pointer = stack_pointer;
+  vm->frame_pointer = frame_pointer;
+  pop_error_handler(&handler);
+  return ROCKET_OK;
+}
+
+RocketStatus rocket_lookup(Rocket *r, const char *name, RocketValue *value) {
+  bool exists;
+  Object val = symbol_table_find(r->vm.globals, name, &exists);
+
+  if (!exists) {
+    snprintf(r->error_message, sizeof(r->error_message),
+             "%s: unbound variable \"%s\"", __FUNCTION__, name);
+    return ROCKET_ERROR;
+  }
+  *value = value_of(val);
+  return ROCKET_OK;
+}
+
+void rocket_define(Rocket *r, const char *name, RocketValue value) {
+  vm_define_global(&r->vm, name, object_of(value));
+}
+
+/* The native itself sits right below its arguments on VM::stack. */
+static Object host_native_call(VM *vm, int argc, Object *argv) {
+  HostNative *native = (HostNative *)ObjectGetNative(argv[-1]);
+  RocketValue args[UINT8_MAX];
+
+  (void)vm;
+  if (native->arity >= 0 && native->arity != argc) {
+    raise_error("%s: %s: expected %d arguments, got %d\n", __FUNCTION__,
+                native->base.name, native->arity, argc);
+  }
+  for (int i = 0; i < argc; ++i)
+    args[i] = value_of(argv[i]);
+  return object_of(native->fn(native->rocket, argc, args));
+}
+
+void rocket_define_native(Rocket *r, const char *name, RocketNative fn,
+                          int arity) {
+  HostNative *native = heap_alloc(r->vm.heap, sizeof(HostNative));
+
+  native->base.name = heap_intern_symbol(r->vm.heap, name);
+  native->base.arity = -1;
+  native->base.fn.fnv = host_native_call;
+  native->rocket = r;
+  native->fn = fn;
+  native->arity = arity;
+  vm_define_global(&r->vm, name,
+                   make_object(OBJ_NATIVE, PointerGetDatum(native)));
+}
+
+void rocket_raise(const char *format, ...) {
+  char message[ERROR_MESSAGE_SIZE];
+  va_list args;
+
+  va_start(args, format);
+  vsnprintf(message, sizeof(message), format, args);
+  va_end(args);
+  raise_error("%s", message);
+}
+
+const char *rocket_error_message(Rocket *r) {
+  return r->error_message;
+}
+
+RocketType rocket_type(RocketValue value) {
+  switch ((ObjectType)value.tag) {
+  case OBJ_NIL:
+    return ROCKET_NIL;
+  case OBJ_BOOL:
+    return ROCKET_BOOL;
+  case OBJ_NUMBER:
+    return ROCKET_NUMBER;
+  case OBJ_SYMBOL:
+    return ROCKET_SYMBOL;
+  case OBJ_PAIR:
+    return ROCKET_PAIR;
+  case OBJ_PROCEDURE:
+  case OBJ_CLOSURE:
+  case OBJ_PRIMITIVE:
+  case OBJ_NATIVE:
+    return ROCKET_PROCEDURE;
+  default:
+    return ROCKET_UNSPECIFIED;
+  }
+}
+
+bool rocket_eq(RocketValue a, RocketValue b) {
+  return object_eq(object_of(a), object_of(b));
+}
+
+RocketValue rocket_nil(void) {
+  return value_of(NIL_OBJECT);
+}
+
+RocketValue rocket_bool(bool b) {
+  return value_of(BoolGetObject(b));
+}
+
+bool rocket_truthy(RocketValue value) {
+  return !ObjectIsFalse(object_of(value));
+}
+
+RocketValue rocket_number(double number) {
+  return value_of(FloatGetObject(number));
+}
+
+double rocket_number_value(RocketValue value) {
+  assert(value.tag == OBJ_NUMBER);
+  return DatumGetFloat(value.bits);
+}
+
+RocketValue rocket_symbol(Rocket *r, const char *name) {
+  return value_of(make_object(
+      OBJ_SYMBOL, CStringGetDatum(heap_intern_symbol(r->vm.heap, name))));
+}
+
+const char *rocket_symbol_name(RocketValue value) {
+  assert(value.tag == OBJ_SYMBOL);
+  return DatumGetCString(value.bits);
+}
+
+RocketValue rocket_cons(Rocket *r, RocketValue car, RocketValue cdr) {
+  return value_of(make_pair(r->vm.heap, object_of(car), object_of(cdr)));
+}
+
+RocketValue rocket_car(RocketValue pair) {
+  assert(pair.tag == OBJ_PAIR);
+  return value_of(ObjectGetPair(object_of(pair))->car);
+}
+
+RocketValue rocket_cdr(RocketValue pair) {
+  assert(pair.tag == OBJ_PAIR);
+  return value_of(ObjectGetPair(object_of(pair))->cdr);
+}
@@ -0,0 +1,176 @@
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "rocket.h"
+
+static double number_of(RocketValue val) {
+  assert(rocket_type(val) == ROCKET_NUMBER);
+  return rocket_number_value(val);
+}
+
+static double eval_number(Rocket *r, const char *source) {
+  RocketValue result;
+  assert(rocket_eval(r, "rocket_test", source, &result) == ROCKET_OK);
+  return number_of(result);
+}
+
+static bool eval_fails_with(Rocket *r, const char *source,
+                            const char *message) {
+  RocketValue result;
+  if (rocket_eval(r, "rocket_test", source, &result) != ROCKET_ERROR)
+    return false;
+  return strstr(rocket_error_message(r), message) != NULL;
+}
+
+/* (twice f x) calls back into the runtime it was called from. */
+static RocketValue native_twice(Rocket *r, int argc, const RocketValue *argv) {
+  RocketValue result;
+  (void)argc;
+  if (rocket_call(r, argv[0], 1, &argv[1], &result) != ROCKET_OK ||
+      rocket_call(r, argv[0], 1, &result, &result) != ROCKET_OK)
+    rocket_raise("twice: %s\n", rocket_error_message(r));
+  return result;
+}
+
+static RocketValue native_fail(Rocket *r, int argc, const RocketValue *argv) {
+  (void)r;
+  (void)argc;
+  rocket_raise("fail: %g\n", number_of(argv[0]));
+}
+
+/* (sum x ...) */
+static RocketValue native_sum(Rocket *r, int argc, const RocketValue *argv) {
+  double sum = 0;
+  (void)r;
+  for (int i = 0; i < argc; ++i)
+    sum += number_of(argv[i]);
+  return rocket_number(sum);
+}
+
+/* Sums (fib i) for i below n in a runtime of its own. */
+static void *run_fib(void *arg) {
+  double n = *(double *)arg;
+  Rocket *r = rocket_create(NULL);
+  RocketValue fib, result;
+  double sum = 0;
+
+  assert(r);
+  eval_number(r, "(define (fib n) (if (< n 2) n (+ (fib (- n 1)) "
+                 "(fib (- n 2))))) 0");
+  assert(rocket_lookup(r, "fib", &fib) == ROCKET_OK);
+  for (double i = 0; i < n; ++i) {
+    RocketValue arg = rocket_number(i);
+    assert(rocket_call(r, fib, 1, &arg, &result) == ROCKET_OK);
+    sum += number_of(result);
+  }
+  /* Errors unwind this thread's calls only. */
+  assert(eval_fails_with(r, "(fib 'x)", "expected a number"));
+  assert(eval_number(r, "(fib 10)") == 55);
+  rocket_destroy(r);
+  *(double *)arg = sum;
+  return NULL;
+}
+
+int main() {
+  {
+    Rocket *r = rocket_create(NULL);
+    RocketValue val, result, args[2];
+
+    assert(eval_number(r, "(+ 1 2)") == 3);
+    assert(rocket_eval(r, "rocket_test", "", &result) == ROCKET_OK);
+    assert(rocket_type(result) == ROCKET_UNSPECIFIED);
+    /* Definitions stay around for the programs that follow. */
+    eval_number(r, "(define (add a b) (+ a b)) (define base 10) 0");
+    assert(eval_number(r, "(add base 5)") == 15);
+
+    /* A compiled program runs every time it is called. */
+    assert(rocket_compile(r, "rocket_test", "(set! base (+ base 1)) base",
+                          &val) == ROCKET_OK);
+    assert(rocket_call(r, val, 0, NULL, &result) == ROCKET_OK);
+    assert(rocket_call(r, val, 0, NULL, &result) == ROCKET_OK);
+    assert(number_of(result) == 12);
+
+    /* Procedures, primitives and values in both directions. */
+    assert(rocket_lookup(r, "add", &val) == ROCKET_OK);
+    args[0] = rocket_number(2);
+    args[1] = rocket_number(40);
+    assert(rocket_call(r, val, 2, args, &result) == ROCKET_OK);
+    assert(number_of(result) == 42);
+    assert(rocket_lookup(r, "cons", &val) == ROCKET_OK);
+    assert(rocket_call(r, val, 2, args, &result) == ROCKET_OK);
+    assert(rocket_type(result) == ROCKET_PAIR &&
+           number_of(rocket_car(result)) == 2);
+
+    rocket_define(r, "items",
+                  rocket_cons(r, rocket_symbol(r, "a"),
+                              rocket_cons(r, rocket_number(7), rocket_nil())));
+    assert(rocket_eval(r, "rocket_test", "(eq? (car items) 'a)", &result) ==
+           ROCKET_OK);
+    assert(rocket_type(result) == ROCKET_BOOL && rocket_truthy(result));
+    assert(rocket_eval(r, "rocket_test", "(cdr items)", &result) == ROCKET_OK);
+    /* The same pair, not a copy. */
+    assert(rocket_lookup(r, "items", &val) == ROCKET_OK);
+    assert(rocket_eq(result, rocket_cdr(val)));
+    assert(strcmp(rocket_symbol_name(rocket_car(val)), "a") == 0);
+
+    rocket_define_native(r, "twice", native_twice, 2);
+    rocket_define_native(r, "fail", native_fail, 1);
+    rocket_define_native(r, "sum", native_sum, -1);
+    assert(eval_number(r, "(twice (lambda (x) (* x 3)) 2)") == 18);
+    assert(eval_number(r, "(+ (sum) (sum 1 2 3 4 5))") == 15);
+
+    /* Errors leave the runtime as it was. */
+    assert(eval_fails_with(r, "(+ 1 nope)", "unbound variable \"nope\""));
+    assert(
+        eval_fails_with(r, "(define (f x) (+ x 1)", "Expected more tokens"));
+    assert(eval_fails_with(r, "(add 1)", "expected 2 arguments, got 1"));
+    assert(eval_fails_with(r, "(lambda)", "bad syntax"));
+    assert(eval_fails_with(r, "(add 1 (fail 3))", "fail: 3"));
+    assert(eval_fails_with(r, "(fail)", "fail: expected 1 arguments, got 0"));
+    assert(
+        eval_fails_with(r, "(twice (lambda (x) (fail x)) 4)", "fail: 4"));
+    assert(eval_fails_with(r, "(define (deep n) (+ 1 (deep n))) (deep 0)",
+                           "stack overflow"));
+    assert(rocket_lookup(r, "nope", &val) == ROCKET_ERROR);
+    assert(eval_number(r, "(add base 1)") == 13);
+
+    /* A body that fails to compile on its first call fails every call. */
+    eval_number(r, "(define (bad) (if)) 0");
+    assert(eval_fails_with(r, "(bad)", "bad syntax"));
+    assert(eval_fails_with(r, "(bad)", "bad syntax"));
+    assert(eval_number(r, "(add 2 2)") == 4);
+    rocket_destroy(r);
+  }
+  {
+    /* Runtimes on threads of their own share nothing. */
+    pthread_t threads[4];
+    double sums[4];
+
+    for (int i = 0; i < 4; ++i) {
+      sums[i] = 18 + i;
+      assert(pthread_create(&threads[i], NULL, run_fib, &sums[i]) == 0);
+    }
+    for (int i = 0; i < 4; ++i)
+      assert(pthread_join(threads[i], NULL) == 0);
+    /* The sum of fib(i) below n is fib(n + 1) - 1. */
+    assert(sums[0] == 4180 && sums[1] == 6764 && sums[2] == 10945 &&
+           sums[3] == 17710);
+  }
+  {
+    RocketOptions options = rocket_default_options();
+    Rocket *r;
+
+    /* Without optimizations and lazy compilation, and with the JIT. */
+    options.optimization_level = 0;
+    options.lazy = false;
+    options.jit_threshold = 2;
+    r = rocket_create(&options);
+    eval_number(r, "(define (sq x) (* x x)) 0");
+    assert(eval_number(r, "(+ (sq 1) (sq 2) (sq 3) (sq 4))") == 30);
+    assert(eval_fails_with(r, "(sq 'a)", "expected a number"));
+    assert(eval_number(r, "(sq 5)") == 25);
+    rocket_destroy(r);
+  }
+}
@@ -0,0 +1,206 @@
+#include "common.h"
+
+#include "bytecode.h"
+#include "error_handler.h"
+#include "heap.h"
+#include "primitive.h"
+#include "regvm.h"
+#include "runtime.h"
+#include "symbol.h"
+#include "verifier.h"
+#include "vm.h"
+
+void vm_store_global(VM *vm, const char *name, Object val) {
+  int len = symbol_table_len(vm->globals);
+  symbol_table_add(vm->globals, name, val);
+  if (symbol_table_len(vm->globals) != len)
+    ++vm->globals_version;
+}
+
+SymbolTableElement *vm_resolve_global(VM *vm, uint8_t *ip) {
+  const char *name = global_name(vm, read_uint16(ip + 1));
+  int index = symbol_table_index(vm->globals, name);
+  SymbolTableElement *slot;
+
+  if (index < 0) {
+    raise_error("%s: unbound variable \"%s\"\n", __FUNCTION__, name);
+  }
+  slot = &symbol_table_data(vm->globals)[index];
+  memcpy(ip + 3, &vm->globals_version, sizeof(uint32_t));
+  memcpy(ip + 3 + sizeof(uint32_t), &slot, sizeof(slot));
+  return slot;
+}
+
+void vm_note_global_store(VM *vm, const char *name, Object old, Object val) {
+  int kind;
+  if (old.type != OBJ_PRIMITIVE)
+    return;
+  if (val.type == OBJ_PRIMITIVE && val.value == old.value)
+    return;
+  if ((kind = lookup_primitive(name)) >= 0)
+    vm->redefined_primitives |= (uint64_t)1 << kind;
+}
+
+void vm_define_global(VM *vm, const char *name, Object val) {
+  bool exists;
+  Object old = symbol_table_find(vm->globals, name, &exists);
+  if (exists)
+    vm_note_global_store(vm, name, old, val);
+  vm_store_global(vm, name, val);
+}
+
+static Object vm_fill_closure(VM *vm, Frame *frame, Closure *closure,
+                              CompiledFunction *fn, uint8_t num_free_vars,
+                              const uint8_t *captures) {
+  closure->fn = fn;
+  for (int i = 0; i < num_free_vars; ++i) {
+    uint8_t from_local = captures[2 * i];
+    uint8_t index = captures[2 * i + 1];
+    closure->free_vars[i] =
+        from_local ? vm->stack[frame->base_pointer + index]
+                   : vm_current_closure(vm, frame)->free_vars[index];
+  }
+  return make_object(OBJ_CLOSURE, PointerGetDatum(closure));
+}
+
+Object vm_make_closure(VM *vm, Frame *frame, CompiledFunction *fn,
+                       uint8_t num_free_vars, const uint8_t *captures) {
+  Closure *closure =
+      heap_alloc(vm->heap, sizeof(Closure) + num_free_vars * sizeof(Object));
+  return vm_fill_closure(vm, frame, closure, fn, num_free_vars, captures);
+}
+
+Object vm_make_stack_closure(VM *vm, Frame *frame, CompiledFunction *fn,
+                             uint8_t slot, uint8_t num_free_vars,
+                             const uint8_t *captures) {
+  Closure *closure = (Closure *)&vm->stack[frame->base_pointer + slot];
+  return vm_fill_closure(vm, frame, closure, fn, num_free_vars, captures);
+}
+
+Frame *vm_call_inlined_primitive(VM *vm, Frame *frame) {
+  PrimitiveKind kind = inline_op_primitive(*frame->ip);
+  int argc = primitive_inline_argc(kind);
+  Object *args = &vm->stack[vm->stack_pointer - argc];
+  vm_record_feedback(vm, frame, FEEDBACK_SLOW_PATH);
+  ++frame->ip;
+
+  if (vm->redefined_primitives & ((uint64_t)1 << kind)) {
+    bool exists;
+    Object callee = symbol_table_find(vm->globals, primitives[kind].name,
+                                      &exists);
+    if (!exists) {
+      raise_error("%s: unbound variable \"%s\"\n", __FUNCTION__,
+                  primitives[kind].name);
+    }
+    memmove(args + 1, args, argc * sizeof(Object));
+    args[0] = callee;
+    ++vm->stack_pointer;
+    return vm_call(vm, frame, argc, /*tail=*/false);
+  }
+
+  args[0] = call_primitive(vm, kind, argc, args);
+  vm->stack_pointer -= argc - 1;
+  return frame;
+}
+
+void vm_record_feedback(VM *vm, Frame *frame, uint8_t feedback) {
+  CompiledFunction *fn = frame->fn;
+
+  if (vm->specialize_threshold < 0)
+    return;
+  if (!fn->type_feedback) {
+    int len = instructions_len(fn->instructions);
+    fn->type_feedback = heap_alloc(vm->heap, len);
+    memset(fn->type_feedback, 0, len);
+  }
+  fn->type_feedback[frame->ip - instructions_data(fn->instructions)] |=
+      feedback;
+}
+
+static bool vm_site_saw(CompiledFunction *fn, int offset, uint8_t feedback) {
+  return fn->type_feedback && (fn->type_feedback[offset] & feedback);
+}
+
+/*
+ * Sites that never reported anything are taken to see only numbers and
+ * compiled procedures, the guards catch the ones that were just not run yet.
+ */
+void vm_specialize_function(VM *vm, CompiledFunction *fn) {
+  uint8_t *code = instructions_data(fn->instructions);
+  int len = instructions_len(fn->instructions);
+
+  for (int offset = 0; offset < len;
+       offset += instruction_length(&code[offset])) {
+    uint8_t *ip = &code[offset];
+    switch (*ip) {
+    case OP_CONSTANT: {
+      /* A number operand: (+ x 1), (< i 10). */
+      int next = offset + 3;
+      OpCode op = next < len ? generic_opcode(code[next]) : OP_LAST;
+      if (vm_constant(vm, read_uint16(ip + 1)).type != OBJ_NUMBER ||
+          vm_site_saw(fn, next, FEEDBACK_SLOW_PATH))
+        break;
+      if (op >= OP_ADD && op <= OP_DIV)
+        *ip = OP_ADD_CONSTANT + (op - OP_ADD);
+      else if (op >= OP_NUM_EQ && op <= OP_GE &&
+               code[next + 1] == OP_JUMP_IF_FALSE)
+        *ip = OP_BRANCH_NUM_EQ_CONSTANT + (op - OP_NUM_EQ);
+      break;
+    }
+    case OP_NUM_EQ:
+    case OP_LT:
+    case OP_GT:
+    case OP_LE:
+    case OP_GE:
+      if (ip[1] == OP_JUMP_IF_FALSE &&
+          !vm_site_saw(fn, offset, FEEDBACK_SLOW_PATH))
+        *ip = OP_BRANCH_NUM_EQ + (*ip - OP_NUM_EQ);
+      break;
+    case OP_PROC_CALL:
+    case OP_TAIL_CALL:
+      if (!vm_site_saw(fn, offset, FEEDBACK_NOT_PROCEDURE))
+        *ip = *ip == OP_PROC_CALL ? OP_CALL_PROCEDURE : OP_TAIL_CALL_PROCEDURE;
+      break;
+    default:
+      break;
+    }
+  }
+}
+
+void vm_compile_lazy(VM *vm, CompiledFunction *fn) {
+  LazyBody *lazy = fn->lazy;
+  int num_constants = objects_pool_len(vm->constants);
+
+  /* What an earlier call compiled but failed to verify. */
+  if (fn->instructions) {
+    free_instructions(fn->instructions);
+    fn->instructions = NULL;
+  }
+  if (fn->lines) {
+    free_line_table(fn->lines);
+    fn->lines = NULL;
+  }
+  lazy->compile(vm, lazy, fn);
+  verify_code(vm->constants, fn, num_constants);
+  /*
+   * Only now, a body that failed to compile or verify is compiled again on
+   * the next call instead of running unchecked.
+   */
+  fn->lazy = NULL;
+  if (!vm->use_registers)
+    return;
+  registerize_function(fn);
+  /* And the lambdas nested in it, which came with it. */
+  for (int i = num_constants; i < objects_pool_len(vm->constants); ++i) {
+    Object val = objects_pool_get(vm->constants, i);
+    if (val.type == OBJ_PROCEDURE)
+      registerize_function(DatumGetPtr(val.value));
+  }
+}
+
+EvalResult vm_run_compiled(VM *vm) {
+  Frame *frame = &vm->frames[vm->frame_pointer];
+  while (frame)
+    frame = frame->fn->compiled_code(vm, frame);
+  return EVAL_OK;
+}
@@ -1,6 +1,5 @@
 #include "symbol.h"
 #include "vector.h"
-#include "vm.h"
 #include <string.h>
 
 VECTOR_GENERATE_TYPE_NAME_IMPL(SymbolTableElement, SymbolTable, symbol_table);
@@ -26,6 +25,15 @@ void symbol_table_add(SymbolTable *sym_tab, const char *symbol_name,
   symbol_table_append(sym_tab, ele);
 }
 
+int symbol_table_index(SymbolTable *sym_tab, const char *symbol_name) {
+  int len = symbol_table_len(sym_tab);
+  for (int i = 0; i < len; ++i) {
+    if (strcmp(symbol_table_get(sym_tab, i).symbol_name, symbol_name) == 0)
+      return i;
+  }
+  return -1;
+}
+
 Object symbol_table_find(SymbolTable *sym_tab, const char *symbol_name,
                          bool *exists) {
   int len = symbol_table_len(sym_tab);
@@ -1,5 +1,6 @@
 #include "common.h"
 
+#include "error_handler.h"
 #include "tokenizer.h"
 #include "vector.h"
 
@@ -126,32 +127,32 @@ void destroy_tokenizer(Tokenizer *tokenizer) {
   tokenizer->program = NULL;
 }
 
-static Token *tokenizer_peek(Tokenizer *tokenizer) {
-  int len = vector_len(tokenizer->tokens);
-  if (len == 0)
-    return NULL;
-  return DatumGetPtr(vector_get(tokenizer->tokens, len - 1));
-}
-
 TokenIter tokenizer_iter(Tokenizer *tokenizer) {
   TokenIter iter = {.tokenizer = tokenizer, .index = -1};
   return iter;
 }
 
+/*
+ * Tokens another iterator already read are replayed from the tokenizer,
+ * the rest are read from the program.
+ */
 Token *token_iter_peek(TokenIter *iter) {
+  Vector *tokens;
+
   assert(iter->tokenizer);
-  if (iter->index == -1) {
+  tokens = iter->tokenizer->tokens;
+  if (iter->index == -1)
     ++iter->index;
-    return tokenizer_next(iter->tokenizer);
-  }
-  return tokenizer_peek(iter->tokenizer);
+  if (iter->index < vector_len(tokens))
+    return DatumGetPtr(vector_get(tokens, iter->index));
+  return tokenizer_next(iter->tokenizer);
 }
 
 Token *token_iter_next(TokenIter *iter) {
   assert(iter->tokenizer);
   token_iter_peek(iter);
   ++iter->index;
-  return tokenizer_next(iter->tokenizer);
+  return token_iter_peek(iter);
 }
 
 static void skip_whitespaces(Tokenizer *tokenizer) {
@@ -427,8 +428,7 @@ static Token *tokenizer_next(Tokenizer *tokenizer) {
         return tok;
       }
       /* Raise Error. */
-      fprintf(stdout, "Error: %s:%d\n", __FILE__, __LINE__);
-      goto fail;
+      raise_error("Error: %s:%d\n", __FILE__, __LINE__);
     }
     default: {
       Token *tok = NULL;
@@ -439,8 +439,7 @@ static Token *tokenizer_next(Tokenizer *tokenizer) {
       } else {
         /* Make sure we have consumed all tokens. */
         if (CURR_CHAR(tokenizer)) {
-          fprintf(stdout, "Error: %s:%d\n", __FILE__, __LINE__);
-          goto fail;
+          raise_error("Error: %s:%d\n", __FILE__, __LINE__);
         } else {
           goto out;
         }
@@ -455,6 +454,4 @@ out : {
   vector_append(tokenizer->tokens, PointerGetDatum(tok));
   return tok;
 }
-
-fail : { exit(1); }
 }
@@ -0,0 +1,286 @@
+#include "common.h"
+
+#include "bytecode.h"
+#include "error_handler.h"
+#include "primitive.h"
+#include "verifier.h"
+#include "vm.h"
+
+typedef struct Verifier {
+  ObjectsPool *constants;
+  CompiledFunction *fn;
+  const uint8_t *code;
+  int len;
+  /* Indexed by offset: whether an instruction starts there. */
+  bool *is_start;
+  /* The stack depth on entry to each instruction, -1 until reached. */
+  int *depth;
+  /* Offsets reached but not looked at yet. */
+  int *pending;
+  int num_pending;
+  int max_stack;
+  VerifyError *error;
+} Verifier;
+
+static bool fail(Verifier *v, int offset, const char *message) {
+  v->error->offset = offset;
+  v->error->message = message;
+  return false;
+}
+
+static bool constant_has_type(Verifier *v, uint16_t index, ObjectType type) {
+  return index < objects_pool_len(v->constants) &&
+         objects_pool_get(v->constants, index).type == type;
+}
+
+static bool check_captures(Verifier *v, int offset, const uint8_t *captures,
+                           int num_free_vars) {
+  for (int i = 0; i < num_free_vars; ++i) {
+    bool from_local = captures[2 * i];
+    uint8_t index = captures[2 * i + 1];
+    if (from_local ? index >= v->fn->num_locals
+                   : index >= v->fn->num_free_vars)
+      return fail(v, offset, "capture of a variable that does not exist");
+  }
+  return true;
+}
+
+/* Checks the operands of the instruction at offset, except jump targets. */
+static bool check_operands(Verifier *v, int offset) {
+  const uint8_t *ip = v->code + offset;
+
+  switch (*ip) {
+  case OP_CONSTANT:
+  case OP_EQ_CONSTANT:
+    if (read_uint16(ip + 1) >= objects_pool_len(v->constants))
+      return fail(v, offset, "constant out of range");
+    return true;
+  case OP_ADD_CONSTANT:
+  case OP_SUB_CONSTANT:
+  case OP_MUL_CONSTANT:
+  case OP_DIV_CONSTANT:
+  case OP_BRANCH_NUM_EQ_CONSTANT:
+  case OP_BRANCH_LT_CONSTANT:
+  case OP_BRANCH_GT_CONSTANT:
+  case OP_BRANCH_LE_CONSTANT:
+  case OP_BRANCH_GE_CONSTANT:
+    if (!constant_has_type(v, read_uint16(ip + 1), OBJ_NUMBER))
+      return fail(v, offset, "specialized operand is not a number constant");
+    return true;
+  case OP_GET_GLOBAL:
+  case OP_DEFINE_GLOBAL:
+  case OP_SET_GLOBAL:
+    if (!constant_has_type(v, read_uint16(ip + 1), OBJ_SYMBOL))
+      return fail(v, offset, "global name is not a symbol constant");
+    return true;
+  case OP_GET_LOCAL:
+  case OP_SET_LOCAL:
+  case OP_GET_LOCAL_BOX:
+  case OP_SET_LOCAL_BOX:
+  case OP_BOX_LOCAL:
+    if (ip[1] >= v->fn->num_locals)
+      return fail(v, offset, "local slot out of range");
+    return true;
+  case OP_STACK_CONS:
+    if (ip[1] + 2 > v->fn->num_locals)
+      return fail(v, offset, "pair storage out of range");
+    return true;
+  case OP_GET_FREE:
+  case OP_GET_FREE_BOX:
+  case OP_SET_FREE_BOX:
+    if (ip[1] >= v->fn->num_free_vars)
+      return fail(v, offset, "free variable out of range");
+    return true;
+  case OP_CLOSURE:
+  case OP_STACK_CLOSURE: {
+    bool in_frame = *ip == OP_STACK_CLOSURE;
+    uint16_t fn_idx = read_uint16(ip + 1);
+    int num_free_vars = ip[in_frame ? 4 : 3];
+    CompiledFunction *fn;
+    if (!constant_has_type(v, fn_idx, OBJ_PROCEDURE))
+      return fail(v, offset, "closure of a constant that is no procedure");
+    fn = DatumGetPtr(objects_pool_get(v->constants, fn_idx).value);
+    if (fn->num_free_vars != num_free_vars)
+      return fail(v, offset, "closure captures the wrong number of variables");
+    if (in_frame && ip[3] + 1 + num_free_vars > v->fn->num_locals)
+      return fail(v, offset, "closure storage out of range");
+    return check_captures(v, offset, ip + (in_frame ? 5 : 4), num_free_vars);
+  }
+  default:
+    return true;
+  }
+}
+
+/*
+ * How many entries the generic instruction at ip takes off the stack and
+ * puts back.
+ */
+static void stack_effect(const uint8_t *ip, int *pops, int *pushes) {
+  OpCode op = generic_opcode(*ip);
+
+  *pops = 0;
+  *pushes = 0;
+  switch (op) {
+  case OP_CONSTANT:
+  case OP_GET_LOCAL:
+  case OP_GET_GLOBAL:
+  case OP_GET_FREE:
+  case OP_GET_FREE_BOX:
+  case OP_GET_LOCAL_BOX:
+  case OP_CLOSURE:
+  case OP_STACK_CLOSURE:
+    *pushes = 1;
+    break;
+  case OP_POP:
+  case OP_JUMP_IF_FALSE:
+  case OP_RETURN:
+    *pops = 1;
+    break;
+  case OP_SET_LOCAL:
+  case OP_DEFINE_GLOBAL:
+  case OP_SET_GLOBAL:
+  case OP_SET_FREE_BOX:
+  case OP_SET_LOCAL_BOX:
+  case OP_EQ_CONSTANT:
+    *pops = *pushes = 1;
+    break;
+  case OP_STACK_CONS:
+    *pops = 2;
+    *pushes = 1;
+    break;
+  case OP_PROC_CALL:
+  case OP_TAIL_CALL:
+    *pops = ip[1] + 1;
+    *pushes = 1;
+    break;
+  case OP_CALL_NATIVE0:
+  case OP_CALL_NATIVE1:
+  case OP_CALL_NATIVE2:
+  case OP_CALL_NATIVE3:
+    *pops = op - OP_CALL_NATIVE0 + 1;
+    *pushes = 1;
+    break;
+  default:
+    if (op >= OP_ADD && op <= OP_PAIR_P) {
+      *pops = primitive_inline_argc(inline_op_primitive(op));
+      *pushes = 1;
+    }
+    break;
+  }
+}
+
+/* Notes that control reaches target with depth entries on the stack. */
+static bool reach(Verifier *v, int from, int target, int depth) {
+  if (target >= v->len)
+    return fail(v, from, "control runs off the end of the function");
+  if (!v->is_start[target])
+    return fail(v, from, "jump into the middle of an instruction");
+  if (v->depth[target] == -1) {
+    v->depth[target] = depth;
+    v->pending[v->num_pending++] = target;
+    return true;
+  }
+  if (v->depth[target] != depth)
+    return fail(v, from, "paths meet with different stack depths");
+  return true;
+}
+
+/* Follows every path from offset 0, tracking the stack depth. */
+static bool check_flow(Verifier *v) {
+  if (v->len == 0)
+    return true;
+  if (!reach(v, 0, 0, 0))
+    return false;
+
+  while (v->num_pending > 0) {
+    int offset = v->pending[--v->num_pending];
+    const uint8_t *ip = v->code + offset;
+    OpCode op = generic_opcode(*ip);
+    int depth = v->depth[offset];
+    int pops, pushes;
+
+    stack_effect(ip, &pops, &pushes);
+    if (depth < pops)
+      return fail(v, offset, "stack underflow");
+    /* The slow path of an inlined primitive pushes the callee below. */
+    if (op >= OP_ADD && op <= OP_PAIR_P && depth + 1 > v->max_stack)
+      v->max_stack = depth + 1;
+    depth += pushes - pops;
+    if (depth > v->max_stack)
+      v->max_stack = depth;
+
+    if (op == OP_RETURN || op == OP_LAST)
+      continue;
+    if (opcode_is_jump(op) && !reach(v, offset, read_uint16(ip + 1), depth))
+      return false;
+    if (op != OP_JUMP &&
+        !reach(v, offset, offset + instruction_length(ip), depth))
+      return false;
+  }
+  return true;
+}
+
+bool verify_function(ObjectsPool *constants, CompiledFunction *fn,
+                     VerifyError *error) {
+  Verifier v;
+  bool ok = true;
+
+  v.constants = constants;
+  v.fn = fn;
+  v.code = instructions_data(fn->instructions);
+  v.len = instructions_len(fn->instructions);
+  v.is_start = calloc(v.len + 1, sizeof(bool));
+  v.depth = malloc((v.len + 1) * sizeof(int));
+  v.pending = malloc((v.len + 1) * sizeof(int));
+  v.num_pending = 0;
+  v.max_stack = 0;
+  v.error = error;
+  if (!v.is_start || !v.depth || !v.pending) {
+    raise_error("%s: OOM\n", __FUNCTION__);
+  }
+  for (int i = 0; i < v.len; ++i)
+    v.depth[i] = -1;
+
+  /* Decode the code in sequence, unreachable instructions included. */
+  for (int offset = 0; ok && offset < v.len;
+       offset += instruction_length(v.code + offset)) {
+    const uint8_t *ip = v.code + offset;
+    if (*ip > OP_LAST)
+      ok = fail(&v, offset, "unknown opcode");
+    else if (offset + instruction_length(ip) > v.len)
+      ok = fail(&v, offset, "instruction runs past the end of the function");
+    else
+      ok = check_operands(&v, offset);
+    v.is_start[offset] = true;
+  }
+  ok = ok && check_flow(&v);
+  if (ok)
+    fn->max_stack = v.max_stack;
+
+  free(v.is_start);
+  free(v.depth);
+  free(v.pending);
+  return ok;
+}
+
+void verify_code(ObjectsPool *constants, CompiledFunction *fn, int first) {
+  VerifyError error;
+
+  if (!verify_function(constants, fn, &error)) {
+    raise_error("%s: bad bytecode at offset %d: %s\n", __FUNCTION__,
+                error.offset, error.message);
+  }
+  for (int i = first; i < objects_pool_len(constants); ++i) {
+    Object val = objects_pool_get(constants, i);
+    CompiledFunction *procedure;
+    if (val.type != OBJ_PROCEDURE)
+      continue;
+    procedure = DatumGetPtr(val.value);
+    if (procedure->lazy)
+      continue;
+    if (!verify_function(constants, procedure, &error)) {
+      raise_error("%s: bad bytecode in procedure %d at offset %d: %s\n",
+                  __FUNCTION__, i, error.offset, error.message);
+    }
+  }
+}
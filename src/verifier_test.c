@@ -0,0 +1,111 @@
+#include <assert.h>
+
+#include "common.h"
+#include "heap.h"
+#include "verifier.h"
+#include "vm.h"
+
+static CompiledFunction *make_function(Heap *heap, const uint8_t *bytes,
+                                       int len, int num_locals) {
+  Instructions *code = make_instructions();
+  for (int i = 0; i < len; ++i)
+    instructions_append(code, bytes[i]);
+  return make_compiled_function(heap, code, num_locals);
+}
+
+/* Verifies code with two number constants and returns the error, if any. */
+static const char *verify(const uint8_t *bytes, int len, int num_locals,
+                          int *max_stack) {
+  Heap *heap = make_heap();
+  ObjectsPool *constants = make_objects_pool();
+  CompiledFunction *fn = make_function(heap, bytes, len, num_locals);
+  VerifyError error;
+  bool ok;
+
+  objects_pool_append(constants, FloatGetObject(1));
+  objects_pool_append(constants, FloatGetObject(2));
+  ok = verify_function(constants, fn, &error);
+  if (max_stack)
+    *max_stack = fn->max_stack;
+  free_instructions(fn->instructions);
+  free_objects_pool(constants);
+  free_heap(heap);
+  return ok ? NULL : error.message;
+}
+
+#define ASSERT_VALID(code, num_locals, expected_max_stack)                     \
+  do {                                                                         \
+    int max_stack;                                                             \
+    assert(verify(code, sizeof(code), num_locals, &max_stack) == NULL);        \
+    assert(max_stack == (expected_max_stack));                                 \
+  } while (0)
+
+#define ASSERT_INVALID(code, num_locals)                                       \
+  assert(verify(code, sizeof(code), num_locals, NULL) != NULL)
+
+int main() {
+  {
+    /* (if (< a 1) 1 (+ a 2)), the slow path of + needs a third slot. */
+    const uint8_t code[] = {OP_GET_LOCAL,     0,  OP_CONSTANT,  0, 0,
+                            OP_LT,            OP_JUMP_IF_FALSE, 13, 0,
+                            OP_CONSTANT,      0,  0,            OP_RETURN,
+                            OP_GET_LOCAL,     0,  OP_CONSTANT,  1, 0,
+                            OP_ADD,           OP_RETURN};
+    ASSERT_VALID(code, 1, 3);
+  }
+  {
+    /* A loop that jumps back with the stack as it found it. */
+    const uint8_t code[] = {OP_GET_LOCAL, 0, OP_JUMP_IF_FALSE, 8, 0,
+                            OP_JUMP,      0, 0,                OP_CONSTANT,
+                            0,            0, OP_RETURN};
+    ASSERT_VALID(code, 1, 1);
+  }
+  {
+    const uint8_t code[] = {OP_CONSTANT, 2, 0, OP_RETURN};
+    ASSERT_INVALID(code, 0);
+  }
+  {
+    const uint8_t code[] = {OP_GET_LOCAL, 1, OP_RETURN};
+    ASSERT_INVALID(code, 1);
+  }
+  {
+    const uint8_t code[] = {OP_GET_FREE, 0, OP_RETURN};
+    ASSERT_INVALID(code, 0);
+  }
+  {
+    const uint8_t code[] = {OP_POP, OP_CONSTANT, 0, 0, OP_RETURN};
+    ASSERT_INVALID(code, 0);
+  }
+  {
+    /* Falls off the end. */
+    const uint8_t code[] = {OP_CONSTANT, 0, 0};
+    ASSERT_INVALID(code, 0);
+  }
+  {
+    /* Runs past the end. */
+    const uint8_t code[] = {OP_CONSTANT, 0};
+    ASSERT_INVALID(code, 0);
+  }
+  {
+    /* Into the operand of the CONSTANT. */
+    const uint8_t code[] = {OP_JUMP, 4, 0, OP_CONSTANT, 0, 0, OP_RETURN};
+    ASSERT_INVALID(code, 0);
+  }
+  {
+    /* The paths reach the RETURN with no value and with two. */
+    const uint8_t code[] = {OP_GET_LOCAL, 0, OP_JUMP_IF_FALSE, 11,
+                            0,            OP_CONSTANT,       0,  0,
+                            OP_CONSTANT,  0, 0,                OP_RETURN};
+    ASSERT_INVALID(code, 1);
+  }
+  {
+    /* A specialized site has to refer to a number. */
+    const uint8_t code[] = {OP_GET_LOCAL, 0, OP_ADD_CONSTANT, 5, 0, OP_ADD,
+                            OP_RETURN};
+    ASSERT_INVALID(code, 1);
+  }
+  {
+    const uint8_t code[] = {OP_LAST + 1};
+    ASSERT_INVALID(code, 0);
+  }
+}
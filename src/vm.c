@@ -2,11 +2,23 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
 #include "ast.h"
+#include "bytecode.h"
 #include "common.h"
+#include "error_handler.h"
+#include "heap.h"
+#include "jit.h"
+#include "primitive.h"
+#include "regvm.h"
+#include "runtime.h"
+#include "symbol.h"
 #include "vector.h"
+#include "verifier.h"
 #include "vm.h"
+#include "vmstats.h"
 
 VECTOR_GENERATE_TYPE_NAME_IMPL(Object, ObjectsPool, objects_pool);
 VECTOR_GENERATE_TYPE_NAME_IMPL(uint8_t, Instructions, instructions);
@@ -15,63 +27,818 @@ static inline Frame *vm_current_frame(VM *vm) {
   return &vm->frames[vm->frame_pointer];
 }
 
+/* Reserves size bytes followed by a guard page, committed on first touch. */
+static void *vm_reserve_stack(size_t size) {
+  size_t page_size = sysconf(_SC_PAGESIZE);
+  uint8_t *region;
+
+  size = (size + page_size - 1) / page_size * page_size;
+  region = mmap(NULL, size + page_size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (region == MAP_FAILED) {
+    raise_error("%s: cannot reserve the VM stack %m\n", __FUNCTION__);
+  }
+  if (mprotect(region + size, page_size, PROT_NONE) != 0) {
+    raise_error("%s: cannot protect the VM stack guard page %m\n",
+                __FUNCTION__);
+  }
+  return region;
+}
+
+static void vm_release_stack(void *region, size_t size) {
+  size_t page_size = sysconf(_SC_PAGESIZE);
+  size = (size + page_size - 1) / page_size * page_size;
+  munmap(region, size + page_size);
+}
+
 void initialize_vm(VM *vm, Instructions *instructions, ObjectsPool *constants,
-                   ObjectsPool *globals) {
+                   SymbolTable *globals, Heap *heap) {
   assert(vm != NULL);
   assert(instructions);
 
   vm->stack_pointer = 0;
   vm->frame_pointer = 0;
+  vm->stack = vm_reserve_stack(VM_STACK_MAX_DEPTH * sizeof(Object));
+  vm->frames = vm_reserve_stack(VM_FRAME_MAX_DEPTH * sizeof(Frame));
 
-  vm->globals = globals ? globals : make_objects_pool();
+  if (globals) {
+    vm->globals = globals;
+  } else {
+    vm->globals = make_symbol_table();
+    define_primitives(vm->globals);
+  }
+  /* Inlined primitive opcodes only run in place while these globals hold
+     the primitives. */
+  vm->globals_version = 1;
+  vm->redefined_primitives = 0;
+  vm->use_registers = false;
+  vm->jit_threshold = -1;
+  vm->specialize_threshold = -1;
+  for (int i = 0; i < PRIM_LAST; ++i) {
+    bool exists;
+    Object val = symbol_table_find(vm->globals, primitives[i].name, &exists);
+    if (!exists || val.type != OBJ_PRIMITIVE || DatumGetInt64(val.value) != i)
+      vm->redefined_primitives |= (uint64_t)1 << i;
+  }
   vm->constants = constants ? constants : make_objects_pool();
-  vm->heap = make_objects_pool();
+  vm->heap = heap ? heap : make_heap();
+#ifdef ROCKET_VM_STATS
+  vm->stats = make_vm_stats();
+#endif
 
   vm->frames[0].base_pointer = 0;
-  vm->frames[0].fn = make_compiled_function(instructions, 0);
+  vm->frames[0].fn = make_compiled_function(vm->heap, instructions, 0);
+  /* Nothing runs that has not been verified, see verifier.h. */
+  verify_code(vm->constants, vm->frames[0].fn, 0);
   vm->frames[0].ip = instructions_data(vm->frames[0].fn->instructions);
 }
 
 void destroy_vm(VM *vm) {
-  free_objects_pool(vm->globals);
+  for (int i = 0; i < objects_pool_len(vm->constants); ++i) {
+    Object constant = objects_pool_get(vm->constants, i);
+    if (constant.type == OBJ_PROCEDURE)
+      free_compiled_function(vm->heap, DatumGetPtr(constant.value));
+  }
+  free_compiled_function(vm->heap, vm->frames[0].fn);
+  for (int i = 0; i < symbol_table_len(vm->globals); ++i)
+    free(symbol_table_get(vm->globals, i).symbol_name);
+  free_symbol_table(vm->globals);
   free_objects_pool(vm->constants);
-  free_objects_pool(vm->heap);
+  free_heap(vm->heap);
+#ifdef ROCKET_VM_STATS
+  free_vm_stats(vm->stats);
+#endif
+  vm_release_stack(vm->stack, VM_STACK_MAX_DEPTH * sizeof(Object));
+  vm_release_stack(vm->frames, VM_FRAME_MAX_DEPTH * sizeof(Frame));
 }
 
-EvalResult vm_run(VM *vm) {
-  Frame *frame = vm_current_frame(vm);
+Object vm_stack_top(VM *vm) {
+  if (vm->stack_pointer == 0)
+    return UNSPECIFIED_OBJECT;
+  return vm->stack[vm->stack_pointer - 1];
+}
+
+/*
+ * Continues with the frame a call or return leaves us in. vm_interpret hands
+ * frames that have machine code to the JIT.
+ */
+#define VM_SWITCH_FRAME(next)                                                  \
+  {                                                                            \
+    frame = (next);                                                            \
+    if (frame->fn->jit_code)                                                   \
+      return frame;                                                            \
+    continue;                                                                  \
+  }
+
+/* Takes the slow path unless the primitive is intact and cond holds. */
+#define VM_INLINE_GUARD(op, cond)                                              \
+  if (!(cond) || (vm->redefined_primitives &                                   \
+                  ((uint64_t)1 << inline_op_primitive(op)))) {                 \
+    VM_SWITCH_FRAME(vm_call_inlined_primitive(vm, frame));                     \
+  }
+
+#define VM_NUMBER_OP(op, result)                                               \
+  case op: {                                                                   \
+    Object *args = &vm->stack[vm->stack_pointer - 2];                          \
+    double a, b;                                                               \
+    VM_INLINE_GUARD(op, args[0].type == OBJ_NUMBER &&                          \
+                            args[1].type == OBJ_NUMBER);                       \
+    a = DatumGetFloat(args[0].value);                                          \
+    b = DatumGetFloat(args[1].value);                                          \
+    args[0] = (result);                                                        \
+    --vm->stack_pointer;                                                       \
+    ++frame->ip;                                                               \
+    continue;                                                                  \
+  }
+
+/*
+ * The guard of a type-specialized opcode. If it fails the site is put back
+ * to its generic code, which runs next.
+ */
+#define VM_SPECIALIZED_GUARD(op, cond)                                         \
+  if (!(cond) || (vm->redefined_primitives &                                   \
+                  ((uint64_t)1 << inline_op_primitive(op)))) {                 \
+    *frame->ip = generic_opcode(*frame->ip);                                   \
+    continue;                                                                  \
+  }
+
+/* <u16 constant> op: the number on top op the constant. */
+#define VM_NUMBER_CONSTANT_OP(specialized, op, result)                         \
+  case specialized: {                                                          \
+    Object *top = &vm->stack[vm->stack_pointer - 1];                           \
+    double a, b;                                                               \
+    VM_SPECIALIZED_GUARD(op, top->type == OBJ_NUMBER);                         \
+    a = DatumGetFloat(top->value);                                             \
+    b = DatumGetFloat(vm_constant(vm, read_uint16(frame->ip + 1)).value);      \
+    *top = (result);                                                           \
+    frame->ip += 4;                                                            \
+    continue;                                                                  \
+  }
+
+/* op JUMP_IF_FALSE <u16 target> on the two numbers on top. */
+#define VM_BRANCH_OP(specialized, op, cond)                                    \
+  case specialized: {                                                          \
+    Object *args = &vm->stack[vm->stack_pointer - 2];                          \
+    double a, b;                                                               \
+    VM_SPECIALIZED_GUARD(op, args[0].type == OBJ_NUMBER &&                     \
+                                 args[1].type == OBJ_NUMBER);                  \
+    a = DatumGetFloat(args[0].value);                                          \
+    b = DatumGetFloat(args[1].value);                                          \
+    vm->stack_pointer -= 2;                                                    \
+    if (cond)                                                                  \
+      frame->ip += 4;                                                          \
+    else                                                                       \
+      frame->ip = instructions_data(frame->fn->instructions) +                 \
+                  read_uint16(frame->ip + 2);                                  \
+    continue;                                                                  \
+  }
 
-  while (*frame->ip != OP_LAST) {
+/* <u16 constant> op JUMP_IF_FALSE <u16 target> on the number on top. */
+#define VM_BRANCH_CONSTANT_OP(specialized, op, cond)                           \
+  case specialized: {                                                          \
+    Object top = vm->stack[vm->stack_pointer - 1];                             \
+    double a, b;                                                               \
+    VM_SPECIALIZED_GUARD(op, top.type == OBJ_NUMBER);                          \
+    a = DatumGetFloat(top.value);                                              \
+    b = DatumGetFloat(vm_constant(vm, read_uint16(frame->ip + 1)).value);      \
+    --vm->stack_pointer;                                                       \
+    if (cond)                                                                  \
+      frame->ip += 7;                                                          \
+    else                                                                       \
+      frame->ip = instructions_data(frame->fn->instructions) +                 \
+                  read_uint16(frame->ip + 5);                                  \
+    continue;                                                                  \
+  }
+
+/*
+ * The callee may have changed since the site was rewritten, anything but a
+ * native of the same arity goes through vm_call.
+ */
+#define VM_CALL_NATIVE(op, argc, call)                                         \
+  case op: {                                                                   \
+    Object *args = &vm->stack[vm->stack_pointer - (argc)];                     \
+    Native *native = ObjectGetNative(args[-1]);                                \
+    if (args[-1].type != OBJ_NATIVE || native->arity != (argc)) {              \
+      bool tail = frame->ip[1];                                                \
+      frame->ip += 2;                                                          \
+      VM_SWITCH_FRAME(vm_call(vm, frame, (argc), tail));                       \
+    }                                                                          \
+    args[-1] = (call);                                                         \
+    vm->stack_pointer -= (argc);                                               \
+    frame->ip += 2;                                                            \
+    continue;                                                                  \
+  }
+
+/*
+ * Interprets frame until the program ends or the next frame has machine
+ * code. With single_step only the instruction at frame->ip runs.
+ */
+static inline Frame *vm_interpret(VM *vm, Frame *frame, bool single_step) {
+  if (*frame->ip == OP_LAST)
+    return frame;
+
+  do {
+    VM_STATS_DISPATCH(vm, *frame->ip);
     switch (*frame->ip) {
     case OP_CONSTANT: {
-      int constant_idx;
+      uint16_t constant_idx = read_uint16(frame->ip + 1);
+      vm_push(vm, vm_constant(vm, constant_idx));
+      frame->ip += 3;
+      continue;
+    }
+    case OP_POP: {
+      --vm->stack_pointer;
+      ++frame->ip;
+      continue;
+    }
+    case OP_GET_LOCAL: {
+      uint8_t slot = frame->ip[1];
+      vm_push(vm, vm->stack[frame->base_pointer + slot]);
+      frame->ip += 2;
+      continue;
+    }
+    case OP_SET_LOCAL: {
+      uint8_t slot = frame->ip[1];
+      vm->stack[frame->base_pointer + slot] = vm_stack_top(vm);
+      frame->ip += 2;
+      continue;
+    }
+    case OP_GET_LOCAL_BOX: {
+      uint8_t slot = frame->ip[1];
+      vm_push(vm, ObjectGetBox(vm->stack[frame->base_pointer + slot])->value);
+      frame->ip += 2;
+      continue;
+    }
+    case OP_SET_LOCAL_BOX: {
+      uint8_t slot = frame->ip[1];
+      ObjectGetBox(vm->stack[frame->base_pointer + slot])->value =
+          vm_stack_top(vm);
+      frame->ip += 2;
+      continue;
+    }
+    case OP_BOX_LOCAL: {
+      Object *local = &vm->stack[frame->base_pointer + frame->ip[1]];
+      *local = make_object(OBJ_BOX, PointerGetDatum(vm_make_box(vm, *local)));
+      frame->ip += 2;
+      continue;
+    }
+    case OP_GET_FREE: {
+      uint8_t index = frame->ip[1];
+      vm_push(vm, vm_current_closure(vm, frame)->free_vars[index]);
+      frame->ip += 2;
+      continue;
+    }
+    case OP_GET_FREE_BOX: {
+      uint8_t index = frame->ip[1];
+      Object box = vm_current_closure(vm, frame)->free_vars[index];
+      vm_push(vm, ObjectGetBox(box)->value);
+      frame->ip += 2;
+      continue;
+    }
+    case OP_SET_FREE_BOX: {
+      uint8_t index = frame->ip[1];
+      Object box = vm_current_closure(vm, frame)->free_vars[index];
+      ObjectGetBox(box)->value = vm_stack_top(vm);
+      frame->ip += 2;
+      continue;
+    }
+    case OP_CLOSURE: {
+      uint16_t fn_idx = read_uint16(frame->ip + 1);
+      CompiledFunction *fn =
+          DatumGetPtr(vm_constant(vm, fn_idx).value);
+      uint8_t num_free_vars = frame->ip[3];
+      vm_push(vm, vm_make_closure(vm, frame, fn, num_free_vars, frame->ip + 4));
+      frame->ip += 4 + 2 * num_free_vars;
+      continue;
+    }
+    case OP_STACK_CLOSURE: {
+      uint16_t fn_idx = read_uint16(frame->ip + 1);
+      CompiledFunction *fn =
+          DatumGetPtr(vm_constant(vm, fn_idx).value);
+      uint8_t num_free_vars = frame->ip[4];
+      vm_push(vm, vm_make_stack_closure(vm, frame, fn, frame->ip[3],
+                                        num_free_vars, frame->ip + 5));
+      frame->ip += 5 + 2 * num_free_vars;
+      continue;
+    }
+    case OP_STACK_CONS: {
+      Object *args = &vm->stack[vm->stack_pointer - 2];
+      args[0] = vm_stack_cons(vm, frame, frame->ip[1], args[0], args[1]);
+      --vm->stack_pointer;
+      frame->ip += 2;
+      continue;
+    }
+    case OP_GET_GLOBAL: {
+      vm_push(vm, vm_global_slot(vm, frame->ip)->val);
+      frame->ip += 3 + VM_GLOBAL_CACHE_SIZE;
+      continue;
+    }
+    case OP_DEFINE_GLOBAL: {
+      vm_define_global(vm, global_name(vm, read_uint16(frame->ip + 1)),
+                       vm_stack_top(vm));
+      frame->ip += 3;
+      continue;
+    }
+    case OP_SET_GLOBAL: {
+      vm_set_global(vm, vm_global_slot(vm, frame->ip), vm_stack_top(vm));
+      frame->ip += 3 + VM_GLOBAL_CACHE_SIZE;
+      continue;
+    }
+    case OP_JUMP: {
+      uint8_t *target = instructions_data(frame->fn->instructions) +
+                        read_uint16(frame->ip + 1);
+      bool back = target < frame->ip;
+      frame->ip = target;
+      if (back)
+        VM_SWITCH_FRAME(vm_loop_back(vm, frame));
+      continue;
+    }
+    case OP_JUMP_IF_FALSE: {
+      if (ObjectIsFalse(vm_pop(vm)))
+        frame->ip = instructions_data(frame->fn->instructions) +
+                    read_uint16(frame->ip + 1);
+      else
+        frame->ip += 3;
+      continue;
+    }
+    case OP_PROC_CALL:
+    case OP_TAIL_CALL: {
+      bool tail = *frame->ip == OP_TAIL_CALL;
+      uint8_t argc = frame->ip[1];
+      Object callee = vm->stack[vm->stack_pointer - argc - 1];
+      if (callee.type == OBJ_NATIVE && argc <= NATIVE_MAX_FIXED_ARITY &&
+          ObjectGetNative(callee)->arity == argc) {
+        /* Later calls from this site skip the generic dispatch. */
+        frame->ip[0] = OP_CALL_NATIVE0 + argc;
+        frame->ip[1] = tail;
+      } else if (callee.type != OBJ_PROCEDURE && callee.type != OBJ_CLOSURE) {
+        vm_record_feedback(vm, frame, FEEDBACK_NOT_PROCEDURE);
+      }
+      frame->ip += 2;
+      VM_SWITCH_FRAME(vm_call(vm, frame, argc, tail));
+    }
+    case OP_CALL_PROCEDURE:
+    case OP_TAIL_CALL_PROCEDURE: {
+      bool tail = *frame->ip == OP_TAIL_CALL_PROCEDURE;
+      uint8_t argc = frame->ip[1];
+      uint32_t callee_idx = vm->stack_pointer - argc - 1;
+      Object callee = vm->stack[callee_idx];
+      CompiledFunction *fn;
+      if (callee.type == OBJ_PROCEDURE) {
+        fn = DatumGetPtr(callee.value);
+      } else if (callee.type == OBJ_CLOSURE) {
+        fn = ((Closure *)DatumGetPtr(callee.value))->fn;
+      } else {
+        *frame->ip = generic_opcode(*frame->ip);
+        continue;
+      }
+      frame->ip += 2;
+      VM_SWITCH_FRAME(vm_call_procedure(vm, frame, fn, callee_idx, argc, tail));
+    }
+    VM_CALL_NATIVE(OP_CALL_NATIVE0, 0, native->fn.fn0(vm))
+    VM_CALL_NATIVE(OP_CALL_NATIVE1, 1, native->fn.fn1(vm, args[0]))
+    VM_CALL_NATIVE(OP_CALL_NATIVE2, 2, native->fn.fn2(vm, args[0], args[1]))
+    VM_CALL_NATIVE(OP_CALL_NATIVE3, 3,
+                   native->fn.fn3(vm, args[0], args[1], args[2]))
+    VM_NUMBER_OP(OP_ADD, FloatGetObject(a + b))
+    VM_NUMBER_OP(OP_SUB, FloatGetObject(a - b))
+    VM_NUMBER_OP(OP_MUL, FloatGetObject(a * b))
+    VM_NUMBER_OP(OP_DIV, FloatGetObject(a / b))
+    VM_NUMBER_OP(OP_NUM_EQ, BoolGetObject(a == b))
+    VM_NUMBER_OP(OP_LT, BoolGetObject(a < b))
+    VM_NUMBER_OP(OP_GT, BoolGetObject(a > b))
+    VM_NUMBER_OP(OP_LE, BoolGetObject(a <= b))
+    VM_NUMBER_OP(OP_GE, BoolGetObject(a >= b))
+    VM_NUMBER_CONSTANT_OP(OP_ADD_CONSTANT, OP_ADD, FloatGetObject(a + b))
+    VM_NUMBER_CONSTANT_OP(OP_SUB_CONSTANT, OP_SUB, FloatGetObject(a - b))
+    VM_NUMBER_CONSTANT_OP(OP_MUL_CONSTANT, OP_MUL, FloatGetObject(a * b))
+    VM_NUMBER_CONSTANT_OP(OP_DIV_CONSTANT, OP_DIV, FloatGetObject(a / b))
+    VM_BRANCH_OP(OP_BRANCH_NUM_EQ, OP_NUM_EQ, a == b)
+    VM_BRANCH_OP(OP_BRANCH_LT, OP_LT, a < b)
+    VM_BRANCH_OP(OP_BRANCH_GT, OP_GT, a > b)
+    VM_BRANCH_OP(OP_BRANCH_LE, OP_LE, a <= b)
+    VM_BRANCH_OP(OP_BRANCH_GE, OP_GE, a >= b)
+    VM_BRANCH_CONSTANT_OP(OP_BRANCH_NUM_EQ_CONSTANT, OP_NUM_EQ, a == b)
+    VM_BRANCH_CONSTANT_OP(OP_BRANCH_LT_CONSTANT, OP_LT, a < b)
+    VM_BRANCH_CONSTANT_OP(OP_BRANCH_GT_CONSTANT, OP_GT, a > b)
+    VM_BRANCH_CONSTANT_OP(OP_BRANCH_LE_CONSTANT, OP_LE, a <= b)
+    VM_BRANCH_CONSTANT_OP(OP_BRANCH_GE_CONSTANT, OP_GE, a >= b)
+    case OP_NOT: {
+      Object *arg = &vm->stack[vm->stack_pointer - 1];
+      VM_INLINE_GUARD(OP_NOT, true);
+      *arg = BoolGetObject(ObjectIsFalse(*arg));
+      ++frame->ip;
+      continue;
+    }
+    case OP_EQ: {
+      Object *args = &vm->stack[vm->stack_pointer - 2];
+      VM_INLINE_GUARD(OP_EQ, true);
+      args[0] = BoolGetObject(object_eq(args[0], args[1]));
+      --vm->stack_pointer;
+      ++frame->ip;
+      continue;
+    }
+    case OP_CONS: {
+      Object *args = &vm->stack[vm->stack_pointer - 2];
+      VM_INLINE_GUARD(OP_CONS, true);
+      args[0] = make_pair(vm->heap, args[0], args[1]);
+      --vm->stack_pointer;
+      ++frame->ip;
+      continue;
+    }
+    case OP_CAR: {
+      Object *arg = &vm->stack[vm->stack_pointer - 1];
+      VM_INLINE_GUARD(OP_CAR, arg->type == OBJ_PAIR);
+      *arg = ObjectGetPair(*arg)->car;
+      ++frame->ip;
+      continue;
+    }
+    case OP_CDR: {
+      Object *arg = &vm->stack[vm->stack_pointer - 1];
+      VM_INLINE_GUARD(OP_CDR, arg->type == OBJ_PAIR);
+      *arg = ObjectGetPair(*arg)->cdr;
       ++frame->ip;
-      constant_idx = *frame->ip;
-      vm->stack[vm->stack_pointer++] =
-          objects_pool_get(vm->constants, constant_idx);
+      continue;
+    }
+    case OP_NULL_P: {
+      Object *arg = &vm->stack[vm->stack_pointer - 1];
+      VM_INLINE_GUARD(OP_NULL_P, true);
+      *arg = BoolGetObject(arg->type == OBJ_NIL);
       ++frame->ip;
       continue;
     }
+    case OP_PAIR_P: {
+      Object *arg = &vm->stack[vm->stack_pointer - 1];
+      VM_INLINE_GUARD(OP_PAIR_P, true);
+      *arg = BoolGetObject(arg->type == OBJ_PAIR);
+      ++frame->ip;
+      continue;
+    }
+    case OP_EQ_CONSTANT: {
+      Object *top = &vm->stack[vm->stack_pointer - 1];
+      *top = BoolGetObject(object_eq(
+          *top, vm_constant(vm, read_uint16(frame->ip + 1))));
+      frame->ip += 3;
+      continue;
+    }
+    case OP_RETURN: {
+      Object result = vm_pop(vm);
+      /* Drop the locals and the callee itself. */
+      vm->stack_pointer = frame->base_pointer - 1;
+      vm_push(vm, result);
+      VM_STATS_RETURN(frame->fn);
+      VM_SWITCH_FRAME(&vm->frames[--vm->frame_pointer]);
+    }
+    default: {
+      raise_error("%s: unrecoginzed operator %d", __FUNCTION__, (*frame->ip));
+    }
+    }
+  } while (!single_step && *frame->ip != OP_LAST);
+
+  return frame;
+}
+
+static EvalResult vm_run_stack(VM *vm) {
+  Frame *frame = vm_current_frame(vm);
+
+  for (;;) {
+    while (frame->fn->jit_code)
+      frame = jit_enter(vm, frame);
+    frame = vm_interpret(vm, frame, /*single_step=*/false);
+    if (*frame->ip == OP_LAST)
+      return EVAL_OK;
+  }
+}
+
+Frame *jit_step(VM *vm, Frame *frame, uint8_t *ip) {
+  frame->ip = ip;
+  return vm_interpret(vm, frame, /*single_step=*/true);
+}
+
+/*
+ * The slow path of the register VM's inlined primitives, see
+ * vm_call_inlined_primitive. A call of a redefined primitive is set up with
+ * the callee in register dst and the arguments after it, frame->ip has to
+ * point to the instruction that continues once it returns.
+ */
+static Frame *vm_call_register_primitive(VM *vm, Frame *frame,
+                                         PrimitiveKind kind, uint8_t dst,
+                                         Object *args) {
+  int argc = primitive_inline_argc(kind);
+  Object *regs = &vm->stack[frame->base_pointer];
+
+  if (vm->redefined_primitives & ((uint64_t)1 << kind)) {
+    bool exists;
+    Object callee = symbol_table_find(vm->globals, primitives[kind].name,
+                                      &exists);
+    if (!exists) {
+      raise_error("%s: unbound variable \"%s\"\n", __FUNCTION__,
+                  primitives[kind].name);
+    }
+    regs[dst] = callee;
+    memcpy(&regs[dst + 1], args, argc * sizeof(Object));
+    vm->stack_pointer = frame->base_pointer + dst + 1 + argc;
+    return vm_call(vm, frame, argc, /*tail=*/false);
+  }
+
+  regs[dst] = call_primitive(vm, kind, argc, args);
+  return frame;
+}
+
+/* Reloads the state cached in locals of vm_run_registers after a call. */
+#define VM_REG_SWITCH_FRAME(new_frame)                                         \
+  do {                                                                         \
+    frame = (new_frame);                                                       \
+    ip = frame->ip;                                                            \
+    code = instructions_data(frame->fn->register_instructions);                \
+    regs = &vm->stack[frame->base_pointer];                                    \
+  } while (0)
+
+#define VM_REG_INLINE_SLOW_PATH(op, length)                                    \
+  do {                                                                         \
+    Object args[2] = {regs[ip[2]], regs[ip[3]]};                               \
+    frame->ip = ip + (length);                                                 \
+    VM_REG_SWITCH_FRAME(vm_call_register_primitive(                            \
+        vm, frame, reg_op_primitive(op), ip[1], args));                        \
+  } while (0)
+
+#define VM_REG_INLINE_GUARD(op, cond)                                          \
+  if (!(cond) ||                                                               \
+      (vm->redefined_primitives & ((uint64_t)1 << reg_op_primitive(op)))) {    \
+    VM_REG_INLINE_SLOW_PATH(op, reg_instruction_length(ip));                   \
+    continue;                                                                  \
+  }
+
+#define VM_REG_NUMBER_OP(op, result)                                           \
+  case op: {                                                                   \
+    Object b_ = regs[ip[2]], c_ = regs[ip[3]];                                 \
+    double a, b;                                                               \
+    VM_REG_INLINE_GUARD(op, b_.type == OBJ_NUMBER && c_.type == OBJ_NUMBER);   \
+    a = DatumGetFloat(b_.value);                                               \
+    b = DatumGetFloat(c_.value);                                               \
+    regs[ip[1]] = (result);                                                    \
+    ip += 4;                                                                   \
+    continue;                                                                  \
+  }
+
+/* Jumps to the target of the ROP_JUMP_IF_FALSE that follows unless cond. */
+#define VM_REG_BRANCH_OP(op, cond)                                             \
+  case op: {                                                                   \
+    Object b_ = regs[ip[2]], c_ = regs[ip[3]];                                 \
+    double a, b;                                                               \
+    VM_REG_INLINE_GUARD(op, b_.type == OBJ_NUMBER && c_.type == OBJ_NUMBER);   \
+    a = DatumGetFloat(b_.value);                                               \
+    b = DatumGetFloat(c_.value);                                               \
+    if (cond)                                                                  \
+      ip += 8;                                                                 \
+    else                                                                       \
+      ip = code + read_uint16(ip + 5);                                         \
+    continue;                                                                  \
+  }
+
+static EvalResult vm_run_registers(VM *vm) {
+  Frame *frame;
+  uint8_t *ip, *code;
+  Object *regs;
+
+  VM_REG_SWITCH_FRAME(vm_current_frame(vm));
+
+  for (;;) {
+    switch (*ip) {
+    case ROP_LOADK: {
+      regs[ip[1]] = vm_constant(vm, read_uint16(ip + 2));
+      ip += 4;
+      continue;
+    }
+    case ROP_MOVE: {
+      regs[ip[1]] = regs[ip[2]];
+      ip += 3;
+      continue;
+    }
+    case ROP_GET_GLOBAL: {
+      regs[ip[3 + VM_GLOBAL_CACHE_SIZE]] = vm_global_slot(vm, ip)->val;
+      ip += 4 + VM_GLOBAL_CACHE_SIZE;
+      continue;
+    }
+    case ROP_DEFINE_GLOBAL: {
+      vm_define_global(vm, global_name(vm, read_uint16(ip + 1)), regs[ip[3]]);
+      ip += 4;
+      continue;
+    }
+    case ROP_SET_GLOBAL: {
+      vm_set_global(vm, vm_global_slot(vm, ip),
+                    regs[ip[3 + VM_GLOBAL_CACHE_SIZE]]);
+      ip += 4 + VM_GLOBAL_CACHE_SIZE;
+      continue;
+    }
+    case ROP_JUMP: {
+      ip = code + read_uint16(ip + 1);
+      continue;
+    }
+    case ROP_JUMP_IF_FALSE: {
+      if (ObjectIsFalse(regs[ip[3]]))
+        ip = code + read_uint16(ip + 1);
+      else
+        ip += 4;
+      continue;
+    }
+    case ROP_GET_FREE: {
+      regs[ip[1]] = vm_current_closure(vm, frame)->free_vars[ip[2]];
+      ip += 3;
+      continue;
+    }
+    case ROP_GET_FREE_BOX: {
+      Object box = vm_current_closure(vm, frame)->free_vars[ip[2]];
+      regs[ip[1]] = ObjectGetBox(box)->value;
+      ip += 3;
+      continue;
+    }
+    case ROP_SET_FREE_BOX: {
+      Object box = vm_current_closure(vm, frame)->free_vars[ip[1]];
+      ObjectGetBox(box)->value = regs[ip[2]];
+      ip += 3;
+      continue;
+    }
+    case ROP_GET_LOCAL_BOX: {
+      regs[ip[1]] = ObjectGetBox(regs[ip[2]])->value;
+      ip += 3;
+      continue;
+    }
+    case ROP_SET_LOCAL_BOX: {
+      ObjectGetBox(regs[ip[1]])->value = regs[ip[2]];
+      ip += 3;
+      continue;
+    }
+    case ROP_BOX_LOCAL: {
+      Object *local = &regs[ip[1]];
+      *local = make_object(OBJ_BOX, PointerGetDatum(vm_make_box(vm, *local)));
+      ip += 2;
+      continue;
+    }
+    case ROP_CLOSURE: {
+      uint16_t fn_idx = read_uint16(ip + 2);
+      CompiledFunction *fn =
+          DatumGetPtr(vm_constant(vm, fn_idx).value);
+      uint8_t num_free_vars = ip[4];
+      regs[ip[1]] = vm_make_closure(vm, frame, fn, num_free_vars, ip + 5);
+      ip += 5 + 2 * num_free_vars;
+      continue;
+    }
+    case ROP_STACK_CLOSURE: {
+      uint16_t fn_idx = read_uint16(ip + 2);
+      CompiledFunction *fn =
+          DatumGetPtr(vm_constant(vm, fn_idx).value);
+      uint8_t num_free_vars = ip[5];
+      regs[ip[1]] =
+          vm_make_stack_closure(vm, frame, fn, ip[4], num_free_vars, ip + 6);
+      ip += 6 + 2 * num_free_vars;
+      continue;
+    }
+    case ROP_STACK_CONS: {
+      regs[ip[1]] = vm_stack_cons(vm, frame, ip[4], regs[ip[2]], regs[ip[3]]);
+      ip += 5;
+      continue;
+    }
+    case ROP_CALL:
+    case ROP_TAIL_CALL: {
+      uint8_t argc = ip[2];
+      vm->stack_pointer = frame->base_pointer + ip[1] + argc + 1;
+      frame->ip = ip + 3;
+      VM_REG_SWITCH_FRAME(vm_call(vm, frame, argc, *ip == ROP_TAIL_CALL));
+      continue;
+    }
+    case ROP_EQ_CONSTANT: {
+      Object constant = vm_constant(vm, read_uint16(ip + 3));
+      regs[ip[1]] = BoolGetObject(object_eq(regs[ip[2]], constant));
+      ip += 5;
+      continue;
+    }
+    case ROP_RETURN: {
+      /* The caller finds the result where the callee was. */
+      vm->stack[frame->base_pointer - 1] = regs[ip[1]];
+      VM_STATS_RETURN(frame->fn);
+      VM_REG_SWITCH_FRAME(&vm->frames[--vm->frame_pointer]);
+      continue;
+    }
+    case ROP_HALT: {
+      vm->stack_pointer = frame->base_pointer + ip[1];
+      frame->ip = ip;
+      return EVAL_OK;
+    }
+    VM_REG_BRANCH_OP(ROP_BRANCH_NUM_EQ, a == b)
+    VM_REG_BRANCH_OP(ROP_BRANCH_LT, a < b)
+    VM_REG_BRANCH_OP(ROP_BRANCH_GT, a > b)
+    VM_REG_BRANCH_OP(ROP_BRANCH_LE, a <= b)
+    VM_REG_BRANCH_OP(ROP_BRANCH_GE, a >= b)
+    VM_REG_NUMBER_OP(ROP_ADD, FloatGetObject(a + b))
+    VM_REG_NUMBER_OP(ROP_SUB, FloatGetObject(a - b))
+    VM_REG_NUMBER_OP(ROP_MUL, FloatGetObject(a * b))
+    VM_REG_NUMBER_OP(ROP_DIV, FloatGetObject(a / b))
+    VM_REG_NUMBER_OP(ROP_NUM_EQ, BoolGetObject(a == b))
+    VM_REG_NUMBER_OP(ROP_LT, BoolGetObject(a < b))
+    VM_REG_NUMBER_OP(ROP_GT, BoolGetObject(a > b))
+    VM_REG_NUMBER_OP(ROP_LE, BoolGetObject(a <= b))
+    VM_REG_NUMBER_OP(ROP_GE, BoolGetObject(a >= b))
+    case ROP_NOT: {
+      VM_REG_INLINE_GUARD(ROP_NOT, true);
+      regs[ip[1]] = BoolGetObject(ObjectIsFalse(regs[ip[2]]));
+      ip += 3;
+      continue;
+    }
+    case ROP_EQ: {
+      VM_REG_INLINE_GUARD(ROP_EQ, true);
+      regs[ip[1]] = BoolGetObject(object_eq(regs[ip[2]], regs[ip[3]]));
+      ip += 4;
+      continue;
+    }
+    case ROP_CONS: {
+      VM_REG_INLINE_GUARD(ROP_CONS, true);
+      regs[ip[1]] = make_pair(vm->heap, regs[ip[2]], regs[ip[3]]);
+      ip += 4;
+      continue;
+    }
+    case ROP_CAR: {
+      VM_REG_INLINE_GUARD(ROP_CAR, regs[ip[2]].type == OBJ_PAIR);
+      regs[ip[1]] = ObjectGetPair(regs[ip[2]])->car;
+      ip += 3;
+      continue;
+    }
+    case ROP_CDR: {
+      VM_REG_INLINE_GUARD(ROP_CDR, regs[ip[2]].type == OBJ_PAIR);
+      regs[ip[1]] = ObjectGetPair(regs[ip[2]])->cdr;
+      ip += 3;
+      continue;
+    }
+    case ROP_NULL_P: {
+      VM_REG_INLINE_GUARD(ROP_NULL_P, true);
+      regs[ip[1]] = BoolGetObject(regs[ip[2]].type == OBJ_NIL);
+      ip += 3;
+      continue;
+    }
+    case ROP_PAIR_P: {
+      VM_REG_INLINE_GUARD(ROP_PAIR_P, true);
+      regs[ip[1]] = BoolGetObject(regs[ip[2]].type == OBJ_PAIR);
+      ip += 3;
+      continue;
+    }
     default: {
-      fprintf(stderr, "%s: unrecoginzed operator %d", __FUNCTION__,
-              (*frame->ip));
-      exit(1);
+      raise_error("%s: unrecognized register opcode %d", __FUNCTION__, *ip);
     }
     }
   }
+}
+
+EvalResult vm_run(VM *vm) {
+  if (vm->use_registers)
+    return vm_run_registers(vm);
+  return vm_run_stack(vm);
+}
+
+void vm_define_native(VM *vm, const char *name, NativeFn fn, int arity) {
+  Native *native = heap_alloc(vm->heap, sizeof(Native));
 
-  return EVAL_OK;
+  native->name = heap_intern_symbol(vm->heap, name);
+  native->arity = arity;
+  native->fn = fn;
+  vm_define_global(vm, name, make_object(OBJ_NATIVE, PointerGetDatum(native)));
 }
 
-CompiledFunction *make_compiled_function(Instructions *instructions,
+CompiledFunction *make_compiled_function(Heap *heap,
+                                         Instructions *instructions,
                                          int num_locals) {
-  CompiledFunction *compiled_fn = malloc(sizeof(CompiledFunction));
+  CompiledFunction *compiled_fn = heap_alloc(heap, sizeof(CompiledFunction));
   compiled_fn->instructions = instructions;
+  compiled_fn->name = NULL;
+  compiled_fn->lines = NULL;
+  compiled_fn->num_params = 0;
   compiled_fn->num_locals = num_locals;
+  compiled_fn->num_free_vars = 0;
+  compiled_fn->max_stack = 0;
+  compiled_fn->register_instructions = NULL;
+  compiled_fn->num_registers = 0;
+  compiled_fn->call_count = 0;
+  compiled_fn->loop_count = 0;
+  compiled_fn->type_feedback = NULL;
+  compiled_fn->jit_code = NULL;
+  compiled_fn->compiled_code = NULL;
+  compiled_fn->lazy = NULL;
+#ifdef ROCKET_VM_STATS
+  compiled_fn->stats_calls = 0;
+  compiled_fn->stats_returns = 0;
+#endif
   return compiled_fn;
 }
 
-void free_compiled_function(CompiledFunction *fn) {
-  // free_instructions(fn->instructions);
-  free(fn);
+void free_compiled_function(Heap *heap, CompiledFunction *fn) {
+  jit_free_function(fn);
+  if (fn->lines)
+    free_line_table(fn->lines);
+  if (fn->type_feedback)
+    heap_free(heap, fn->type_feedback, instructions_len(fn->instructions));
+  if (fn->register_instructions)
+    free_instructions(fn->register_instructions);
+  /* Lazy bodies have none yet, translated programs keep theirs static. */
+  if (fn->instructions && !fn->compiled_code)
+    free_instructions(fn->instructions);
+  heap_free(heap, fn, sizeof(CompiledFunction));
 }
@@ -1,11 +1,349 @@
 #include <stdio.h>
 
+#include "bytecode.h"
 #include "common.h"
+#include "compiler.h"
+#include "error_handler.h"
+#include "jit.h"
+#include "parser.h"
+#include "profiler.h"
+#include "regvm.h"
+#include "runtime.h"
+#include "tokenizer.h"
 #include "vector.h"
 #include "vm.h"
 
+/* Compiles source into a fresh VM without running it. */
+static void load(VM *vm, const char *source) {
+  char *program = strdup(source);
+  Tokenizer tokenizer;
+  Compiler compiler;
+  Vector *parsed_program;
+
+  initialize_tokenizer(&tokenizer, "vm_test", program);
+  parsed_program = parse_program(&tokenizer);
+  initialize_compiler(&compiler);
+  compile_program(&compiler, parsed_program);
+  initialize_vm(vm, compiler_give_out_instructions(&compiler),
+                compiler_give_out_constants(&compiler), /*globals=*/NULL,
+                compiler_give_out_heap(&compiler));
+  destroy_compiler(&compiler);
+  for (int i = 0; i < vector_len(parsed_program); ++i)
+    free_ast_node(DatumGetPtr(vector_get(parsed_program, i)));
+  free_vector(parsed_program);
+  destroy_tokenizer(&tokenizer);
+  free(program);
+}
+
+/* What has to outlive a run with lazily compiled procedures. */
+typedef struct LazyProgram {
+  char *source;
+  Tokenizer tokenizer;
+  Compiler compiler;
+  Vector *parsed_program;
+} LazyProgram;
+
+/* Like load, but procedure bodies are compiled on their first call. */
+static void load_lazy(VM *vm, LazyProgram *p, const char *source) {
+  p->source = strdup(source);
+  initialize_tokenizer(&p->tokenizer, "vm_test", p->source);
+  p->parsed_program = parse_program(&p->tokenizer);
+  initialize_compiler(&p->compiler);
+  p->compiler.lazy = true;
+  compile_program(&p->compiler, p->parsed_program);
+  initialize_vm(vm, compiler_give_out_instructions(&p->compiler),
+                compiler_give_out_constants(&p->compiler), /*globals=*/NULL,
+                compiler_give_out_heap(&p->compiler));
+}
+
+static void unload_lazy(VM *vm, LazyProgram *p) {
+  destroy_vm(vm);
+  destroy_compiler(&p->compiler);
+  for (int i = 0; i < vector_len(p->parsed_program); ++i)
+    free_ast_node(DatumGetPtr(vector_get(p->parsed_program, i)));
+  free_vector(p->parsed_program);
+  destroy_tokenizer(&p->tokenizer);
+  free(p->source);
+}
+
+static Object eval(VM *vm, const char *source) {
+  load(vm, source);
+  vm_run(vm);
+  return vm_stack_top(vm);
+}
+
+static int num_native_calls = 0;
+
+static Object native_zero(VM *vm) {
+  ++num_native_calls;
+  return FloatGetObject(0);
+}
+
+static Object native_inc(VM *vm, Object a) {
+  ++num_native_calls;
+  return FloatGetObject(DatumGetFloat(a.value) + 1);
+}
+
+static Object native_sub(VM *vm, Object a, Object b) {
+  ++num_native_calls;
+  return FloatGetObject(DatumGetFloat(a.value) - DatumGetFloat(b.value));
+}
+
+static Object native_mid(VM *vm, Object a, Object b, Object c) {
+  ++num_native_calls;
+  return b;
+}
+
+static Object native_count(VM *vm, int argc, Object *argv) {
+  ++num_native_calls;
+  return FloatGetObject(argc);
+}
+
+static Profiler *sampled_profiler = NULL;
+
+static Object native_sample(VM *vm) {
+  profiler_take_sample(sampled_profiler);
+  return FloatGetObject(0);
+}
+
+static int num_bad_compiles = 0;
+
+/* A body the verifier rejects, it pops a value it never pushed. */
+static void compile_bad_body(VM *vm, LazyBody *body, CompiledFunction *fn) {
+  ++num_bad_compiles;
+  fn->instructions = make_instructions();
+  instructions_append(fn->instructions, OP_POP);
+  instructions_append(fn->instructions, OP_RETURN);
+}
+
+static CompiledFunction *global_function(VM *vm, const char *name) {
+  bool exists;
+  Object val = symbol_table_find(vm->globals, name, &exists);
+  assert(exists && val.type == OBJ_PROCEDURE);
+  return DatumGetPtr(val.value);
+}
+
+/* The offset of the first op in fn's bytecode, or -1. */
+static int find_opcode(CompiledFunction *fn, OpCode op) {
+  uint8_t *code = instructions_data(fn->instructions);
+  for (int offset = 0; offset < instructions_len(fn->instructions);
+       offset += instruction_length(&code[offset])) {
+    if (code[offset] == op)
+      return offset;
+  }
+  return -1;
+}
+
 int main() {
   VM vm;
-  initialize_vm(&vm,make_instructions(), /*constants=*/NULL, /*globals=*/NULL);
+  Object val;
+  CompiledFunction *fn;
+  LazyProgram lazy;
+
+  initialize_vm(&vm, make_instructions(), /*constants=*/NULL,
+                /*globals=*/NULL, /*heap=*/NULL);
+  destroy_vm(&vm);
+
+  val = eval(&vm, "(car (cdr '(1 2 3)))");
+  assert(val.type == OBJ_NUMBER && DatumGetFloat(val.value) == 2);
+  destroy_vm(&vm);
+
+  val = eval(&vm, "(define (len l) (if (null? l) 0 (+ 1 (len (cdr l)))))"
+                  "(len (append '(1 2) (reverse (list 3 4 5))))");
+  assert(val.type == OBJ_NUMBER && DatumGetFloat(val.value) == 5);
+  destroy_vm(&vm);
+
+  val = eval(&vm, "(let ((x 1) (y 2)) (cons y x))");
+  assert(val.type == OBJ_PAIR);
+  assert(DatumGetFloat(ObjectGetPair(val)->car.value) == 2);
+  destroy_vm(&vm);
+
+  /* Only lambdas with free variables are allocated as closures. */
+  val = eval(&vm, "(lambda (x) x)");
+  assert(val.type == OBJ_PROCEDURE);
+  destroy_vm(&vm);
+
+  val = eval(&vm, "((lambda (x) (lambda () x)) 1)");
+  assert(val.type == OBJ_CLOSURE);
+  destroy_vm(&vm);
+
+  val = eval(&vm, "(define (make-counter n) (lambda () (set! n (+ n 1)) n))"
+                  "(define counter (make-counter 10))"
+                  "(counter) (counter)");
+  assert(val.type == OBJ_NUMBER && DatumGetFloat(val.value) == 12);
+  destroy_vm(&vm);
+
+  load(&vm, "(define (loop i acc)"
+            "  (if (= i (zero)) acc"
+            "      (loop (sub i 1) (+ acc (mid 0 (inc 0) 2) (count 1 2 3)))))"
+            "(loop 1000 0)");
+  vm_define_native(&vm, "zero", (NativeFn){.fn0 = native_zero}, 0);
+  vm_define_native(&vm, "inc", (NativeFn){.fn1 = native_inc}, 1);
+  vm_define_native(&vm, "sub", (NativeFn){.fn2 = native_sub}, 2);
+  vm_define_native(&vm, "mid", (NativeFn){.fn3 = native_mid}, 3);
+  vm_define_native(&vm, "count", (NativeFn){.fnv = native_count}, -1);
+  vm_run(&vm);
+  val = vm_stack_top(&vm);
+  assert(val.type == OBJ_NUMBER && DatumGetFloat(val.value) == 4000);
+  assert(num_native_calls == 1001 + 4 * 1000);
   destroy_vm(&vm);
+
+  /* A rewritten call site still calls whatever the global holds. */
+  load(&vm, "(define (f x) (inc x))"
+            "(define a (f 1))"
+            "(set! inc (lambda (x) (* x 100)))"
+            "(+ a (f 2))");
+  vm_define_native(&vm, "inc", (NativeFn){.fn1 = native_inc}, 1);
+  vm_run(&vm);
+  val = vm_stack_top(&vm);
+  assert(val.type == OBJ_NUMBER && DatumGetFloat(val.value) == 202);
+  destroy_vm(&vm);
+
+  /* The register VM runs the same programs. */
+  num_native_calls = 0;
+  load(&vm, "(define (loop i acc)"
+            "  (if (< i 1) acc (loop (sub i 1) (cons (inc i) acc))))"
+            "(define (len l) (if (null? l) 0 (+ 1 (len (cdr l)))))"
+            "(let ((l (loop 100 '()))) (+ (car l) (len l)))");
+  vm_define_native(&vm, "inc", (NativeFn){.fn1 = native_inc}, 1);
+  vm_define_native(&vm, "sub", (NativeFn){.fn2 = native_sub}, 2);
+  registerize_program(&vm, /*dump_file=*/NULL);
+  vm_run(&vm);
+  val = vm_stack_top(&vm);
+  assert(val.type == OBJ_NUMBER && DatumGetFloat(val.value) == 102);
+  assert(num_native_calls == 200);
+  destroy_vm(&vm);
+
+  /*
+   * So does the JIT, which takes over loop halfway through and has to notice
+   * that + is redefined on the way.
+   */
+  if (jit_supported()) {
+    bool exists;
+    load(&vm, "(define (loop i acc)"
+              "  (if (= i 50) (set! + (lambda (a b) (- a b))))"
+              "  (if (< i 1) acc (loop (sub i 1) (+ acc (inc i)))))"
+              "(loop 100 0)");
+    vm_define_native(&vm, "inc", (NativeFn){.fn1 = native_inc}, 1);
+    vm_define_native(&vm, "sub", (NativeFn){.fn2 = native_sub}, 2);
+    vm.jit_threshold = 10;
+    vm_run(&vm);
+    val = vm_stack_top(&vm);
+    assert(val.type == OBJ_NUMBER && DatumGetFloat(val.value) == 2500);
+    val = symbol_table_find(vm.globals, "loop", &exists);
+    assert(((CompiledFunction *)DatumGetPtr(val.value))->jit_code);
+    destroy_vm(&vm);
+
+    /* So are procedures called once whose loops run long. */
+    load(&vm, "(define (sum n)"
+              "  (do ((i 0 (+ i 1)) (acc 0 (+ acc i))) ((= i n) acc)))"
+              "(sum 100)");
+    vm.jit_threshold = 10;
+    vm_run(&vm);
+    val = vm_stack_top(&vm);
+    assert(val.type == OBJ_NUMBER && DatumGetFloat(val.value) == 4950);
+    fn = global_function(&vm, "sum");
+    assert(fn->call_count == 1 && fn->loop_count < 100 && fn->jit_code);
+    destroy_vm(&vm);
+  }
+
+  /* Hot procedures are rewritten according to what their sites saw. */
+  load(&vm, "(define (loop i acc) (if (< i 1) acc (loop (- i 1) (+ acc i))))"
+            "(loop 100 0)");
+  vm.specialize_threshold = 10;
+  vm_run(&vm);
+  val = vm_stack_top(&vm);
+  assert(val.type == OBJ_NUMBER && DatumGetFloat(val.value) == 5050);
+  fn = global_function(&vm, "loop");
+  assert(find_opcode(fn, OP_BRANCH_LT_CONSTANT) >= 0);
+  assert(find_opcode(fn, OP_SUB_CONSTANT) >= 0);
+  assert(find_opcode(fn, OP_TAIL_CALL_PROCEDURE) >= 0);
+  destroy_vm(&vm);
+
+  /* A failed guard puts the site back, which then reports what it saw. */
+  load(&vm, "(define (f g x) (g x))"
+            "(define (go i)"
+            "  (if (> i 0) (begin (f (lambda (x) x) i) (go (- i 1)))))"
+            "(go 50)"
+            "(f car '(7))");
+  vm.specialize_threshold = 10;
+  vm_run(&vm);
+  val = vm_stack_top(&vm);
+  assert(val.type == OBJ_NUMBER && DatumGetFloat(val.value) == 7);
+  fn = global_function(&vm, "f");
+  assert(find_opcode(fn, OP_TAIL_CALL_PROCEDURE) < 0);
+  assert(fn->type_feedback[find_opcode(fn, OP_TAIL_CALL)] &
+         FEEDBACK_NOT_PROCEDURE);
+  destroy_vm(&vm);
+
+  /* Procedures are compiled on their first call, with what they contain. */
+  load_lazy(&vm, &lazy,
+            "(define (make-adder n) (lambda (x) (+ x n)))"
+            "(define (unused x) (* x 2))"
+            "((make-adder 40) 2)");
+  vm_run(&vm);
+  val = vm_stack_top(&vm);
+  assert(val.type == OBJ_NUMBER && DatumGetFloat(val.value) == 42);
+  fn = global_function(&vm, "make-adder");
+  assert(!fn->lazy && find_opcode(fn, OP_CLOSURE) >= 0);
+  fn = global_function(&vm, "unused");
+  assert(fn->lazy && !fn->instructions && fn->num_params == 1);
+  unload_lazy(&vm, &lazy);
+
+  /* The register VM translates them then too. */
+  load_lazy(&vm, &lazy,
+            "(define (make-adder n) (lambda (x) (+ x n)))"
+            "((make-adder 40) 2)");
+  registerize_program(&vm, /*dump_file=*/NULL);
+  vm_run(&vm);
+  val = vm_stack_top(&vm);
+  assert(val.type == OBJ_NUMBER && DatumGetFloat(val.value) == 42);
+  assert(global_function(&vm, "make-adder")->register_instructions);
+  unload_lazy(&vm, &lazy);
+
+  {
+    /* A body that fails verification is compiled again on every call. */
+    LazyBody bad_body = {.compile = compile_bad_body};
+    ErrorHandler handler;
+
+    load(&vm, "0");
+    fn = make_compiled_function(vm.heap, NULL, 0);
+    fn->lazy = &bad_body;
+    objects_pool_append(vm.constants,
+                        make_object(OBJ_PROCEDURE, PointerGetDatum(fn)));
+    for (int i = 1; i <= 2; ++i) {
+      push_error_handler(&handler);
+      if (!setjmp(handler.env)) {
+        vm_compile_lazy(&vm, fn);
+        assert(false);
+      }
+      assert(strstr(handler.message, "bad bytecode"));
+      assert(fn->lazy && num_bad_compiles == i);
+    }
+    destroy_vm(&vm);
+  }
+
+  {
+    /* Samples name the procedures and the lines their frames are at. */
+    char *folded;
+    size_t folded_len;
+    FILE *out = open_memstream(&folded, &folded_len);
+
+    load(&vm, "(define (g) (sample) 0)\n"
+              "(define (f)\n"
+              "  (g)\n"
+              "  (g))\n"
+              "(f)\n");
+    vm_define_native(&vm, "sample", (NativeFn){.fn0 = native_sample}, 0);
+    sampled_profiler = make_profiler(&vm, PROFILER_DEFAULT_HZ);
+    vm_run(&vm);
+    profiler_write_folded(sampled_profiler, out);
+    fclose(out);
+    /* The second call of g is a tail call, it replaced the frame of f. */
+    assert(strcmp(folded, "top-level;f:3;g:1 1\n"
+                          "top-level;g:1 1\n") == 0);
+    free(folded);
+    free_profiler(sampled_profiler);
+    destroy_vm(&vm);
+  }
 }
@@ -0,0 +1,191 @@
+#include "common.h"
+
+#include "bytecode.h"
+#include "error_handler.h"
+#include "vm.h"
+#include "vmstats.h"
+
+#ifdef ROCKET_VM_STATS
+
+/* The widest bar of a histogram. */
+#define VM_STATS_BAR_WIDTH 40
+
+static const char *class_names[VM_STATS_NUM_CLASSES] = {
+    [VM_STATS_LOAD_STORE] = "load/store",
+    [VM_STATS_BRANCH] = "branch",
+    [VM_STATS_PRIMITIVE] = "primitive",
+    [VM_STATS_ALLOCATE] = "allocate",
+    [VM_STATS_CALL] = "call",
+    [VM_STATS_RETURN] = "return",
+};
+
+typedef struct StatsRow {
+  const char *name;
+  uint64_t count;
+  uint64_t other_count;
+} StatsRow;
+
+VMStats *make_vm_stats(void) {
+  VMStats *stats = calloc(1, sizeof(VMStats));
+
+  if (!stats) {
+    raise_error("%s: OOM\n", __FUNCTION__);
+  }
+  /* Any seed but 0, the runs are the same from one to the next. */
+  stats->random_state = 0x9e3779b9;
+  stats->countdown = vm_stats_next_countdown(stats);
+  stats->timed_class = -1;
+  return stats;
+}
+
+void free_vm_stats(VMStats *stats) {
+  free(stats);
+}
+
+VMStatsClass vm_stats_class(OpCode op) {
+  switch (op) {
+  case OP_JUMP:
+  case OP_JUMP_IF_FALSE:
+  case OP_BRANCH_NUM_EQ:
+  case OP_BRANCH_LT:
+  case OP_BRANCH_GT:
+  case OP_BRANCH_LE:
+  case OP_BRANCH_GE:
+  case OP_BRANCH_NUM_EQ_CONSTANT:
+  case OP_BRANCH_LT_CONSTANT:
+  case OP_BRANCH_GT_CONSTANT:
+  case OP_BRANCH_LE_CONSTANT:
+  case OP_BRANCH_GE_CONSTANT:
+    return VM_STATS_BRANCH;
+  case OP_CLOSURE:
+  case OP_STACK_CLOSURE:
+  case OP_STACK_CONS:
+  case OP_BOX_LOCAL:
+  case OP_CONS:
+    return VM_STATS_ALLOCATE;
+  case OP_PROC_CALL:
+  case OP_TAIL_CALL:
+  case OP_CALL_NATIVE0:
+  case OP_CALL_NATIVE1:
+  case OP_CALL_NATIVE2:
+  case OP_CALL_NATIVE3:
+  case OP_CALL_PROCEDURE:
+  case OP_TAIL_CALL_PROCEDURE:
+    return VM_STATS_CALL;
+  case OP_RETURN:
+    return VM_STATS_RETURN;
+  default:
+    if ((op >= OP_ADD && op <= OP_PAIR_P) || op == OP_EQ_CONSTANT ||
+        (op >= OP_ADD_CONSTANT && op <= OP_DIV_CONSTANT))
+      return VM_STATS_PRIMITIVE;
+    return VM_STATS_LOAD_STORE;
+  }
+}
+
+static int compare_rows(const void *a, const void *b) {
+  const StatsRow *row_a = a, *row_b = b;
+
+  if (row_a->count != row_b->count)
+    return row_a->count < row_b->count ? 1 : -1;
+  return strcmp(row_a->name, row_b->name);
+}
+
+static void report_opcodes(FILE *output_file, VMStats *stats) {
+  StatsRow rows[OP_LAST + 1];
+  uint64_t total = 0;
+  int num_rows = 0;
+
+  for (int op = 0; op <= OP_LAST; ++op) {
+    if (stats->op_counts[op] == 0)
+      continue;
+    rows[num_rows].name = opcode_name(op);
+    rows[num_rows].count = stats->op_counts[op];
+    total += stats->op_counts[op];
+    ++num_rows;
+  }
+  qsort(rows, num_rows, sizeof(StatsRow), compare_rows);
+
+  fprintf(output_file, "%-24s %14s %7s\n", "opcode", "count", "%");
+  for (int i = 0; i < num_rows; ++i)
+    fprintf(output_file, "%-24s %14llu %7.2f\n", rows[i].name,
+            (unsigned long long)rows[i].count, 100.0 * rows[i].count / total);
+  fprintf(output_file, "%-24s %14llu\n\n", "total",
+          (unsigned long long)total);
+}
+
+static void report_cycles(FILE *output_file, VMStats *stats) {
+  fprintf(output_file, "cycles until the next dispatch, 1 in about %d timed\n",
+          VM_STATS_CYCLE_PERIOD);
+  for (int c = 0; c < VM_STATS_NUM_CLASSES; ++c) {
+    uint64_t *histogram = stats->histograms[c];
+    uint64_t timed = 0, widest = 0;
+
+    for (int i = 0; i < VM_STATS_NUM_BUCKETS; ++i) {
+      timed += histogram[i];
+      if (histogram[i] > widest)
+        widest = histogram[i];
+    }
+    if (timed == 0)
+      continue;
+    fprintf(output_file, "%s: %llu timed, mean %.1f\n", class_names[c],
+            (unsigned long long)timed,
+            (double)stats->total_cycles[c] / timed);
+    for (int i = 0; i < VM_STATS_NUM_BUCKETS; ++i) {
+      int width;
+      if (histogram[i] == 0)
+        continue;
+      width = (int)(VM_STATS_BAR_WIDTH * histogram[i] / widest);
+      fprintf(output_file, "  %10llu.. %12llu %.*s\n",
+              (unsigned long long)(i == 0 ? 0 : (uint64_t)1 << i),
+              (unsigned long long)histogram[i], width > 0 ? width : 1,
+              "########################################");
+    }
+  }
+  fprintf(output_file, "\n");
+}
+
+static void report_procedures(FILE *output_file, VM *vm) {
+  int num_constants = objects_pool_len(vm->constants);
+  StatsRow *rows = malloc((num_constants + 1) * sizeof(StatsRow));
+  char(*names)[32] = malloc((num_constants + 1) * sizeof(*names));
+  int num_rows = 0;
+
+  if (!rows || !names) {
+    raise_error("%s: OOM\n", __FUNCTION__);
+  }
+  for (int i = 0; i < num_constants; ++i) {
+    Object val = objects_pool_get(vm->constants, i);
+    CompiledFunction *fn;
+    if (val.type != OBJ_PROCEDURE)
+      continue;
+    fn = DatumGetPtr(val.value);
+    if (fn->stats_calls == 0)
+      continue;
+    if (fn->name) {
+      rows[num_rows].name = fn->name;
+    } else {
+      snprintf(names[num_rows], sizeof(names[num_rows]), "procedure %d", i);
+      rows[num_rows].name = names[num_rows];
+    }
+    rows[num_rows].count = fn->stats_calls;
+    rows[num_rows].other_count = fn->stats_returns;
+    ++num_rows;
+  }
+  qsort(rows, num_rows, sizeof(StatsRow), compare_rows);
+
+  fprintf(output_file, "%-24s %14s %14s\n", "procedure", "calls", "returns");
+  for (int i = 0; i < num_rows; ++i)
+    fprintf(output_file, "%-24s %14llu %14llu\n", rows[i].name,
+            (unsigned long long)rows[i].count,
+            (unsigned long long)rows[i].other_count);
+  free(rows);
+  free(names);
+}
+
+void vm_stats_report(FILE *output_file, VM *vm) {
+  report_opcodes(output_file, vm->stats);
+  report_cycles(output_file, vm->stats);
+  report_procedures(output_file, vm);
+}
+
+#endif
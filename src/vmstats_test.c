@@ -0,0 +1,69 @@
+#include <math.h>
+#include <stdio.h>
+
+#include "common.h"
+#include "compiler.h"
+#include "parser.h"
+#include "tokenizer.h"
+#include "vector.h"
+#include "vm.h"
+#include "vmstats.h"
+
+/* Compiles source into a fresh VM without running it. */
+static void load(VM *vm, const char *source) {
+  char *program = strdup(source);
+  Tokenizer tokenizer;
+  Compiler compiler;
+  Vector *parsed_program;
+
+  initialize_tokenizer(&tokenizer, "vmstats_test", program);
+  parsed_program = parse_program(&tokenizer);
+  initialize_compiler(&compiler);
+  compile_program(&compiler, parsed_program);
+  initialize_vm(vm, compiler_give_out_instructions(&compiler),
+                compiler_give_out_constants(&compiler), /*globals=*/NULL,
+                compiler_give_out_heap(&compiler));
+  destroy_compiler(&compiler);
+  for (int i = 0; i < vector_len(parsed_program); ++i)
+    free_ast_node(DatumGetPtr(vector_get(parsed_program, i)));
+  free_vector(parsed_program);
+  destroy_tokenizer(&tokenizer);
+  free(program);
+}
+
+int main() {
+  VM vm;
+  uint64_t counts[VM_STATS_NUM_CLASSES] = {0};
+  int num_checked = 0;
+
+  /*
+   * Tight loops whose every iteration runs the same few instructions, the
+   * schedule a fixed sampling period locks onto.
+   */
+  load(&vm, "(define (fib n) (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2)))))"
+            "(define (build i acc) (if (= i 0) acc"
+            "  (build (- i 1) (cons i acc))))"
+            "(fib 22)"
+            "(build 100000 '())");
+  vm_run(&vm);
+
+  for (int op = 0; op <= OP_LAST; ++op) {
+    if (vm.stats->op_counts[op] > 0)
+      counts[vm_stats_class(op)] += vm.stats->op_counts[op];
+  }
+  /* Every class that ran often is timed in proportion to how often. */
+  for (int c = 0; c < VM_STATS_NUM_CLASSES; ++c) {
+    double expected = (double)counts[c] / VM_STATS_CYCLE_PERIOD;
+    uint64_t timed = 0;
+
+    if (counts[c] < 100000)
+      continue;
+    for (int i = 0; i < VM_STATS_NUM_BUCKETS; ++i)
+      timed += vm.stats->histograms[c][i];
+    assert(fabs(timed - expected) < 0.1 * expected);
+    ++num_checked;
+  }
+  /* Loads and stores, branches, primitives, calls and returns. */
+  assert(num_checked >= 5);
+  destroy_vm(&vm);
+}
@@ -0,0 +1,6 @@
+;; RUN: diff --color -u <(cat %s.expected) <(rsi --emit-c %s 2>&1)
+;; Number constants are folded into the arithmetic and comparisons, which
+;; branch directly.
+(define (clamp x)
+  (if (> x 10) 10 (* x 2)))
+(display (clamp 4))
@@ -0,0 +1,43 @@
+;; RUN: t=$(mktemp -d) && rsi --emit-c %s > $t/prog.c && cc -O2 -w -I$(dirname %s)/../../include $t/prog.c $(dirname $(command -v rsi))/librocket_runtime.a -lm -o $t/prog && diff --color -u <(cat %s.expected) <($t/prog 2>&1)
+;; RUN: diff --color -u <(cat %s.expected) <(rsi %s 2>&1)
+;; RUN: diff --color -u <(cat %s.expected) <(rsi --jit --jit-threshold=0 %s 2>&1)
+;; Recursion stays inside the generated function, returns resume at the call.
+(define (fib n)
+  (if (< n 2)
+      n
+      (+ (fib (- n 1)) (fib (- n 2)))))
+(display (fib 20))
+(newline)
+
+;; Tail calls loop without growing the stacks.
+(define (count-down n acc)
+  (if (= n 0) acc (count-down (- n 1) (+ acc 0.5))))
+(display (count-down 100000 0))
+(newline)
+
+;; Calls between generated functions and closures over boxed variables.
+(define (make-counter)
+  (let ((count 0))
+    (lambda ()
+      (set! count (+ count 1))
+      count)))
+(define c (make-counter))
+(c)
+(display (list (c) (c)))
+(newline)
+
+;; Quoted data is rebuilt at startup.
+(define (lookup key alist)
+  (cond ((null? alist) #f)
+        ((eq? (car (car alist)) key) (car (cdr (car alist))))
+        (else (lookup key (cdr alist)))))
+(display (lookup 'b '((a 1) (b 2) (c 3))))
+(newline)
+
+;; Redefined primitives take the slow path.
+(define (add a b) (+ a b))
+(display (add 1 2))
+(newline)
+(set! + (lambda (a b) (* a b)))
+(display (add 3 4))
+(newline)
@@ -0,0 +1,19 @@
+;; RUN: diff --color -u <(cat %s.expected) <(rsi -O1 --debug-dump-bytecode %s 2>&1)
+;; RUN: diff --color -u <(cat %s.expected) <(rsi -O1 --debug-dump-bytecode --jit --jit-threshold=0 %s 2>&1)
+(define (for-each-item f l)
+  (if (pair? l)
+      (begin (f (car l)) (for-each-item f (cdr l)))))
+
+(define (weighted-sum k l)
+  (let ((total 0))
+    (for-each-item (lambda (x) (set! total (+ total (* k x)))) l)
+    total))
+
+(define (norm2 x y)
+  (let ((p (cons x y)))
+    (+ (* (car p) (car p)) (* (cdr p) (cdr p)))))
+
+(define (returned x y) (let ((p (cons x y))) p))
+
+(display (list (weighted-sum 2 (list 1 2 3)) (norm2 3 4) (returned 1 2)))
+(newline)
@@ -0,0 +1,22 @@
+;; RUN: diff --color -u <(cat %s.expected) <(rsi -O1 --inline-budget=0 --debug-dump-bytecode %s 2>&1)
+;; RUN: diff --color -u <(cat %s.expected) <(rsi -O1 --inline-budget=0 --debug-dump-bytecode --jit --jit-threshold=0 %s 2>&1)
+
+(display (if (< 1 2) (* 2 (+ 3 4)) 'never))
+(newline)
+
+(define (shadowed + x)
+  (+ 1 x))
+(display (shadowed - 5))
+(newline)
+
+(define (classify)
+  (cond ((> 1 2) 'big)
+        ((not #f) 'small)
+        (else 'other)))
+(display (classify))
+(newline)
+
+(define (f) (/ 8 2))
+(define / -)
+(display (f))
+(newline)
@@ -0,0 +1,57 @@
+;; RUN: diff --color -u <(cat %s.expected) <(rsi -O1 --debug-inline %s 2>&1)
+;; RUN: diff --color -u <(rsi -O0 %s 2>&1) <(rsi -O1 %s 2>&1)
+;; RUN: diff --color -u <(cat %s.expected) <(rsi -O1 --debug-inline --jit --jit-threshold=0 %s 2>&1)
+
+(define (square x) (* x x))
+(define (sum-of-squares a b) (+ (square a) (square b)))
+
+(define (loop i acc)
+  (if (= i 0)
+      acc
+      (loop (- i 1) (+ acc (sum-of-squares i 2)))))
+(display (loop 10 0))
+(newline)
+
+;; Constant arguments are substituted into the body.
+(display (sum-of-squares 3 4))
+(newline)
+
+;; Arguments that are locals are substituted unless a slot hides them.
+(define (pick a b) (- a b))
+(define (swap-sub a b) (pick b a))
+(define (use x y) (swap-sub y x))
+(define (add z q) (+ z q))
+(define (hide z) (add (* z 2) z))
+(display (list (use 10 3) (hide 5)))
+(newline)
+
+;; A local that a later argument assigns keeps a slot, the body sees the
+;; value it had when the argument was evaluated.
+(define (h a b) (+ a b))
+(define (use-h y) (h y (begin (set! y 10) y)))
+(display (use-h 1))
+(newline)
+
+;; A local named like the helper is not inlined.
+(define (shadow square) (square 5))
+(display (shadow (lambda (x) (+ x 1))))
+(newline)
+
+;; Recursive procedures are never inlined.
+(define (fact n) (if (= n 0) 1 (* n (fact (- n 1)))))
+(display (fact 5))
+(newline)
+
+;; Nor are bodies that bind or assign variables, the log says which.
+(define counter 0)
+(define (bump n) (set! counter (+ counter n)))
+(define (double-of n) (let ((m (* 2 n))) m))
+(bump 3)
+(display (list counter (double-of 4)))
+(newline)
+
+;; Inlined sites notice that the global changed.
+(define (cube-sum n) (square n))
+(set! square (lambda (x) (* x x x)))
+(display (cube-sum 2))
+(newline)
@@ -0,0 +1,9 @@
+;; RUN: diff --color -u <(cat %s.expected) <(rsi -O1 --debug-dump-bytecode %s 2>&1)
+;; RUN: diff --color -u <(cat %s.expected) <(rsi -O1 --debug-dump-bytecode --jit --jit-threshold=0 %s 2>&1)
+;; Self-calls in tail position jump back to the loop head.
+(define (sum-to n)
+  (let loop ((i 0) (acc 0))
+    (if (> i n) acc (loop (+ i 1) (+ acc i)))))
+(define (count n)
+  (do ((i 0 (+ i 1)) (acc '() (cons i acc)))
+      ((= i n) acc)))
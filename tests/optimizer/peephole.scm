@@ -0,0 +1,14 @@
+;; RUN: diff --color -u <(cat %s.expected) <(rsi -O1 --debug-dump-bytecode %s 2>&1)
+;; RUN: diff --color -u <(cat %s.expected) <(rsi -O1 --debug-dump-bytecode --jit --jit-threshold=0 %s 2>&1)
+(define (sign x)
+  (cond ((< x 0) -1)
+        ((> x 0) 1)
+        (else 0)))
+
+(define (count-up n)
+  (let ((i 0))
+    (set! i (+ i 1))
+    i))
+
+(display (list (sign -5) (sign 0) (sign 7) (count-up 1)))
+(newline)
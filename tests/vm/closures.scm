@@ -0,0 +1,62 @@
+;; RUN: diff --color -u <(cat %s.expected) <(rsi %s 2>&1)
+;; RUN: diff --color -u <(cat %s.expected) <(rsi --vm=register %s 2>&1)
+;; RUN: diff --color -u <(cat %s.expected) <(rsi --jit --jit-threshold=0 %s 2>&1)
+;; RUN: diff --color -u <(cat %s.expected) <(rsi --compile=eager %s 2>&1)
+(define (make-adder n)
+  (lambda (x) (+ x n)))
+(define add5 (make-adder 5))
+(display (add5 10))
+(newline)
+
+;; Assigned and captured variables are shared through a box.
+(define (make-counter)
+  (let ((count 0))
+    (lambda ()
+      (set! count (+ count 1))
+      count)))
+(define c1 (make-counter))
+(define c2 (make-counter))
+(c1)
+(c1)
+(display (list (c1) (c2)))
+(newline)
+
+;; Captures thread through lambdas that do not use the variable themselves.
+(define (curry3 a)
+  (lambda (b)
+    (lambda (c) (list a b c))))
+(display (((curry3 1) 2) 3))
+(newline)
+
+;; Internal definitions can refer to each other and to themselves.
+(define (count-evens l)
+  (define (even? n) (if (= n 0) #t (odd? (- n 1))))
+  (define (odd? n) (if (= n 0) #f (even? (- n 1))))
+  (define (walk l acc)
+    (cond ((null? l) acc)
+          ((even? (car l)) (walk (cdr l) (+ acc 1)))
+          (else (walk (cdr l) acc))))
+  (walk l 0))
+(display (count-evens '(1 2 3 4 5 6)))
+(newline)
+
+;; A closure sees assignments made after it was created.
+(define (make-account balance)
+  (define (withdraw amount)
+    (set! balance (- balance amount))
+    balance)
+  (set! balance (* balance 2))
+  withdraw)
+(display ((make-account 50) 30))
+(newline)
+
+(define (map f l)
+  (if (null? l)
+      '()
+      (cons (f (car l)) (map f (cdr l)))))
+(define (scale-all factor l)
+  (map (lambda (x) (* x factor)) l))
+(display (scale-all 3 '(1 2 3)))
+(newline)
+(display (make-adder 1))
+(newline)
@@ -0,0 +1,65 @@
+;; RUN: diff --color -u <(cat %s.expected) <(rsi %s 2>&1)
+;; RUN: diff --color -u <(cat %s.expected) <(rsi --vm=register %s 2>&1)
+;; RUN: diff --color -u <(cat %s.expected) <(rsi --jit --jit-threshold=0 %s 2>&1)
+(define x 1)
+(define (get-x) x)
+(define (set-x v) (set! x v))
+(display (get-x))
+(newline)
+(set-x 2)
+(display (get-x))
+(newline)
+
+;; New globals may move the table under the cached reads.
+(define g0 0)
+(define g1 1)
+(define g2 2)
+(define g3 3)
+(define g4 4)
+(define g5 5)
+(define g6 6)
+(define g7 7)
+(define g8 8)
+(define g9 9)
+(define g10 10)
+(define g11 11)
+(define g12 12)
+(define g13 13)
+(define g14 14)
+(define g15 15)
+(define g16 16)
+(define g17 17)
+(define g18 18)
+(define g19 19)
+(define g20 20)
+(define g21 21)
+(define g22 22)
+(define g23 23)
+(define g24 24)
+(define g25 25)
+(define g26 26)
+(define g27 27)
+(define g28 28)
+(define g29 29)
+(define g30 30)
+(define g31 31)
+(define g32 32)
+(define g33 33)
+(define g34 34)
+(define g35 35)
+(define g36 36)
+(define g37 37)
+(define g38 38)
+(define g39 39)
+(display (list (get-x) g0 g39))
+(newline)
+(set-x 3)
+(define x (+ x 1))
+(display (get-x))
+(newline)
+
+;; A procedure may refer to a global that is defined after it.
+(define (get-late) late)
+(define late 5)
+(display (get-late))
+(newline)
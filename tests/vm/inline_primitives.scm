@@ -0,0 +1,36 @@
+;; RUN: diff --color -u <(cat %s.expected) <(rsi %s 2>&1)
+;; RUN: diff --color -u <(cat %s.expected) <(rsi --vm=register %s 2>&1)
+;; RUN: diff --color -u <(cat %s.expected) <(rsi --jit --jit-threshold=0 %s 2>&1)
+(define (sum-to n)
+  (if (< n 1)
+      0
+      (+ n (sum-to (- n 1)))))
+(display (sum-to 100))
+(newline)
+(display (list (* 6 7) (/ 1 4) (= 1 1) (> 1 2) (<= 2 2) (>= 1 2)))
+(newline)
+(display (list (not #f) (eq? 'a 'a) (cons 1 2) (car '(1 2)) (cdr '(1 2))
+               (null? '()) (pair? '())))
+(newline)
+
+;; Variadic uses still go through the primitive.
+(display (list (+ 1 2 3) (- 5)))
+(newline)
+
+;; Locals shadow the built-ins.
+(define (apply-car car x) (car x))
+(display (apply-car (lambda (x) (* x 10)) 4))
+(newline)
+
+;; Redefining a built-in at run time affects code compiled before.
+(define (add a b) (+ a b))
+(define plus +)
+(set! + (lambda (a b) (list 'plus a b)))
+(display (add 1 2))
+(newline)
+(set! + plus)
+(display (add 1 2))
+(newline)
+(define (car x) 'redefined)
+(display (car '(1 2)))
+(newline)
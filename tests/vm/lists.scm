@@ -0,0 +1,38 @@
+;; RUN: diff --color -u <(cat %s.expected) <(rsi %s 2>&1)
+;; RUN: diff --color -u <(cat %s.expected) <(rsi --vm=register %s 2>&1)
+;; RUN: diff --color -u <(cat %s.expected) <(rsi --jit --jit-threshold=0 %s 2>&1)
+(define (map f l)
+  (if (null? l)
+      '()
+      (cons (f (car l)) (map f (cdr l)))))
+
+(define (square x) (* x x))
+
+(define (iota-loop i acc)
+  (if (< i 0)
+      acc
+      (iota-loop (- i 1) (cons i acc))))
+
+(define (iota n)
+  (iota-loop (- n 1) '()))
+
+(display (map square '(1 2 3 4)))
+(newline)
+(display (append '(1 2) '(3) '() (list 4 5)))
+(newline)
+(display (reverse (iota 10)))
+(newline)
+(display (length (append (iota 10) (iota 20))))
+(newline)
+(display '(a (b c) 'd #t #f 2.5))
+(newline)
+(display (cons 1 2))
+(newline)
+(let ((l (list 1 2 3)))
+  (display (eq? l l))
+  (display (eq? l (list 1 2 3)))
+  (newline))
+(display (cond ((pair? '()) 'pair) ((null? '()) 'null) (else 'other)))
+(newline)
+(display (< 2.5 2.2))
+(newline)
@@ -0,0 +1,56 @@
+;; RUN: diff --color -u <(cat %s.expected) <(rsi %s 2>&1)
+;; RUN: diff --color -u <(cat %s.expected) <(rsi -O0 %s 2>&1)
+;; RUN: diff --color -u <(cat %s.expected) <(rsi --vm=register %s 2>&1)
+;; RUN: diff --color -u <(cat %s.expected) <(rsi --jit --jit-threshold=0 %s 2>&1)
+;; Named let and do loops, each iteration binds fresh variables.
+(define (map f l) (if (null? l) '() (cons (f (car l)) (map f (cdr l)))))
+(define (sum-to n)
+  (let loop ((i 0) (acc 0))
+    (if (> i n) acc (loop (+ i 1) (+ acc i)))))
+(display (sum-to 100000))
+(newline)
+(define (rsum n)
+  (let rec ((i n))
+    (if (= i 0) 0 (+ i (rec (- i 1))))))
+(display (rsum 100))
+(newline)
+(define (make-thunks n)
+  (let loop ((i 0) (out '()))
+    (if (= i n) out (loop (+ i 1) (cons (lambda () i) out)))))
+(display (map (lambda (t) (t)) (make-thunks 4)))
+(newline)
+(define (vec-fill n)
+  (do ((i 0 (+ i 1)) (acc '() (cons i acc)))
+      ((= i n) acc)))
+(display (vec-fill 5))
+(newline)
+(define (count-down n)
+  (do ((i n (- i 1)) (fs '()))
+      ((= i 0) (map (lambda (f) (f)) fs))
+    (set! fs (cons (lambda () i) fs))))
+(display (count-down 3))
+(newline)
+(let loop ((i 0))
+  (if (< i 3) (begin (display i) (loop (+ i 1)))))
+(newline)
+(do ((i 0 (+ i 1))) ((= i 3)) (display (* i i)))
+(newline)
+(define (grid n)
+  (let outer ((i 0) (acc '()))
+    (if (= i n) acc
+        (outer (+ i 1)
+               (let inner ((j 0) (acc acc))
+                 (if (= j n) acc (inner (+ j 1) (cons (list i j) acc))))))))
+(display (grid 2))
+(newline)
+(define (esc n)
+  (let loop ((i 0))
+    (if (= i n) loop (loop (+ i 1)))))
+(display (let ((l (esc 3))) (eq? l (l 3))))
+(newline)
+(define (even-odd n)
+  (let loop ((i n) (even #t))
+    (cond ((= i 0) even)
+          (else (loop (- i 1) (not even))))))
+(display (even-odd 7))
+(newline)
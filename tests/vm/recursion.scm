@@ -0,0 +1,29 @@
+;; RUN: diff --color -u <(cat %s.expected) <(rsi %s 2>&1)
+;; RUN: diff --color -u <(cat %s.expected) <(rsi --vm=register %s 2>&1)
+;; RUN: diff --color -u <(cat %s.expected) <(rsi --jit --jit-threshold=0 %s 2>&1)
+(define (count n)
+  (if (= n 0)
+      0
+      (+ 1 (count (- n 1)))))
+
+(define (iota-from i n)
+  (if (= i n)
+      '()
+      (cons i (iota-from (+ i 1) n))))
+
+(define (map f l)
+  (if (null? l)
+      '()
+      (cons (f (car l)) (map f (cdr l)))))
+
+(define (sum l)
+  (if (null? l)
+      0
+      (+ (car l) (sum (cdr l)))))
+
+(define (double x) (* 2 x))
+
+(display (count 200000))
+(newline)
+(display (sum (map double (iota-from 0 100000))))
+(newline)
@@ -0,0 +1,7 @@
+;; RUN: diff --color -u <(cat %s.expected) <(rsi -O0 --vm=register --debug-dump-bytecode %s 2>&1)
+(define (fib n)
+  (if (< n 2)
+      n
+      (+ (fib (- n 1)) (fib (- n 2)))))
+
+(display (fib 10))
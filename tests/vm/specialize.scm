@@ -0,0 +1,46 @@
+;; RUN: diff --color -u <(cat %s.expected) <(rsi %s 2>&1)
+;; RUN: diff --color -u <(cat %s.expected) <(rsi --specialize-threshold=0 %s 2>&1)
+;; RUN: diff --color -u <(cat %s.expected) <(rsi --specialize-threshold=0 --jit --jit-threshold=0 %s 2>&1)
+;; Hot procedures get type-specialized opcodes, whose guards fall back to the
+;; generic code once the operands or callees change.
+(define (count-down n acc)
+  (if (< n 1)
+      acc
+      (count-down (- n 1) (+ acc 2))))
+(display (count-down 1000 0))
+(newline)
+
+(define (fib n)
+  (if (< n 2)
+      n
+      (+ (fib (- n 1)) (fib (- n 2)))))
+(display (fib 20))
+(newline)
+
+;; The call site has only seen procedures so far.
+(define (apply-to f x) (f x))
+(define (repeat i)
+  (if (> i 0)
+      (begin (apply-to (lambda (x) (* x 2)) i) (repeat (- i 1)))))
+(repeat 200)
+(display (list (apply-to car '(1 2)) (apply-to (lambda (x) (* x 2)) 21)))
+(newline)
+
+;; So has the comparison.
+(define (small? x) (if (< x 10) 'small 'big))
+(define (check i)
+  (if (> i 0)
+      (begin (small? i) (check (- i 1)))))
+(check 200)
+(display (list (small? 3) (small? 30)))
+(newline)
+
+;; The guards also notice a redefined primitive.
+(define (add-one x) (+ x 1))
+(define (bump i)
+  (if (> i 0)
+      (begin (add-one i) (bump (- i 1)))))
+(bump 200)
+(set! + (lambda (a b) (list 'plus a b)))
+(display (add-one 1))
+(newline)
@@ -0,0 +1,59 @@
+;; RUN: diff --color -u <(cat %s.expected) <(rsi %s 2>&1)
+;; RUN: diff --color -u <(cat %s.expected) <(rsi -O0 %s 2>&1)
+;; RUN: diff --color -u <(cat %s.expected) <(rsi --vm=register %s 2>&1)
+;; RUN: diff --color -u <(cat %s.expected) <(rsi --jit --jit-threshold=0 %s 2>&1)
+;; Closures and lists that never leave their frame are built in its slots,
+;; everything that escapes still goes to the heap.
+(define saved '())
+
+(define (for-each-item f l)
+  (if (pair? l)
+      (begin (f (car l)) (for-each-item f (cdr l)))))
+
+(define (keep x) (set! saved x) 'kept)
+(define (pass-on x) (keep x) 'passed)
+(define (sum l) (if (null? l) 0 (+ (car l) (sum (cdr l)))))
+
+(define (weighted-sum k l)
+  (let ((total 0))
+    (for-each-item (lambda (x) (set! total (+ total (* k x)))) l)
+    total))
+
+(define (norm2 x y)
+  (let ((p (cons x y)))
+    (+ (* (car p) (car p)) (* (cdr p) (cdr p)))))
+
+(define (returned x y) (let ((p (cons x y))) p))
+(define (returned-tail x) (let ((p (list x x x))) (cdr p)))
+(define (stored x) (let ((p (list x x))) (set! saved p) (sum p)))
+(define (stored-through x) (pass-on (list x x)) (sum saved))
+(define (captured x)
+  (let ((p (cons x x)))
+    (lambda () (car p))))
+(define (called-in-tail x)
+  (let ((f (lambda () (* x 2))))
+    (f)))
+
+(define (loop i acc)
+  (if (= i 0)
+      acc
+      (loop (- i 1) (+ acc (sum (list i i i)) (norm2 i 1)))))
+
+(display (weighted-sum 2 '(1 2 3)))
+(newline)
+(display (loop 100 0))
+(newline)
+(display (returned 1 2))
+(newline)
+(display (returned-tail 3))
+(newline)
+(display (stored 4))
+(display saved)
+(newline)
+(display (stored-through 5))
+(display saved)
+(newline)
+(display ((captured 6)))
+(newline)
+(display (called-in-tail 7))
+(newline)
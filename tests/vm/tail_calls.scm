@@ -0,0 +1,31 @@
+;; RUN: diff --color -u <(cat %s.expected) <(rsi %s 2>&1)
+;; RUN: diff --color -u <(cat %s.expected) <(rsi --vm=register %s 2>&1)
+;; RUN: diff --color -u <(cat %s.expected) <(rsi --jit --jit-threshold=0 %s 2>&1)
+
+;; Loops written as tail calls run in constant stack space, far past the
+;; frame stack's limit.
+(define (loop i acc)
+  (if (= i 0)
+      acc
+      (loop (- i 1) (+ acc 1))))
+(display (loop 1500000 0))
+(newline)
+
+(define (even? n) (if (= n 0) #t (odd? (- n 1))))
+(define (odd? n) (if (= n 0) #f (even? (- n 1))))
+(display (even? 1200001))
+(newline)
+
+;; Tail positions inside cond, let and begin.
+(define (count-down n)
+  (cond ((= n 0) 'done)
+        (else (let ((m (- n 1)))
+                (begin m (count-down m))))))
+(display (count-down 1200000))
+(newline)
+
+;; A primitive in tail position returns normally.
+(define (last-pair-car l)
+  (if (null? (cdr l)) (car l) (last-pair-car (cdr l))))
+(display (last-pair-car '(1 2 3)))
+(newline)